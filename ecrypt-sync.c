@@ -3,6 +3,7 @@
 /* *** Please do not edit this file. *** */
 
 #include "ecrypt-sync.h"
+#include "rabbit_probes.h"
 
 #ifdef ECRYPT_USES_DEFAULT_ALL_IN_ONE
 
@@ -21,6 +22,8 @@ void ECRYPT_process_packet(
   u8* output,
   u32 msglen)
 {
+  RABBIT_PROBE_ENTRY(packet, msglen, RABBIT_BACKEND_ECRYPT);
+
   ECRYPT_ivsetup(ctx, iv);
 
 #ifdef ECRYPT_HAS_SINGLE_BYTE_FUNCTION
@@ -31,6 +34,8 @@ void ECRYPT_process_packet(
   else
     ECRYPT_decrypt_bytes(ctx, input, output, msglen);
 #endif
+
+  RABBIT_PROBE_RETURN(packet, msglen, RABBIT_BACKEND_ECRYPT, 0);
 }
 
 #else
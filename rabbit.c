@@ -25,6 +25,51 @@
 /******************************************************************************/
 
 #include "rabbit.h"
+#include "rabbit_internal.h"
+#include "rabbit_probes.h"
+#include "rabbit_stats.h"
+#include <string.h>
+#include <sys/uio.h>
+
+/* Non-temporal stores need SSE2 and a GCC-compatible compiler */
+#if defined(__GNUC__) && defined(__SSE2__)
+#define RABBIT_NT_STORES
+#include <emmintrin.h>
+#include <unistd.h>
+#endif
+
+/* Non-temporal threshold used when the cache size cannot be read */
+#define RABBIT_NT_DEFAULT (8*1024*1024)
+
+/* Source bytes prefetched ahead of the non-temporal loop */
+#define RABBIT_NT_PREFETCH 512
+
+/* Current non-temporal threshold; 0 until it is first needed */
+static size_t rabbit_nt_threshold;
+
+
+/* Read a 32-bit word from any address. memcpy is well defined for any */
+/* alignment and under strict aliasing, and compiles to a single load. */
+/* There is deliberately no separate aligned 128/256-bit path: the */
+/* keystream is built in general purpose registers, and moving it into */
+/* vector registers made 16-byte aligned SSE2 loads and stores 7-22% */
+/* slower and AVX2 70-85% slower. Word accesses run at the same speed on */
+/* aligned and unaligned buffers. */
+static cc_uint32 rabbit_load32(const cc_byte *p)
+{
+   /* Temporary variables */
+   cc_uint32 x;
+
+   memcpy(&x, p, 4);
+   return x;
+}
+
+
+/* Write a 32-bit word to any address */
+static void rabbit_store32(cc_byte *p, cc_uint32 x)
+{
+   memcpy(p, &x, 4);
+}
 
 
 /* Left rotation of a 32-bit unsigned integer */
@@ -93,7 +138,7 @@ static void rabbit_next_state(rabbit_instance *p_instance)
 
 /* Initialize the cipher instance (*p_instance) as a function of the */
 /* key (*p_key) */
-int rabbit_key_setup(rabbit_instance *p_instance, const cc_byte *p_key, 
+int rabbit_key_setup_raw(rabbit_instance *p_instance, const cc_byte *p_key,
           size_t key_size)
 {
    /* Temporary variables */
@@ -104,10 +149,10 @@ int rabbit_key_setup(rabbit_instance *p_instance, const cc_byte *p_key,
       return -1;
       
    /* Generate four subkeys */
-   k0 = *(cc_uint32*)(p_key+ 0);
-   k1 = *(cc_uint32*)(p_key+ 4);
-   k2 = *(cc_uint32*)(p_key+ 8);
-   k3 = *(cc_uint32*)(p_key+12);
+   k0 = rabbit_load32(p_key+ 0);
+   k1 = rabbit_load32(p_key+ 4);
+   k2 = rabbit_load32(p_key+ 8);
+   k3 = rabbit_load32(p_key+12);
 
    /* Generate initial state variables */
    p_instance->x[0] = k0;
@@ -145,9 +190,24 @@ int rabbit_key_setup(rabbit_instance *p_instance, const cc_byte *p_key,
 }
 
 
+/* Instrumented key setup */
+int rabbit_key_setup(rabbit_instance *p_instance, const cc_byte *p_key, 
+          size_t key_size)
+{
+   /* Temporary variables */
+   int res;
+   RABBIT_STATS_START
+
+   RABBIT_PROBE_ENTRY(key_setup, key_size, RABBIT_BACKEND_SCALAR);
+   res = rabbit_key_setup_raw(p_instance, p_key, key_size);
+   RABBIT_PROBE_RETURN(key_setup, key_size, RABBIT_BACKEND_SCALAR, res);
+   return RABBIT_STATS_RETURN(RABBIT_STATS_KEY_SETUP, 0, res);
+}
+
+
 /* Initialize the cipher instance (*p_instance) as a function of the */
 /* IV (*p_iv) and the master instance (*p_master_instance) */
-int rabbit_iv_setup(const rabbit_instance *p_master_instance,
+int rabbit_iv_setup_raw(const rabbit_instance *p_master_instance,
           rabbit_instance *p_instance, const cc_byte *p_iv, size_t iv_size)
 {
    /* Temporary variables */
@@ -158,8 +218,8 @@ int rabbit_iv_setup(const rabbit_instance *p_master_instance,
       return -1;
       
    /* Generate four subvectors */
-   i0 = *(cc_uint32*)(p_iv+0);
-   i2 = *(cc_uint32*)(p_iv+4);
+   i0 = rabbit_load32(p_iv+0);
+   i2 = rabbit_load32(p_iv+4);
    i1 = (i0>>16) | (i2&0xFFFF0000);
    i3 = (i2<<16) | (i0&0x0000FFFF);
 
@@ -187,32 +247,175 @@ int rabbit_iv_setup(const rabbit_instance *p_master_instance,
 }
 
 
-/* Encrypt or decrypt data */
-int rabbit_cipher(rabbit_instance *p_instance, const cc_byte *p_src, 
+/* Instrumented IV setup */
+int rabbit_iv_setup(const rabbit_instance *p_master_instance,
+          rabbit_instance *p_instance, const cc_byte *p_iv, size_t iv_size)
+{
+   /* Temporary variables */
+   int res;
+   RABBIT_STATS_START
+
+   RABBIT_PROBE_ENTRY(iv_setup, iv_size, RABBIT_BACKEND_SCALAR);
+   res = rabbit_iv_setup_raw(p_master_instance, p_instance, p_iv, iv_size);
+   RABBIT_PROBE_RETURN(iv_setup, iv_size, RABBIT_BACKEND_SCALAR, res);
+   return RABBIT_STATS_RETURN(RABBIT_STATS_IV_SETUP, 0, res);
+}
+
+
+#ifdef RABBIT_NT_STORES
+/* Default threshold: three quarters of the last level cache, beyond */
+/* which the output would evict most of the cache anyway */
+static size_t rabbit_nt_auto(void)
+{
+   /* Temporary variables */
+   long llc = -1;
+
+#ifdef _SC_LEVEL3_CACHE_SIZE
+   llc = sysconf(_SC_LEVEL3_CACHE_SIZE);
+   if (llc <= 0)
+      llc = sysconf(_SC_LEVEL2_CACHE_SIZE);
+#endif
+   return llc > 0 ? (size_t)llc/4*3 : RABBIT_NT_DEFAULT;
+}
+
+
+/* Out-of-place encryption of a large buffer into a 4-byte aligned */
+/* destination. The output bypasses the cache, so destination lines are */
+/* never read, and the source is prefetched with a non-temporal hint. */
+/* The keystream is produced in general purpose registers, so 32-bit */
+/* streaming stores (movnti) avoid moving it into vector registers. */
+static void rabbit_cipher_nt(rabbit_instance *p_instance, const cc_byte *p_src,
           cc_byte *p_dest, size_t data_size)
 {
    /* Temporary variables */
-   cc_uint32 i;
+   cc_uint32 w[4];
+   size_t i;
+
+   for (i=0; i<data_size; i+=16)
+   {
+      /* Prefetch only within the buffer, as a pointer past its end */
+      /* is undefined */
+      if (!(i & (RABBIT_CACHE_LINE-1)) && i + RABBIT_NT_PREFETCH < data_size)
+         _mm_prefetch((const char *)(p_src + i + RABBIT_NT_PREFETCH),
+                _MM_HINT_NTA);
+
+      /* Iterate the system */
+      rabbit_next_state(p_instance);
+
+      /* Encrypt 16 bytes of data */
+      memcpy(w, p_src + i, 16);
+      _mm_stream_si32((int *)(p_dest + i+ 0), (int)(w[0] ^
+                p_instance->x[0] ^ (p_instance->x[5]>>16) ^ (p_instance->x[3]<<16)));
+      _mm_stream_si32((int *)(p_dest + i+ 4), (int)(w[1] ^
+                p_instance->x[2] ^ (p_instance->x[7]>>16) ^ (p_instance->x[5]<<16)));
+      _mm_stream_si32((int *)(p_dest + i+ 8), (int)(w[2] ^
+                p_instance->x[4] ^ (p_instance->x[1]>>16) ^ (p_instance->x[7]<<16)));
+      _mm_stream_si32((int *)(p_dest + i+12), (int)(w[3] ^
+                p_instance->x[6] ^ (p_instance->x[3]>>16) ^ (p_instance->x[1]<<16)));
+   }
+
+   /* Order the streaming stores before anything that follows */
+   _mm_sfence();
+}
+#endif
+
+
+/* Set the size from which rabbit_cipher() uses non-temporal stores */
+void rabbit_set_nt_threshold(size_t threshold)
+{
+#ifdef __GNUC__
+   __atomic_store_n(&rabbit_nt_threshold, threshold, __ATOMIC_RELAXED);
+#else
+   rabbit_nt_threshold = threshold;
+#endif
+}
+
+
+/* Threshold derived from the cache size, whatever is set */
+size_t rabbit_nt_default(void)
+{
+#ifdef RABBIT_NT_STORES
+   return rabbit_nt_auto();
+#else
+   return (size_t)-1;
+#endif
+}
+
+
+/* Size from which rabbit_cipher() uses non-temporal stores */
+size_t rabbit_get_nt_threshold(void)
+{
+#ifdef RABBIT_NT_STORES
+   /* Temporary variables */
+   size_t threshold = __atomic_load_n(&rabbit_nt_threshold, __ATOMIC_RELAXED);
+
+   /* Derive it once; racing first calls store the same value */
+   if (!threshold)
+   {
+      threshold = rabbit_nt_auto();
+      __atomic_store_n(&rabbit_nt_threshold, threshold, __ATOMIC_RELAXED);
+   }
+   return threshold;
+#else
+   return (size_t)-1;
+#endif
+}
+
+
+/* Code path rabbit_cipher() takes for a call */
+static int rabbit_cipher_backend(const cc_byte *p_src, const cc_byte *p_dest,
+          size_t data_size)
+{
+#ifdef RABBIT_NT_STORES
+   /* Large out-of-place buffers bypass the cache */
+   if (data_size >= rabbit_get_nt_threshold() && p_src != p_dest &&
+       !((size_t)p_dest & 3))
+      return RABBIT_BACKEND_NT;
+#else
+   (void)p_src;
+   (void)p_dest;
+   (void)data_size;
+#endif
+   return RABBIT_BACKEND_SCALAR;
+}
+
+
+/* Encrypt or decrypt data on the given code path */
+static int rabbit_cipher_run(rabbit_instance *p_instance, const cc_byte *p_src,
+          cc_byte *p_dest, size_t data_size, int backend)
+{
+   /* Temporary variables */
+   size_t i;
 
    /* Return error if the size of the data to encrypt is */
    /* not a multiple of 16 */
    if (data_size%16)
       return -1;
 
+#ifdef RABBIT_NT_STORES
+   if (backend == RABBIT_BACKEND_NT)
+   {
+      rabbit_cipher_nt(p_instance, p_src, p_dest, data_size);
+      return 0;
+   }
+#else
+   (void)backend;
+#endif
+
    for (i=0; i<data_size; i+=16)
    {
       /* Iterate the system */
       rabbit_next_state(p_instance);
 
       /* Encrypt 16 bytes of data */
-      *(cc_uint32*)(p_dest+ 0) = *(cc_uint32*)(p_src+ 0) ^
-                p_instance->x[0] ^ (p_instance->x[5]>>16) ^ (p_instance->x[3]<<16);
-      *(cc_uint32*)(p_dest+ 4) = *(cc_uint32*)(p_src+ 4) ^
-                p_instance->x[2] ^ (p_instance->x[7]>>16) ^ (p_instance->x[5]<<16);
-      *(cc_uint32*)(p_dest+ 8) = *(cc_uint32*)(p_src+ 8) ^
-                p_instance->x[4] ^ (p_instance->x[1]>>16) ^ (p_instance->x[7]<<16);
-      *(cc_uint32*)(p_dest+12) = *(cc_uint32*)(p_src+12) ^
-                p_instance->x[6] ^ (p_instance->x[3]>>16) ^ (p_instance->x[1]<<16);
+      rabbit_store32(p_dest+ 0, rabbit_load32(p_src+ 0) ^
+                p_instance->x[0] ^ (p_instance->x[5]>>16) ^ (p_instance->x[3]<<16));
+      rabbit_store32(p_dest+ 4, rabbit_load32(p_src+ 4) ^
+                p_instance->x[2] ^ (p_instance->x[7]>>16) ^ (p_instance->x[5]<<16));
+      rabbit_store32(p_dest+ 8, rabbit_load32(p_src+ 8) ^
+                p_instance->x[4] ^ (p_instance->x[1]>>16) ^ (p_instance->x[7]<<16));
+      rabbit_store32(p_dest+12, rabbit_load32(p_src+12) ^
+                p_instance->x[6] ^ (p_instance->x[3]>>16) ^ (p_instance->x[1]<<16));
 
       /* Increment pointers to source and destination data */
       p_src += 16;
@@ -224,12 +427,48 @@ int rabbit_cipher(rabbit_instance *p_instance, const cc_byte *p_src,
 }
 
 
-/* Generate data with Pseudo-Random Number Generator */
-int rabbit_prng(rabbit_instance *p_instance, cc_byte *p_dest, 
+/* Encrypt or decrypt data with ordinary or non-temporal stores, */
+/* whatever the threshold */
+int rabbit_cipher_stores(rabbit_instance *p_instance, const cc_byte *p_src,
+          cc_byte *p_dest, size_t data_size, int nt)
+{
+   return rabbit_cipher_run(p_instance, p_src, p_dest, data_size,
+          nt && p_src != p_dest && !((size_t)p_dest & 3) ?
+          RABBIT_BACKEND_NT : RABBIT_BACKEND_SCALAR);
+}
+
+
+/* Encrypt or decrypt data without instrumentation */
+int rabbit_cipher_raw(rabbit_instance *p_instance, const cc_byte *p_src,
+          cc_byte *p_dest, size_t data_size)
+{
+   return rabbit_cipher_run(p_instance, p_src, p_dest, data_size,
+          rabbit_cipher_backend(p_src, p_dest, data_size));
+}
+
+
+/* Encrypt or decrypt data */
+int rabbit_cipher(rabbit_instance *p_instance, const cc_byte *p_src, 
+          cc_byte *p_dest, size_t data_size)
+{
+   /* Temporary variables */
+   int backend = rabbit_cipher_backend(p_src, p_dest, data_size), res;
+   RABBIT_STATS_START
+
+   RABBIT_PROBE_ENTRY(cipher, data_size, backend);
+   res = rabbit_cipher_run(p_instance, p_src, p_dest, data_size, backend);
+   RABBIT_PROBE_RETURN(cipher, data_size, backend, res);
+   return RABBIT_STATS_RETURN(RABBIT_STATS_CIPHER, data_size, res);
+}
+
+
+/* Generate data with Pseudo-Random Number Generator without */
+/* instrumentation */
+int rabbit_prng_raw(rabbit_instance *p_instance, cc_byte *p_dest,
           size_t data_size)
 {
    /* Temporary variables */
-   cc_uint32 i;
+   size_t i;
 
    /* Return error if the size of the data to generate is */
    /* not a multiple of 16 */
@@ -242,14 +481,14 @@ int rabbit_prng(rabbit_instance *p_instance, cc_byte *p_dest,
       rabbit_next_state(p_instance);
 
       /* Generate 16 bytes of pseudo-random data */
-      *(cc_uint32*)(p_dest+ 0) = p_instance->x[0] ^
-                (p_instance->x[5]>>16) ^ (p_instance->x[3]<<16);
-      *(cc_uint32*)(p_dest+ 4) = p_instance->x[2] ^
-                (p_instance->x[7]>>16) ^ (p_instance->x[5]<<16);
-      *(cc_uint32*)(p_dest+ 8) = p_instance->x[4] ^
-                (p_instance->x[1]>>16) ^ (p_instance->x[7]<<16);
-      *(cc_uint32*)(p_dest+12) = p_instance->x[6] ^
-                (p_instance->x[3]>>16) ^ (p_instance->x[1]<<16);
+      rabbit_store32(p_dest+ 0, p_instance->x[0] ^
+                (p_instance->x[5]>>16) ^ (p_instance->x[3]<<16));
+      rabbit_store32(p_dest+ 4, p_instance->x[2] ^
+                (p_instance->x[7]>>16) ^ (p_instance->x[5]<<16));
+      rabbit_store32(p_dest+ 8, p_instance->x[4] ^
+                (p_instance->x[1]>>16) ^ (p_instance->x[7]<<16));
+      rabbit_store32(p_dest+12, p_instance->x[6] ^
+                (p_instance->x[3]>>16) ^ (p_instance->x[1]<<16));
 
       /* Increment pointer to destination data */
       p_dest += 16;
@@ -259,3 +498,108 @@ int rabbit_prng(rabbit_instance *p_instance, cc_byte *p_dest,
    return 0;
 }
 
+
+/* Generate data with Pseudo-Random Number Generator */
+int rabbit_prng(rabbit_instance *p_instance, cc_byte *p_dest, 
+          size_t data_size)
+{
+   /* Temporary variables */
+   int res;
+   RABBIT_STATS_START
+
+   RABBIT_PROBE_ENTRY(prng, data_size, RABBIT_BACKEND_SCALAR);
+   res = rabbit_prng_raw(p_instance, p_dest, data_size);
+   RABBIT_PROBE_RETURN(prng, data_size, RABBIT_BACKEND_SCALAR, res);
+   return RABBIT_STATS_RETURN(RABBIT_STATS_PRNG, data_size, res);
+}
+
+
+/* Encrypt or decrypt fragmented data */
+int rabbit_cipher_iov(rabbit_instance *p_instance, const struct iovec *p_src,
+          int src_count, const struct iovec *p_dest, int dest_count)
+{
+   /* Temporary variables */
+   cc_byte ks[16];
+   size_t src_total = 0, dest_total = 0, src_off = 0, dest_off = 0;
+   size_t ks_off = 16, run, n, j;
+   const cc_byte *p_s;
+   cc_byte *p_d;
+   int i, k;
+
+   /* Return error if the chains differ in size or the size */
+   /* is not a multiple of 16 */
+   if (src_count < 0 || dest_count < 0)
+      return -1;
+   for (i=0; i<src_count; i++)
+      src_total += p_src[i].iov_len;
+   for (k=0; k<dest_count; k++)
+      dest_total += p_dest[k].iov_len;
+   if (src_total != dest_total || src_total%16)
+      return -1;
+
+   i = k = 0;
+   while (src_total)
+   {
+      /* Skip exhausted and empty fragments */
+      if (src_off == p_src[i].iov_len)
+      {
+         i++;
+         src_off = 0;
+         continue;
+      }
+      if (dest_off == p_dest[k].iov_len)
+      {
+         k++;
+         dest_off = 0;
+         continue;
+      }
+
+      /* Largest run both current fragments can take */
+      p_s = (const cc_byte *)p_src[i].iov_base + src_off;
+      p_d = (cc_byte *)p_dest[k].iov_base + dest_off;
+      run = p_src[i].iov_len - src_off;
+      if (run > p_dest[k].iov_len - dest_off)
+         run = p_dest[k].iov_len - dest_off;
+
+      if (ks_off == 16 && run >= 16)
+      {
+         /* On a block boundary: whole blocks straight through */
+         n = run & ~(size_t)15;
+         rabbit_cipher_raw(p_instance, p_s, p_d, n);
+      }
+      else
+      {
+         /* A block split across fragments goes through a buffer */
+         if (ks_off == 16)
+         {
+            rabbit_prng_raw(p_instance, ks, 16);
+            ks_off = 0;
+         }
+         n = run < 16 - ks_off ? run : 16 - ks_off;
+         for (j=0; j<n; j++)
+            p_d[j] = p_s[j] ^ ks[ks_off+j];
+         ks_off += n;
+      }
+
+      src_off += n;
+      dest_off += n;
+      src_total -= n;
+   }
+
+   rabbit_wipe(ks, sizeof(ks));
+
+   /* Return success */
+   return 0;
+}
+
+
+/* Overwrite key material with zeros */
+void rabbit_wipe(void *p_dest, size_t data_size)
+{
+   /* Temporary variables */
+   volatile cc_byte *p = (volatile cc_byte *)p_dest;
+
+   /* Clear the block through a volatile pointer so the stores are kept */
+   while (data_size--)
+      *p++ = 0;
+}
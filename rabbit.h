@@ -35,13 +35,33 @@
 typedef unsigned char cc_byte;
 typedef unsigned int cc_uint32;
 
+/* Fragment descriptor of the scatter-gather interface (<sys/uio.h>) */
+struct iovec;
+
+/* Cache line size assumed for alignment and padding decisions */
+#define RABBIT_CACHE_LINE 64
+
+/* Define RABBIT_ALIGNED_INSTANCE to align every instance to a cache line. */
+/* The structure is then padded to two full lines, so instances in arrays */
+/* never straddle an extra line or share one with a neighbour. */
+#if defined(RABBIT_ALIGNED_INSTANCE) && defined(_MSC_VER)
+#define RABBIT_ALIGN_PRE __declspec(align(RABBIT_CACHE_LINE))
+#define RABBIT_ALIGN_POST
+#elif defined(RABBIT_ALIGNED_INSTANCE)
+#define RABBIT_ALIGN_PRE
+#define RABBIT_ALIGN_POST __attribute__((aligned(RABBIT_CACHE_LINE)))
+#else
+#define RABBIT_ALIGN_PRE
+#define RABBIT_ALIGN_POST
+#endif
+
 /* Structure to store the instance data (internal state) */
-typedef struct
+typedef RABBIT_ALIGN_PRE struct
 {
    cc_uint32 x[8];
    cc_uint32 c[8];
    cc_uint32 carry;
-} rabbit_instance;
+} RABBIT_ALIGN_POST rabbit_instance;
 
 
 #ifdef __cplusplus
@@ -60,6 +80,24 @@ int rabbit_cipher(rabbit_instance *p_instance, const cc_byte *p_src,
 
 int rabbit_prng(rabbit_instance *p_instance, cc_byte *p_dest, size_t data_size);
 
+/* Encrypt or decrypt a fragmented buffer into another (or the same) one. */
+/* Both chains must hold the same total number of bytes, a multiple of */
+/* 16; fragments may have any size and may split a 16-byte block. */
+int rabbit_cipher_iov(rabbit_instance *p_instance, const struct iovec *p_src,
+          int src_count, const struct iovec *p_dest, int dest_count);
+
+/* Out-of-place rabbit_cipher() calls of at least threshold bytes into a */
+/* 4-byte aligned destination use non-temporal stores where the CPU has */
+/* them, so the output does not evict the cache. 0 restores the default, */
+/* derived from the last level cache size; (size_t)-1 turns them off. */
+void rabbit_set_nt_threshold(size_t threshold);
+
+size_t rabbit_get_nt_threshold(void);
+
+/* Overwrite a buffer holding key material with zeros in a way the */
+/* compiler may not optimize away */
+void rabbit_wipe(void *p_dest, size_t data_size);
+
 #ifdef __cplusplus
 }
 #endif
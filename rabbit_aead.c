@@ -0,0 +1,516 @@
+/******************************************************************************/
+/* File name: rabbit_aead.c                                                   */
+/*----------------------------------------------------------------------------*/
+/* Source file for authenticated encryption with Rabbit and Poly1305.         */
+/*                                                                            */
+/* Poly1305 uses radix 2^44 limbs with 64x64->128-bit products when the       */
+/* compiler provides a 128-bit integer type, and radix 2^26 limbs with        */
+/* 32x32->64-bit products otherwise (define RABBIT_POLY1305_32 to force it).  */
+/*                                                                            */
+/* This source code is for little-endian processors (e.g. x86).               */
+/******************************************************************************/
+
+#include "rabbit_aead.h"
+#include "rabbit_internal.h"
+#include <string.h>
+
+/* Bytes encrypted and authenticated per step of the fused loop; small */
+/* enough that source, destination and keystream stay in L1 */
+#define RABBIT_AEAD_CHUNK 1024
+
+#if defined(__SIZEOF_INT128__) && !defined(RABBIT_POLY1305_32)
+#define RABBIT_POLY1305_64
+#endif
+
+/* Internal Poly1305 state */
+typedef struct
+{
+#if defined(RABBIT_POLY1305_64)
+   unsigned long long r[3], h[3], pad[2];
+#else
+   cc_uint32 r[5], h[5], pad[4];
+#endif
+   size_t leftover;
+   cc_byte buffer[16];
+   int final;
+} rabbit_poly1305_state;
+
+/* Compile-time check that the public storage is large enough */
+typedef char rabbit_poly1305_fits[
+   sizeof(rabbit_poly1305_state) <= sizeof(rabbit_poly1305) ? 1 : -1];
+
+
+/* Little-endian loads and stores that work at any alignment */
+static cc_uint32 rabbit_aead_load32(const cc_byte *p)
+{
+   return (cc_uint32)p[0] | ((cc_uint32)p[1] << 8) |
+          ((cc_uint32)p[2] << 16) | ((cc_uint32)p[3] << 24);
+}
+
+static void rabbit_aead_store32(cc_byte *p, cc_uint32 v)
+{
+   p[0] = (cc_byte)v;
+   p[1] = (cc_byte)(v >> 8);
+   p[2] = (cc_byte)(v >> 16);
+   p[3] = (cc_byte)(v >> 24);
+}
+
+static void rabbit_aead_store64(cc_byte *p, unsigned long long v)
+{
+   rabbit_aead_store32(p, (cc_uint32)v);
+   rabbit_aead_store32(p+4, (cc_uint32)(v >> 32));
+}
+
+
+#if defined(RABBIT_POLY1305_64)
+
+typedef unsigned __int128 rabbit_u128;
+
+static unsigned long long rabbit_aead_load64(const cc_byte *p)
+{
+   return (unsigned long long)rabbit_aead_load32(p) |
+          ((unsigned long long)rabbit_aead_load32(p+4) << 32);
+}
+
+
+/* Absorb whole 16-byte blocks */
+static void rabbit_poly1305_blocks(rabbit_poly1305_state *p_st,
+          const cc_byte *p_m, size_t bytes)
+{
+   /* Temporary variables */
+   const unsigned long long hibit = p_st->final ? 0 : (1ULL << 40);
+   const unsigned long long m44 = 0xFFFFFFFFFFFULL, m42 = 0x3FFFFFFFFFFULL;
+   unsigned long long r0 = p_st->r[0], r1 = p_st->r[1], r2 = p_st->r[2];
+   unsigned long long h0 = p_st->h[0], h1 = p_st->h[1], h2 = p_st->h[2];
+   unsigned long long s1 = r1*(5 << 2), s2 = r2*(5 << 2);
+   unsigned long long t0, t1, c;
+   rabbit_u128 d0, d1, d2;
+
+   while (bytes >= 16)
+   {
+      /* h += m */
+      t0 = rabbit_aead_load64(p_m);
+      t1 = rabbit_aead_load64(p_m+8);
+      h0 += t0 & m44;
+      h1 += ((t0 >> 44) | (t1 << 20)) & m44;
+      h2 += ((t1 >> 24) & m42) | hibit;
+
+      /* h *= r */
+      d0 = (rabbit_u128)h0*r0 + (rabbit_u128)h1*s2 + (rabbit_u128)h2*s1;
+      d1 = (rabbit_u128)h0*r1 + (rabbit_u128)h1*r0 + (rabbit_u128)h2*s2;
+      d2 = (rabbit_u128)h0*r2 + (rabbit_u128)h1*r1 + (rabbit_u128)h2*r0;
+
+      /* Partial reduction mod 2^130 - 5 */
+      c = (unsigned long long)(d0 >> 44);  h0 = (unsigned long long)d0 & m44;
+      d1 += c;
+      c = (unsigned long long)(d1 >> 44);  h1 = (unsigned long long)d1 & m44;
+      d2 += c;
+      c = (unsigned long long)(d2 >> 42);  h2 = (unsigned long long)d2 & m42;
+      h0 += c*5;
+      c = h0 >> 44;  h0 &= m44;
+      h1 += c;
+
+      p_m += 16;
+      bytes -= 16;
+   }
+
+   p_st->h[0] = h0;
+   p_st->h[1] = h1;
+   p_st->h[2] = h2;
+}
+
+
+/* Set the key */
+void rabbit_poly1305_init(rabbit_poly1305 *p_state, const cc_byte *p_key)
+{
+   /* Temporary variables */
+   rabbit_poly1305_state *p_st = (rabbit_poly1305_state *)p_state;
+   unsigned long long t0 = rabbit_aead_load64(p_key);
+   unsigned long long t1 = rabbit_aead_load64(p_key+8);
+
+   /* r &= 0x0ffffffc0ffffffc0ffffffc0fffffff */
+   p_st->r[0] = t0 & 0xFFC0FFFFFFFULL;
+   p_st->r[1] = ((t0 >> 44) | (t1 << 20)) & 0xFFFFFC0FFFFULL;
+   p_st->r[2] = (t1 >> 24) & 0x00FFFFFFC0FULL;
+   p_st->h[0] = p_st->h[1] = p_st->h[2] = 0;
+   p_st->pad[0] = rabbit_aead_load64(p_key+16);
+   p_st->pad[1] = rabbit_aead_load64(p_key+24);
+   p_st->leftover = 0;
+   p_st->final = 0;
+}
+
+
+/* Fully reduce h, add s and write the tag */
+static void rabbit_poly1305_finish(rabbit_poly1305_state *p_st, cc_byte *p_tag)
+{
+   /* Temporary variables */
+   const unsigned long long m44 = 0xFFFFFFFFFFFULL, m42 = 0x3FFFFFFFFFFULL;
+   unsigned long long h0 = p_st->h[0], h1 = p_st->h[1], h2 = p_st->h[2];
+   unsigned long long g0, g1, g2, c, t0, t1;
+
+   /* Carry h through twice */
+   c = h1 >> 44;  h1 &= m44;  h2 += c;
+   c = h2 >> 42;  h2 &= m42;  h0 += c*5;
+   c = h0 >> 44;  h0 &= m44;  h1 += c;
+   c = h1 >> 44;  h1 &= m44;  h2 += c;
+   c = h2 >> 42;  h2 &= m42;  h0 += c*5;
+   c = h0 >> 44;  h0 &= m44;  h1 += c;
+
+   /* g = h + -p; select h if h < p, g otherwise, in constant time */
+   g0 = h0 + 5;  c = g0 >> 44;  g0 &= m44;
+   g1 = h1 + c;  c = g1 >> 44;  g1 &= m44;
+   g2 = h2 + c - (1ULL << 42);
+   c = (g2 >> 63) - 1;
+   g0 &= c;  g1 &= c;  g2 &= c;
+   c = ~c;
+   h0 = (h0 & c) | g0;
+   h1 = (h1 & c) | g1;
+   h2 = (h2 & c) | g2;
+
+   /* h = (h + s) mod 2^128 */
+   t0 = p_st->pad[0];
+   t1 = p_st->pad[1];
+   h0 += t0 & m44;  c = h0 >> 44;  h0 &= m44;
+   h1 += (((t0 >> 44) | (t1 << 20)) & m44) + c;  c = h1 >> 44;  h1 &= m44;
+   h2 += ((t1 >> 24) & m42) + c;  h2 &= m42;
+
+   rabbit_aead_store64(p_tag, h0 | (h1 << 44));
+   rabbit_aead_store64(p_tag+8, (h1 >> 20) | (h2 << 24));
+}
+
+#else
+
+/* Absorb whole 16-byte blocks */
+static void rabbit_poly1305_blocks(rabbit_poly1305_state *p_st,
+          const cc_byte *p_m, size_t bytes)
+{
+   /* Temporary variables */
+   const cc_uint32 hibit = p_st->final ? 0 : (1UL << 24);
+   const cc_uint32 m26 = 0x3FFFFFF;
+   cc_uint32 r0 = p_st->r[0], r1 = p_st->r[1], r2 = p_st->r[2];
+   cc_uint32 r3 = p_st->r[3], r4 = p_st->r[4];
+   cc_uint32 s1 = r1*5, s2 = r2*5, s3 = r3*5, s4 = r4*5;
+   cc_uint32 h0 = p_st->h[0], h1 = p_st->h[1], h2 = p_st->h[2];
+   cc_uint32 h3 = p_st->h[3], h4 = p_st->h[4], c;
+   unsigned long long d0, d1, d2, d3, d4;
+
+   while (bytes >= 16)
+   {
+      /* h += m */
+      h0 += rabbit_aead_load32(p_m+ 0) & m26;
+      h1 += (rabbit_aead_load32(p_m+ 3) >> 2) & m26;
+      h2 += (rabbit_aead_load32(p_m+ 6) >> 4) & m26;
+      h3 += (rabbit_aead_load32(p_m+ 9) >> 6) & m26;
+      h4 += (rabbit_aead_load32(p_m+12) >> 8) | hibit;
+
+      /* h *= r */
+      d0 = (unsigned long long)h0*r0 + (unsigned long long)h1*s4 +
+           (unsigned long long)h2*s3 + (unsigned long long)h3*s2 +
+           (unsigned long long)h4*s1;
+      d1 = (unsigned long long)h0*r1 + (unsigned long long)h1*r0 +
+           (unsigned long long)h2*s4 + (unsigned long long)h3*s3 +
+           (unsigned long long)h4*s2;
+      d2 = (unsigned long long)h0*r2 + (unsigned long long)h1*r1 +
+           (unsigned long long)h2*r0 + (unsigned long long)h3*s4 +
+           (unsigned long long)h4*s3;
+      d3 = (unsigned long long)h0*r3 + (unsigned long long)h1*r2 +
+           (unsigned long long)h2*r1 + (unsigned long long)h3*r0 +
+           (unsigned long long)h4*s4;
+      d4 = (unsigned long long)h0*r4 + (unsigned long long)h1*r3 +
+           (unsigned long long)h2*r2 + (unsigned long long)h3*r1 +
+           (unsigned long long)h4*r0;
+
+      /* Partial reduction mod 2^130 - 5 */
+      c = (cc_uint32)(d0 >> 26);  h0 = (cc_uint32)d0 & m26;
+      d1 += c;  c = (cc_uint32)(d1 >> 26);  h1 = (cc_uint32)d1 & m26;
+      d2 += c;  c = (cc_uint32)(d2 >> 26);  h2 = (cc_uint32)d2 & m26;
+      d3 += c;  c = (cc_uint32)(d3 >> 26);  h3 = (cc_uint32)d3 & m26;
+      d4 += c;  c = (cc_uint32)(d4 >> 26);  h4 = (cc_uint32)d4 & m26;
+      h0 += c*5;  c = h0 >> 26;  h0 &= m26;
+      h1 += c;
+
+      p_m += 16;
+      bytes -= 16;
+   }
+
+   p_st->h[0] = h0;
+   p_st->h[1] = h1;
+   p_st->h[2] = h2;
+   p_st->h[3] = h3;
+   p_st->h[4] = h4;
+}
+
+
+/* Set the key */
+void rabbit_poly1305_init(rabbit_poly1305 *p_state, const cc_byte *p_key)
+{
+   /* Temporary variables */
+   rabbit_poly1305_state *p_st = (rabbit_poly1305_state *)p_state;
+   int i;
+
+   /* r &= 0x0ffffffc0ffffffc0ffffffc0fffffff */
+   p_st->r[0] = (rabbit_aead_load32(p_key+ 0)     ) & 0x3FFFFFF;
+   p_st->r[1] = (rabbit_aead_load32(p_key+ 3) >> 2) & 0x3FFFF03;
+   p_st->r[2] = (rabbit_aead_load32(p_key+ 6) >> 4) & 0x3FFC0FF;
+   p_st->r[3] = (rabbit_aead_load32(p_key+ 9) >> 6) & 0x3F03FFF;
+   p_st->r[4] = (rabbit_aead_load32(p_key+12) >> 8) & 0x00FFFFF;
+   for (i=0; i<5; i++)
+      p_st->h[i] = 0;
+   for (i=0; i<4; i++)
+      p_st->pad[i] = rabbit_aead_load32(p_key+16+4*i);
+   p_st->leftover = 0;
+   p_st->final = 0;
+}
+
+
+/* Fully reduce h, add s and write the tag */
+static void rabbit_poly1305_finish(rabbit_poly1305_state *p_st, cc_byte *p_tag)
+{
+   /* Temporary variables */
+   const cc_uint32 m26 = 0x3FFFFFF;
+   cc_uint32 h0 = p_st->h[0], h1 = p_st->h[1], h2 = p_st->h[2];
+   cc_uint32 h3 = p_st->h[3], h4 = p_st->h[4];
+   cc_uint32 g0, g1, g2, g3, g4, c, mask;
+   unsigned long long f;
+
+   /* Carry h through */
+   c = h1 >> 26;  h1 &= m26;
+   h2 += c;  c = h2 >> 26;  h2 &= m26;
+   h3 += c;  c = h3 >> 26;  h3 &= m26;
+   h4 += c;  c = h4 >> 26;  h4 &= m26;
+   h0 += c*5;  c = h0 >> 26;  h0 &= m26;
+   h1 += c;
+
+   /* g = h + -p; select h if h < p, g otherwise, in constant time */
+   g0 = h0 + 5;  c = g0 >> 26;  g0 &= m26;
+   g1 = h1 + c;  c = g1 >> 26;  g1 &= m26;
+   g2 = h2 + c;  c = g2 >> 26;  g2 &= m26;
+   g3 = h3 + c;  c = g3 >> 26;  g3 &= m26;
+   g4 = h4 + c - (1UL << 26);
+   mask = (g4 >> 31) - 1;
+   g0 &= mask;  g1 &= mask;  g2 &= mask;  g3 &= mask;  g4 &= mask;
+   mask = ~mask;
+   h0 = (h0 & mask) | g0;
+   h1 = (h1 & mask) | g1;
+   h2 = (h2 & mask) | g2;
+   h3 = (h3 & mask) | g3;
+   h4 = (h4 & mask) | g4;
+
+   /* h = h % 2^128, then h = (h + s) mod 2^128 */
+   h0 = (h0      ) | (h1 << 26);
+   h1 = (h1 >>  6) | (h2 << 20);
+   h2 = (h2 >> 12) | (h3 << 14);
+   h3 = (h3 >> 18) | (h4 <<  8);
+   f = (unsigned long long)h0 + p_st->pad[0];              h0 = (cc_uint32)f;
+   f = (unsigned long long)h1 + p_st->pad[1] + (f >> 32);  h1 = (cc_uint32)f;
+   f = (unsigned long long)h2 + p_st->pad[2] + (f >> 32);  h2 = (cc_uint32)f;
+   f = (unsigned long long)h3 + p_st->pad[3] + (f >> 32);  h3 = (cc_uint32)f;
+
+   rabbit_aead_store32(p_tag+ 0, h0);
+   rabbit_aead_store32(p_tag+ 4, h1);
+   rabbit_aead_store32(p_tag+ 8, h2);
+   rabbit_aead_store32(p_tag+12, h3);
+}
+
+#endif
+
+
+/* Absorb data of any length */
+void rabbit_poly1305_update(rabbit_poly1305 *p_state, const cc_byte *p_data,
+          size_t data_size)
+{
+   /* Temporary variables */
+   rabbit_poly1305_state *p_st = (rabbit_poly1305_state *)p_state;
+   size_t n;
+
+   /* Complete a buffered partial block first */
+   if (p_st->leftover)
+   {
+      n = 16 - p_st->leftover;
+      if (n > data_size)
+         n = data_size;
+      memcpy(p_st->buffer + p_st->leftover, p_data, n);
+      p_st->leftover += n;
+      p_data += n;
+      data_size -= n;
+      if (p_st->leftover < 16)
+         return;
+      rabbit_poly1305_blocks(p_st, p_st->buffer, 16);
+      p_st->leftover = 0;
+   }
+
+   /* Whole blocks straight from the input */
+   n = data_size & ~(size_t)15;
+   if (n)
+   {
+      rabbit_poly1305_blocks(p_st, p_data, n);
+      p_data += n;
+      data_size -= n;
+   }
+
+   /* Keep the rest */
+   if (data_size)
+   {
+      memcpy(p_st->buffer, p_data, data_size);
+      p_st->leftover = data_size;
+   }
+}
+
+
+/* Produce the tag and clear the state */
+void rabbit_poly1305_final(rabbit_poly1305 *p_state, cc_byte *p_tag)
+{
+   /* Temporary variables */
+   rabbit_poly1305_state *p_st = (rabbit_poly1305_state *)p_state;
+
+   /* A final partial block is padded with a one bit, not with 2^128 */
+   if (p_st->leftover)
+   {
+      p_st->buffer[p_st->leftover] = 1;
+      memset(p_st->buffer + p_st->leftover + 1, 0, 15 - p_st->leftover);
+      p_st->final = 1;
+      rabbit_poly1305_blocks(p_st, p_st->buffer, 16);
+   }
+
+   rabbit_poly1305_finish(p_st, p_tag);
+   rabbit_wipe(p_state, sizeof(rabbit_poly1305));
+}
+
+
+/* Derive the message instance and the one-time Poly1305 key, and absorb */
+/* the padded associated data */
+static int rabbit_aead_start(const rabbit_instance *p_master_instance,
+          const cc_byte *p_iv, size_t iv_size, const cc_byte *p_aad,
+          size_t aad_size, rabbit_instance *p_instance,
+          rabbit_poly1305 *p_mac)
+{
+   /* Temporary variables */
+   cc_byte otk[32];
+   static const cc_byte zeros[16] = { 0 };
+
+   if (rabbit_iv_setup_raw(p_master_instance, p_instance, p_iv, iv_size))
+      return -1;
+
+   rabbit_prng_raw(p_instance, otk, 32);
+   rabbit_poly1305_init(p_mac, otk);
+   rabbit_wipe(otk, sizeof(otk));
+
+   rabbit_poly1305_update(p_mac, p_aad, aad_size);
+   rabbit_poly1305_update(p_mac, zeros, (16 - aad_size%16) % 16);
+
+   /* Return success */
+   return 0;
+}
+
+
+/* Absorb the ciphertext padding and the lengths and produce the tag */
+static void rabbit_aead_finish(rabbit_poly1305 *p_mac, size_t aad_size,
+          size_t data_size, cc_byte *p_tag)
+{
+   /* Temporary variables */
+   cc_byte lengths[16];
+   static const cc_byte zeros[16] = { 0 };
+
+   rabbit_poly1305_update(p_mac, zeros, (16 - data_size%16) % 16);
+   rabbit_aead_store64(lengths, (unsigned long long)aad_size);
+   rabbit_aead_store64(lengths+8, (unsigned long long)data_size);
+   rabbit_poly1305_update(p_mac, lengths, 16);
+   rabbit_poly1305_final(p_mac, p_tag);
+}
+
+
+/* XOR a chunk with keystream; only the last chunk may end mid-block */
+static void rabbit_aead_xor(rabbit_instance *p_instance, const cc_byte *p_src,
+          cc_byte *p_dest, size_t data_size)
+{
+   /* Temporary variables */
+   cc_byte ks[16];
+   size_t whole = data_size & ~(size_t)15, i;
+
+   if (whole)
+      rabbit_cipher_raw(p_instance, p_src, p_dest, whole);
+   if (whole == data_size)
+      return;
+
+   rabbit_prng_raw(p_instance, ks, 16);
+   for (i=whole; i<data_size; i++)
+      p_dest[i] = p_src[i] ^ ks[i-whole];
+   rabbit_wipe(ks, sizeof(ks));
+}
+
+
+/* Encrypt and authenticate */
+int rabbit_aead_encrypt(const rabbit_instance *p_master_instance,
+          const cc_byte *p_iv, size_t iv_size, const cc_byte *p_aad,
+          size_t aad_size, const cc_byte *p_src, cc_byte *p_dest,
+          size_t data_size, cc_byte *p_tag)
+{
+   /* Temporary variables */
+   rabbit_instance inst;
+   rabbit_poly1305 mac;
+   size_t done, n;
+
+   if (rabbit_aead_start(p_master_instance, p_iv, iv_size, p_aad, aad_size,
+          &inst, &mac))
+      return -1;
+
+   /* Encrypt a chunk, then authenticate it while it is still in L1 */
+   for (done=0; done<data_size; done+=n)
+   {
+      n = data_size - done;
+      if (n > RABBIT_AEAD_CHUNK)
+         n = RABBIT_AEAD_CHUNK;
+      rabbit_aead_xor(&inst, p_src+done, p_dest+done, n);
+      rabbit_poly1305_update(&mac, p_dest+done, n);
+   }
+
+   rabbit_aead_finish(&mac, aad_size, data_size, p_tag);
+   rabbit_wipe(&inst, sizeof(inst));
+
+   /* Return success */
+   return 0;
+}
+
+
+/* Verify and decrypt */
+int rabbit_aead_decrypt(const rabbit_instance *p_master_instance,
+          const cc_byte *p_iv, size_t iv_size, const cc_byte *p_aad,
+          size_t aad_size, const cc_byte *p_src, cc_byte *p_dest,
+          size_t data_size, const cc_byte *p_tag)
+{
+   /* Temporary variables */
+   rabbit_instance inst;
+   rabbit_poly1305 mac;
+   cc_byte tag[RABBIT_AEAD_TAG_SIZE];
+   cc_byte diff = 0;
+   size_t done, n, i;
+
+   if (rabbit_aead_start(p_master_instance, p_iv, iv_size, p_aad, aad_size,
+          &inst, &mac))
+      return -1;
+
+   /* Authenticate a chunk, then decrypt it while it is still in L1 */
+   for (done=0; done<data_size; done+=n)
+   {
+      n = data_size - done;
+      if (n > RABBIT_AEAD_CHUNK)
+         n = RABBIT_AEAD_CHUNK;
+      rabbit_poly1305_update(&mac, p_src+done, n);
+      rabbit_aead_xor(&inst, p_src+done, p_dest+done, n);
+   }
+
+   rabbit_aead_finish(&mac, aad_size, data_size, tag);
+   rabbit_wipe(&inst, sizeof(inst));
+
+   /* Compare in constant time; never release unauthenticated plaintext */
+   for (i=0; i<RABBIT_AEAD_TAG_SIZE; i++)
+      diff |= (cc_byte)(tag[i] ^ p_tag[i]);
+   if (diff)
+   {
+      rabbit_wipe(p_dest, data_size);
+      return -1;
+   }
+
+   /* Return success */
+   return 0;
+}
@@ -0,0 +1,68 @@
+/******************************************************************************/
+/* File name: rabbit_aead.h                                                   */
+/*----------------------------------------------------------------------------*/
+/* Header file for authenticated encryption with Rabbit and Poly1305.         */
+/*                                                                            */
+/* Construction, for a master instance set up with a 16-byte key and an       */
+/* 8-byte nonce that is never reused with that key:                           */
+/*                                                                            */
+/*  1. Derive the message instance with rabbit_iv_setup(master, nonce).       */
+/*  2. The first 32 keystream bytes are the one-time Poly1305 key: bytes      */
+/*     0..15 are r (clamped as in RFC 8439) and bytes 16..31 are s.           */
+/*  3. The message is XORed with the keystream starting at byte 32. Any       */
+/*     length is allowed; the unused end of the last block is discarded.     */
+/*  4. The tag is Poly1305 over                                               */
+/*       aad || pad16(aad) || ciphertext || pad16(ciphertext) ||             */
+/*       le64(aad length) || le64(ciphertext length)                          */
+/*     where pad16() is zero to fifteen zero bytes up to a multiple of 16.    */
+/*                                                                            */
+/* Encryption and authentication run in a single pass: each chunk is          */
+/* encrypted and then fed to Poly1305 while it is still in the L1 cache.      */
+/*                                                                            */
+/* This source code is for little-endian processors (e.g. x86).               */
+/******************************************************************************/
+
+#ifndef _RABBIT_AEAD_H
+#define _RABBIT_AEAD_H
+
+#include "rabbit.h"
+
+/* Size of the authentication tag in bytes */
+#define RABBIT_AEAD_TAG_SIZE 16
+
+/* Poly1305 state; opaque storage large enough for either implementation */
+typedef struct
+{
+   unsigned long long opaque[12];
+} rabbit_poly1305;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* All function calls return zero on success */
+
+/* Encrypt data_size bytes and compute the tag over aad and the ciphertext */
+int rabbit_aead_encrypt(const rabbit_instance *p_master_instance,
+          const cc_byte *p_iv, size_t iv_size, const cc_byte *p_aad,
+          size_t aad_size, const cc_byte *p_src, cc_byte *p_dest,
+          size_t data_size, cc_byte *p_tag);
+
+/* Check the tag and decrypt. On a tag mismatch -1 is returned and the */
+/* output is cleared. */
+int rabbit_aead_decrypt(const rabbit_instance *p_master_instance,
+          const cc_byte *p_iv, size_t iv_size, const cc_byte *p_aad,
+          size_t aad_size, const cc_byte *p_src, cc_byte *p_dest,
+          size_t data_size, const cc_byte *p_tag);
+
+/* Stand-alone Poly1305 with a 32-byte one-time key */
+void rabbit_poly1305_init(rabbit_poly1305 *p_state, const cc_byte *p_key);
+void rabbit_poly1305_update(rabbit_poly1305 *p_state, const cc_byte *p_data,
+          size_t data_size);
+void rabbit_poly1305_final(rabbit_poly1305 *p_state, cc_byte *p_tag);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,339 @@
+/******************************************************************************/
+/* File name: rabbit_async.hpp                                                */
+/*----------------------------------------------------------------------------*/
+/* C++20 coroutine interface for encrypting large buffers off the caller's    */
+/* thread.                                                                    */
+/*                                                                            */
+/*    co_await rabbit::async_encrypt(stream, src, dst, executor);             */
+/*                                                                            */
+/* suspends the calling coroutine while a rabbit_sched pool does the work and */
+/* resumes it through executor.post(), so an event loop thread never runs     */
+/* the cipher itself. Inputs below inline_threshold are processed right away  */
+/* without suspending.                                                        */
+/*                                                                            */
+/* The executor has no default: it decides which thread the coroutine         */
+/* resumes on, and only the caller knows its own loop. inline_executor        */
+/* resumes on whichever pool worker finished the job, which suits code that   */
+/* does not care where it runs and is wrong for an event loop.                */
+/*                                                                            */
+/* A cipher_stream is either a single stream continuing one instance, which   */
+/* is inherently sequential and runs as a chain of chunks on one pinned       */
+/* worker, or a segmented-IV stream (see rabbit_parallel.h), whose segments   */
+/* are spread over the pool and stolen by idle workers. Awaits on one stream  */
+/* must not overlap.                                                          */
+/*                                                                            */
+/* This source code is for little-endian processors (e.g. x86).               */
+/******************************************************************************/
+
+#ifndef _RABBIT_ASYNC_HPP
+#define _RABBIT_ASYNC_HPP
+
+#include <atomic>
+#include <coroutine>
+#include <cstddef>
+#include <span>
+#include <stdexcept>
+#include <utility>
+#include <vector>
+#include "rabbit.h"
+#include "rabbit_internal.h"
+#include "rabbit_parallel.h"
+
+namespace rabbit
+{
+
+/* Owning handle for a rabbit_sched pool */
+class thread_pool
+{
+public:
+   /* thread_count 0 uses one thread per online CPU */
+   explicit thread_pool(int thread_count = 0)
+   {
+      if (rabbit_sched_create(&p_sched_, thread_count))
+         throw std::runtime_error("rabbit::thread_pool: cannot start workers");
+   }
+
+   thread_pool(const thread_pool &) = delete;
+   thread_pool &operator=(const thread_pool &) = delete;
+
+   /* Finishes queued work before returning */
+   ~thread_pool()
+   {
+      rabbit_sched_destroy(p_sched_);
+   }
+
+   rabbit_sched *native() const
+   {
+      return p_sched_;
+   }
+
+   int size() const
+   {
+      return rabbit_sched_size(p_sched_);
+   }
+
+   /* Worker for the next sequential job, round robin */
+   int next_worker()
+   {
+      return (int)(next_.fetch_add(1, std::memory_order_relaxed) %
+             (unsigned)size());
+   }
+
+   /* Process-wide pool, started on first use */
+   static thread_pool &shared()
+   {
+      static thread_pool pool;
+      return pool;
+   }
+
+private:
+   rabbit_sched *p_sched_ = nullptr;
+   std::atomic<unsigned> next_{0};
+};
+
+/* Executor that resumes on whichever worker finishes the job */
+struct inline_executor
+{
+   template <class F>
+   void post(F &&f) const
+   {
+      std::forward<F>(f)();
+   }
+};
+
+/* Anything with post(callable) can resume the awaiting coroutine */
+template <class E>
+concept executor = std::copy_constructible<E> &&
+   requires (E &e) { e.post([] {}); };
+
+/* Keystream state for async_encrypt */
+class cipher_stream
+{
+public:
+   static constexpr std::size_t default_segment = 64 << 10;
+
+   /* Single stream continuing instance */
+   explicit cipher_stream(const rabbit_instance &instance)
+      : inst_(instance)
+   {
+   }
+
+   /* Segmented-IV stream: segment k uses IV p_base_iv + k under master */
+   cipher_stream(const rabbit_instance &master, const cc_byte *p_base_iv,
+             std::size_t segment_size = default_segment)
+      : inst_(master), segment_size_(segment_size), segmented_(true)
+   {
+      if (segment_size == 0 || segment_size%16)
+         throw std::invalid_argument(
+                "rabbit::cipher_stream: segment size must be a multiple of 16");
+      for (int i=0; i<8; i++)
+         iv_[i] = p_base_iv[i];
+   }
+
+   cipher_stream(const cipher_stream &) = delete;
+   cipher_stream &operator=(const cipher_stream &) = delete;
+
+   ~cipher_stream()
+   {
+      rabbit_wipe(&inst_, sizeof(inst_));
+   }
+
+   bool segmented() const
+   {
+      return segmented_;
+   }
+
+   /* Segment the next call starts with */
+   unsigned long long next_segment() const
+   {
+      return next_segment_;
+   }
+
+private:
+   template <executor E> friend class encrypt_awaitable;
+
+   rabbit_instance inst_;                  /* Working or master instance */
+   cc_byte iv_[8] = {};
+   std::size_t segment_size_ = 0;
+   unsigned long long next_segment_ = 0;
+   bool segmented_ = false;
+};
+
+/* Awaitable returned by async_encrypt() */
+template <executor E>
+class encrypt_awaitable
+{
+public:
+   /* Below this size the work is done inline */
+   static constexpr std::size_t inline_threshold = 64 << 10;
+
+   /* Bytes per task: a chain link in single-stream mode, a group of */
+   /* whole segments in segmented mode */
+   static constexpr std::size_t task_bytes = 1 << 20;
+
+   encrypt_awaitable(cipher_stream &stream, const cc_byte *p_src,
+             cc_byte *p_dest, std::size_t size, E ex, thread_pool &pool)
+      : p_stream_(&stream), p_src_(p_src), p_dest_(p_dest), size_(size),
+        ex_(std::move(ex)), p_pool_(&pool)
+   {
+   }
+
+   encrypt_awaitable(const encrypt_awaitable &) = delete;
+   encrypt_awaitable &operator=(const encrypt_awaitable &) = delete;
+
+   bool await_ready()
+   {
+      unsigned long long first;
+
+      if (!p_stream_->segmented_)
+      {
+         if (size_ >= inline_threshold)
+            return false;
+         rabbit_cipher_raw(&p_stream_->inst_, p_src_, p_dest_, size_);
+         return true;
+      }
+
+      /* Claim this call's segments up front */
+      first = p_stream_->next_segment_;
+      p_stream_->next_segment_ += (size_ + p_stream_->segment_size_ - 1) /
+             p_stream_->segment_size_;
+      if (size_ >= inline_threshold)
+      {
+         first_segment_ = first;
+         return false;
+      }
+      rabbit_segment_cipher(&p_stream_->inst_, p_stream_->iv_,
+             p_stream_->segment_size_, first, p_src_, p_dest_, size_);
+      return true;
+   }
+
+   bool await_suspend(std::coroutine_handle<> handle)
+   {
+      handle_ = handle;
+      if (p_stream_->segmented_)
+         start_segments();
+      else
+         start_chain();
+
+      /* The extra count held during submission; if the work already */
+      /* finished, continue without suspending */
+      return remaining_.fetch_sub(1, std::memory_order_acq_rel) != 1;
+   }
+
+   void await_resume() const
+   {
+   }
+
+private:
+   /* One segmented task */
+   struct segment_task
+   {
+      encrypt_awaitable *p_self;
+      unsigned long long first_segment;
+      std::size_t offset, size;
+   };
+
+   cipher_stream *p_stream_;
+   const cc_byte *p_src_;
+   cc_byte *p_dest_;
+   std::size_t size_;
+   E ex_;
+   thread_pool *p_pool_;
+   std::coroutine_handle<> handle_;
+   std::atomic<std::size_t> remaining_{1};
+   unsigned long long first_segment_ = 0;
+   std::vector<segment_task> tasks_;
+   std::size_t offset_ = 0;               /* Chain progress */
+   int worker_ = 0;
+
+   /* Count one unit of work done; the last one resumes the coroutine. */
+   /* Nothing of *this is touched after the count drops. */
+   void finish()
+   {
+      E ex = ex_;
+      const std::coroutine_handle<> handle = handle_;
+
+      if (remaining_.fetch_sub(1, std::memory_order_acq_rel) == 1)
+         ex.post([handle] { handle.resume(); });
+   }
+
+   void start_segments()
+   {
+      const std::size_t seg = p_stream_->segment_size_;
+      const std::size_t group = task_bytes > seg ? task_bytes / seg * seg : seg;
+      std::size_t off, i;
+
+      for (off=0; off<size_; off+=group)
+         tasks_.push_back({ this, first_segment_ + off/seg, off,
+                size_ - off < group ? size_ - off : group });
+      remaining_.fetch_add(tasks_.size(), std::memory_order_relaxed);
+
+      for (i=0; i<tasks_.size(); i++)
+         if (rabbit_sched_submit(p_pool_->native(), run_segments, &tasks_[i]))
+            run_segments(&tasks_[i]);
+   }
+
+   static void run_segments(void *p_arg)
+   {
+      segment_task *p_task = static_cast<segment_task *>(p_arg);
+      encrypt_awaitable *p_self = p_task->p_self;
+
+      rabbit_segment_cipher(&p_self->p_stream_->inst_, p_self->p_stream_->iv_,
+             p_self->p_stream_->segment_size_, p_task->first_segment,
+             p_self->p_src_ + p_task->offset, p_self->p_dest_ + p_task->offset,
+             p_task->size);
+      p_self->finish();
+   }
+
+   void start_chain()
+   {
+      remaining_.fetch_add(1, std::memory_order_relaxed);
+      worker_ = p_pool_->next_worker();
+      if (rabbit_sched_submit_to(p_pool_->native(), worker_, run_chain, this))
+         run_chain(this);
+   }
+
+   /* One link of the sequential chain; requeues itself behind other work */
+   /* on the same worker until the buffer is done */
+   static void run_chain(void *p_arg)
+   {
+      encrypt_awaitable *p_self = static_cast<encrypt_awaitable *>(p_arg);
+      std::size_t n;
+
+      do
+      {
+         n = p_self->size_ - p_self->offset_;
+         if (n > task_bytes)
+            n = task_bytes;
+         rabbit_cipher_raw(&p_self->p_stream_->inst_,
+                p_self->p_src_ + p_self->offset_,
+                p_self->p_dest_ + p_self->offset_, n);
+         p_self->offset_ += n;
+         if (p_self->offset_ == p_self->size_)
+         {
+            p_self->finish();
+            return;
+         }
+      }
+      while (rabbit_sched_submit_to(p_self->p_pool_->native(), p_self->worker_,
+             run_chain, p_self));
+   }
+};
+
+/* Encrypt or decrypt src into dst (which may be the same buffer). The */
+/* size must be a multiple of 16. The coroutine resumes through ex. */
+template <executor E>
+encrypt_awaitable<E> async_encrypt(cipher_stream &stream,
+          std::span<const cc_byte> src, std::span<cc_byte> dst, E ex,
+          thread_pool &pool = thread_pool::shared())
+{
+   if (src.size() != dst.size() || src.size()%16)
+      throw std::invalid_argument(
+             "rabbit::async_encrypt: sizes must match and be multiples of 16");
+   return encrypt_awaitable<E>(stream, src.data(), dst.data(), src.size(),
+          std::move(ex), pool);
+}
+
+}
+
+#endif
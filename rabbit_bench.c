@@ -0,0 +1,2425 @@
+/******************************************************************************/
+/* File name: rabbit_bench.c                                                  */
+/*----------------------------------------------------------------------------*/
+/* Benchmark driver for the Rabbit stream cipher and its helper modules.      */
+/*                                                                            */
+/* Usage: rabbit_bench <scenario> [options]                                   */
+/* Run without arguments to list the available scenarios.                     */
+/*                                                                            */
+/* This source code is for little-endian processors (e.g. x86).               */
+/******************************************************************************/
+
+#define _GNU_SOURCE
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <linux/perf_event.h>
+#include <netinet/in.h>
+#include <sys/ioctl.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include "rabbit.h"
+#include "rabbit_aead.h"
+#include "rabbit_crc32c.h"
+#include "rabbit_log.h"
+#include "rabbit_numa.h"
+#include "rabbit_parallel.h"
+#include "rabbit_pipeline.h"
+#include "rabbit_pool.h"
+#include "rabbit_precomp.h"
+#include "rabbit_session.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define BENCH_AESNI
+#include <immintrin.h>
+#endif
+
+/* Keep the compiler from dropping or merging work on an object */
+#ifdef __GNUC__
+#define BENCH_CLOBBER(p) __asm__ __volatile__ ("" : : "r" (p) : "memory")
+#else
+#define BENCH_CLOBBER(p) ((void)(p))
+#endif
+
+/* -------------------------------------------------------------------------- */
+
+/* Monotonic time in seconds */
+static double bench_now(void)
+{
+   /* Temporary variables */
+   struct timespec ts;
+
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return (double)ts.tv_sec + (double)ts.tv_nsec*1e-9;
+}
+
+/* -------------------------------------------------------------------------- */
+
+/* Small deterministic generator for benchmark inputs (xorshift64*) */
+static uint64_t bench_rand(uint64_t *p_state)
+{
+   *p_state ^= *p_state >> 12;
+   *p_state ^= *p_state << 25;
+   *p_state ^= *p_state >> 27;
+   return *p_state * 0x2545F4914F6CDD1DULL;
+}
+
+/* -------------------------------------------------------------------------- */
+
+/* Open a hardware counter of the calling thread, user space only. Returns */
+/* -1 where counters are unavailable, e.g. in containers. Counters that    */
+/* share the PMU with too many others are multiplexed and scaled up. */
+static int bench_counter_open(uint32_t type, uint64_t config)
+{
+   /* Temporary variables */
+   struct perf_event_attr attr;
+
+   memset(&attr, 0, sizeof(attr));
+   attr.size = sizeof(attr);
+   attr.type = type;
+   attr.config = config;
+   attr.disabled = 1;
+   attr.exclude_kernel = 1;
+   attr.exclude_hv = 1;
+   attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED |
+          PERF_FORMAT_TOTAL_TIME_RUNNING;
+   return (int)syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+/* Start counting from zero */
+static void bench_counter_start(int fd)
+{
+   if (fd >= 0)
+   {
+      ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+      ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+   }
+}
+
+/* Suspend or resume counting without resetting */
+static void bench_counter_enable(int fd, int on)
+{
+   if (fd >= 0)
+      ioctl(fd, on ? PERF_EVENT_IOC_ENABLE : PERF_EVENT_IOC_DISABLE, 0);
+}
+
+/* Stop counting and return the count, or -1 if unavailable */
+static double bench_counter_stop(int fd)
+{
+   /* Temporary variables */
+   uint64_t value[3];
+
+   if (fd < 0)
+      return -1;
+   ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+   if (read(fd, value, sizeof(value)) != (ssize_t)sizeof(value) || !value[2])
+      return -1;
+
+   /* Extrapolate over the time the counter was not scheduled */
+   return (double)value[0]*((double)value[1]/(double)value[2]);
+}
+
+/* A hardware event for bench_counter_open() */
+typedef struct
+{
+   const char *name;
+   uint32_t type;
+   uint64_t config;
+} bench_event;
+
+#define BENCH_CACHE_EVENT(cache, op, result) \
+   ((uint64_t)(cache) | ((uint64_t)(op) << 8) | ((uint64_t)(result) << 16))
+
+/* -------------------------------------------------------------------------- */
+
+/* Read "name=value" style numeric options, returning def if absent */
+static size_t bench_opt(int argc, char *argv[], const char *name, size_t def)
+{
+   /* Temporary variables */
+   size_t len = strlen(name);
+   int i;
+
+   for (i=0; i<argc; i++)
+      if (!strncmp(argv[i], name, len) && argv[i][len] == '=')
+         return (size_t)strtoull(argv[i]+len+1, NULL, 0);
+   return def;
+}
+
+/* -------------------------------------------------------------------------- */
+
+/* Read "name=value" style string options, returning def if absent */
+static const char *bench_opt_str(int argc, char *argv[], const char *name,
+          const char *def)
+{
+   /* Temporary variables */
+   size_t len = strlen(name);
+   int i;
+
+   for (i=0; i<argc; i++)
+      if (!strncmp(argv[i], name, len) && argv[i][len] == '=')
+         return argv[i]+len+1;
+   return def;
+}
+
+/* -------------------------------------------------------------------------- */
+
+/* Compare two doubles for qsort() */
+static int bench_cmp_double(const void *p_a, const void *p_b)
+{
+   /* Temporary variables */
+   double a = *(const double *)p_a, b = *(const double *)p_b;
+
+   return (a > b) - (a < b);
+}
+
+/* -------------------------------------------------------------------------- */
+
+/* Sort latency samples and return the given percentile */
+static double bench_percentile(double *p_samples, size_t count, double pct)
+{
+   /* Temporary variables */
+   size_t i;
+
+   qsort(p_samples, count, sizeof(double), bench_cmp_double);
+   i = (size_t)(pct/100.0*(double)(count-1) + 0.5);
+   return p_samples[i];
+}
+
+/* -------------------------------------------------------------------------- */
+
+/* Read or write exactly size bytes on a socket */
+static int bench_io(int fd, cc_byte *p_buf, size_t size, int write_mode)
+{
+   /* Temporary variables */
+   ssize_t n;
+
+   while (size)
+   {
+      n = write_mode ? write(fd, p_buf, size) : read(fd, p_buf, size);
+      if (n <= 0)
+         return -1;
+      p_buf += n;
+      size -= (size_t)n;
+   }
+   return 0;
+}
+
+/* -------------------------------------------------------------------------- */
+
+/* Compare two pointers for qsort() */
+static int bench_cmp_ptr(const void *p_a, const void *p_b)
+{
+   /* Temporary variables */
+   uintptr_t a = (uintptr_t)*(void * const *)p_a;
+   uintptr_t b = (uintptr_t)*(void * const *)p_b;
+
+   return (a > b) - (a < b);
+}
+
+/* -------------------------------------------------------------------------- */
+
+/* Count the objects of the given size that share a cache line with another */
+/* object of the set (the array of pointers is sorted as a side effect) */
+static size_t bench_shared_lines(void **pp_obj, size_t count, size_t size)
+{
+   /* Temporary variables */
+   size_t i, shared = 0;
+   uintptr_t first, last, prev_last, next_first;
+
+   qsort(pp_obj, count, sizeof(void *), bench_cmp_ptr);
+   for (i=0; i<count; i++)
+   {
+      first = (uintptr_t)pp_obj[i] / RABBIT_CACHE_LINE;
+      last = ((uintptr_t)pp_obj[i] + size - 1) / RABBIT_CACHE_LINE;
+      prev_last = i ? ((uintptr_t)pp_obj[i-1] + size - 1) / RABBIT_CACHE_LINE
+             : first - 1;
+      next_first = i+1 < count ? (uintptr_t)pp_obj[i+1] / RABBIT_CACHE_LINE
+             : last + 1;
+      shared += (prev_last == first || next_first == last);
+   }
+   return shared;
+}
+
+/* -------------------------------------------------------------------------- */
+
+/* Cache and TLB events of the pool scenario */
+static const bench_event bench_pool_events[] =
+{
+   { "L1D miss", PERF_TYPE_HW_CACHE, BENCH_CACHE_EVENT(PERF_COUNT_HW_CACHE_L1D,
+          PERF_COUNT_HW_CACHE_OP_READ, PERF_COUNT_HW_CACHE_RESULT_MISS) },
+   { "LLC miss", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES },
+   { "dTLB miss", PERF_TYPE_HW_CACHE,
+          BENCH_CACHE_EVENT(PERF_COUNT_HW_CACHE_DTLB,
+          PERF_COUNT_HW_CACHE_OP_READ, PERF_COUNT_HW_CACHE_RESULT_MISS) }
+};
+
+#define BENCH_POOL_EVENT_COUNT \
+   (sizeof(bench_pool_events)/sizeof(bench_pool_events[0]))
+
+/* Churn a large population of contexts: replace random contexts with new */
+/* ones (release, allocate, IV setup) and process short packets on random */
+/* live contexts. Compares malloc()/free() against rabbit_pool. Cache and */
+/* TLB misses per packet come from the hardware counters where available. */
+static int bench_pool(int argc, char *argv[])
+{
+   /* Temporary variables */
+   size_t live = bench_opt(argc, argv, "live", 1000000);
+   size_t ops = bench_opt(argc, argv, "ops", 4000000);
+   int flags = bench_opt(argc, argv, "hugepages", 1) ?
+          RABBIT_POOL_HUGEPAGES : 0;
+   rabbit_instance **pp_inst, master;
+   rabbit_pool *p_pool;
+   cc_byte key[16] = { 0 }, iv[8] = { 0 }, packet[64] = { 0 };
+   uint64_t seed;
+   size_t i, j, e, shared;
+   double t0, t_churn, t_packet, misses;
+   int fds[BENCH_POOL_EVENT_COUNT];
+   int mode, available = 0;
+
+   rabbit_key_setup(&master, key, 16);
+   pp_inst = (rabbit_instance **)calloc(live, sizeof(rabbit_instance *));
+   if (!pp_inst || rabbit_pool_create(&p_pool, 0, flags))
+      return -1;
+
+   for (e=0; e<BENCH_POOL_EVENT_COUNT; e++)
+   {
+      fds[e] = bench_counter_open(bench_pool_events[e].type,
+             bench_pool_events[e].config);
+      available += fds[e] >= 0;
+   }
+   if (!available)
+      printf("hardware counters unavailable (container or "
+             "perf_event_paranoid), misses reported as n/a\n");
+
+   printf("%-8s %10s %14s %14s", "alloc", "contexts", "churn ns/op",
+          "packet ns/op");
+   for (e=0; e<BENCH_POOL_EVENT_COUNT; e++)
+      printf(" %10s", bench_pool_events[e].name);
+   printf(" %15s   (misses per packet)\n", "shared line %");
+
+   for (mode=0; mode<2; mode++)
+   {
+      /* Populate */
+      for (i=0; i<live; i++)
+      {
+         if (mode == 0)
+            pp_inst[i] = (rabbit_instance *)malloc(sizeof(rabbit_instance));
+         else
+            rabbit_pool_alloc(p_pool, &pp_inst[i]);
+         rabbit_iv_setup(&master, pp_inst[i], iv, 8);
+      }
+
+      /* Churn: release and replace random contexts */
+      seed = 0x9E3779B97F4A7C15ULL;
+      t0 = bench_now();
+      for (i=0; i<ops; i++)
+      {
+         j = (size_t)(bench_rand(&seed) % live);
+         if (mode == 0)
+         {
+            rabbit_wipe(pp_inst[j], sizeof(rabbit_instance));
+            free(pp_inst[j]);
+            pp_inst[j] = (rabbit_instance *)malloc(sizeof(rabbit_instance));
+         }
+         else
+         {
+            rabbit_pool_free(p_pool, pp_inst[j]);
+            rabbit_pool_alloc(p_pool, &pp_inst[j]);
+         }
+         iv[0] = (cc_byte)i;
+         rabbit_iv_setup(&master, pp_inst[j], iv, 8);
+      }
+      t_churn = bench_now() - t0;
+
+      /* Packets on random live contexts */
+      for (e=0; e<BENCH_POOL_EVENT_COUNT; e++)
+         bench_counter_start(fds[e]);
+      t0 = bench_now();
+      for (i=0; i<ops; i++)
+      {
+         j = (size_t)(bench_rand(&seed) % live);
+         rabbit_cipher(pp_inst[j], packet, packet, 16);
+      }
+      t_packet = bench_now() - t0;
+
+      printf("%-8s %10lu %14.1f %14.1f", mode ? "pool" : "malloc",
+             (unsigned long)live, t_churn*1e9/(double)ops,
+             t_packet*1e9/(double)ops);
+      for (e=0; e<BENCH_POOL_EVENT_COUNT; e++)
+      {
+         misses = bench_counter_stop(fds[e]);
+         if (misses >= 0)
+            printf(" %10.3f", misses/(double)ops);
+         else
+            printf(" %10s", "n/a");
+      }
+
+      /* Contexts that can false-share a line with a neighbour */
+      shared = bench_shared_lines((void **)pp_inst, live,
+             sizeof(rabbit_instance));
+      printf(" %15.1f\n", 100.0*(double)shared/(double)live);
+
+      /* Tear down */
+      if (mode == 0)
+         for (i=0; i<live; i++)
+         {
+            rabbit_wipe(pp_inst[i], sizeof(rabbit_instance));
+            free(pp_inst[i]);
+         }
+      else
+         rabbit_pool_reset(p_pool);
+   }
+
+   for (e=0; e<BENCH_POOL_EVENT_COUNT; e++)
+      if (fds[e] >= 0)
+         close(fds[e]);
+   rabbit_pool_destroy(p_pool);
+   free(pp_inst);
+   return 0;
+}
+
+/* -------------------------------------------------------------------------- */
+
+/* Process short packets on random sessions of a large session table, one */
+/* lookup at a time and in prefetched batches */
+static int bench_session(int argc, char *argv[])
+{
+   /* Temporary variables */
+   size_t live = bench_opt(argc, argv, "live", 1000000);
+   size_t ops = bench_opt(argc, argv, "ops", 4000000);
+   size_t batch = bench_opt(argc, argv, "batch", 32);
+   rabbit_session_table *p_table;
+   rabbit_session_op *p_ops;
+   rabbit_instance master;
+   cc_byte key[16] = { 0 }, iv[8] = { 0 }, *p_packets;
+   uint64_t seed = 0x9E3779B97F4A7C15ULL;
+   size_t i, j;
+   double t0, t_single, t_batch;
+
+   rabbit_key_setup(&master, key, 16);
+   p_ops = (rabbit_session_op *)calloc(batch, sizeof(rabbit_session_op));
+   p_packets = (cc_byte *)calloc(batch, 64);
+   if (!p_ops || !p_packets || !batch ||
+       rabbit_session_create(&p_table, &master, live, 0))
+      return -1;
+
+   for (i=0; i<live; i++)
+   {
+      memcpy(iv, &i, sizeof(i) < 8 ? sizeof(i) : 8);
+      rabbit_session_open(p_table, i, iv, 8);
+   }
+
+   /* One lookup per packet */
+   t0 = bench_now();
+   for (i=0; i<ops; i++)
+      rabbit_session_cipher(p_table, bench_rand(&seed) % live, p_packets,
+             p_packets, 64);
+   t_single = bench_now() - t0;
+
+   /* Batched lookups with prefetching */
+   t0 = bench_now();
+   for (i=0; i<ops; i+=batch)
+   {
+      for (j=0; j<batch; j++)
+      {
+         p_ops[j].id = bench_rand(&seed) % live;
+         p_ops[j].p_src = p_ops[j].p_dest = p_packets + j*64;
+         p_ops[j].data_size = 64;
+      }
+      rabbit_session_cipher_many(p_table, p_ops, batch);
+   }
+   t_batch = bench_now() - t0;
+
+   printf("%-10s %10s %14s\n", "lookup", "sessions", "ns/packet");
+   printf("%-10s %10lu %14.1f\n", "single", (unsigned long)live,
+          t_single*1e9/(double)ops);
+   printf("%-10s %10lu %14.1f\n", "batched", (unsigned long)live,
+          t_batch*1e9/(double)((ops+batch-1)/batch*batch));
+
+   rabbit_session_destroy(p_table);
+   free(p_packets);
+   free(p_ops);
+   return 0;
+}
+
+/* -------------------------------------------------------------------------- */
+
+/* Server side of the request/response latency benchmark */
+typedef struct
+{
+   int fd;
+   int mode;                /* 0 direct, 1 idle-time refill, 2 worker */
+   size_t ops;
+   size_t reply_size;
+   rabbit_instance inst;
+   rabbit_precomp *p_session;
+   double *p_encrypt;       /* Encryption time per reply */
+} bench_precomp_server;
+
+static void *bench_precomp_serve(void *p_arg)
+{
+   /* Temporary variables */
+   bench_precomp_server *p_srv = (bench_precomp_server *)p_arg;
+   cc_byte request[64], *p_reply;
+   size_t i;
+   double t0;
+
+   p_reply = (cc_byte *)calloc(1, p_srv->reply_size);
+   for (i=0; p_reply && i<p_srv->ops; i++)
+   {
+      if (bench_io(p_srv->fd, request, sizeof(request), 0))
+         break;
+
+      t0 = bench_now();
+      if (p_srv->mode == 0)
+         rabbit_cipher(&p_srv->inst, p_reply, p_reply, p_srv->reply_size);
+      else
+         rabbit_precomp_cipher(p_srv->p_session, p_reply, p_reply,
+                p_srv->reply_size);
+      p_srv->p_encrypt[i] = bench_now() - t0;
+
+      if (bench_io(p_srv->fd, p_reply, p_srv->reply_size, 1))
+         break;
+
+      /* Idle until the next request: precompute its keystream */
+      if (p_srv->mode == 1)
+         rabbit_precomp_refill(p_srv->p_session);
+   }
+
+   free(p_reply);
+   return NULL;
+}
+
+/* Request/response over a Unix loopback socket pair. Reports p50/p99 of */
+/* the round trip and of the server-side encryption, with keystream */
+/* generated on the critical path and precomputed ahead. */
+static int bench_precompute(int argc, char *argv[])
+{
+   /* Temporary variables */
+   size_t ops = bench_opt(argc, argv, "ops", 100000);
+   size_t reply_size = bench_opt(argc, argv, "size", 256) & ~(size_t)15;
+   static const char *mode_names[] = { "inline", "idle-refill", "worker" };
+   bench_precomp_server srv;
+   rabbit_precomp_worker *p_worker = NULL;
+   cc_byte key[16] = { 0 }, request[64] = { 0 }, *p_reply;
+   double *p_rtt, t0;
+   pthread_t thread;
+   int fds[2], mode;
+   size_t i;
+
+   p_rtt = (double *)calloc(ops, sizeof(double));
+   srv.p_encrypt = (double *)calloc(ops, sizeof(double));
+   p_reply = (cc_byte *)malloc(reply_size ? reply_size : 16);
+   if (!p_rtt || !srv.p_encrypt || !p_reply || !ops || !reply_size ||
+       reply_size > RABBIT_PRECOMP_MAX_DEPTH)
+      return -1;
+
+   printf("%-12s %8s %12s %12s %14s %14s\n", "keystream", "bytes",
+          "rtt p50 us", "rtt p99 us", "encrypt p50 ns", "encrypt p99 ns");
+
+   for (mode=0; mode<3; mode++)
+   {
+      if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds))
+         return -1;
+
+      srv.fd = fds[1];
+      srv.mode = mode;
+      srv.ops = ops;
+      srv.reply_size = reply_size;
+      rabbit_key_setup(&srv.inst, key, 16);
+      srv.p_session = NULL;
+      if (mode)
+      {
+         rabbit_precomp_create(&srv.p_session, &srv.inst, reply_size);
+         rabbit_precomp_refill(srv.p_session);
+      }
+      if (mode == 2 && !rabbit_precomp_worker_create(&p_worker))
+         rabbit_precomp_worker_add(p_worker, srv.p_session);
+      pthread_create(&thread, NULL, bench_precomp_serve, &srv);
+
+      for (i=0; i<ops; i++)
+      {
+         t0 = bench_now();
+         if (bench_io(fds[0], request, sizeof(request), 1) ||
+             bench_io(fds[0], p_reply, reply_size, 0))
+            break;
+         p_rtt[i] = bench_now() - t0;
+      }
+
+      pthread_join(thread, NULL);
+      if (p_worker)
+      {
+         rabbit_precomp_worker_destroy(p_worker);
+         p_worker = NULL;
+      }
+      rabbit_precomp_destroy(srv.p_session);
+      close(fds[0]);
+      close(fds[1]);
+
+      printf("%-12s %8lu %12.2f %12.2f %14.0f %14.0f\n", mode_names[mode],
+             (unsigned long)reply_size,
+             bench_percentile(p_rtt, i, 50)*1e6,
+             bench_percentile(p_rtt, i, 99)*1e6,
+             bench_percentile(srv.p_encrypt, i, 50)*1e9,
+             bench_percentile(srv.p_encrypt, i, 99)*1e9);
+   }
+
+   free(p_reply);
+   free(srv.p_encrypt);
+   free(p_rtt);
+   return 0;
+}
+
+/* -------------------------------------------------------------------------- */
+
+/* File callbacks for the pipeline benchmark */
+static long bench_fd_read(void *p_context, cc_byte *p_buf, size_t size)
+{
+   return (long)read(*(int *)p_context, p_buf, size);
+}
+
+static int bench_fd_write(void *p_context, const cc_byte *p_buf, size_t size)
+{
+   return bench_io(*(int *)p_context, (cc_byte *)p_buf, size, 1);
+}
+
+/* Encrypt a file on tmpfs into another file, with a plain read/encrypt/ */
+/* write loop and with the three-stage pipeline in both wait modes */
+static int bench_pipeline(int argc, char *argv[])
+{
+   /* Temporary variables */
+   size_t size = bench_opt(argc, argv, "mb", 256) << 20;
+   size_t slot_size = bench_opt(argc, argv, "slot", 256) << 10;
+   size_t slots = bench_opt(argc, argv, "slots", 16);
+   size_t batch = bench_opt(argc, argv, "batch", 4);
+   const char *p_in_name = "/dev/shm/rabbit_bench.in";
+   const char *p_out_name = "/dev/shm/rabbit_bench.out";
+   static const char *mode_names[] = { "loop", "busy-poll", "futex" };
+   rabbit_pipeline_config config;
+   rabbit_instance master, inst;
+   cc_byte key[16] = { 0 }, *p_buf;
+   int in_fd, out_fd, mode, res;
+   size_t done;
+   long n;
+   double t0;
+
+   p_buf = (cc_byte *)calloc(1, slot_size);
+   in_fd = open(p_in_name, O_RDWR|O_CREAT|O_TRUNC, 0600);
+   if (!p_buf || in_fd < 0 || !slot_size)
+      return -1;
+
+   /* Create the input file */
+   for (done=0; done<size; done+=slot_size)
+      if (bench_io(in_fd, p_buf, slot_size, 1))
+         return -1;
+
+   rabbit_key_setup(&master, key, 16);
+   config.slot_size = slot_size;
+   config.slot_count = slots;
+   config.batch = batch;
+
+   printf("%-10s %8s %8s %8s %10s\n", "mode", "MiB", "slot KiB", "slots",
+          "GB/s");
+   for (mode=0; mode<3; mode++)
+   {
+      lseek(in_fd, 0, SEEK_SET);
+      out_fd = open(p_out_name, O_WRONLY|O_CREAT|O_TRUNC, 0600);
+      if (out_fd < 0)
+         return -1;
+      inst = master;
+
+      t0 = bench_now();
+      if (mode == 0)
+      {
+         res = 0;
+         while (!res && (n = bench_fd_read(&in_fd, p_buf, slot_size)) > 0)
+         {
+            rabbit_cipher(&inst, p_buf, p_buf, ((size_t)n+15) & ~(size_t)15);
+            res = bench_fd_write(&out_fd, p_buf, (size_t)n);
+         }
+      }
+      else
+      {
+         config.wait_mode = mode == 1 ? RABBIT_PIPELINE_BUSY_POLL :
+                RABBIT_PIPELINE_FUTEX;
+         res = rabbit_pipeline_run(&config, &inst, bench_fd_read, &in_fd,
+                bench_fd_write, &out_fd);
+      }
+      t0 = bench_now() - t0;
+      close(out_fd);
+
+      printf("%-10s %8lu %8lu %8lu %10.3f%s\n", mode_names[mode],
+             (unsigned long)(size >> 20), (unsigned long)(slot_size >> 10),
+             (unsigned long)slots, (double)size/t0*1e-9,
+             res ? " (failed)" : "");
+   }
+
+   close(in_fd);
+   unlink(p_in_name);
+   unlink(p_out_name);
+   free(p_buf);
+   return 0;
+}
+
+/* -------------------------------------------------------------------------- */
+
+/* One connection of the proxy benchmark, seen from both ends */
+typedef struct
+{
+   int fd;
+   struct sockaddr_in addr;       /* Sender: the proxy */
+   const rabbit_instance *p_master;
+   size_t size;                   /* Plaintext bytes */
+   unsigned int delay;            /* Sink: microseconds between reads */
+   int verify;
+   int failed;
+} bench_proxy_flow;
+
+/* Connect to the proxy, retrying while it starts, and send zeros */
+static void *bench_proxy_send(void *p_arg)
+{
+   /* Temporary variables */
+   bench_proxy_flow *p_flow = (bench_proxy_flow *)p_arg;
+   cc_byte buf[65536] = { 0 };
+   size_t left = p_flow->size, n;
+   int tries;
+
+   for (tries=0; tries<500; tries++)
+   {
+      p_flow->fd = socket(AF_INET, SOCK_STREAM, 0);
+      if (p_flow->fd >= 0 && !connect(p_flow->fd,
+             (const struct sockaddr *)&p_flow->addr, sizeof(p_flow->addr)))
+         break;
+      close(p_flow->fd);
+      p_flow->fd = -1;
+      usleep(10000);
+   }
+   if (p_flow->fd < 0)
+   {
+      p_flow->failed = 1;
+      return NULL;
+   }
+
+   while (left && !p_flow->failed)
+   {
+      n = left < sizeof(buf) ? left : sizeof(buf);
+      p_flow->failed = bench_io(p_flow->fd, buf, n, 1) != 0;
+      left -= n;
+   }
+   shutdown(p_flow->fd, SHUT_WR);
+   return NULL;
+}
+
+/* Receive one encrypted stream: the IV, then the keystream itself, since */
+/* the plaintext is zeros; optionally compare it with rabbit_prng() */
+static void *bench_proxy_sink(void *p_arg)
+{
+   /* Temporary variables */
+   bench_proxy_flow *p_flow = (bench_proxy_flow *)p_arg;
+   cc_byte iv[8], buf[65536], ks[65536];
+   rabbit_instance inst;
+   size_t got = 0, ks_pos = sizeof(ks), i;
+   ssize_t n;
+
+   if (bench_io(p_flow->fd, iv, 8, 0))
+   {
+      p_flow->failed = 1;
+      return NULL;
+   }
+   rabbit_iv_setup(p_flow->p_master, &inst, iv, 8);
+
+   while ((n = read(p_flow->fd, buf, sizeof(buf))) > 0)
+   {
+      if (p_flow->verify)
+         for (i=0; i<(size_t)n; i++)
+         {
+            if (ks_pos == sizeof(ks))
+            {
+               rabbit_prng(&inst, ks, sizeof(ks));
+               ks_pos = 0;
+            }
+            if (buf[i] != ks[ks_pos++])
+               p_flow->failed = 1;
+         }
+      got += (size_t)n;
+      if (p_flow->delay)
+         usleep(p_flow->delay);
+   }
+   if (n < 0 || got != p_flow->size)
+      p_flow->failed = 1;
+   rabbit_wipe(&inst, sizeof(inst));
+   return NULL;
+}
+
+/* Bind a loopback TCP socket to a free port */
+static int bench_proxy_listen(struct sockaddr_in *p_addr)
+{
+   /* Temporary variables */
+   socklen_t len = sizeof(*p_addr);
+   int fd;
+
+   memset(p_addr, 0, sizeof(*p_addr));
+   p_addr->sin_family = AF_INET;
+   p_addr->sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+   fd = socket(AF_INET, SOCK_STREAM, 0);
+   if (fd < 0)
+      return -1;
+   if (bind(fd, (const struct sockaddr *)p_addr, sizeof(*p_addr)) ||
+       getsockname(fd, (struct sockaddr *)p_addr, &len) || listen(fd, 1024))
+   {
+      close(fd);
+      return -1;
+   }
+   return fd;
+}
+
+/* Relay zeros from many loopback connections through rabbit_proxy to a */
+/* sink, once with relay=copy (read, encrypt, write: two copies) and once */
+/* with relay=splice (vmsplice into a pipe). The sink checks every byte. */
+/* Reports wall time and the CPU time of the proxy process per byte. */
+static int bench_proxy(int argc, char *argv[])
+{
+   /* Temporary variables */
+   const char *p_path = bench_opt_str(argc, argv, "proxy", "./rabbit_proxy");
+   size_t conns = bench_opt(argc, argv, "conns", 80);
+   size_t size = bench_opt(argc, argv, "mb", 16) << 20;
+   static const char *relay_names[] = { "copy", "splice" };
+   bench_proxy_flow *p_send, *p_sink;
+   pthread_t *p_send_thread, *p_sink_thread;
+   struct sockaddr_in target;
+   struct rusage usage;
+   struct timeval timeout = { 30, 0 };
+   rabbit_instance master;
+   cc_byte key[16] = { 0 };
+   char listen_arg[32], target_arg[32], relay_arg[16];
+   double t0, cpu;
+   size_t i;
+   pid_t pid;
+   int sink_fd, relay, status, failed, res = 0;
+
+   p_send = (bench_proxy_flow *)calloc(conns, sizeof(bench_proxy_flow));
+   p_sink = (bench_proxy_flow *)calloc(conns, sizeof(bench_proxy_flow));
+   p_send_thread = (pthread_t *)calloc(conns, sizeof(pthread_t));
+   p_sink_thread = (pthread_t *)calloc(conns, sizeof(pthread_t));
+   if (!p_send || !p_sink || !p_send_thread || !p_sink_thread || !conns)
+      return -1;
+   rabbit_key_setup(&master, key, 16);
+   signal(SIGPIPE, SIG_IGN);
+
+   printf("%-8s %6s %8s %10s %14s %8s\n", "relay", "conns", "MiB/conn",
+          "GB/s", "proxy cpu ns/B", "check");
+
+   for (relay=0; relay<2 && !res; relay++)
+   {
+      /* The sink listens first; the proxy takes the next free port. */
+      /* Accepting gives up if the proxy does not come up. */
+      sink_fd = bench_proxy_listen(&target);
+      if (sink_fd >= 0)
+         setsockopt(sink_fd, SOL_SOCKET, SO_RCVTIMEO, &timeout,
+                sizeof(timeout));
+      p_send[0].fd = bench_proxy_listen(&p_send[0].addr);
+      if (sink_fd < 0 || p_send[0].fd < 0)
+         return -1;
+      close(p_send[0].fd);
+      snprintf(listen_arg, sizeof(listen_arg), "127.0.0.1:%u",
+             (unsigned)ntohs(p_send[0].addr.sin_port));
+      snprintf(target_arg, sizeof(target_arg), "127.0.0.1:%u",
+             (unsigned)ntohs(target.sin_port));
+      snprintf(relay_arg, sizeof(relay_arg), "relay=%s", relay_names[relay]);
+
+      pid = fork();
+      if (pid == 0)
+      {
+         execl(p_path, p_path, listen_arg, target_arg,
+                "key=00000000000000000000000000000000", relay_arg,
+                (char *)NULL);
+         _exit(127);
+      }
+      if (pid < 0)
+         return -1;
+
+      t0 = bench_now();
+      for (i=0; i<conns; i++)
+      {
+         p_send[i].addr = p_send[0].addr;
+         p_send[i].size = size;
+         p_send[i].failed = 0;
+         pthread_create(&p_send_thread[i], NULL, bench_proxy_send, &p_send[i]);
+      }
+      for (i=0; i<conns; i++)
+      {
+         p_sink[i].fd = accept(sink_fd, NULL, NULL);
+         p_sink[i].p_master = &master;
+         p_sink[i].size = size;
+         p_sink[i].delay = (unsigned int)bench_opt(argc, argv, "delay", 0);
+         p_sink[i].verify = (int)bench_opt(argc, argv, "verify", 1);
+         p_sink[i].failed = p_sink[i].fd < 0;
+         if (!p_sink[i].failed)
+            pthread_create(&p_sink_thread[i], NULL, bench_proxy_sink,
+                   &p_sink[i]);
+      }
+
+      failed = 0;
+      for (i=0; i<conns; i++)
+      {
+         pthread_join(p_send_thread[i], NULL);
+         if (p_sink[i].fd >= 0)
+            pthread_join(p_sink_thread[i], NULL);
+         failed |= p_send[i].failed | p_sink[i].failed;
+      }
+      t0 = bench_now() - t0;
+      for (i=0; i<conns; i++)
+      {
+         close(p_send[i].fd);
+         close(p_sink[i].fd);
+      }
+      close(sink_fd);
+
+      kill(pid, SIGTERM);
+      if (wait4(pid, &status, 0, &usage) != pid)
+         return -1;
+      cpu = (double)usage.ru_utime.tv_sec + (double)usage.ru_stime.tv_sec +
+             1e-6*(double)(usage.ru_utime.tv_usec + usage.ru_stime.tv_usec);
+
+      printf("%-8s %6lu %8lu %10.3f %14.3f %8s\n", relay_names[relay],
+             (unsigned long)conns, (unsigned long)(size >> 20),
+             (double)(conns*size)/t0*1e-9, cpu*1e9/(double)(conns*size),
+             failed ? "FAILED" : (p_sink[0].verify ? "ok" : "-"));
+      res = failed ? -1 : 0;
+   }
+
+   rabbit_wipe(&master, sizeof(master));
+   free(p_send);
+   free(p_sink);
+   free(p_send_thread);
+   free(p_sink_thread);
+   return res;
+}
+
+/* -------------------------------------------------------------------------- */
+
+/* One appending thread of the log benchmark */
+typedef struct
+{
+   int mode;
+   rabbit_log *p_log;
+   int fd;                        /* Sync-each mode: file and lock */
+   pthread_mutex_t *p_lock;
+   unsigned long long *p_seq;
+   const rabbit_instance *p_master;
+   size_t ops;
+   size_t size;
+   int failed;
+} bench_log_arg;
+
+static void *bench_log_thread(void *p_arg)
+{
+   /* Temporary variables */
+   bench_log_arg *p_work = (bench_log_arg *)p_arg;
+   size_t padded = (p_work->size + 15) & ~(size_t)15;
+   cc_byte *p_src, *p_out, base_iv[8] = { 0 };
+   rabbit_instance inst;
+   size_t i;
+
+   p_src = (cc_byte *)calloc(1, padded);
+   p_out = (cc_byte *)calloc(1, 16 + padded);
+   if (!p_src || !p_out)
+   {
+      free(p_src);
+      p_work->failed = 1;
+      return NULL;
+   }
+
+   for (i=0; i<p_work->ops && !p_work->failed; i++)
+   {
+      if (p_work->mode)
+      {
+         p_work->failed = rabbit_log_append(p_work->p_log, p_src,
+                p_work->size, NULL) != 0;
+         continue;
+      }
+
+      /* One record, one write and one sync at a time */
+      pthread_mutex_lock(p_work->p_lock);
+      memcpy(p_out, p_work->p_seq, 8);
+      rabbit_segment_iv_setup(p_work->p_master, &inst, base_iv,
+             (*p_work->p_seq)++);
+      rabbit_cipher(&inst, p_src, p_out + 16, padded);
+      p_work->failed = bench_io(p_work->fd, p_out, 16 + padded, 1) ||
+             fdatasync(p_work->fd);
+      pthread_mutex_unlock(p_work->p_lock);
+   }
+
+   free(p_src);
+   free(p_out);
+   return NULL;
+}
+
+/* Durable encrypted appends from many threads: a write and fdatasync per */
+/* record under a lock, rabbit_log group commit as records arrive, and */
+/* group commit held open for delay microseconds with lanes on a pool */
+static int bench_log(int argc, char *argv[])
+{
+   /* Temporary variables */
+   size_t threads = bench_opt(argc, argv, "threads", 8);
+   size_t ops = bench_opt(argc, argv, "ops", 200);
+   size_t size = bench_opt(argc, argv, "size", 256);
+   unsigned int delay = (unsigned int)bench_opt(argc, argv, "delay", 200);
+   const char *p_name = "rabbit_bench.log";
+   static const char *mode_names[3] = { "sync-each", "group", "group+delay" };
+   pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+   bench_log_arg *p_work;
+   pthread_t *p_threads;
+   rabbit_log_config config;
+   rabbit_instance master;
+   rabbit_sched *p_sched;
+   cc_byte key[16] = { 0 }, base_iv[8] = { 0 };
+   unsigned long long seq;
+   int mode, failed;
+   size_t i;
+   double t0;
+
+   if (!threads || !ops || size > RABBIT_LOG_MAX_RECORD)
+      return -1;
+   p_work = (bench_log_arg *)calloc(threads, sizeof(bench_log_arg));
+   p_threads = (pthread_t *)calloc(threads, sizeof(pthread_t));
+   if (!p_work || !p_threads || rabbit_sched_create(&p_sched, 0))
+   {
+      free(p_work);
+      free(p_threads);
+      return -1;
+   }
+   rabbit_key_setup(&master, key, 16);
+   config.max_batch = 0;
+   config.max_delay_us = delay;
+   config.p_sched = p_sched;
+   config.lanes = 0;
+
+   printf("%-12s %8s %8s %12s %10s\n", "mode", "threads", "size",
+          "records/s", "MB/s");
+   for (mode=0; mode<3; mode++)
+   {
+      unlink(p_name);
+      for (i=0; i<threads; i++)
+      {
+         p_work[i].mode = mode;
+         p_work[i].p_lock = &lock;
+         p_work[i].p_seq = &seq;
+         p_work[i].p_master = &master;
+         p_work[i].ops = ops;
+         p_work[i].size = size;
+         p_work[i].failed = 0;
+      }
+      seq = 0;
+      if (mode == 0)
+         p_work[0].fd = open(p_name, O_WRONLY|O_CREAT|O_TRUNC, 0600);
+      else if (rabbit_log_open(&p_work[0].p_log, p_name, &master, base_iv,
+             mode == 2 ? &config : NULL))
+         p_work[0].fd = -1;
+      if (p_work[0].fd < 0)
+         break;
+      for (i=1; i<threads; i++)
+      {
+         p_work[i].fd = p_work[0].fd;
+         p_work[i].p_log = p_work[0].p_log;
+      }
+
+      t0 = bench_now();
+      for (i=0; i<threads; i++)
+         pthread_create(&p_threads[i], NULL, bench_log_thread, &p_work[i]);
+      for (i=0; i<threads; i++)
+         pthread_join(p_threads[i], NULL);
+      t0 = bench_now() - t0;
+
+      if (mode == 0)
+         close(p_work[0].fd);
+      else
+         rabbit_log_close(p_work[0].p_log);
+      for (failed=0, i=0; i<threads; i++)
+         failed |= p_work[i].failed;
+
+      printf("%-12s %8lu %8lu %12.0f %10.2f%s\n", mode_names[mode],
+             (unsigned long)threads, (unsigned long)size,
+             (double)(threads*ops)/t0, (double)(threads*ops*size)/t0*1e-6,
+             failed ? " (failed)" : "");
+   }
+
+   unlink(p_name);
+   rabbit_sched_destroy(p_sched);
+   free(p_work);
+   free(p_threads);
+   return 0;
+}
+
+/* -------------------------------------------------------------------------- */
+
+/* Seal messages of growing size: cipher only, encrypt then authenticate in */
+/* two passes over the buffer, and the fused rabbit_aead_encrypt() */
+static int bench_aead(int argc, char *argv[])
+{
+   /* Temporary variables */
+   size_t max_size = bench_opt(argc, argv, "max", 4 << 20);
+   size_t total = bench_opt(argc, argv, "mb", 256) << 20;
+   rabbit_instance master, inst;
+   rabbit_poly1305 mac;
+   cc_byte key[16] = { 0 }, iv[8] = { 0 }, tag[RABBIT_AEAD_TAG_SIZE];
+   cc_byte otk[32], lengths[16] = { 0 }, *p_buf;
+   size_t size, reps, i, j;
+   double t[3], t0;
+
+   p_buf = (cc_byte *)calloc(max_size ? max_size : 1, 1);
+   if (!p_buf)
+      return -1;
+   rabbit_key_setup(&master, key, 16);
+
+   printf("%10s %12s %12s %12s\n", "bytes", "cipher GB/s", "2-pass GB/s",
+          "fused GB/s");
+   for (size=64; size<=max_size; size*=4)
+   {
+      reps = total/size ? total/size : 1;
+
+      /* Keystream only */
+      t0 = bench_now();
+      for (i=0; i<reps; i++)
+      {
+         rabbit_iv_setup(&master, &inst, iv, 8);
+         rabbit_cipher(&inst, p_buf, p_buf, size);
+      }
+      t[0] = bench_now() - t0;
+
+      /* Encrypt the whole buffer, then authenticate the whole buffer */
+      t0 = bench_now();
+      for (i=0; i<reps; i++)
+      {
+         rabbit_iv_setup(&master, &inst, iv, 8);
+         rabbit_prng(&inst, otk, 32);
+         rabbit_cipher(&inst, p_buf, p_buf, size);
+         rabbit_poly1305_init(&mac, otk);
+         rabbit_poly1305_update(&mac, p_buf, size);
+         for (j=0; j<8; j++)
+            lengths[8+j] = (cc_byte)(size >> (8*j));
+         rabbit_poly1305_update(&mac, lengths, 16);
+         rabbit_poly1305_final(&mac, tag);
+      }
+      t[1] = bench_now() - t0;
+
+      /* Single pass */
+      t0 = bench_now();
+      for (i=0; i<reps; i++)
+         rabbit_aead_encrypt(&master, iv, 8, NULL, 0, p_buf, p_buf, size,
+                tag);
+      t[2] = bench_now() - t0;
+
+      printf("%10lu %12.2f %12.2f %12.2f\n", (unsigned long)size,
+             (double)(reps*size)/t[0]*1e-9, (double)(reps*size)/t[1]*1e-9,
+             (double)(reps*size)/t[2]*1e-9);
+   }
+
+   free(p_buf);
+   return 0;
+}
+
+/* -------------------------------------------------------------------------- */
+
+/* Encrypt and checksum storage blocks spread over a working set larger */
+/* than the last level cache, in two passes and fused. LLC misses per MiB */
+/* stand in for memory traffic where the counter is available. */
+static int bench_crc32c(int argc, char *argv[])
+{
+   /* Temporary variables */
+   size_t set = bench_opt(argc, argv, "mb", 256) << 20;
+   size_t rounds = bench_opt(argc, argv, "rounds", 4);
+   rabbit_instance master, inst;
+   cc_byte key[16] = { 0 }, iv[8] = { 0 }, *p_buf;
+   cc_uint32 crc;
+   size_t block, off, r;
+   double t_two, t_fused, t0, miss_two, miss_fused, mib;
+   int fd;
+
+   p_buf = (cc_byte *)malloc(set ? set : 1);
+   if (!p_buf)
+      return -1;
+   memset(p_buf, 0x5A, set);
+   rabbit_key_setup(&master, key, 16);
+   fd = bench_counter_open(PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES);
+
+   if (fd < 0)
+      printf("LLC miss counter unavailable, memory traffic not measured\n");
+   printf("%10s %14s %14s %10s %14s %14s\n", "block", "2-pass GB/s",
+          "fused GB/s", "speedup", "2-pass LLC/MiB", "fused LLC/MiB");
+   for (block=4096; block<=65536; block*=2)
+   {
+      mib = (double)(rounds*(set/block*block))/(1 << 20);
+
+      /* Encrypt each block, then read it back for the checksum */
+      bench_counter_start(fd);
+      t0 = bench_now();
+      for (r=0; r<rounds; r++)
+         for (off=0; off+block<=set; off+=block)
+         {
+            rabbit_iv_setup(&master, &inst, iv, 8);
+            rabbit_cipher(&inst, p_buf+off, p_buf+off, block);
+            crc = rabbit_crc32c(0, p_buf+off, block);
+         }
+      t_two = bench_now() - t0;
+      miss_two = bench_counter_stop(fd);
+
+      /* One pass per block */
+      bench_counter_start(fd);
+      t0 = bench_now();
+      for (r=0; r<rounds; r++)
+         for (off=0; off+block<=set; off+=block)
+         {
+            rabbit_iv_setup(&master, &inst, iv, 8);
+            crc = 0;
+            rabbit_cipher_crc32c(&inst, p_buf+off, p_buf+off, block, &crc);
+         }
+      t_fused = bench_now() - t0;
+      miss_fused = bench_counter_stop(fd);
+
+      printf("%10lu %14.2f %14.2f %9.2fx", (unsigned long)block,
+             mib*(1 << 20)/t_two*1e-9, mib*(1 << 20)/t_fused*1e-9,
+             t_two/t_fused);
+      if (miss_two >= 0 && miss_fused >= 0)
+         printf(" %14.0f %14.0f\n", miss_two/mib, miss_fused/mib);
+      else
+         printf(" %14s %14s\n", "n/a", "n/a");
+   }
+
+   if (fd >= 0)
+      close(fd);
+   free(p_buf);
+   return 0;
+}
+
+/* -------------------------------------------------------------------------- */
+
+/* Batch of independent messages of very uneven size: most are small, a */
+/* few are several MiB, keys are drawn from a small set. Reports scaling */
+/* of rabbit_encrypt_many() from 1 to max threads. */
+static int bench_many(int argc, char *argv[])
+{
+   /* Temporary variables */
+   size_t job_count = bench_opt(argc, argv, "jobs", 200000);
+   size_t key_count = bench_opt(argc, argv, "keys", 64);
+   size_t max_threads = bench_opt(argc, argv, "max", 64);
+   size_t rounds = bench_opt(argc, argv, "rounds", 3);
+   rabbit_job *p_jobs;
+   cc_byte *p_keys, *p_ivs, *p_buf;
+   uint64_t seed = 38, r;
+   size_t total = 0, off, threads, i;
+   double t, t_one = 0, t0;
+
+   p_jobs = (rabbit_job *)calloc(job_count ? job_count : 1, sizeof(rabbit_job));
+   p_keys = (cc_byte *)malloc(key_count ? key_count*16 : 16);
+   p_ivs = (cc_byte *)malloc(job_count ? job_count*8 : 8);
+   if (!p_jobs || !p_keys || !p_ivs)
+   {
+      free(p_jobs);
+      free(p_keys);
+      free(p_ivs);
+      return -1;
+   }
+   for (i=0; i<(key_count ? key_count : 1)*16; i++)
+      p_keys[i] = (cc_byte)bench_rand(&seed);
+
+   /* Sizes: 1 in 1000 jobs takes up to 8 MiB, the rest 16 B to 4 KiB */
+   for (i=0; i<job_count; i++)
+   {
+      r = bench_rand(&seed);
+      p_jobs[i].data_size = r%1000 ? 16 + (r >> 16)%4096 : (r >> 16)%(8 << 20);
+      p_jobs[i].data_size &= ~(size_t)15;
+      total += p_jobs[i].data_size;
+   }
+   p_buf = (cc_byte *)malloc(total ? total : 1);
+   if (!p_buf)
+   {
+      free(p_jobs);
+      free(p_keys);
+      free(p_ivs);
+      return -1;
+   }
+   memset(p_buf, 0x5A, total);
+
+   /* Large jobs use segmented-IV mode so they can be split */
+   for (i=0, off=0; i<job_count; i++)
+   {
+      r = bench_rand(&seed);
+      memcpy(p_ivs + 8*i, &r, 8);
+      p_jobs[i].p_key = p_keys + 16*(key_count ? (r >> 40)%key_count : 0);
+      p_jobs[i].p_iv = p_ivs + 8*i;
+      p_jobs[i].p_src = p_buf + off;
+      p_jobs[i].p_dest = p_buf + off;
+      p_jobs[i].segment_size = p_jobs[i].data_size > (1 << 20) ? 64 << 10 : 0;
+      off += p_jobs[i].data_size;
+   }
+
+   printf("%lu jobs, %.1f MiB\n", (unsigned long)job_count,
+          (double)total/(1 << 20));
+   printf("%8s %12s %12s %10s %12s\n", "threads", "GB/s", "Mjobs/s",
+          "speedup", "efficiency");
+   for (threads=1; threads<=max_threads; threads*=2)
+   {
+      /* Best of a few rounds; pool startup is part of each call */
+      t = 0;
+      for (i=0; i<rounds; i++)
+      {
+         t0 = bench_now();
+         rabbit_encrypt_many(p_jobs, job_count, (int)threads);
+         t0 = bench_now() - t0;
+         if (!i || t0 < t)
+            t = t0;
+      }
+      if (threads == 1)
+         t_one = t;
+      printf("%8lu %12.2f %12.2f %9.2fx %11.0f%%\n", (unsigned long)threads,
+             (double)total/t*1e-9, (double)job_count/t*1e-6, t_one/t,
+             t_one/t/(double)threads*100);
+   }
+
+   free(p_buf);
+   free(p_jobs);
+   free(p_keys);
+   free(p_ivs);
+   return 0;
+}
+
+/* -------------------------------------------------------------------------- */
+
+/* Segmented encryption of a large buffer whose pages are spread over the */
+/* NUMA nodes: unpinned pool with stealable tasks against a pinned pool */
+/* that keeps every segment on the node of its pages. Reports the overall */
+/* rate and, per node, the rate at which that node's share was processed. */
+static int bench_numa(int argc, char *argv[])
+{
+   /* Temporary variables */
+   size_t size = bench_opt(argc, argv, "mb", 1024) << 20;
+   size_t segment = bench_opt(argc, argv, "segment", 64) << 10;
+   size_t rounds = bench_opt(argc, argv, "rounds", 5);
+   int threads = (int)bench_opt(argc, argv, "threads", 0);
+   int node_count = rabbit_numa_node_count();
+   static const char *mode_names[2] = { "naive", "numa" };
+   size_t node_bytes[RABBIT_NUMA_MAX_NODES] = { 0 };
+   rabbit_sched *p_pinned, *p_sched;
+   rabbit_instance master;
+   cc_byte key[16] = { 0 }, iv[8] = { 0 }, *p_src, *p_dst;
+   const void *p_page;
+   char name[32];
+   size_t off, r;
+   double t, t0;
+   int mode, node, res = -1;
+
+   if (!segment || segment%16)
+      return -1;
+   if (rabbit_sched_create_numa(&p_pinned, threads))
+      return -1;
+
+   /* Both buffers spread over the nodes by first touch */
+   p_src = p_dst = NULL;
+   if (rabbit_segment_alloc(p_pinned, segment, size, &p_src) ||
+       rabbit_segment_alloc(p_pinned, segment, size, &p_dst))
+      goto cleanup;
+   memset(p_src, 0x5A, size);
+   for (off=0; off<size; off+=4096)
+   {
+      p_page = p_dst + off;
+      if (!rabbit_numa_page_nodes(&p_page, 1, &node) && node >= 0 &&
+          node < RABBIT_NUMA_MAX_NODES)
+         node_bytes[node] += size - off < 4096 ? size - off : 4096;
+   }
+   rabbit_key_setup(&master, key, 16);
+
+   printf("%d node(s), %d workers, %lu MiB, %lu KiB segments\n", node_count,
+          rabbit_sched_size(p_pinned), (unsigned long)(size >> 20),
+          (unsigned long)(segment >> 10));
+   printf("%-8s %10s", "mode", "GB/s");
+   for (node=0; node<node_count; node++)
+   {
+      snprintf(name, sizeof(name), "node%d GB/s", node);
+      printf(" %14s", name);
+   }
+   printf("\n");
+
+   for (mode=0; mode<2; mode++)
+   {
+      p_sched = p_pinned;
+      if (!mode && rabbit_sched_create(&p_sched, rabbit_sched_size(p_pinned)))
+         goto cleanup;
+
+      /* Best of a few rounds */
+      t = 0;
+      for (r=0; r<rounds; r++)
+      {
+         t0 = bench_now();
+         rabbit_segment_cipher_parallel(p_sched, &master, iv, segment, 0,
+                p_src, p_dst, size);
+         t0 = bench_now() - t0;
+         if (!r || t0 < t)
+            t = t0;
+      }
+      if (!mode)
+         rabbit_sched_destroy(p_sched);
+
+      printf("%-8s %10.2f", mode_names[mode], (double)size/t*1e-9);
+      for (node=0; node<node_count; node++)
+         printf(" %14.2f", (double)node_bytes[node]/t*1e-9);
+      printf("\n");
+   }
+   res = 0;
+
+cleanup:
+   rabbit_segment_free(p_src, size);
+   rabbit_segment_free(p_dst, size);
+   rabbit_sched_destroy(p_pinned);
+   return res;
+}
+
+/* -------------------------------------------------------------------------- */
+
+/* Out-of-place encryption of buffers around and beyond the last level */
+/* cache, with ordinary and with non-temporal stores */
+static int bench_nt(int argc, char *argv[])
+{
+   /* Temporary variables */
+   size_t max_size = bench_opt(argc, argv, "mb", 1024) << 20;
+   size_t rounds = bench_opt(argc, argv, "rounds", 3);
+   static const char *mode_names[2] = { "default", "nt" };
+   size_t auto_threshold = rabbit_get_nt_threshold();
+   rabbit_instance master, inst;
+   cc_byte key[16] = { 0 }, *p_src, *p_dst;
+   double t, t0, misses, best_misses;
+   size_t size, r;
+   int mode, fd;
+
+   p_src = (cc_byte *)malloc(max_size ? max_size : 1);
+   p_dst = (cc_byte *)aligned_alloc(RABBIT_CACHE_LINE,
+          max_size ? max_size : RABBIT_CACHE_LINE);
+   if (!p_src || !p_dst)
+   {
+      free(p_src);
+      free(p_dst);
+      return -1;
+   }
+   memset(p_src, 0x5A, max_size);
+   memset(p_dst, 0, max_size);
+   rabbit_key_setup(&master, key, 16);
+   fd = bench_counter_open(PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES);
+
+   printf("automatic threshold %.1f MiB%s\n",
+          (double)auto_threshold/(1 << 20),
+          fd < 0 ? ", LLC miss counter unavailable" : "");
+   printf("%10s %-8s %10s %16s\n", "MiB", "stores", "GB/s", "LLC misses/MiB");
+   for (size=16 << 20; size<=max_size; size*=2)
+   {
+      for (mode=0; mode<2; mode++)
+      {
+         rabbit_set_nt_threshold(mode ? 16 : (size_t)-1);
+         t = 0;
+         best_misses = -1;
+         for (r=0; r<rounds; r++)
+         {
+            inst = master;
+            bench_counter_start(fd);
+            t0 = bench_now();
+            rabbit_cipher(&inst, p_src, p_dst, size);
+            t0 = bench_now() - t0;
+            misses = bench_counter_stop(fd);
+            if (!r || t0 < t)
+            {
+               t = t0;
+               best_misses = misses;
+            }
+         }
+         printf("%10lu %-8s %10.2f", (unsigned long)(size >> 20),
+                mode_names[mode], (double)size/t*1e-9);
+         if (best_misses >= 0)
+            printf(" %16.0f\n", best_misses/(double)(size >> 20));
+         else
+            printf(" %16s\n", "n/a");
+      }
+   }
+   rabbit_set_nt_threshold(0);
+
+   if (fd >= 0)
+      close(fd);
+   free(p_src);
+   free(p_dst);
+   return 0;
+}
+
+/* -------------------------------------------------------------------------- */
+
+/* Hardware events of the counters scenario */
+static const bench_event bench_events[] =
+{
+   { "cycles", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES },
+   { "instr", PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS },
+   { "L1D miss", PERF_TYPE_HW_CACHE, BENCH_CACHE_EVENT(PERF_COUNT_HW_CACHE_L1D,
+          PERF_COUNT_HW_CACHE_OP_READ, PERF_COUNT_HW_CACHE_RESULT_MISS) },
+   { "LLC miss", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES },
+   { "br miss", PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES },
+   { "FE stall", PERF_TYPE_HARDWARE, PERF_COUNT_HW_STALLED_CYCLES_FRONTEND },
+   { "BE stall", PERF_TYPE_HARDWARE, PERF_COUNT_HW_STALLED_CYCLES_BACKEND },
+   { "raw", PERF_TYPE_RAW, 0 }
+};
+
+#define BENCH_EVENT_COUNT (sizeof(bench_events)/sizeof(bench_events[0]))
+
+/* Backends of the counters scenario */
+static const char *bench_backends[] = { "cipher", "nt", "prng", "precomp" };
+
+#define BENCH_BACKEND_COUNT (sizeof(bench_backends)/sizeof(bench_backends[0]))
+
+/* Pass `count` messages of `size` bytes through a backend with the */
+/* counters enabled; precomp refills its buffer with them paused */
+static void bench_counters_pass(int backend, rabbit_instance *p_inst,
+          rabbit_precomp *p_pre, const cc_byte *p_src, cc_byte *p_dst,
+          size_t size, size_t count, const int *p_fds)
+{
+   /* Temporary variables */
+   size_t i, e;
+
+   for (e=0; e<BENCH_EVENT_COUNT; e++)
+      bench_counter_start(p_fds[e]);
+   for (i=0; i<count; i++)
+      switch (backend)
+      {
+         case 0:
+         case 1:
+            rabbit_cipher(p_inst, p_src, p_dst, size);
+            break;
+         case 2:
+            rabbit_prng(p_inst, p_dst, size);
+            break;
+         default:
+            if (rabbit_precomp_available(p_pre) < size)
+            {
+               for (e=0; e<BENCH_EVENT_COUNT; e++)
+                  bench_counter_enable(p_fds[e], 0);
+               rabbit_precomp_refill(p_pre);
+               for (e=0; e<BENCH_EVENT_COUNT; e++)
+                  bench_counter_enable(p_fds[e], 1);
+            }
+            rabbit_precomp_cipher(p_pre, p_src, p_dst, size);
+            break;
+      }
+}
+
+/* Hardware counters per byte and per 16-byte block, i.e. per */
+/* rabbit_next_state() call, for each backend and message size. The */
+/* precomp counts leave out buffer refills; its times include them. */
+static int bench_counters(int argc, char *argv[])
+{
+   /* Temporary variables */
+   size_t max_size = bench_opt(argc, argv, "max", 1 << 20);
+   size_t work = bench_opt(argc, argv, "mb", 8) << 20;
+   size_t rounds = bench_opt(argc, argv, "rounds", 3);
+   uint64_t raw = bench_opt(argc, argv, "raw", 0);
+   int fds[BENCH_EVENT_COUNT];
+   double value[BENCH_EVENT_COUNT], best[BENCH_EVENT_COUNT];
+   rabbit_instance master, inst;
+   rabbit_precomp *p_pre = NULL;
+   cc_byte key[16] = { 0 }, *p_src, *p_dst;
+   double t, t0, blocks;
+   size_t size, count, r, e, b;
+   int available = 0, res = 0;
+
+   if (max_size < 16)
+      max_size = 16;
+   p_src = (cc_byte *)aligned_alloc(RABBIT_CACHE_LINE,
+          (max_size + RABBIT_CACHE_LINE - 1) & ~(size_t)(RABBIT_CACHE_LINE - 1));
+   p_dst = (cc_byte *)aligned_alloc(RABBIT_CACHE_LINE,
+          (max_size + RABBIT_CACHE_LINE - 1) & ~(size_t)(RABBIT_CACHE_LINE - 1));
+   if (!p_src || !p_dst)
+   {
+      free(p_src);
+      free(p_dst);
+      return -1;
+   }
+   memset(p_src, 0x5A, max_size);
+   memset(p_dst, 0, max_size);
+   rabbit_key_setup(&master, key, 16);
+
+   /* Counters missing on this CPU, or all of them in a container, */
+   /* are reported as n/a */
+   for (e=0; e<BENCH_EVENT_COUNT; e++)
+   {
+      fds[e] = -1;
+      if (bench_events[e].type != PERF_TYPE_RAW || raw)
+         fds[e] = bench_counter_open(bench_events[e].type,
+                bench_events[e].type == PERF_TYPE_RAW ? raw :
+                bench_events[e].config);
+      if (fds[e] >= 0)
+         available++;
+   }
+   if (!available)
+      printf("hardware counters unavailable (container or "
+             "perf_event_paranoid), reporting time only\n");
+
+   printf("%-8s %8s %7s %7s %7s %5s", "backend", "bytes", "ns/B", "cyc/B",
+          "ins/B", "IPC");
+   for (e=0; e<BENCH_EVENT_COUNT; e++)
+      if (fds[e] >= 0)
+         printf(" %9s", bench_events[e].name);
+   printf("   (events per block)\n");
+
+   for (b=0; b<BENCH_BACKEND_COUNT && !res; b++)
+      for (size=16; size<=max_size; size*=4)
+      {
+         /* The precompute buffer only covers messages up to its depth */
+         if (b == 3 && size > RABBIT_PRECOMP_MAX_DEPTH)
+            break;
+
+         rabbit_set_nt_threshold(b == 1 ? 16 : (size_t)-1);
+         inst = master;
+         if (b == 3 && rabbit_precomp_create(&p_pre, &master,
+                RABBIT_PRECOMP_MAX_DEPTH))
+         {
+            res = -1;
+            break;
+         }
+         count = work/size ? work/size : 1;
+         blocks = (double)(count*(size/16));
+
+         /* One pass to warm up, then the fastest of the measured ones */
+         bench_counters_pass(b, &inst, p_pre, p_src, p_dst, size, count/8 + 1,
+                fds);
+         t = 0;
+         for (r=0; r<rounds || !r; r++)
+         {
+            t0 = bench_now();
+            bench_counters_pass(b, &inst, p_pre, p_src, p_dst, size, count,
+                   fds);
+            t0 = bench_now() - t0;
+            for (e=0; e<BENCH_EVENT_COUNT; e++)
+               value[e] = bench_counter_stop(fds[e]);
+            if (!r || t0 < t)
+            {
+               t = t0;
+               memcpy(best, value, sizeof(best));
+            }
+         }
+         if (p_pre)
+         {
+            rabbit_precomp_destroy(p_pre);
+            p_pre = NULL;
+         }
+
+         printf("%-8s %8lu %7.3f", bench_backends[b], (unsigned long)size,
+                t*1e9/(16*blocks));
+         if (best[0] >= 0)
+            printf(" %7.2f", best[0]/(16*blocks));
+         else
+            printf(" %7s", "n/a");
+         if (best[1] >= 0)
+            printf(" %7.2f", best[1]/(16*blocks));
+         else
+            printf(" %7s", "n/a");
+         if (best[0] > 0 && best[1] >= 0)
+            printf(" %5.2f", best[1]/best[0]);
+         else
+            printf(" %5s", "n/a");
+         for (e=0; e<BENCH_EVENT_COUNT; e++)
+            if (fds[e] >= 0)
+            {
+               if (best[e] >= 0)
+                  printf(" %9.3f", best[e]/blocks);
+               else
+                  printf(" %9s", "n/a");
+            }
+         printf("\n");
+      }
+   rabbit_set_nt_threshold(0);
+
+   for (e=0; e<BENCH_EVENT_COUNT; e++)
+      if (fds[e] >= 0)
+         close(fds[e]);
+   rabbit_wipe(&inst, sizeof(inst));
+   free(p_src);
+   free(p_dst);
+   return res;
+}
+
+/* -------------------------------------------------------------------------- */
+
+/* Scaling efficiency, or throughput relative to the previous thread */
+/* count, below which a thread count is flagged */
+#define BENCH_SCALING_FLAG 0.8
+
+/* Start gate of the scaling threads: 0 waiting, 1 go, -1 abort */
+typedef struct
+{
+   pthread_mutex_t mutex;
+   pthread_cond_t cond;
+   int state;
+} bench_gate;
+
+/* Work of one thread in the scaling scenario */
+typedef struct
+{
+   bench_gate *p_gate;
+   const rabbit_instance *p_master;
+   rabbit_instance *p_inst;           /* NULL: private instance on the stack */
+   cc_byte *p_src, *p_dst;
+   size_t buf_size, size, ops;
+   double *p_latency;
+   double start, end;
+   int cpu;
+} bench_scaling_arg;
+
+/* IV setup from the shared master, then one message, ops times */
+static void *bench_scaling_run(void *p_arg)
+{
+   /* Temporary variables */
+   bench_scaling_arg *p_work = (bench_scaling_arg *)p_arg;
+   rabbit_instance local, *p_inst = p_work->p_inst ? p_work->p_inst : &local;
+   cc_byte iv[8] = { 0 };
+   cpu_set_t set;
+   size_t i, off = 0;
+   double t0;
+   int state;
+
+   if (p_work->cpu >= 0)
+   {
+      CPU_ZERO(&set);
+      CPU_SET(p_work->cpu, &set);
+      pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+   }
+   pthread_mutex_lock(&p_work->p_gate->mutex);
+   while (!(state = p_work->p_gate->state))
+      pthread_cond_wait(&p_work->p_gate->cond, &p_work->p_gate->mutex);
+   pthread_mutex_unlock(&p_work->p_gate->mutex);
+   if (state < 0)
+      return NULL;
+
+   p_work->start = bench_now();
+   for (i=0; i<p_work->ops; i++)
+   {
+      t0 = bench_now();
+      memcpy(iv, &i, sizeof(i) < 8 ? sizeof(i) : 8);
+      rabbit_iv_setup(p_work->p_master, p_inst, iv, 8);
+      rabbit_cipher(p_inst, p_work->p_src + off, p_work->p_dst + off,
+             p_work->size);
+      p_work->p_latency[i] = bench_now() - t0;
+      off += p_work->size;
+      if (off + p_work->size > p_work->buf_size)
+         off = 0;
+   }
+   p_work->end = bench_now();
+
+   rabbit_wipe(&local, sizeof(local));
+   return NULL;
+}
+
+/* Aggregate throughput and tail latency of 1 to N threads that set up */
+/* IVs from one shared const master: with private instances on their */
+/* stacks, in a packed or a cache-line padded shared array, and streaming */
+/* large private buffers */
+static int bench_scaling(int argc, char *argv[])
+{
+   /* Temporary variables */
+   size_t size = bench_opt(argc, argv, "size", 64);
+   size_t ops = bench_opt(argc, argv, "ops", 200000);
+   size_t stream_size = bench_opt(argc, argv, "mb", 64) << 20;
+   size_t chunk = bench_opt(argc, argv, "chunk", 1024) << 10;
+   int max_threads = (int)bench_opt(argc, argv, "threads", 0);
+   static const char *mode_names[4] = { "shared", "packed", "padded",
+          "stream" };
+   bench_scaling_arg *p_work = NULL;
+   pthread_t *p_threads = NULL;
+   bench_gate gate = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, 0 };
+   rabbit_instance master;
+   cc_byte key[16] = { 0 }, *p_array = NULL, **pp_src = NULL, **pp_dst = NULL;
+   double *p_latency = NULL, t, first = 0, prev = 0, rate, eff, start, end;
+   size_t stride, mode_size, mode_ops, mode_buf;
+   int cpus[CPU_SETSIZE], cpu_count = 0, threads, mode, i, j, res = -1;
+   cpu_set_t set;
+
+   if (!size || size%16 || !chunk || chunk%16 || stream_size < chunk || !ops)
+      return -1;
+
+   /* One thread per usable CPU by default; pinned unless oversubscribed */
+   CPU_ZERO(&set);
+   if (!sched_getaffinity(0, sizeof(set), &set))
+      for (i=0; i<CPU_SETSIZE; i++)
+         if (CPU_ISSET(i, &set))
+            cpus[cpu_count++] = i;
+   if (max_threads <= 0)
+      max_threads = cpu_count ? cpu_count : 1;
+
+   p_work = (bench_scaling_arg *)calloc((size_t)max_threads,
+          sizeof(bench_scaling_arg));
+   p_threads = (pthread_t *)calloc((size_t)max_threads, sizeof(pthread_t));
+   pp_src = (cc_byte **)calloc((size_t)max_threads, sizeof(cc_byte *));
+   pp_dst = (cc_byte **)calloc((size_t)max_threads, sizeof(cc_byte *));
+   p_latency = (double *)malloc((size_t)max_threads*ops*sizeof(double));
+   stride = (sizeof(rabbit_instance) + RABBIT_CACHE_LINE - 1) &
+          ~(size_t)(RABBIT_CACHE_LINE - 1);
+   p_array = (cc_byte *)aligned_alloc(RABBIT_CACHE_LINE,
+          (size_t)max_threads*stride);
+   if (!p_work || !p_threads || !pp_src || !pp_dst || !p_latency || !p_array)
+      goto cleanup;
+   for (i=0; i<max_threads; i++)
+   {
+      pp_src[i] = (cc_byte *)malloc(stream_size);
+      pp_dst[i] = (cc_byte *)malloc(stream_size);
+      if (!pp_src[i] || !pp_dst[i])
+         goto cleanup;
+      memset(pp_src[i], 0x5A, stream_size);
+      memset(pp_dst[i], 0, stream_size);
+   }
+   rabbit_key_setup(&master, key, 16);
+
+   printf("%d usable CPU(s), instance %lu bytes, padded stride %lu, "
+          "messages %lu bytes, stream chunks %lu KiB\n", cpu_count,
+          (unsigned long)sizeof(rabbit_instance), (unsigned long)stride,
+          (unsigned long)size, (unsigned long)(chunk >> 10));
+   printf("%-8s %7s %10s %10s %10s %10s %7s\n", "mode", "threads", "kop/s",
+          "GB/s", "p50 us", "p99 us", "eff %");
+
+   for (mode=0; mode<4; mode++)
+   {
+      mode_size = mode == 3 ? chunk : size;
+      mode_buf = mode == 3 ? stream_size : size;
+      mode_ops = mode == 3 ? stream_size/chunk : ops;
+
+      /* 1, 2, 4, ... threads and the maximum */
+      for (threads=1; threads<=max_threads;
+           threads = threads < max_threads && threads*2 > max_threads ?
+           max_threads : threads*2)
+      {
+         gate.state = 0;
+         for (i=0; i<threads; i++)
+         {
+            p_work[i].p_gate = &gate;
+            p_work[i].p_master = &master;
+            p_work[i].p_inst = NULL;
+            if (mode == 1)
+               p_work[i].p_inst = (rabbit_instance *)p_array + i;
+            else if (mode == 2)
+               p_work[i].p_inst = (rabbit_instance *)(p_array + i*stride);
+            p_work[i].p_src = pp_src[i];
+            p_work[i].p_dst = mode == 3 ? pp_dst[i] : pp_src[i];
+            p_work[i].buf_size = mode_buf;
+            p_work[i].size = mode_size;
+            p_work[i].ops = mode_ops;
+            p_work[i].p_latency = p_latency + (size_t)i*mode_ops;
+            p_work[i].cpu = threads <= cpu_count ? cpus[i] : -1;
+            if (pthread_create(&p_threads[i], NULL, bench_scaling_run,
+                   &p_work[i]))
+               break;
+         }
+
+         /* Start all threads at once, or send them home if one is missing */
+         pthread_mutex_lock(&gate.mutex);
+         gate.state = i == threads ? 1 : -1;
+         pthread_cond_broadcast(&gate.cond);
+         pthread_mutex_unlock(&gate.mutex);
+         for (j=0; j<i; j++)
+            pthread_join(p_threads[j], NULL);
+         if (gate.state < 0)
+            goto cleanup;
+
+         /* From the first start to the last finish */
+         start = p_work[0].start;
+         end = p_work[0].end;
+         for (i=1; i<threads; i++)
+         {
+            if (p_work[i].start < start)
+               start = p_work[i].start;
+            if (p_work[i].end > end)
+               end = p_work[i].end;
+         }
+         t = end - start;
+         rate = (double)threads*(double)mode_ops/t;
+         if (threads == 1)
+            first = prev = rate;
+         eff = rate/((double)threads*first);
+
+         printf("%-8s %7d %10.1f %10.3f %10.3f %10.3f %7.1f",
+                mode_names[mode], threads, rate*1e-3,
+                rate*(double)mode_size*1e-9,
+                bench_percentile(p_latency, (size_t)threads*mode_ops, 50)*1e6,
+                bench_percentile(p_latency, (size_t)threads*mode_ops, 99)*1e6,
+                eff*100);
+         if (rate < prev*BENCH_SCALING_FLAG)
+            printf("  <- slower than fewer threads");
+         else if (eff < BENCH_SCALING_FLAG)
+            printf("  <- sublinear");
+         printf("\n");
+         prev = rate;
+      }
+   }
+   res = 0;
+
+cleanup:
+   for (i=0; pp_src && pp_dst && i<max_threads; i++)
+   {
+      free(pp_src[i]);
+      free(pp_dst[i]);
+   }
+   free(pp_src);
+   free(pp_dst);
+   free(p_array);
+   free(p_latency);
+   free(p_threads);
+   free(p_work);
+   return res;
+}
+
+/* -------------------------------------------------------------------------- */
+
+/* Portable ChaCha20 (RFC 8439) as a cross-cipher baseline */
+typedef struct
+{
+   uint32_t state[16];
+} bench_chacha;
+
+#define BENCH_ROTL(x, n) (((x) << (n)) | ((x) >> (32 - (n))))
+
+#define BENCH_QUARTER(a, b, c, d) \
+   a += b; d ^= a; d = BENCH_ROTL(d, 16); \
+   c += d; b ^= c; b = BENCH_ROTL(b, 12); \
+   a += b; d ^= a; d = BENCH_ROTL(d, 8); \
+   c += d; b ^= c; b = BENCH_ROTL(b, 7)
+
+/* Key setup: constants and key words */
+static void bench_chacha_key(bench_chacha *p_ctx, const cc_byte *p_key)
+{
+   p_ctx->state[0] = 0x61707865;
+   p_ctx->state[1] = 0x3320646E;
+   p_ctx->state[2] = 0x79622D32;
+   p_ctx->state[3] = 0x6B206574;
+   memcpy(p_ctx->state+4, p_key, 32);
+}
+
+/* IV setup: block counter and 12-byte nonce */
+static void bench_chacha_iv(bench_chacha *p_ctx, const cc_byte *p_nonce,
+          uint32_t counter)
+{
+   p_ctx->state[12] = counter;
+   memcpy(p_ctx->state+13, p_nonce, 12);
+}
+
+/* Encrypt or decrypt data of any size; a partial final block ends the */
+/* message */
+static void bench_chacha_xor(bench_chacha *p_ctx, const cc_byte *p_src,
+          cc_byte *p_dest, size_t data_size)
+{
+   /* Temporary variables */
+   uint32_t x[16], w;
+   size_t n, i;
+   int r;
+
+   while (data_size)
+   {
+      memcpy(x, p_ctx->state, sizeof(x));
+      for (r=0; r<10; r++)
+      {
+         BENCH_QUARTER(x[0], x[4], x[ 8], x[12]);
+         BENCH_QUARTER(x[1], x[5], x[ 9], x[13]);
+         BENCH_QUARTER(x[2], x[6], x[10], x[14]);
+         BENCH_QUARTER(x[3], x[7], x[11], x[15]);
+         BENCH_QUARTER(x[0], x[5], x[10], x[15]);
+         BENCH_QUARTER(x[1], x[6], x[11], x[12]);
+         BENCH_QUARTER(x[2], x[7], x[ 8], x[13]);
+         BENCH_QUARTER(x[3], x[4], x[ 9], x[14]);
+      }
+      for (i=0; i<16; i++)
+         x[i] += p_ctx->state[i];
+      p_ctx->state[12]++;
+
+      n = data_size < 64 ? data_size : 64;
+      if (n == 64)
+         for (i=0; i<16; i++)
+         {
+            memcpy(&w, p_src + 4*i, 4);
+            w ^= x[i];
+            memcpy(p_dest + 4*i, &w, 4);
+         }
+      else
+         for (i=0; i<n; i++)
+            p_dest[i] = p_src[i] ^ ((const cc_byte *)x)[i];
+      p_src += n;
+      p_dest += n;
+      data_size -= n;
+   }
+}
+
+#ifdef BENCH_AESNI
+/* AES-128 in CTR mode with AES-NI as a cross-cipher baseline; the */
+/* counter block is a 64-bit big-endian nonce and block counter */
+typedef struct
+{
+   __m128i rk[11];
+   uint64_t nonce, counter;
+} bench_aes;
+
+#define BENCH_AES_TARGET __attribute__((target("aes,sse2")))
+
+/* One round key from the previous one */
+static inline BENCH_AES_TARGET __m128i bench_aes_round_key(__m128i key,
+          __m128i assist)
+{
+   assist = _mm_shuffle_epi32(assist, 0xFF);
+   key = _mm_xor_si128(key, _mm_slli_si128(key, 4));
+   key = _mm_xor_si128(key, _mm_slli_si128(key, 4));
+   key = _mm_xor_si128(key, _mm_slli_si128(key, 4));
+   return _mm_xor_si128(key, assist);
+}
+
+#define BENCH_AES_EXPAND(i, rcon) \
+   p_ctx->rk[i] = bench_aes_round_key(p_ctx->rk[i-1], \
+          _mm_aeskeygenassist_si128(p_ctx->rk[i-1], rcon))
+
+/* Key setup: the round keys */
+static BENCH_AES_TARGET void bench_aes_key(bench_aes *p_ctx,
+          const cc_byte *p_key)
+{
+   p_ctx->rk[0] = _mm_loadu_si128((const __m128i *)p_key);
+   BENCH_AES_EXPAND(1, 0x01);
+   BENCH_AES_EXPAND(2, 0x02);
+   BENCH_AES_EXPAND(3, 0x04);
+   BENCH_AES_EXPAND(4, 0x08);
+   BENCH_AES_EXPAND(5, 0x10);
+   BENCH_AES_EXPAND(6, 0x20);
+   BENCH_AES_EXPAND(7, 0x40);
+   BENCH_AES_EXPAND(8, 0x80);
+   BENCH_AES_EXPAND(9, 0x1B);
+   BENCH_AES_EXPAND(10, 0x36);
+}
+
+/* IV setup: the first counter block */
+static void bench_aes_iv(bench_aes *p_ctx, const cc_byte *p_iv)
+{
+   /* Temporary variables */
+   uint64_t w;
+
+   memcpy(&w, p_iv, 8);
+   p_ctx->nonce = w;
+   memcpy(&w, p_iv+8, 8);
+   p_ctx->counter = __builtin_bswap64(w);
+}
+
+/* Next counter block */
+static inline BENCH_AES_TARGET __m128i bench_aes_next(bench_aes *p_ctx)
+{
+   return _mm_set_epi64x((long long)__builtin_bswap64(p_ctx->counter++),
+          (long long)p_ctx->nonce);
+}
+
+/* Encrypt or decrypt data of any size, eight blocks at a time to fill */
+/* the AES pipeline; a partial final block ends the message */
+static BENCH_AES_TARGET void bench_aes_xor(bench_aes *p_ctx,
+          const cc_byte *p_src, cc_byte *p_dest, size_t data_size)
+{
+   /* Temporary variables */
+   __m128i b[8];
+   cc_byte ks[16];
+   size_t n, i;
+   int j, r;
+
+   for (; data_size>=128; data_size-=128, p_src+=128, p_dest+=128)
+   {
+      for (j=0; j<8; j++)
+         b[j] = _mm_xor_si128(bench_aes_next(p_ctx), p_ctx->rk[0]);
+      for (r=1; r<10; r++)
+         for (j=0; j<8; j++)
+            b[j] = _mm_aesenc_si128(b[j], p_ctx->rk[r]);
+      for (j=0; j<8; j++)
+         _mm_storeu_si128((__m128i *)(p_dest + 16*j), _mm_xor_si128(
+                _mm_aesenclast_si128(b[j], p_ctx->rk[10]),
+                _mm_loadu_si128((const __m128i *)(p_src + 16*j))));
+   }
+
+   for (; data_size; data_size-=n, p_src+=n, p_dest+=n)
+   {
+      b[0] = _mm_xor_si128(bench_aes_next(p_ctx), p_ctx->rk[0]);
+      for (r=1; r<10; r++)
+         b[0] = _mm_aesenc_si128(b[0], p_ctx->rk[r]);
+      _mm_storeu_si128((__m128i *)ks, _mm_aesenclast_si128(b[0],
+             p_ctx->rk[10]));
+      n = data_size < 16 ? data_size : 16;
+      for (i=0; i<n; i++)
+         p_dest[i] = p_src[i] ^ ks[i];
+   }
+}
+#endif
+
+/* Known answers: RFC 8439 section 2.3.2 and FIPS-197 appendix C.1 */
+static int bench_baseline_check(void)
+{
+   /* Temporary variables */
+   static const cc_byte chacha_nonce[12] = { 0, 0, 0, 0x09, 0, 0, 0, 0x4A };
+   static const cc_byte chacha_out[16] = { 0x10, 0xF1, 0xE7, 0xE4, 0xD1,
+          0x3B, 0x59, 0x15, 0x50, 0x0F, 0xDD, 0x1F, 0xA3, 0x20, 0x71, 0xC4 };
+   cc_byte key[32], buf[64] = { 0 };
+   bench_chacha chacha;
+   int i;
+#ifdef BENCH_AESNI
+   static const cc_byte aes_out[16] = { 0x69, 0xC4, 0xE0, 0xD8, 0x6A, 0x7B,
+          0x04, 0x30, 0xD8, 0xCD, 0xB7, 0x80, 0x70, 0xB4, 0xC5, 0x5A };
+   cc_byte iv[16];
+   bench_aes aes;
+#endif
+
+   for (i=0; i<32; i++)
+      key[i] = (cc_byte)i;
+   bench_chacha_key(&chacha, key);
+   bench_chacha_iv(&chacha, chacha_nonce, 1);
+   bench_chacha_xor(&chacha, buf, buf, 64);
+   if (memcmp(buf, chacha_out, 16))
+      return -1;
+
+#ifdef BENCH_AESNI
+   if (__builtin_cpu_supports("aes"))
+   {
+      for (i=0; i<16; i++)
+         iv[i] = (cc_byte)(i*0x11);
+      memset(buf, 0, 16);
+      bench_aes_key(&aes, key);
+      bench_aes_iv(&aes, iv);
+      bench_aes_xor(&aes, buf, buf, 16);
+      if (memcmp(buf, aes_out, 16))
+         return -1;
+   }
+#endif
+
+   return 0;
+}
+
+/* Ciphers and Rabbit backends of the baseline scenario */
+#define BENCH_RABBIT     0
+#define BENCH_RABBIT_NT  1
+#define BENCH_RABBIT_PRE 2
+#define BENCH_CHACHA     3
+#define BENCH_AES        4
+
+/* State of every candidate */
+typedef struct
+{
+   rabbit_instance master, inst;
+   rabbit_precomp *p_pre;
+   bench_chacha chacha;
+#ifdef BENCH_AESNI
+   bench_aes aes;
+#endif
+   cc_byte key[32], iv[16];
+} bench_baseline_ctx;
+
+/* Key setup; returns -1 if the candidate has none of its own */
+static int bench_baseline_key(int cipher, bench_baseline_ctx *p_ctx)
+{
+   switch (cipher)
+   {
+      case BENCH_RABBIT:
+         rabbit_key_setup(&p_ctx->master, p_ctx->key, 16);
+         break;
+      case BENCH_CHACHA:
+         bench_chacha_key(&p_ctx->chacha, p_ctx->key);
+         break;
+#ifdef BENCH_AESNI
+      case BENCH_AES:
+         bench_aes_key(&p_ctx->aes, p_ctx->key);
+         break;
+#endif
+      default:
+         return -1;
+   }
+   BENCH_CLOBBER(p_ctx);
+   return 0;
+}
+
+/* IV setup; returns -1 if the candidate has none of its own */
+static int bench_baseline_iv(int cipher, bench_baseline_ctx *p_ctx)
+{
+   switch (cipher)
+   {
+      case BENCH_RABBIT:
+         rabbit_iv_setup(&p_ctx->master, &p_ctx->inst, p_ctx->iv, 8);
+         break;
+      case BENCH_CHACHA:
+         bench_chacha_iv(&p_ctx->chacha, p_ctx->iv, 0);
+         break;
+#ifdef BENCH_AESNI
+      case BENCH_AES:
+         bench_aes_iv(&p_ctx->aes, p_ctx->iv);
+         break;
+#endif
+      default:
+         return -1;
+   }
+   BENCH_CLOBBER(p_ctx);
+   return 0;
+}
+
+/* Encrypt data, continuing the current stream */
+static void bench_baseline_xor(int cipher, bench_baseline_ctx *p_ctx,
+          const cc_byte *p_src, cc_byte *p_dest, size_t data_size)
+{
+   switch (cipher)
+   {
+      case BENCH_RABBIT:
+      case BENCH_RABBIT_NT:
+         rabbit_cipher(&p_ctx->inst, p_src, p_dest, data_size);
+         break;
+      case BENCH_RABBIT_PRE:
+         rabbit_precomp_cipher(p_ctx->p_pre, p_src, p_dest, data_size);
+         break;
+      case BENCH_CHACHA:
+         bench_chacha_xor(&p_ctx->chacha, p_src, p_dest, data_size);
+         break;
+#ifdef BENCH_AESNI
+      case BENCH_AES:
+         bench_aes_xor(&p_ctx->aes, p_src, p_dest, data_size);
+         break;
+#endif
+   }
+   BENCH_CLOBBER(p_dest);
+}
+
+/* Key setup, IV setup, short packet and bulk cost of Rabbit's backends */
+/* next to ChaCha20 and AES-128-CTR in the same harness. A packet is an */
+/* IV setup plus the message, except for precomp, which continues one */
+/* stream with refills left out, as a background worker would do them. */
+static int bench_baseline(int argc, char *argv[])
+{
+   /* Temporary variables */
+   size_t ops = bench_opt(argc, argv, "ops", 100000);
+   size_t packet = bench_opt(argc, argv, "packet", 64);
+   size_t bulk = bench_opt(argc, argv, "mb", 64) << 20;
+   size_t rounds = bench_opt(argc, argv, "rounds", 3);
+   static const char *names[5] = { "rabbit", "rabbit-nt", "rabbit-pre",
+          "chacha20", "aes128-ctr" };
+   static const char *columns[4] = { "key ns", "iv ns", "packet ns",
+          "bulk GB/s" };
+   bench_baseline_ctx ctx;
+   cc_byte *p_src, *p_dst, *p_pkt;
+   double result[5][4], best[4], t, t0;
+   int has[5] = { 1, 1, 1, 1, 0 }, winner[4] = { -1, -1, -1, -1 };
+   size_t i, r, done;
+   int c, k, res = -1;
+
+   if (bench_baseline_check())
+   {
+      printf("baseline ciphers failed their known answer tests\n");
+      return -1;
+   }
+#ifdef BENCH_AESNI
+   has[BENCH_AES] = __builtin_cpu_supports("aes");
+#endif
+   if (!has[BENCH_AES])
+      printf("AES-NI not available, aes128-ctr skipped\n");
+
+   if (!ops || !packet || packet > RABBIT_PRECOMP_MAX_DEPTH || bulk < 16)
+      return -1;
+   bulk &= ~(size_t)15;
+   p_src = (cc_byte *)malloc(bulk);
+   p_dst = (cc_byte *)aligned_alloc(RABBIT_CACHE_LINE, bulk);
+   p_pkt = (cc_byte *)calloc(1, packet);
+   memset(&ctx, 0, sizeof(ctx));
+   if (!p_src || !p_dst || !p_pkt)
+      goto cleanup;
+   memset(p_src, 0x5A, bulk);
+   memset(p_dst, 0, bulk);
+   rabbit_key_setup(&ctx.master, ctx.key, 16);
+   if (rabbit_precomp_create(&ctx.p_pre, &ctx.master, RABBIT_PRECOMP_MAX_DEPTH))
+      goto cleanup;
+
+   printf("packets of %lu bytes, bulk %lu MiB out of place\n",
+          (unsigned long)packet, (unsigned long)(bulk >> 20));
+   printf("%-10s", "cipher");
+   for (k=0; k<4; k++)
+      printf(" %12s", columns[k]);
+   printf("\n");
+
+   for (c=0; c<5; c++)
+   {
+      for (k=0; k<4; k++)
+         result[c][k] = -1;
+      if (!has[c])
+         continue;
+      ctx.iv[0] = 0;
+      bench_baseline_key(c == BENCH_RABBIT_PRE ? BENCH_RABBIT : c, &ctx);
+      bench_baseline_iv(c == BENCH_RABBIT_PRE ? BENCH_RABBIT : c, &ctx);
+      rabbit_set_nt_threshold(c == BENCH_RABBIT_NT ? 16 : (size_t)-1);
+
+      for (k=0; k<4; k++)
+      {
+         best[k] = -1;
+         for (r=0; r<rounds || !r; r++)
+         {
+            t = -1;
+            if (k == 0 && c != BENCH_RABBIT_NT && c != BENCH_RABBIT_PRE)
+            {
+               t0 = bench_now();
+               for (i=0; i<ops; i++)
+               {
+                  ctx.key[0] = (cc_byte)i;
+                  bench_baseline_key(c, &ctx);
+               }
+               t = (bench_now() - t0)/(double)ops*1e9;
+            }
+            else if (k == 1 && c != BENCH_RABBIT_NT && c != BENCH_RABBIT_PRE)
+            {
+               t0 = bench_now();
+               for (i=0; i<ops; i++)
+               {
+                  ctx.iv[0] = (cc_byte)i;
+                  bench_baseline_iv(c, &ctx);
+               }
+               t = (bench_now() - t0)/(double)ops*1e9;
+            }
+            else if (k == 2 && c == BENCH_RABBIT_PRE)
+            {
+               /* Time only the calls served from the buffer */
+               t = 0;
+               for (done=0; done<ops; )
+               {
+                  rabbit_precomp_refill(ctx.p_pre);
+                  t0 = bench_now();
+                  for (; done<ops && rabbit_precomp_available(ctx.p_pre) >=
+                       packet; done++)
+                     bench_baseline_xor(c, &ctx, p_pkt, p_pkt, packet);
+                  t += bench_now() - t0;
+               }
+               t = t/(double)ops*1e9;
+            }
+            else if (k == 2 && c != BENCH_RABBIT_NT &&
+                     (c != BENCH_RABBIT || !(packet%16)))
+            {
+               t0 = bench_now();
+               for (i=0; i<ops; i++)
+               {
+                  ctx.iv[0] = (cc_byte)i;
+                  bench_baseline_iv(c, &ctx);
+                  bench_baseline_xor(c, &ctx, p_pkt, p_pkt, packet);
+               }
+               t = (bench_now() - t0)/(double)ops*1e9;
+            }
+            else if (k == 3 && c != BENCH_RABBIT_PRE)
+            {
+               t0 = bench_now();
+               bench_baseline_xor(c, &ctx, p_src, p_dst, bulk);
+               t = (double)bulk/(bench_now() - t0)*1e-9;
+            }
+            if (t >= 0 && (best[k] < 0 || (k == 3 ? t > best[k] :
+                t < best[k])))
+               best[k] = t;
+         }
+         result[c][k] = best[k];
+      }
+
+      printf("%-10s", names[c]);
+      for (k=0; k<4; k++)
+      {
+         if (result[c][k] >= 0)
+            printf(" %12.*f", k == 3 ? 3 : 1, result[c][k]);
+         else
+            printf(" %12s", "-");
+         if (result[c][k] >= 0 && (winner[k] < 0 || (k == 3 ?
+             result[c][k] > result[winner[k]][k] :
+             result[c][k] < result[winner[k]][k])))
+            winner[k] = c;
+      }
+      printf("\n");
+   }
+   rabbit_set_nt_threshold(0);
+
+   printf("fastest:");
+   for (k=0; k<4; k++)
+      printf(" %s %s%s", columns[k], winner[k] >= 0 ? names[winner[k]] : "-",
+             k < 3 ? "," : "\n");
+   res = 0;
+
+cleanup:
+   if (ctx.p_pre)
+      rabbit_precomp_destroy(ctx.p_pre);
+   rabbit_wipe(&ctx, sizeof(ctx));
+   free(p_src);
+   free(p_dst);
+   free(p_pkt);
+   return res;
+}
+
+/* -------------------------------------------------------------------------- */
+
+/* Benchmark scenarios */
+typedef struct
+{
+   const char *name;
+   const char *description;
+   int (*run)(int argc, char *argv[]);
+} bench_scenario;
+
+static const bench_scenario bench_scenarios[] =
+{
+   { "aead", "message sealing, two-pass vs fused Rabbit-Poly1305 "
+             "[max=N mb=N]", bench_aead },
+   { "baseline", "Rabbit backends against ChaCha20 and AES-128-CTR: "
+             "setup, packet and bulk cost [ops=N packet=N mb=N rounds=N]",
+             bench_baseline },
+   { "counters", "hardware counters per byte and per block for each "
+             "backend and size [max=N mb=N rounds=N raw=EVENT]",
+             bench_counters },
+   { "crc32c", "storage blocks, encrypt then CRC32C vs fused "
+             "[mb=N rounds=N]", bench_crc32c },
+   { "log", "durable encrypted appends from many threads, sync per "
+             "record vs group commit [threads=N ops=N size=N delay=us]",
+             bench_log },
+   { "many", "batch of uneven independent messages, scaling of "
+             "rabbit_encrypt_many() [jobs=N keys=N max=N rounds=N]",
+             bench_many },
+   { "nt", "large out-of-place encryption, default vs non-temporal "
+             "stores [mb=N rounds=N]", bench_nt },
+   { "numa", "segmented encryption over NUMA nodes, naive vs node-local "
+             "scheduling [mb=N segment=KiB threads=N rounds=N]", bench_numa },
+   { "pipeline", "tmpfs file encryption, loop vs SPSC pipeline "
+             "[mb=N slot=KiB slots=N batch=N]", bench_pipeline },
+   { "pool", "context churn, malloc vs rabbit_pool "
+             "[live=N ops=N hugepages=0|1]", bench_pool },
+   { "precompute", "loopback request/response latency with keystream "
+             "precomputation [ops=N size=N]", bench_precompute },
+   { "proxy", "loopback connections through rabbit_proxy, copy vs "
+             "splice relay, every byte checked [conns=N mb=N delay=us "
+             "verify=0|1 proxy=PATH]", bench_proxy },
+   { "scaling", "1 to N threads on a shared master: private, packed, "
+             "padded instances and streaming [threads=N ops=N size=N mb=N "
+             "chunk=KiB]", bench_scaling },
+   { "session", "random packets on a session table, single vs batched "
+             "[live=N ops=N batch=N]", bench_session },
+};
+
+#define BENCH_SCENARIO_COUNT \
+   (sizeof(bench_scenarios)/sizeof(bench_scenarios[0]))
+
+/* -------------------------------------------------------------------------- */
+
+/* Run the selected scenario */
+int main(int argc, char* argv[])
+{
+   /* Temporary variables */
+   size_t i;
+
+   if (argc >= 2)
+      for (i=0; i<BENCH_SCENARIO_COUNT; i++)
+         if (!strcmp(argv[1], bench_scenarios[i].name))
+            return bench_scenarios[i].run(argc-2, argv+2) ? 1 : 0;
+
+   printf("Usage: %s <scenario> [options]\n\nScenarios:\n", argv[0]);
+   for (i=0; i<BENCH_SCENARIO_COUNT; i++)
+      printf("  %-12s %s\n", bench_scenarios[i].name,
+             bench_scenarios[i].description);
+   return 1;
+}
+
+/* -------------------------------------------------------------------------- */
@@ -0,0 +1,213 @@
+/******************************************************************************/
+/* File name: rabbit_crc32c.c                                                 */
+/*----------------------------------------------------------------------------*/
+/* Source file for encryption fused with a CRC32C (Castagnoli) checksum.      */
+/*                                                                            */
+/* The checksum implementation is chosen once, on first use: the SSE4.2       */
+/* crc32 instruction eight bytes at a time on x86 processors that have it,    */
+/* slicing-by-8 tables everywhere else.                                       */
+/*                                                                            */
+/* This source code is for little-endian processors (e.g. x86).               */
+/******************************************************************************/
+
+#include "rabbit_crc32c.h"
+#include "rabbit_internal.h"
+#include <pthread.h>
+#include <string.h>
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#define RABBIT_CRC32C_SSE42
+#include <nmmintrin.h>
+#endif
+
+/* Reflected Castagnoli polynomial */
+#define RABBIT_CRC32C_POLY 0x82F63B78
+
+/* Bytes encrypted before they are checksummed: one cache line */
+#define RABBIT_CRC32C_STEP RABBIT_CACHE_LINE
+
+/* Checksum kernel; takes and returns the non-inverted register */
+typedef cc_uint32 (*rabbit_crc32c_fn)(cc_uint32 crc, const cc_byte *p_data,
+          size_t data_size);
+
+static pthread_once_t rabbit_crc32c_once = PTHREAD_ONCE_INIT;
+static rabbit_crc32c_fn rabbit_crc32c_kernel;
+static cc_uint32 rabbit_crc32c_table[8][256];
+
+
+/* Slicing-by-8 kernel */
+static cc_uint32 rabbit_crc32c_sw(cc_uint32 crc, const cc_byte *p_data,
+          size_t data_size)
+{
+   /* Temporary variables */
+   cc_uint32 lo, hi;
+
+   while (data_size >= 8)
+   {
+      lo = crc ^ ((cc_uint32)p_data[0] | ((cc_uint32)p_data[1] << 8) |
+             ((cc_uint32)p_data[2] << 16) | ((cc_uint32)p_data[3] << 24));
+      hi = (cc_uint32)p_data[4] | ((cc_uint32)p_data[5] << 8) |
+           ((cc_uint32)p_data[6] << 16) | ((cc_uint32)p_data[7] << 24);
+      crc = rabbit_crc32c_table[7][lo & 0xFF] ^
+            rabbit_crc32c_table[6][(lo >> 8) & 0xFF] ^
+            rabbit_crc32c_table[5][(lo >> 16) & 0xFF] ^
+            rabbit_crc32c_table[4][lo >> 24] ^
+            rabbit_crc32c_table[3][hi & 0xFF] ^
+            rabbit_crc32c_table[2][(hi >> 8) & 0xFF] ^
+            rabbit_crc32c_table[1][(hi >> 16) & 0xFF] ^
+            rabbit_crc32c_table[0][hi >> 24];
+      p_data += 8;
+      data_size -= 8;
+   }
+
+   while (data_size--)
+      crc = rabbit_crc32c_table[0][(crc ^ *p_data++) & 0xFF] ^ (crc >> 8);
+
+   return crc;
+}
+
+
+#if defined(RABBIT_CRC32C_SSE42)
+
+/* SSE4.2 kernel */
+__attribute__((target("sse4.2")))
+static cc_uint32 rabbit_crc32c_hw(cc_uint32 crc, const cc_byte *p_data,
+          size_t data_size)
+{
+#if defined(__x86_64__)
+   /* Temporary variables */
+   unsigned long long crc64 = crc, word;
+
+   while (data_size >= 8)
+   {
+      memcpy(&word, p_data, 8);
+      crc64 = _mm_crc32_u64(crc64, word);
+      p_data += 8;
+      data_size -= 8;
+   }
+   crc = (cc_uint32)crc64;
+#else
+   /* Temporary variables */
+   cc_uint32 word;
+
+   while (data_size >= 4)
+   {
+      memcpy(&word, p_data, 4);
+      crc = _mm_crc32_u32(crc, word);
+      p_data += 4;
+      data_size -= 4;
+   }
+#endif
+
+   while (data_size--)
+      crc = _mm_crc32_u8(crc, *p_data++);
+
+   return crc;
+}
+
+#endif
+
+
+/* Build the tables and pick the kernel */
+static void rabbit_crc32c_init(void)
+{
+   /* Temporary variables */
+   cc_uint32 crc;
+   int i, j;
+
+   for (i=0; i<256; i++)
+   {
+      crc = (cc_uint32)i;
+      for (j=0; j<8; j++)
+         crc = (crc >> 1) ^ (RABBIT_CRC32C_POLY & (0U - (crc & 1)));
+      rabbit_crc32c_table[0][i] = crc;
+   }
+   for (i=0; i<256; i++)
+      for (j=1; j<8; j++)
+         rabbit_crc32c_table[j][i] = (rabbit_crc32c_table[j-1][i] >> 8) ^
+                rabbit_crc32c_table[0][rabbit_crc32c_table[j-1][i] & 0xFF];
+
+   rabbit_crc32c_kernel = rabbit_crc32c_sw;
+#if defined(RABBIT_CRC32C_SSE42)
+   __builtin_cpu_init();
+   if (__builtin_cpu_supports("sse4.2"))
+      rabbit_crc32c_kernel = rabbit_crc32c_hw;
+#endif
+}
+
+
+/* Continue a CRC32C */
+cc_uint32 rabbit_crc32c(cc_uint32 crc, const cc_byte *p_data,
+          size_t data_size)
+{
+   pthread_once(&rabbit_crc32c_once, rabbit_crc32c_init);
+   return ~rabbit_crc32c_kernel(~crc, p_data, data_size);
+}
+
+
+/* Encrypt each cache line, then checksum it while it is in L1. Ordinary */
+/* stores whatever the threshold, as non-temporal ones would evict the */
+/* line the checksum is about to read. */
+int rabbit_cipher_crc32c(rabbit_instance *p_instance, const cc_byte *p_src,
+          cc_byte *p_dest, size_t data_size, cc_uint32 *p_crc)
+{
+   /* Temporary variables */
+   cc_uint32 crc;
+   size_t n;
+
+   /* Return error if the size of the data to encrypt is */
+   /* not a multiple of 16 */
+   if (data_size%16)
+      return -1;
+
+   pthread_once(&rabbit_crc32c_once, rabbit_crc32c_init);
+   crc = ~*p_crc;
+
+   while (data_size)
+   {
+      n = data_size < RABBIT_CRC32C_STEP ? data_size : RABBIT_CRC32C_STEP;
+      rabbit_cipher_stores(p_instance, p_src, p_dest, n, 0);
+      crc = rabbit_crc32c_kernel(crc, p_dest, n);
+      p_src += n;
+      p_dest += n;
+      data_size -= n;
+   }
+
+   *p_crc = ~crc;
+
+   /* Return success */
+   return 0;
+}
+
+
+/* Checksum each cache line of input, then decrypt it */
+int rabbit_crc32c_cipher(rabbit_instance *p_instance, const cc_byte *p_src,
+          cc_byte *p_dest, size_t data_size, cc_uint32 *p_crc)
+{
+   /* Temporary variables */
+   cc_uint32 crc;
+   size_t n;
+
+   /* Return error if the size of the data to decrypt is */
+   /* not a multiple of 16 */
+   if (data_size%16)
+      return -1;
+
+   pthread_once(&rabbit_crc32c_once, rabbit_crc32c_init);
+   crc = ~*p_crc;
+
+   while (data_size)
+   {
+      n = data_size < RABBIT_CRC32C_STEP ? data_size : RABBIT_CRC32C_STEP;
+      crc = rabbit_crc32c_kernel(crc, p_src, n);
+      rabbit_cipher_stores(p_instance, p_src, p_dest, n, 0);
+      p_src += n;
+      p_dest += n;
+      data_size -= n;
+   }
+
+   *p_crc = ~crc;
+
+   /* Return success */
+   return 0;
+}
@@ -0,0 +1,45 @@
+/******************************************************************************/
+/* File name: rabbit_crc32c.h                                                 */
+/*----------------------------------------------------------------------------*/
+/* Header file for encryption fused with a CRC32C (Castagnoli) checksum.      */
+/*                                                                            */
+/* rabbit_cipher_crc32c() encrypts one cache line at a time and folds the     */
+/* freshly written ciphertext into the checksum before moving on, so a        */
+/* block is read and written once instead of being read again for the CRC.    */
+/* The SSE4.2 crc32 instruction is used when the processor has it and a       */
+/* table-driven implementation otherwise.                                     */
+/*                                                                            */
+/* This source code is for little-endian processors (e.g. x86).               */
+/******************************************************************************/
+
+#ifndef _RABBIT_CRC32C_H
+#define _RABBIT_CRC32C_H
+
+#include "rabbit.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Continue a CRC32C over data_size bytes. Start with crc = 0; the result */
+/* of one call can be passed to the next to checksum data in pieces. */
+cc_uint32 rabbit_crc32c(cc_uint32 crc, const cc_byte *p_data,
+          size_t data_size);
+
+/* All function calls return zero on success */
+
+/* Encrypt or decrypt like rabbit_cipher() and continue *p_crc over the */
+/* ciphertext, which is the output when encrypting. To decrypt, use */
+/* rabbit_crc32c_cipher() instead, which checksums the input. */
+int rabbit_cipher_crc32c(rabbit_instance *p_instance, const cc_byte *p_src,
+          cc_byte *p_dest, size_t data_size, cc_uint32 *p_crc);
+
+/* Continue *p_crc over the input, then decrypt it */
+int rabbit_crc32c_cipher(rabbit_instance *p_instance, const cc_byte *p_src,
+          cc_byte *p_dest, size_t data_size, cc_uint32 *p_crc);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,53 @@
+/******************************************************************************/
+/* File name: rabbit_internal.h                                               */
+/*----------------------------------------------------------------------------*/
+/* Header file for the entry points the library uses internally.              */
+/*                                                                            */
+/* These behave exactly like their public counterparts in rabbit.h but are    */
+/* not instrumented, so statistics and probes count only the calls made by    */
+/* the application. A fused helper such as rabbit_cipher_crc32c() calls the   */
+/* cipher once per cache line and would otherwise be counted that often.      */
+/* Not part of the public interface; the library's C++ headers include it     */
+/* for the same reason, applications should not.                              */
+/*                                                                            */
+/* This source code is for little-endian processors (e.g. x86).               */
+/******************************************************************************/
+
+#ifndef _RABBIT_INTERNAL_H
+#define _RABBIT_INTERNAL_H
+
+#include "rabbit.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* All function calls return zero on success */
+
+int rabbit_key_setup_raw(rabbit_instance *p_instance, const cc_byte *p_key,
+          size_t key_size);
+
+int rabbit_iv_setup_raw(const rabbit_instance *p_master_instance,
+          rabbit_instance *p_instance, const cc_byte *p_iv, size_t iv_size);
+
+int rabbit_cipher_raw(rabbit_instance *p_instance, const cc_byte *p_src,
+          cc_byte *p_dest, size_t data_size);
+
+int rabbit_prng_raw(rabbit_instance *p_instance, cc_byte *p_dest,
+          size_t data_size);
+
+/* Like rabbit_cipher_raw(), but with non-temporal stores if nt is set */
+/* and ordinary ones otherwise, regardless of the threshold. Falls back */
+/* to ordinary stores where non-temporal ones are not available. */
+int rabbit_cipher_stores(rabbit_instance *p_instance, const cc_byte *p_src,
+          cc_byte *p_dest, size_t data_size, int nt);
+
+/* Non-temporal threshold derived from the cache size, which */
+/* rabbit_get_nt_threshold() returns until another one is set */
+size_t rabbit_nt_default(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,780 @@
+/******************************************************************************/
+/* File name: rabbit_log.c                                                    */
+/*----------------------------------------------------------------------------*/
+/* Source file for an encrypted append-only log.                              */
+/*                                                                            */
+/* Group commit follows the leader/follower pattern. Appenders reserve room   */
+/* for their record in the open group and wait. The first one to find no      */
+/* commit in progress becomes the leader: it keeps the group open for up to   */
+/* max_delay_us, swaps in the second group so new records keep arriving, and  */
+/* seals, writes and syncs the closed group without holding the lock. The     */
+/* record data is read straight from the appenders' buffers, which stay       */
+/* valid because they wait until their group is durable.                      */
+/*                                                                            */
+/* This source code is for little-endian processors (e.g. x86).               */
+/******************************************************************************/
+
+#define _GNU_SOURCE
+
+#include "rabbit_log.h"
+#include "rabbit_crc32c.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+/* Format version */
+#define RABBIT_LOG_VERSION 1
+
+/* Sizes of the file and record headers */
+#define RABBIT_LOG_HEADER 32
+#define RABBIT_LOG_RECORD 16
+
+/* Most lanes per group */
+#define RABBIT_LOG_MAX_LANES 64
+
+/* Default spacing of reader index entries */
+#define RABBIT_LOG_INDEX_INTERVAL 64
+
+/* Bytes a record of data_size bytes takes in the file */
+#define RABBIT_LOG_SPAN(data_size) \
+   (RABBIT_LOG_RECORD + (((size_t)(data_size) + 15) & ~(size_t)15))
+
+/* One record of a group */
+typedef struct
+{
+   const cc_byte *p_src;
+   size_t data_size;
+   size_t offset;                 /* Of the record in the group buffer */
+   unsigned long long seq;
+} rabbit_log_entry;
+
+/* Records written together */
+typedef struct
+{
+   cc_byte *p_buf;
+   size_t used;
+   size_t capacity;
+   rabbit_log_entry *p_entries;
+   size_t count;
+   size_t entry_capacity;
+   unsigned long long first_seq;
+} rabbit_log_group;
+
+/* Structure to store a writer */
+struct rabbit_log
+{
+   pthread_mutex_t lock;
+   pthread_cond_t full;           /* The open group reached max_batch */
+   pthread_cond_t done;           /* A commit finished */
+   int fd;
+   rabbit_instance master;
+   cc_byte base_iv[8];
+   rabbit_log_config config;
+   rabbit_log_group groups[2];
+   int open_group;                /* Group taking new records */
+   int committing;                /* A leader owns the other group */
+   int failed;                    /* A write failed; no more appends */
+   unsigned long long next_seq;
+   unsigned long long durable_seq;   /* Every record below is on disk */
+};
+
+/* Lanes of one group */
+typedef struct
+{
+   pthread_mutex_t lock;
+   pthread_cond_t cond;
+   int left;                      /* Lanes still running on the pool */
+} rabbit_log_lanes;
+
+/* One lane: a run of records */
+typedef struct
+{
+   rabbit_log *p_log;
+   rabbit_log_group *p_group;
+   size_t first;
+   size_t last;
+   rabbit_log_lanes *p_lanes;
+} rabbit_log_lane;
+
+/* Structure to store a reader */
+struct rabbit_log_reader
+{
+   int fd;
+   rabbit_instance master;
+   cc_byte base_iv[8];
+   unsigned long long interval;
+   off_t *p_index;                /* Offset of record k*interval */
+   size_t index_count;
+   size_t index_capacity;
+   unsigned long long scanned;    /* Records found so far */
+   off_t scan_off;                /* Offset of the record after them */
+};
+
+/* Magic number */
+static const cc_byte rabbit_log_magic[4] = { 'R', 'b', 'L', 'g' };
+
+
+/* Store n bytes of a value, least significant first */
+static void rabbit_log_put(cc_byte *p_dest, unsigned long long value, int n)
+{
+   /* Temporary variables */
+   int i;
+
+   for (i=0; i<n; i++)
+      p_dest[i] = (cc_byte)(value >> (8*i));
+}
+
+
+/* Load n bytes of a value, least significant first */
+static unsigned long long rabbit_log_get(const cc_byte *p_src, int n)
+{
+   /* Temporary variables */
+   unsigned long long value = 0;
+   int i;
+
+   for (i=n-1; i>=0; i--)
+      value = (value << 8) | p_src[i];
+   return value;
+}
+
+
+/* Read exactly size bytes at off */
+static int rabbit_log_pread(int fd, cc_byte *p_buf, size_t size, off_t off)
+{
+   /* Temporary variables */
+   ssize_t n;
+
+   while (size)
+   {
+      n = pread(fd, p_buf, size, off);
+      if (n < 0 && errno == EINTR)
+         continue;
+      if (n <= 0)
+         return -1;
+      p_buf += n;
+      size -= (size_t)n;
+      off += n;
+   }
+
+   /* Return success */
+   return 0;
+}
+
+
+/* Write all of a buffer at the file position */
+static int rabbit_log_write(int fd, const cc_byte *p_buf, size_t size)
+{
+   /* Temporary variables */
+   ssize_t n;
+
+   while (size)
+   {
+      n = write(fd, p_buf, size);
+      if (n < 0 && errno == EINTR)
+         continue;
+      if (n <= 0)
+         return -1;
+      p_buf += n;
+      size -= (size_t)n;
+   }
+
+   /* Return success */
+   return 0;
+}
+
+
+/* Read and check the file header */
+static int rabbit_log_read_header(int fd, cc_byte *p_base_iv)
+{
+   /* Temporary variables */
+   cc_byte header[RABBIT_LOG_HEADER];
+
+   if (rabbit_log_pread(fd, header, RABBIT_LOG_HEADER, 0) ||
+       memcmp(header, rabbit_log_magic, 4) ||
+       rabbit_log_get(header+4, 2) != RABBIT_LOG_VERSION ||
+       rabbit_log_get(header+28, 4) != rabbit_crc32c(0, header, 28))
+      return -1;
+   memcpy(p_base_iv, header+8, 8);
+
+   /* Return success */
+   return 0;
+}
+
+
+/* Read the header of record seq at off and check that the whole record */
+/* lies before file_size */
+static int rabbit_log_record_at(int fd, off_t off, off_t file_size,
+          unsigned long long seq, cc_byte *p_header, size_t *p_size)
+{
+   /* Temporary variables */
+   size_t size;
+
+   if (off + RABBIT_LOG_RECORD > file_size ||
+       rabbit_log_pread(fd, p_header, RABBIT_LOG_RECORD, off) ||
+       rabbit_log_get(p_header, 8) != seq)
+      return -1;
+   size = (size_t)rabbit_log_get(p_header+8, 4);
+   if (size > RABBIT_LOG_MAX_RECORD ||
+       file_size - off < (off_t)RABBIT_LOG_SPAN(size))
+      return -1;
+   *p_size = size;
+
+   /* Return success */
+   return 0;
+}
+
+
+/* Find the end of the intact records, checking every checksum */
+static int rabbit_log_recover(rabbit_log *p_log, off_t file_size,
+          off_t *p_end)
+{
+   /* Temporary variables */
+   cc_byte header[RABBIT_LOG_RECORD], *p_buf = NULL, *p_new;
+   size_t size, padded, capacity = 0;
+   off_t off = RABBIT_LOG_HEADER;
+   cc_uint32 crc;
+
+   while (!rabbit_log_record_at(p_log->fd, off, file_size, p_log->next_seq,
+          header, &size))
+   {
+      padded = RABBIT_LOG_SPAN(size) - RABBIT_LOG_RECORD;
+      if (padded > capacity)
+      {
+         p_new = (cc_byte *)realloc(p_buf, padded);
+         if (!p_new)
+         {
+            free(p_buf);
+            return -1;
+         }
+         p_buf = p_new;
+         capacity = padded;
+      }
+      if (rabbit_log_pread(p_log->fd, p_buf, padded, off + RABBIT_LOG_RECORD))
+         break;
+      crc = rabbit_crc32c(rabbit_crc32c(0, header, 12), p_buf, padded);
+      if (crc != rabbit_log_get(header+12, 4))
+         break;
+      off += (off_t)RABBIT_LOG_SPAN(size);
+      p_log->next_seq++;
+   }
+
+   free(p_buf);
+   *p_end = off;
+
+   /* Return success */
+   return 0;
+}
+
+
+/* Encrypt one record into the group buffer and complete its header */
+static void rabbit_log_seal(rabbit_log *p_log, const rabbit_log_entry *p_entry,
+          cc_byte *p_record)
+{
+   /* Temporary variables */
+   rabbit_instance inst;
+   cc_byte tail[16];
+   size_t full = p_entry->data_size & ~(size_t)15;
+   cc_uint32 crc = rabbit_crc32c(0, p_record, 12);
+
+   rabbit_segment_iv_setup(&p_log->master, &inst, p_log->base_iv,
+          p_entry->seq);
+   rabbit_cipher_crc32c(&inst, p_entry->p_src, p_record + RABBIT_LOG_RECORD,
+          full, &crc);
+
+   /* The last partial block is padded with zeros */
+   if (p_entry->data_size > full)
+   {
+      memset(tail, 0, 16);
+      memcpy(tail, p_entry->p_src + full, p_entry->data_size - full);
+      rabbit_cipher_crc32c(&inst, tail, p_record + RABBIT_LOG_RECORD + full,
+             16, &crc);
+      rabbit_wipe(tail, 16);
+   }
+
+   rabbit_log_put(p_record+12, crc, 4);
+   rabbit_wipe(&inst, sizeof(inst));
+}
+
+
+/* Scheduler task: seal a run of records */
+static void rabbit_log_lane_run(void *p_arg)
+{
+   /* Temporary variables */
+   rabbit_log_lane *p_lane = (rabbit_log_lane *)p_arg;
+   rabbit_log_group *p_group = p_lane->p_group;
+   size_t i;
+
+   for (i=p_lane->first; i<p_lane->last; i++)
+      rabbit_log_seal(p_lane->p_log, &p_group->p_entries[i],
+             p_group->p_buf + p_group->p_entries[i].offset);
+
+   if (p_lane->p_lanes)
+   {
+      pthread_mutex_lock(&p_lane->p_lanes->lock);
+      if (!--p_lane->p_lanes->left)
+         pthread_cond_signal(&p_lane->p_lanes->cond);
+      pthread_mutex_unlock(&p_lane->p_lanes->lock);
+   }
+}
+
+
+/* Seal a group, cut into lanes of about equal size on the pool. The */
+/* calling thread runs the first lane. */
+static void rabbit_log_seal_group(rabbit_log *p_log, rabbit_log_group *p_group)
+{
+   /* Temporary variables */
+   rabbit_log_lane lane[RABBIT_LOG_MAX_LANES];
+   rabbit_log_lanes lanes;
+   rabbit_sched *p_sched = p_log->config.p_sched;
+   size_t i, bytes;
+   int lane_count = 1, k;
+
+   if (p_sched && rabbit_sched_current(p_sched) < 0)
+   {
+      lane_count = p_log->config.lanes ? p_log->config.lanes :
+             rabbit_sched_size(p_sched) + 1;
+      if (lane_count > RABBIT_LOG_MAX_LANES)
+         lane_count = RABBIT_LOG_MAX_LANES;
+      if ((size_t)lane_count > p_group->count)
+         lane_count = (int)p_group->count;
+   }
+   if (lane_count <= 1)
+   {
+      lane[0].p_log = p_log;
+      lane[0].p_group = p_group;
+      lane[0].first = 0;
+      lane[0].last = p_group->count;
+      lane[0].p_lanes = NULL;
+      rabbit_log_lane_run(&lane[0]);
+      return;
+   }
+
+   /* Lane k ends after the record that crosses (k+1)/lane_count of the */
+   /* group; lane_count is at most the record count */
+   for (k=0, i=0; k<lane_count; k++)
+   {
+      lane[k].p_log = p_log;
+      lane[k].p_group = p_group;
+      lane[k].first = i;
+      lane[k].p_lanes = k ? &lanes : NULL;
+      bytes = (p_group->used / (size_t)lane_count) * (size_t)(k + 1);
+      do
+         i++;
+      while (i < p_group->count - (size_t)(lane_count - 1 - k) &&
+             p_group->p_entries[i].offset < bytes);
+      lane[k].last = k == lane_count-1 ? p_group->count : i;
+   }
+
+   pthread_mutex_init(&lanes.lock, NULL);
+   pthread_cond_init(&lanes.cond, NULL);
+   lanes.left = lane_count - 1;
+   for (k=1; k<lane_count; k++)
+      if (rabbit_sched_submit(p_sched, rabbit_log_lane_run, &lane[k]))
+         rabbit_log_lane_run(&lane[k]);
+   rabbit_log_lane_run(&lane[0]);
+
+   pthread_mutex_lock(&lanes.lock);
+   while (lanes.left)
+      pthread_cond_wait(&lanes.cond, &lanes.lock);
+   pthread_mutex_unlock(&lanes.lock);
+   pthread_cond_destroy(&lanes.cond);
+   pthread_mutex_destroy(&lanes.lock);
+}
+
+
+/* Lead one group commit. Called and returns with the lock held. */
+static void rabbit_log_commit(rabbit_log *p_log)
+{
+   /* Temporary variables */
+   rabbit_log_group *p_group;
+   struct timespec deadline;
+   int res;
+
+   p_log->committing = 1;
+
+   /* Keep the group open for more records */
+   if (p_log->config.max_delay_us)
+   {
+      clock_gettime(CLOCK_MONOTONIC, &deadline);
+      deadline.tv_nsec += (long)(p_log->config.max_delay_us % 1000000)*1000;
+      deadline.tv_sec += p_log->config.max_delay_us / 1000000 +
+             deadline.tv_nsec / 1000000000;
+      deadline.tv_nsec %= 1000000000;
+      while (p_log->groups[p_log->open_group].used < p_log->config.max_batch &&
+             pthread_cond_timedwait(&p_log->full, &p_log->lock, &deadline) !=
+             ETIMEDOUT)
+         ;
+   }
+
+   /* Close the group; later records go to the other one */
+   p_group = &p_log->groups[p_log->open_group];
+   p_log->open_group ^= 1;
+   pthread_mutex_unlock(&p_log->lock);
+
+   rabbit_log_seal_group(p_log, p_group);
+   res = rabbit_log_write(p_log->fd, p_group->p_buf, p_group->used) ||
+         fdatasync(p_log->fd);
+
+   pthread_mutex_lock(&p_log->lock);
+   if (res)
+      p_log->failed = 1;
+   else
+      p_log->durable_seq = p_group->first_seq + p_group->count;
+   p_group->used = 0;
+   p_group->count = 0;
+   p_log->committing = 0;
+   pthread_cond_broadcast(&p_log->done);
+}
+
+
+/* Make room for a record of size bytes in a group */
+static int rabbit_log_reserve(rabbit_log_group *p_group, size_t size)
+{
+   /* Temporary variables */
+   size_t capacity;
+   void *p_new;
+
+   if (p_group->used + size > p_group->capacity)
+   {
+      capacity = p_group->capacity ? p_group->capacity : 64*1024;
+      while (capacity < p_group->used + size)
+         capacity *= 2;
+      p_new = realloc(p_group->p_buf, capacity);
+      if (!p_new)
+         return -1;
+      p_group->p_buf = (cc_byte *)p_new;
+      p_group->capacity = capacity;
+   }
+   if (p_group->count == p_group->entry_capacity)
+   {
+      capacity = p_group->entry_capacity ? p_group->entry_capacity*2 : 256;
+      p_new = realloc(p_group->p_entries, capacity*sizeof(rabbit_log_entry));
+      if (!p_new)
+         return -1;
+      p_group->p_entries = (rabbit_log_entry *)p_new;
+      p_group->entry_capacity = capacity;
+   }
+
+   /* Return success */
+   return 0;
+}
+
+
+/* Open a log for appending */
+int rabbit_log_open(rabbit_log **pp_log, const char *p_path,
+          const rabbit_instance *p_master_instance, const cc_byte *p_base_iv,
+          const rabbit_log_config *p_config)
+{
+   /* Temporary variables */
+   rabbit_log *p_log;
+   cc_byte header[RABBIT_LOG_HEADER];
+   pthread_condattr_t attr;
+   struct stat st;
+   off_t end = RABBIT_LOG_HEADER;
+
+   p_log = (rabbit_log *)calloc(1, sizeof(rabbit_log));
+   if (!p_log)
+      return -1;
+   p_log->master = *p_master_instance;
+   if (p_config)
+      p_log->config = *p_config;
+   if (!p_log->config.max_batch)
+      p_log->config.max_batch = (size_t)-1;
+
+   p_log->fd = open(p_path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+   if (p_log->fd < 0 || fstat(p_log->fd, &st))
+      goto fail;
+
+   if (st.st_size == 0)
+   {
+      /* New log: write the header */
+      if (!p_base_iv)
+         goto fail;
+      memset(header, 0, RABBIT_LOG_HEADER);
+      memcpy(header, rabbit_log_magic, 4);
+      rabbit_log_put(header+4, RABBIT_LOG_VERSION, 2);
+      memcpy(header+8, p_base_iv, 8);
+      rabbit_log_put(header+28, rabbit_crc32c(0, header, 28), 4);
+      if (rabbit_log_write(p_log->fd, header, RABBIT_LOG_HEADER) ||
+          fdatasync(p_log->fd))
+         goto fail;
+      memcpy(p_log->base_iv, p_base_iv, 8);
+   }
+   else
+   {
+      /* Existing log: drop a torn tail */
+      if (rabbit_log_read_header(p_log->fd, p_log->base_iv) ||
+          rabbit_log_recover(p_log, st.st_size, &end))
+         goto fail;
+      if (end < st.st_size &&
+          (ftruncate(p_log->fd, end) || fdatasync(p_log->fd)))
+         goto fail;
+   }
+   if (lseek(p_log->fd, end, SEEK_SET) != end)
+      goto fail;
+   p_log->durable_seq = p_log->next_seq;
+
+   pthread_mutex_init(&p_log->lock, NULL);
+   pthread_condattr_init(&attr);
+   pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+   pthread_cond_init(&p_log->full, &attr);
+   pthread_condattr_destroy(&attr);
+   pthread_cond_init(&p_log->done, NULL);
+   *pp_log = p_log;
+
+   /* Return success */
+   return 0;
+
+fail:
+   if (p_log->fd >= 0)
+      close(p_log->fd);
+   rabbit_wipe(p_log, sizeof(rabbit_log));
+   free(p_log);
+   return -1;
+}
+
+
+/* Append a record and wait until it is durable */
+int rabbit_log_append(rabbit_log *p_log, const cc_byte *p_data,
+          size_t data_size, unsigned long long *p_seq)
+{
+   /* Temporary variables */
+   rabbit_log_group *p_group;
+   rabbit_log_entry *p_entry;
+   unsigned long long seq;
+   int res;
+
+   /* Return error on an oversized record */
+   if (data_size > RABBIT_LOG_MAX_RECORD || (data_size && !p_data))
+      return -1;
+
+   pthread_mutex_lock(&p_log->lock);
+   p_group = &p_log->groups[p_log->open_group];
+   if (p_log->failed ||
+       rabbit_log_reserve(p_group, RABBIT_LOG_SPAN(data_size)))
+   {
+      pthread_mutex_unlock(&p_log->lock);
+      return -1;
+   }
+
+   /* Take the next sequence number and a place in the open group */
+   seq = p_log->next_seq++;
+   if (!p_group->count)
+      p_group->first_seq = seq;
+   p_entry = &p_group->p_entries[p_group->count++];
+   p_entry->p_src = p_data;
+   p_entry->data_size = data_size;
+   p_entry->offset = p_group->used;
+   p_entry->seq = seq;
+   rabbit_log_put(p_group->p_buf + p_group->used, seq, 8);
+   rabbit_log_put(p_group->p_buf + p_group->used + 8, data_size, 4);
+   p_group->used += RABBIT_LOG_SPAN(data_size);
+   if (p_group->used >= p_log->config.max_batch)
+      pthread_cond_signal(&p_log->full);
+
+   /* Lead a commit when none is running, otherwise wait for one */
+   while (p_log->durable_seq <= seq && !p_log->failed)
+   {
+      if (!p_log->committing)
+         rabbit_log_commit(p_log);
+      else
+         pthread_cond_wait(&p_log->done, &p_log->lock);
+   }
+   res = p_log->durable_seq > seq ? 0 : -1;
+   pthread_mutex_unlock(&p_log->lock);
+
+   if (!res && p_seq)
+      *p_seq = seq;
+   return res;
+}
+
+
+/* Close a log */
+void rabbit_log_close(rabbit_log *p_log)
+{
+   /* Temporary variables */
+   int i;
+
+   if (!p_log)
+      return;
+
+   close(p_log->fd);
+   for (i=0; i<2; i++)
+   {
+      free(p_log->groups[i].p_buf);
+      free(p_log->groups[i].p_entries);
+   }
+   pthread_cond_destroy(&p_log->full);
+   pthread_cond_destroy(&p_log->done);
+   pthread_mutex_destroy(&p_log->lock);
+   rabbit_wipe(p_log, sizeof(rabbit_log));
+   free(p_log);
+}
+
+
+/* Open a log for reading */
+int rabbit_log_reader_open(rabbit_log_reader **pp_reader, const char *p_path,
+          const rabbit_instance *p_master_instance,
+          unsigned long long index_interval)
+{
+   /* Temporary variables */
+   rabbit_log_reader *p_reader;
+
+   p_reader = (rabbit_log_reader *)calloc(1, sizeof(rabbit_log_reader));
+   if (!p_reader)
+      return -1;
+   p_reader->fd = open(p_path, O_RDONLY | O_CLOEXEC);
+   if (p_reader->fd < 0 ||
+       rabbit_log_read_header(p_reader->fd, p_reader->base_iv))
+   {
+      if (p_reader->fd >= 0)
+         close(p_reader->fd);
+      free(p_reader);
+      return -1;
+   }
+   p_reader->master = *p_master_instance;
+   p_reader->interval = index_interval ? index_interval :
+          RABBIT_LOG_INDEX_INTERVAL;
+   p_reader->scan_off = RABBIT_LOG_HEADER;
+   *pp_reader = p_reader;
+
+   /* Return success */
+   return 0;
+}
+
+
+/* Walk record headers until record seq is known, indexing on the way */
+static int rabbit_log_scan(rabbit_log_reader *p_reader, unsigned long long seq)
+{
+   /* Temporary variables */
+   cc_byte header[RABBIT_LOG_RECORD];
+   struct stat st;
+   size_t size, capacity;
+   void *p_new;
+
+   if (fstat(p_reader->fd, &st))
+      return -1;
+
+   while (p_reader->scanned <= seq)
+   {
+      if (rabbit_log_record_at(p_reader->fd, p_reader->scan_off, st.st_size,
+             p_reader->scanned, header, &size))
+         return -1;
+
+      if (p_reader->scanned % p_reader->interval == 0)
+      {
+         if (p_reader->index_count == p_reader->index_capacity)
+         {
+            capacity = p_reader->index_capacity ?
+                   p_reader->index_capacity*2 : 64;
+            p_new = realloc(p_reader->p_index, capacity*sizeof(off_t));
+            if (!p_new)
+               return -1;
+            p_reader->p_index = (off_t *)p_new;
+            p_reader->index_capacity = capacity;
+         }
+         p_reader->p_index[p_reader->index_count++] = p_reader->scan_off;
+      }
+      p_reader->scan_off += (off_t)RABBIT_LOG_SPAN(size);
+      p_reader->scanned++;
+   }
+
+   /* Return success */
+   return 0;
+}
+
+
+/* Check and decrypt one record */
+int rabbit_log_read(rabbit_log_reader *p_reader, unsigned long long seq,
+          cc_byte *p_dest, size_t dest_size, size_t *p_size)
+{
+   /* Temporary variables */
+   rabbit_instance inst;
+   cc_byte header[RABBIT_LOG_RECORD], tail[16];
+   unsigned long long k;
+   size_t size, full;
+   off_t off, file_end;
+   cc_uint32 crc;
+   int res = 0;
+
+   /* Return error if the record does not exist (yet) */
+   if (seq >= p_reader->scanned && rabbit_log_scan(p_reader, seq))
+      return -1;
+
+   /* Start at the closest index entry; records up to scan_off are known */
+   /* to be complete */
+   file_end = p_reader->scan_off;
+   k = seq / p_reader->interval;
+   off = p_reader->p_index[k];
+   for (k*=p_reader->interval; ; k++)
+   {
+      if (rabbit_log_record_at(p_reader->fd, off, file_end, k, header, &size))
+         return -1;
+      if (k == seq)
+         break;
+      off += (off_t)RABBIT_LOG_SPAN(size);
+   }
+
+   *p_size = size;
+   if (size > dest_size)
+      return -1;
+
+   /* Checksum the ciphertext while decrypting it */
+   full = size & ~(size_t)15;
+   crc = rabbit_crc32c(0, header, 12);
+   rabbit_segment_iv_setup(&p_reader->master, &inst, p_reader->base_iv, seq);
+   if (rabbit_log_pread(p_reader->fd, p_dest, full, off + RABBIT_LOG_RECORD))
+      res = -1;
+   else
+      rabbit_crc32c_cipher(&inst, p_dest, p_dest, full, &crc);
+   if (!res && size > full)
+   {
+      if (rabbit_log_pread(p_reader->fd, tail, 16,
+             off + RABBIT_LOG_RECORD + (off_t)full))
+         res = -1;
+      else
+      {
+         rabbit_crc32c_cipher(&inst, tail, tail, 16, &crc);
+         memcpy(p_dest + full, tail, size - full);
+      }
+   }
+   if (!res && crc != rabbit_log_get(header+12, 4))
+      res = -1;
+
+   /* Return no plaintext from a damaged record */
+   if (res)
+      rabbit_wipe(p_dest, size);
+   rabbit_wipe(tail, 16);
+   rabbit_wipe(&inst, sizeof(inst));
+   return res;
+}
+
+
+/* Number of complete records */
+int rabbit_log_count(rabbit_log_reader *p_reader, unsigned long long *p_count)
+{
+   /* Scan to the end; running out of records is the expected outcome */
+   rabbit_log_scan(p_reader, ~0ULL);
+   *p_count = p_reader->scanned;
+
+   /* Return success */
+   return 0;
+}
+
+
+/* Close a reader */
+void rabbit_log_reader_close(rabbit_log_reader *p_reader)
+{
+   if (!p_reader)
+      return;
+
+   close(p_reader->fd);
+   free(p_reader->p_index);
+   rabbit_wipe(p_reader, sizeof(rabbit_log_reader));
+   free(p_reader);
+}
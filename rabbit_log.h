@@ -0,0 +1,99 @@
+/******************************************************************************/
+/* File name: rabbit_log.h                                                    */
+/*----------------------------------------------------------------------------*/
+/* Header file for an encrypted append-only log.                              */
+/*                                                                            */
+/* Every record is encrypted on its own stream, with the segmented-IV         */
+/* derivation of rabbit_parallel.h: record n uses the IV base_iv + n, so no   */
+/* IV is stored and any record can be decrypted alone. The base IV is         */
+/* chosen when the log is created and kept in its header.                     */
+/*                                                                            */
+/* Appends from any number of threads are grouped: records arriving while a   */
+/* group is open, up to max_delay_us or max_batch bytes, are encrypted        */
+/* together, split into lanes that run on a thread pool, and reach the file   */
+/* with one write() and one fdatasync(). rabbit_log_append() returns once     */
+/* its record is durable.                                                     */
+/*                                                                            */
+/* File layout, all fields little-endian:                                     */
+/*                                                                            */
+/*    header  32 bytes: magic "RbLg", version (2 bytes), zero (2 bytes),      */
+/*            base IV (8), zero (12), CRC32C of the first 28 bytes (4)        */
+/*    record  16 bytes: sequence number (8), data size (4), CRC32C of the     */
+/*            first 12 bytes and the ciphertext (4); then the ciphertext,     */
+/*            padded with encrypted zeros to a multiple of 16 bytes           */
+/*                                                                            */
+/* Opening a log for writing checks every record and cuts off a tail torn by  */
+/* a crash. Readers index every index_interval-th record as they go, so a     */
+/* record is found with at most that many header reads.                       */
+/*                                                                            */
+/* Base IV ranges of logs under one key must not overlap.                     */
+/*                                                                            */
+/* This source code is for little-endian processors (e.g. x86).               */
+/******************************************************************************/
+
+#ifndef _RABBIT_LOG_H
+#define _RABBIT_LOG_H
+
+#include "rabbit.h"
+#include "rabbit_parallel.h"
+
+/* Largest record in bytes */
+#define RABBIT_LOG_MAX_RECORD (16*1024*1024)
+
+/* Writer configuration */
+typedef struct
+{
+   size_t max_batch;            /* Bytes that close a group early */
+   unsigned int max_delay_us;   /* Longest wait for more records */
+   rabbit_sched *p_sched;       /* Pool for the lanes, or NULL for inline */
+   int lanes;                   /* Lanes per group, 0 for the pool size */
+} rabbit_log_config;
+
+/* Opaque writer and reader */
+typedef struct rabbit_log rabbit_log;
+typedef struct rabbit_log_reader rabbit_log_reader;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* All function calls return zero on success */
+
+/* Open a log for appending, creating it with p_base_iv if it does not */
+/* exist; an existing log keeps its own base IV and p_base_iv may be NULL. */
+/* The configuration is copied; NULL selects no delay and inline lanes. */
+int rabbit_log_open(rabbit_log **pp_log, const char *p_path,
+          const rabbit_instance *p_master_instance, const cc_byte *p_base_iv,
+          const rabbit_log_config *p_config);
+
+/* Append a record and wait until it is durable. Its sequence number is */
+/* stored in *p_seq unless p_seq is NULL. Fails for good once a write has */
+/* failed. */
+int rabbit_log_append(rabbit_log *p_log, const cc_byte *p_data,
+          size_t data_size, unsigned long long *p_seq);
+
+/* Close a log. No appends may be in progress. */
+void rabbit_log_close(rabbit_log *p_log);
+
+/* Open a log for reading; index_interval 0 selects a default */
+int rabbit_log_reader_open(rabbit_log_reader **pp_reader, const char *p_path,
+          const rabbit_instance *p_master_instance,
+          unsigned long long index_interval);
+
+/* Check and decrypt record seq into p_dest of dest_size bytes, storing */
+/* its size in *p_size. If the record is larger than dest_size, only */
+/* *p_size is set. Records appended after the reader was opened are found. */
+int rabbit_log_read(rabbit_log_reader *p_reader, unsigned long long seq,
+          cc_byte *p_dest, size_t dest_size, size_t *p_size);
+
+/* Number of complete records in the log */
+int rabbit_log_count(rabbit_log_reader *p_reader, unsigned long long *p_count);
+
+/* Close a reader */
+void rabbit_log_reader_close(rabbit_log_reader *p_reader);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,182 @@
+/******************************************************************************/
+/* File name: rabbit_numa.c                                                   */
+/*----------------------------------------------------------------------------*/
+/* Source file for NUMA topology and page placement queries.                  */
+/*                                                                            */
+/* This source code is for little-endian processors (e.g. x86).               */
+/******************************************************************************/
+
+#define _GNU_SOURCE
+
+#include "rabbit_numa.h"
+#include <dirent.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+/* Pages queried per move_pages call */
+#define RABBIT_NUMA_BATCH 256
+
+/* Topology, read once */
+static pthread_once_t rabbit_numa_once = PTHREAD_ONCE_INIT;
+static int rabbit_numa_nodes = 1;
+static short rabbit_numa_cpu_nodes[CPU_SETSIZE];
+
+
+/* Read the node of every usable CPU from sysfs */
+static void rabbit_numa_init(void)
+{
+   /* Temporary variables */
+   cpu_set_t allowed;
+   DIR *p_dir;
+   struct dirent *p_entry;
+   FILE *p_file;
+   char path[64];
+   int node, first, last, cpu, c, found = 0;
+
+   for (cpu=0; cpu<CPU_SETSIZE; cpu++)
+      rabbit_numa_cpu_nodes[cpu] = -1;
+   CPU_ZERO(&allowed);
+   if (sched_getaffinity(0, sizeof(allowed), &allowed))
+      for (cpu=0; cpu<CPU_SETSIZE; cpu++)
+         CPU_SET(cpu, &allowed);
+
+   p_dir = opendir("/sys/devices/system/node");
+   while (p_dir && (p_entry = readdir(p_dir)))
+   {
+      if (sscanf(p_entry->d_name, "node%d", &node) != 1 || node < 0 ||
+          node >= RABBIT_NUMA_MAX_NODES)
+         continue;
+      snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist",
+             node);
+      p_file = fopen(path, "r");
+      if (!p_file)
+         continue;
+
+      /* Ranges such as "0-3,8-11" */
+      while (fscanf(p_file, "%d", &first) == 1)
+      {
+         last = first;
+         c = fgetc(p_file);
+         if (c == '-')
+         {
+            if (fscanf(p_file, "%d", &last) != 1)
+               break;
+            c = fgetc(p_file);
+         }
+         for (cpu=first; cpu>=0 && cpu<=last && cpu<CPU_SETSIZE; cpu++)
+            if (CPU_ISSET(cpu, &allowed))
+            {
+               rabbit_numa_cpu_nodes[cpu] = (short)node;
+               if (node >= rabbit_numa_nodes)
+                  rabbit_numa_nodes = node+1;
+               found = 1;
+            }
+         if (c != ',')
+            break;
+      }
+      fclose(p_file);
+   }
+   if (p_dir)
+      closedir(p_dir);
+
+   /* No NUMA information: a single node with every usable CPU */
+   if (!found)
+   {
+      rabbit_numa_nodes = 1;
+      for (cpu=0; cpu<CPU_SETSIZE; cpu++)
+         if (CPU_ISSET(cpu, &allowed))
+            rabbit_numa_cpu_nodes[cpu] = 0;
+   }
+}
+
+
+/* Number of nodes */
+int rabbit_numa_node_count(void)
+{
+   pthread_once(&rabbit_numa_once, rabbit_numa_init);
+   return rabbit_numa_nodes;
+}
+
+
+/* Usable CPUs of a node */
+int rabbit_numa_node_cpus(int node, int *p_cpus, int max_cpus)
+{
+   /* Temporary variables */
+   int cpu, count = 0;
+
+   pthread_once(&rabbit_numa_once, rabbit_numa_init);
+   for (cpu=0; cpu<CPU_SETSIZE; cpu++)
+      if (rabbit_numa_cpu_nodes[cpu] == node)
+      {
+         if (count < max_cpus)
+            p_cpus[count] = cpu;
+         count++;
+      }
+   return count;
+}
+
+
+/* Node of a CPU */
+int rabbit_numa_cpu_node(int cpu)
+{
+   pthread_once(&rabbit_numa_once, rabbit_numa_init);
+   return cpu >= 0 && cpu < CPU_SETSIZE ? rabbit_numa_cpu_nodes[cpu] : -1;
+}
+
+
+/* Nodes holding a set of pages */
+int rabbit_numa_page_nodes(const void **pp_addr, size_t count, int *p_nodes)
+{
+   /* Temporary variables */
+   void *pages[RABBIT_NUMA_BATCH];
+   int status[RABBIT_NUMA_BATCH];
+   uintptr_t mask = ~(uintptr_t)(sysconf(_SC_PAGESIZE) - 1);
+   size_t done, n, i;
+
+   for (done=0; done<count; done+=n)
+   {
+      n = count - done < RABBIT_NUMA_BATCH ? count - done : RABBIT_NUMA_BATCH;
+      for (i=0; i<n; i++)
+         pages[i] = (void *)((uintptr_t)pp_addr[done+i] & mask);
+
+      /* With no target nodes, move_pages only reports placement */
+      if (syscall(SYS_move_pages, 0, (unsigned long)n, pages, NULL, status, 0))
+      {
+         /* Return error unless the kernel simply has no NUMA support */
+         if (errno != ENOSYS)
+            return -1;
+         for (i=0; i<n; i++)
+            status[i] = 0;
+      }
+      for (i=0; i<n; i++)
+         p_nodes[done+i] = status[i] >= 0 ? status[i] : -1;
+   }
+
+   /* Return success */
+   return 0;
+}
+
+
+/* Allocate without touching */
+void *rabbit_numa_alloc(size_t size)
+{
+   /* Temporary variables */
+   void *p_mem = mmap(NULL, size ? size : 1, PROT_READ|PROT_WRITE,
+          MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+
+   return p_mem == MAP_FAILED ? NULL : p_mem;
+}
+
+
+/* Release memory */
+void rabbit_numa_free(void *p_mem, size_t size)
+{
+   if (p_mem)
+      munmap(p_mem, size ? size : 1);
+}
@@ -0,0 +1,53 @@
+/******************************************************************************/
+/* File name: rabbit_numa.h                                                   */
+/*----------------------------------------------------------------------------*/
+/* Header file for NUMA topology and page placement queries.                  */
+/*                                                                            */
+/* The topology is read once from /sys/devices/system/node, so no libnuma is  */
+/* needed. Only CPUs the process may run on are reported. Page placement is   */
+/* queried with the move_pages system call. Systems without NUMA information  */
+/* look like a single node 0 holding every CPU and page.                      */
+/*                                                                            */
+/* Memory from rabbit_numa_alloc() is not touched before it is returned, so   */
+/* each page lands on the node of the thread that writes it first.            */
+/*                                                                            */
+/* This source code is for little-endian processors (e.g. x86).               */
+/******************************************************************************/
+
+#ifndef _RABBIT_NUMA_H
+#define _RABBIT_NUMA_H
+
+#include "rabbit.h"
+
+/* Largest number of nodes handled */
+#define RABBIT_NUMA_MAX_NODES 64
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Number of nodes with usable CPUs, at least 1 */
+int rabbit_numa_node_count(void);
+
+/* Usable CPUs of a node; fills at most max_cpus entries of p_cpus and */
+/* returns how many the node has */
+int rabbit_numa_node_cpus(int node, int *p_cpus, int max_cpus);
+
+/* Node of a usable CPU, or -1 */
+int rabbit_numa_cpu_node(int cpu);
+
+/* Nodes holding the pages at pp_addr; -1 for pages not populated yet. */
+/* Returns zero on success. */
+int rabbit_numa_page_nodes(const void **pp_addr, size_t count, int *p_nodes);
+
+/* Page-aligned memory left untouched for first-touch placement */
+void *rabbit_numa_alloc(size_t size);
+
+/* Release memory from rabbit_numa_alloc() */
+void rabbit_numa_free(void *p_mem, size_t size);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,1189 @@
+/******************************************************************************/
+/* File name: rabbit_parallel.c                                               */
+/*----------------------------------------------------------------------------*/
+/* Source file for parallel encryption: a work-stealing thread pool and the   */
+/* segmented-IV mode.                                                         */
+/*                                                                            */
+/* The deques follow Chase and Lev with the C11 orderings of Le et al.,       */
+/* "Correct and Efficient Work-Stealing for Weak Memory Models". They have a  */
+/* fixed capacity; a worker whose deque is full runs the task inline. Idle    */
+/* workers spin briefly, then sleep until work is announced through the       */
+/* pending counters.                                                          */
+/*                                                                            */
+/* This source code is for little-endian processors (e.g. x86).               */
+/******************************************************************************/
+
+#define _GNU_SOURCE
+
+#include "rabbit_parallel.h"
+#include "rabbit_internal.h"
+#include "rabbit_numa.h"
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/* Deque capacity per worker, a power of two */
+#define RABBIT_SCHED_DEQUE_SIZE 4096
+
+/* Empty polls before an idle worker goes to sleep */
+#define RABBIT_SCHED_SPINS 64
+
+/* rabbit_encrypt_many(): jobs are grouped into tasks of about this size */
+#define RABBIT_MANY_GROUP (64*1024)
+
+/* rabbit_encrypt_many(): segmented jobs above this size are split */
+#define RABBIT_MANY_SPLIT (1024*1024)
+
+/* rabbit_segment_cipher_parallel(): bytes of whole segments per task */
+#define RABBIT_SEGMENT_TASK (1024*1024)
+
+/* Deque slot; both halves are atomic since thieves read them racily */
+typedef struct
+{
+   _Atomic(rabbit_task_fn) fn;
+   _Atomic(void *) p_arg;
+} rabbit_sched_slot;
+
+/* Mutex-protected growable FIFO of tasks */
+typedef struct
+{
+   pthread_mutex_t lock;
+   rabbit_task_fn *p_fn;
+   void **pp_arg;
+   size_t head, count, capacity;
+} rabbit_sched_queue;
+
+/* Worker thread */
+typedef struct
+{
+   _Alignas(RABBIT_CACHE_LINE) atomic_long top;
+   _Alignas(RABBIT_CACHE_LINE) atomic_long bottom;
+   _Alignas(RABBIT_CACHE_LINE) atomic_size_t mail_count;
+   rabbit_sched_queue mailbox;
+   rabbit_sched_slot slots[RABBIT_SCHED_DEQUE_SIZE];
+   rabbit_sched *p_sched;
+   pthread_t thread;
+   unsigned long long seed;
+   int index;
+   int cpu, node;              /* -1 unless the pool is pinned */
+} rabbit_sched_worker;
+
+/* Structure to store a pool */
+struct rabbit_sched
+{
+   _Alignas(RABBIT_CACHE_LINE) atomic_size_t pending;  /* Stealable tasks */
+   _Alignas(RABBIT_CACHE_LINE) atomic_int sleepers;
+   atomic_int stop;
+   pthread_mutex_t sleep_lock;
+   pthread_cond_t wake;
+   rabbit_sched_queue inject;
+   rabbit_sched_worker *p_workers;
+   int worker_count;
+   int started;                /* Threads running */
+   int pinned;
+};
+
+/* Countdown the caller of a parallel operation waits on */
+typedef struct
+{
+   _Alignas(RABBIT_CACHE_LINE) atomic_size_t left;
+   pthread_mutex_t lock;
+   pthread_cond_t done;
+   int finished;
+} rabbit_sched_latch;
+
+/* Job reference sorted by key */
+typedef struct
+{
+   const cc_byte *p_key;
+   size_t index;
+} rabbit_many_ref;
+
+/* Task of a batch: whole jobs first..first+count-1 of the sorted order, */
+/* or bytes offset..offset+size-1 of job first */
+typedef struct
+{
+   size_t first, count;
+   size_t offset, size;
+   int piece;
+} rabbit_many_unit;
+
+struct rabbit_many;
+
+/* Range of units for one scheduler task */
+typedef struct
+{
+   struct rabbit_many *p_many;
+   size_t lo, hi;
+} rabbit_many_range;
+
+/* State of one rabbit_encrypt_many() call */
+typedef struct rabbit_many
+{
+   rabbit_sched_latch latch;                           /* Units to run */
+   _Alignas(RABBIT_CACHE_LINE) atomic_size_t range_count;
+   const rabbit_job *p_jobs;
+   rabbit_many_ref *p_refs;
+   rabbit_many_unit *p_units;
+   rabbit_many_range *p_ranges;
+   size_t unit_count;
+   rabbit_sched *p_sched;
+} rabbit_many;
+
+/* Task of rabbit_segment_cipher_parallel() or rabbit_segment_alloc() */
+typedef struct
+{
+   const rabbit_instance *p_master_instance;
+   const cc_byte *p_base_iv;
+   size_t segment_size;
+   unsigned long long first_segment;
+   const cc_byte *p_src;
+   cc_byte *p_dest;
+   size_t data_size;
+   rabbit_sched_latch *p_latch;
+} rabbit_segment_task;
+
+/* Worker running on this thread, if any */
+static _Thread_local rabbit_sched_worker *rabbit_sched_self;
+
+
+/* Derive the instance of one segment */
+int rabbit_segment_iv_setup(const rabbit_instance *p_master_instance,
+          rabbit_instance *p_instance, const cc_byte *p_base_iv,
+          unsigned long long segment)
+{
+   /* Temporary variables */
+   cc_byte iv[8];
+   unsigned long long counter = 0;
+   int i;
+
+   /* IV = base + segment as a little-endian 64-bit counter */
+   for (i=7; i>=0; i--)
+      counter = (counter << 8) | p_base_iv[i];
+   counter += segment;
+   for (i=0; i<8; i++)
+      iv[i] = (cc_byte)(counter >> (8*i));
+
+   return rabbit_iv_setup_raw(p_master_instance, p_instance, iv, 8);
+}
+
+
+/* Encrypt or decrypt a run of segments */
+int rabbit_segment_cipher(const rabbit_instance *p_master_instance,
+          const cc_byte *p_base_iv, size_t segment_size,
+          unsigned long long first_segment, const cc_byte *p_src,
+          cc_byte *p_dest, size_t data_size)
+{
+   /* Temporary variables */
+   rabbit_instance inst;
+   size_t n;
+
+   /* Return error if the sizes are not multiples of 16 */
+   if (segment_size == 0 || segment_size%16 || data_size%16)
+      return -1;
+
+   while (data_size)
+   {
+      n = data_size < segment_size ? data_size : segment_size;
+      rabbit_segment_iv_setup(p_master_instance, &inst, p_base_iv,
+             first_segment++);
+      rabbit_cipher_raw(&inst, p_src, p_dest, n);
+      p_src += n;
+      p_dest += n;
+      data_size -= n;
+   }
+   rabbit_wipe(&inst, sizeof(inst));
+
+   /* Return success */
+   return 0;
+}
+
+
+/* Initialize a queue */
+static void rabbit_sched_queue_init(rabbit_sched_queue *p_queue)
+{
+   memset(p_queue, 0, sizeof(*p_queue));
+   pthread_mutex_init(&p_queue->lock, NULL);
+}
+
+
+/* Free a queue */
+static void rabbit_sched_queue_free(rabbit_sched_queue *p_queue)
+{
+   pthread_mutex_destroy(&p_queue->lock);
+   free(p_queue->p_fn);
+   free(p_queue->pp_arg);
+}
+
+
+/* Append a task, growing the queue as needed */
+static int rabbit_sched_queue_push(rabbit_sched_queue *p_queue,
+          rabbit_task_fn fn, void *p_arg)
+{
+   /* Temporary variables */
+   rabbit_task_fn *p_fn;
+   void **pp_arg;
+   size_t capacity, i, j;
+   int res = 0;
+
+   pthread_mutex_lock(&p_queue->lock);
+   if (p_queue->count == p_queue->capacity)
+   {
+      /* Unwrap into larger arrays */
+      capacity = p_queue->capacity*2 + 64;
+      p_fn = (rabbit_task_fn *)malloc(capacity*sizeof(rabbit_task_fn));
+      pp_arg = (void **)malloc(capacity*sizeof(void *));
+      if (p_fn && pp_arg)
+      {
+         for (i=0; i<p_queue->count; i++)
+         {
+            j = (p_queue->head + i) % p_queue->capacity;
+            p_fn[i] = p_queue->p_fn[j];
+            pp_arg[i] = p_queue->pp_arg[j];
+         }
+         free(p_queue->p_fn);
+         free(p_queue->pp_arg);
+         p_queue->p_fn = p_fn;
+         p_queue->pp_arg = pp_arg;
+         p_queue->head = 0;
+         p_queue->capacity = capacity;
+      }
+      else
+      {
+         free(p_fn);
+         free(pp_arg);
+         res = -1;
+      }
+   }
+   if (!res)
+   {
+      i = (p_queue->head + p_queue->count) % p_queue->capacity;
+      p_queue->p_fn[i] = fn;
+      p_queue->pp_arg[i] = p_arg;
+      p_queue->count++;
+   }
+   pthread_mutex_unlock(&p_queue->lock);
+
+   return res;
+}
+
+
+/* Take the oldest task; returns 0 if the queue was empty */
+static int rabbit_sched_queue_pop(rabbit_sched_queue *p_queue,
+          rabbit_task_fn *p_fn, void **pp_arg)
+{
+   /* Temporary variables */
+   int found = 0;
+
+   pthread_mutex_lock(&p_queue->lock);
+   if (p_queue->count)
+   {
+      *p_fn = p_queue->p_fn[p_queue->head];
+      *pp_arg = p_queue->pp_arg[p_queue->head];
+      p_queue->head = (p_queue->head + 1) % p_queue->capacity;
+      p_queue->count--;
+      found = 1;
+   }
+   pthread_mutex_unlock(&p_queue->lock);
+
+   return found;
+}
+
+
+/* Owner: push onto the bottom of the deque; returns 0 if it is full */
+static int rabbit_sched_push(rabbit_sched_worker *p_worker, rabbit_task_fn fn,
+          void *p_arg)
+{
+   /* Temporary variables */
+   long b = atomic_load_explicit(&p_worker->bottom, memory_order_relaxed);
+   long t = atomic_load_explicit(&p_worker->top, memory_order_acquire);
+   rabbit_sched_slot *p_slot;
+
+   if (b - t >= RABBIT_SCHED_DEQUE_SIZE)
+      return 0;
+
+   p_slot = &p_worker->slots[b & (RABBIT_SCHED_DEQUE_SIZE-1)];
+   atomic_store_explicit(&p_slot->fn, fn, memory_order_relaxed);
+   atomic_store_explicit(&p_slot->p_arg, p_arg, memory_order_relaxed);
+   atomic_thread_fence(memory_order_release);
+   atomic_store_explicit(&p_worker->bottom, b+1, memory_order_relaxed);
+   return 1;
+}
+
+
+/* Owner: take from the bottom of the deque; returns 0 if it was empty */
+static int rabbit_sched_take(rabbit_sched_worker *p_worker,
+          rabbit_task_fn *p_fn, void **pp_arg)
+{
+   /* Temporary variables */
+   long b = atomic_load_explicit(&p_worker->bottom, memory_order_relaxed) - 1;
+   long t;
+   rabbit_sched_slot *p_slot;
+   int found = 1;
+
+   atomic_store_explicit(&p_worker->bottom, b, memory_order_relaxed);
+   atomic_thread_fence(memory_order_seq_cst);
+   t = atomic_load_explicit(&p_worker->top, memory_order_relaxed);
+
+   if (t > b)
+   {
+      /* Empty */
+      atomic_store_explicit(&p_worker->bottom, b+1, memory_order_relaxed);
+      return 0;
+   }
+
+   p_slot = &p_worker->slots[b & (RABBIT_SCHED_DEQUE_SIZE-1)];
+   *p_fn = atomic_load_explicit(&p_slot->fn, memory_order_relaxed);
+   *pp_arg = atomic_load_explicit(&p_slot->p_arg, memory_order_relaxed);
+   if (t == b)
+   {
+      /* Last task: race the thieves for it */
+      if (!atomic_compare_exchange_strong_explicit(&p_worker->top, &t, t+1,
+             memory_order_seq_cst, memory_order_relaxed))
+         found = 0;
+      atomic_store_explicit(&p_worker->bottom, b+1, memory_order_relaxed);
+   }
+   return found;
+}
+
+
+/* Thief: take from the top of a deque; returns 0 if it was empty or lost */
+static int rabbit_sched_steal(rabbit_sched_worker *p_worker,
+          rabbit_task_fn *p_fn, void **pp_arg)
+{
+   /* Temporary variables */
+   long t = atomic_load_explicit(&p_worker->top, memory_order_acquire);
+   long b;
+   rabbit_sched_slot *p_slot;
+
+   atomic_thread_fence(memory_order_seq_cst);
+   b = atomic_load_explicit(&p_worker->bottom, memory_order_acquire);
+   if (t >= b)
+      return 0;
+
+   p_slot = &p_worker->slots[t & (RABBIT_SCHED_DEQUE_SIZE-1)];
+   *p_fn = atomic_load_explicit(&p_slot->fn, memory_order_relaxed);
+   *pp_arg = atomic_load_explicit(&p_slot->p_arg, memory_order_relaxed);
+   return atomic_compare_exchange_strong_explicit(&p_worker->top, &t, t+1,
+          memory_order_seq_cst, memory_order_relaxed);
+}
+
+
+/* Wake sleeping workers after new work was announced */
+static void rabbit_sched_notify(rabbit_sched *p_sched)
+{
+   if (atomic_load(&p_sched->sleepers))
+   {
+      pthread_mutex_lock(&p_sched->sleep_lock);
+      pthread_cond_broadcast(&p_sched->wake);
+      pthread_mutex_unlock(&p_sched->sleep_lock);
+   }
+}
+
+
+/* Find a task for a worker: own deque, mailbox, injection queue, then */
+/* the other deques starting at a random victim */
+static int rabbit_sched_find(rabbit_sched_worker *p_self,
+          rabbit_task_fn *p_fn, void **pp_arg)
+{
+   /* Temporary variables */
+   rabbit_sched *p_sched = p_self->p_sched;
+   int i, victim;
+
+   if (rabbit_sched_take(p_self, p_fn, pp_arg))
+      goto shared;
+   if (atomic_load_explicit(&p_self->mail_count, memory_order_relaxed) &&
+       rabbit_sched_queue_pop(&p_self->mailbox, p_fn, pp_arg))
+   {
+      atomic_fetch_sub(&p_self->mail_count, 1);
+      return 1;
+   }
+   if (rabbit_sched_queue_pop(&p_sched->inject, p_fn, pp_arg))
+      goto shared;
+
+   p_self->seed = p_self->seed*6364136223846793005ULL + 1442695040888963407ULL;
+   victim = (int)((p_self->seed >> 33) % (unsigned long long)p_sched->worker_count);
+   for (i=0; i<p_sched->worker_count; i++)
+   {
+      if (victim != p_self->index &&
+          rabbit_sched_steal(&p_sched->p_workers[victim], p_fn, pp_arg))
+         goto shared;
+      if (++victim == p_sched->worker_count)
+         victim = 0;
+   }
+   return 0;
+
+shared:
+   atomic_fetch_sub(&p_sched->pending, 1);
+   return 1;
+}
+
+
+/* Worker thread */
+static void *rabbit_sched_main(void *p_arg)
+{
+   /* Temporary variables */
+   rabbit_sched_worker *p_self = (rabbit_sched_worker *)p_arg;
+   rabbit_sched *p_sched = p_self->p_sched;
+   rabbit_task_fn fn;
+   void *p_task_arg;
+   int idle = 0;
+
+   rabbit_sched_self = p_self;
+
+   for (;;)
+   {
+      if (rabbit_sched_find(p_self, &fn, &p_task_arg))
+      {
+         fn(p_task_arg);
+         idle = 0;
+         continue;
+      }
+
+      /* Leave once stopped and nothing is left for this worker */
+      if (atomic_load(&p_sched->stop) && !atomic_load(&p_sched->pending) &&
+          !atomic_load(&p_self->mail_count))
+         break;
+
+      if (++idle < RABBIT_SCHED_SPINS)
+      {
+         sched_yield();
+         continue;
+      }
+
+      /* Sleep; announcing ourselves before the final check pairs with */
+      /* the counter increment before rabbit_sched_notify() */
+      pthread_mutex_lock(&p_sched->sleep_lock);
+      atomic_fetch_add(&p_sched->sleepers, 1);
+      if (!atomic_load(&p_sched->pending) &&
+          !atomic_load(&p_self->mail_count) && !atomic_load(&p_sched->stop))
+         pthread_cond_wait(&p_sched->wake, &p_sched->sleep_lock);
+      atomic_fetch_sub(&p_sched->sleepers, 1);
+      pthread_mutex_unlock(&p_sched->sleep_lock);
+      idle = 0;
+   }
+
+   rabbit_sched_self = NULL;
+   return NULL;
+}
+
+
+/* Usable CPUs in pinning order: the first CPU of every node, then the */
+/* second of every node, and so on. Returns how many were found. */
+static int rabbit_sched_cpus(int *p_cpus, int max_cpus)
+{
+   /* Temporary variables */
+   int node_count = rabbit_numa_node_count();
+   int node_cpus[CPU_SETSIZE];
+   int count = 0, found = 1, round, node;
+
+   for (round=0; found && count<max_cpus; round++)
+   {
+      found = 0;
+      for (node=0; node<node_count && count<max_cpus; node++)
+         if (rabbit_numa_node_cpus(node, node_cpus, CPU_SETSIZE) > round)
+         {
+            p_cpus[count++] = node_cpus[round];
+            found = 1;
+         }
+   }
+   return count;
+}
+
+
+/* Start a pool, optionally pinning workers across the NUMA nodes */
+static int rabbit_sched_start(rabbit_sched **pp_sched, int thread_count,
+          int pin)
+{
+   /* Temporary variables */
+   rabbit_sched *p_sched;
+   rabbit_sched_worker *p_worker;
+   pthread_attr_t attr;
+   cpu_set_t set;
+   int cpus[CPU_SETSIZE];
+   int cpu_count = 0;
+   void *p_mem;
+   int i;
+
+   if (pin)
+      cpu_count = rabbit_sched_cpus(cpus, CPU_SETSIZE);
+   if (thread_count <= 0)
+      thread_count = cpu_count ? cpu_count : (int)sysconf(_SC_NPROCESSORS_ONLN);
+   if (thread_count <= 0)
+      thread_count = 1;
+
+   if (posix_memalign(&p_mem, RABBIT_CACHE_LINE, sizeof(rabbit_sched)))
+      return -1;
+   p_sched = (rabbit_sched *)p_mem;
+   memset(p_sched, 0, sizeof(rabbit_sched));
+   if (posix_memalign(&p_mem, RABBIT_CACHE_LINE,
+          (size_t)thread_count*sizeof(rabbit_sched_worker)))
+   {
+      free(p_sched);
+      return -1;
+   }
+   p_sched->p_workers = (rabbit_sched_worker *)p_mem;
+   memset(p_sched->p_workers, 0,
+          (size_t)thread_count*sizeof(rabbit_sched_worker));
+
+   atomic_init(&p_sched->pending, 0);
+   atomic_init(&p_sched->sleepers, 0);
+   atomic_init(&p_sched->stop, 0);
+   pthread_mutex_init(&p_sched->sleep_lock, NULL);
+   pthread_cond_init(&p_sched->wake, NULL);
+   rabbit_sched_queue_init(&p_sched->inject);
+   for (i=0; i<thread_count; i++)
+   {
+      p_worker = &p_sched->p_workers[i];
+      atomic_init(&p_worker->top, 0);
+      atomic_init(&p_worker->bottom, 0);
+      atomic_init(&p_worker->mail_count, 0);
+      rabbit_sched_queue_init(&p_worker->mailbox);
+      p_worker->p_sched = p_sched;
+      p_worker->seed = 0x9E3779B97F4A7C15ULL * (unsigned long long)(i+1);
+      p_worker->index = i;
+      p_worker->cpu = cpu_count ? cpus[i % cpu_count] : -1;
+      p_worker->node = cpu_count ? rabbit_numa_cpu_node(p_worker->cpu) : -1;
+   }
+   p_sched->pinned = cpu_count > 0;
+
+   /* Workers read worker_count, so start them only once it is final. */
+   /* Pinned workers start on their CPU, so their stacks are local too. */
+   p_sched->worker_count = thread_count;
+   for (i=0; i<thread_count; i++)
+   {
+      p_worker = &p_sched->p_workers[i];
+      pthread_attr_init(&attr);
+      if (p_worker->cpu >= 0)
+      {
+         CPU_ZERO(&set);
+         CPU_SET(p_worker->cpu, &set);
+         pthread_attr_setaffinity_np(&attr, sizeof(set), &set);
+      }
+      if (pthread_create(&p_worker->thread, &attr, rabbit_sched_main,
+             p_worker))
+      {
+         pthread_attr_destroy(&attr);
+         rabbit_sched_destroy(p_sched);
+         return -1;
+      }
+      pthread_attr_destroy(&attr);
+      p_sched->started = i+1;
+   }
+
+   *pp_sched = p_sched;
+
+   /* Return success */
+   return 0;
+}
+
+
+/* Start a pool */
+int rabbit_sched_create(rabbit_sched **pp_sched, int thread_count)
+{
+   return rabbit_sched_start(pp_sched, thread_count, 0);
+}
+
+
+/* Start a pool pinned across the NUMA nodes */
+int rabbit_sched_create_numa(rabbit_sched **pp_sched, int thread_count)
+{
+   return rabbit_sched_start(pp_sched, thread_count, 1);
+}
+
+
+/* Drain, stop and free a pool */
+void rabbit_sched_destroy(rabbit_sched *p_sched)
+{
+   /* Temporary variables */
+   int i;
+
+   if (!p_sched)
+      return;
+
+   atomic_store(&p_sched->stop, 1);
+   pthread_mutex_lock(&p_sched->sleep_lock);
+   pthread_cond_broadcast(&p_sched->wake);
+   pthread_mutex_unlock(&p_sched->sleep_lock);
+   for (i=0; i<p_sched->started; i++)
+      pthread_join(p_sched->p_workers[i].thread, NULL);
+
+   for (i=0; i<p_sched->worker_count; i++)
+      rabbit_sched_queue_free(&p_sched->p_workers[i].mailbox);
+   rabbit_sched_queue_free(&p_sched->inject);
+   pthread_cond_destroy(&p_sched->wake);
+   pthread_mutex_destroy(&p_sched->sleep_lock);
+   free(p_sched->p_workers);
+   free(p_sched);
+}
+
+
+/* Number of worker threads */
+int rabbit_sched_size(const rabbit_sched *p_sched)
+{
+   return p_sched->worker_count;
+}
+
+
+/* Index of the calling worker */
+int rabbit_sched_current(const rabbit_sched *p_sched)
+{
+   return rabbit_sched_self && rabbit_sched_self->p_sched == p_sched ?
+          rabbit_sched_self->index : -1;
+}
+
+
+/* Node of a worker */
+int rabbit_sched_worker_node(const rabbit_sched *p_sched, int worker)
+{
+   return worker >= 0 && worker < p_sched->worker_count ?
+          p_sched->p_workers[worker].node : -1;
+}
+
+
+/* Queue a task for any worker */
+int rabbit_sched_submit(rabbit_sched *p_sched, rabbit_task_fn fn,
+          void *p_arg)
+{
+   /* Temporary variables */
+   rabbit_sched_worker *p_self = rabbit_sched_self;
+
+   /* Announce first so a worker going to sleep cannot miss the task */
+   atomic_fetch_add(&p_sched->pending, 1);
+
+   if (p_self && p_self->p_sched == p_sched)
+   {
+      /* From a worker: own deque, or run it right here if that is full */
+      if (!rabbit_sched_push(p_self, fn, p_arg))
+      {
+         atomic_fetch_sub(&p_sched->pending, 1);
+         fn(p_arg);
+         return 0;
+      }
+   }
+   else if (rabbit_sched_queue_push(&p_sched->inject, fn, p_arg))
+   {
+      atomic_fetch_sub(&p_sched->pending, 1);
+      return -1;
+   }
+
+   rabbit_sched_notify(p_sched);
+
+   /* Return success */
+   return 0;
+}
+
+
+/* Queue a task for one worker */
+int rabbit_sched_submit_to(rabbit_sched *p_sched, int worker,
+          rabbit_task_fn fn, void *p_arg)
+{
+   /* Temporary variables */
+   rabbit_sched_worker *p_worker;
+
+   if (worker < 0 || worker >= p_sched->worker_count)
+      return -1;
+   p_worker = &p_sched->p_workers[worker];
+
+   atomic_fetch_add(&p_worker->mail_count, 1);
+   if (rabbit_sched_queue_push(&p_worker->mailbox, fn, p_arg))
+   {
+      atomic_fetch_sub(&p_worker->mail_count, 1);
+      return -1;
+   }
+
+   rabbit_sched_notify(p_sched);
+
+   /* Return success */
+   return 0;
+}
+
+
+/* Prepare a latch for count completions */
+static void rabbit_sched_latch_init(rabbit_sched_latch *p_latch, size_t count)
+{
+   atomic_init(&p_latch->left, count);
+   pthread_mutex_init(&p_latch->lock, NULL);
+   pthread_cond_init(&p_latch->done, NULL);
+   p_latch->finished = !count;
+}
+
+
+/* Count one completion; the last one wakes the waiter */
+static void rabbit_sched_latch_count_down(rabbit_sched_latch *p_latch)
+{
+   if (atomic_fetch_sub(&p_latch->left, 1) == 1)
+   {
+      pthread_mutex_lock(&p_latch->lock);
+      p_latch->finished = 1;
+      pthread_cond_signal(&p_latch->done);
+      pthread_mutex_unlock(&p_latch->lock);
+   }
+}
+
+
+/* Wait for all completions, then free the latch */
+static void rabbit_sched_latch_wait(rabbit_sched_latch *p_latch)
+{
+   pthread_mutex_lock(&p_latch->lock);
+   while (!p_latch->finished)
+      pthread_cond_wait(&p_latch->done, &p_latch->lock);
+   pthread_mutex_unlock(&p_latch->lock);
+   pthread_cond_destroy(&p_latch->done);
+   pthread_mutex_destroy(&p_latch->lock);
+}
+
+
+/* Order jobs by key, keeping submission order within a key */
+static int rabbit_many_cmp(const void *p_a, const void *p_b)
+{
+   /* Temporary variables */
+   const rabbit_many_ref *p_x = (const rabbit_many_ref *)p_a;
+   const rabbit_many_ref *p_y = (const rabbit_many_ref *)p_b;
+   int res = p_x->p_key == p_y->p_key ? 0 : memcmp(p_x->p_key, p_y->p_key, 16);
+
+   if (res)
+      return res;
+   return p_x->index < p_y->index ? -1 : p_x->index > p_y->index;
+}
+
+
+/* Cut the sorted jobs into units; only counts them if p_units is NULL */
+static size_t rabbit_many_plan(const rabbit_job *p_jobs,
+          const rabbit_many_ref *p_refs, size_t job_count,
+          rabbit_many_unit *p_units)
+{
+   /* Temporary variables */
+   const rabbit_job *p_job;
+   size_t count = 0, group_bytes = 0, piece, off, i;
+   int open = 0;
+
+   for (i=0; i<job_count; i++)
+   {
+      p_job = &p_jobs[p_refs[i].index];
+
+      if (p_job->segment_size && p_job->data_size > RABBIT_MANY_SPLIT)
+      {
+         /* Large segmented job: whole segments per piece */
+         piece = RABBIT_MANY_SPLIT / p_job->segment_size * p_job->segment_size;
+         if (!piece)
+            piece = p_job->segment_size;
+         for (off=0; off<p_job->data_size; off+=piece)
+         {
+            if (p_units)
+            {
+               p_units[count].first = i;
+               p_units[count].count = 1;
+               p_units[count].offset = off;
+               p_units[count].size = p_job->data_size - off < piece ?
+                      p_job->data_size - off : piece;
+               p_units[count].piece = 1;
+            }
+            count++;
+         }
+         open = 0;
+         continue;
+      }
+
+      /* Otherwise add to the open group, starting one if needed */
+      if (!open)
+      {
+         if (p_units)
+         {
+            p_units[count].first = i;
+            p_units[count].count = 0;
+            p_units[count].piece = 0;
+         }
+         count++;
+         group_bytes = 0;
+         open = 1;
+      }
+      if (p_units)
+         p_units[count-1].count++;
+      group_bytes += p_job->data_size + 64;     /* Setup counts too */
+      if (group_bytes >= RABBIT_MANY_GROUP)
+         open = 0;
+   }
+
+   return count;
+}
+
+
+/* Run one unit, setting up each distinct key once */
+static void rabbit_many_run(const rabbit_many *p_many,
+          const rabbit_many_unit *p_unit)
+{
+   /* Temporary variables */
+   rabbit_instance master, inst;
+   const rabbit_job *p_job;
+   const cc_byte *p_key = NULL;
+   size_t off, size, i;
+
+   for (i=p_unit->first; i<p_unit->first+p_unit->count; i++)
+   {
+      p_job = &p_many->p_jobs[p_many->p_refs[i].index];
+      if (!p_key || (p_key != p_job->p_key && memcmp(p_key, p_job->p_key, 16)))
+      {
+         rabbit_key_setup_raw(&master, p_job->p_key, 16);
+         p_key = p_job->p_key;
+      }
+
+      off = p_unit->piece ? p_unit->offset : 0;
+      size = p_unit->piece ? p_unit->size : p_job->data_size;
+      if (p_job->segment_size)
+         rabbit_segment_cipher(&master, p_job->p_iv, p_job->segment_size,
+                off / p_job->segment_size, p_job->p_src + off,
+                p_job->p_dest + off, size);
+      else
+      {
+         if (p_job->p_iv)
+            rabbit_iv_setup_raw(&master, &inst, p_job->p_iv, 8);
+         else
+            inst = master;
+         rabbit_cipher_raw(&inst, p_job->p_src, p_job->p_dest, size);
+      }
+   }
+
+   rabbit_wipe(&master, sizeof(master));
+   rabbit_wipe(&inst, sizeof(inst));
+}
+
+
+/* Scheduler task: hand the upper half of the range to thieves until one */
+/* unit is left, then run it */
+static void rabbit_many_task(void *p_arg)
+{
+   /* Temporary variables */
+   rabbit_many_range *p_range = (rabbit_many_range *)p_arg;
+   rabbit_many *p_many = p_range->p_many;
+   rabbit_many_range *p_half;
+   size_t lo = p_range->lo, hi = p_range->hi, mid;
+
+   while (hi - lo > 1)
+   {
+      mid = lo + (hi - lo)/2;
+      p_half = &p_many->p_ranges[atomic_fetch_add(&p_many->range_count, 1)];
+      p_half->p_many = p_many;
+      p_half->lo = mid;
+      p_half->hi = hi;
+      rabbit_sched_submit(p_many->p_sched, rabbit_many_task, p_half);
+      hi = mid;
+   }
+
+   rabbit_many_run(p_many, &p_many->p_units[lo]);
+
+   rabbit_sched_latch_count_down(&p_many->latch);
+}
+
+
+/* Encrypt or decrypt a batch of independent messages */
+int rabbit_encrypt_many(const rabbit_job *p_jobs, size_t job_count,
+          int thread_count)
+{
+   /* Temporary variables */
+   rabbit_many many;
+   size_t i;
+   int res = -1;
+
+   /* Return error on any malformed job */
+   for (i=0; i<job_count; i++)
+      if (!p_jobs[i].p_key || p_jobs[i].data_size%16 ||
+          p_jobs[i].segment_size%16 ||
+          (p_jobs[i].segment_size && !p_jobs[i].p_iv))
+         return -1;
+   if (!job_count)
+      return 0;
+
+   memset(&many, 0, sizeof(many));
+   many.p_jobs = p_jobs;
+   many.p_refs = (rabbit_many_ref *)malloc(job_count*sizeof(rabbit_many_ref));
+   if (!many.p_refs)
+      return -1;
+   for (i=0; i<job_count; i++)
+   {
+      many.p_refs[i].p_key = p_jobs[i].p_key;
+      many.p_refs[i].index = i;
+   }
+   qsort(many.p_refs, job_count, sizeof(rabbit_many_ref), rabbit_many_cmp);
+
+   many.unit_count = rabbit_many_plan(p_jobs, many.p_refs, job_count, NULL);
+   many.p_units = (rabbit_many_unit *)malloc(many.unit_count*
+          sizeof(rabbit_many_unit));
+   many.p_ranges = (rabbit_many_range *)malloc(many.unit_count*
+          sizeof(rabbit_many_range));
+   if (!many.p_units || !many.p_ranges)
+      goto cleanup;
+   rabbit_many_plan(p_jobs, many.p_refs, job_count, many.p_units);
+
+   /* One thread needs no pool */
+   if (thread_count == 1)
+   {
+      for (i=0; i<many.unit_count; i++)
+         rabbit_many_run(&many, &many.p_units[i]);
+      res = 0;
+      goto cleanup;
+   }
+
+   if (rabbit_sched_create(&many.p_sched, thread_count))
+      goto cleanup;
+   rabbit_sched_latch_init(&many.latch, many.unit_count);
+   atomic_init(&many.range_count, 1);
+
+   /* The whole range enters through the injection queue and is split */
+   /* among the workers by stealing */
+   many.p_ranges[0].p_many = &many;
+   many.p_ranges[0].lo = 0;
+   many.p_ranges[0].hi = many.unit_count;
+   if (rabbit_sched_submit(many.p_sched, rabbit_many_task, &many.p_ranges[0]))
+      rabbit_many_task(&many.p_ranges[0]);
+
+   rabbit_sched_latch_wait(&many.latch);
+   rabbit_sched_destroy(many.p_sched);
+   res = 0;
+
+cleanup:
+   free(many.p_units);
+   free(many.p_ranges);
+   free(many.p_refs);
+   return res;
+}
+
+
+/* Scheduler task: encrypt a run of segments */
+static void rabbit_segment_task_run(void *p_arg)
+{
+   /* Temporary variables */
+   rabbit_segment_task *p_task = (rabbit_segment_task *)p_arg;
+
+   rabbit_segment_cipher(p_task->p_master_instance, p_task->p_base_iv,
+          p_task->segment_size, p_task->first_segment, p_task->p_src,
+          p_task->p_dest, p_task->data_size);
+   rabbit_sched_latch_count_down(p_task->p_latch);
+}
+
+
+/* Scheduler task: write the pages of a buffer range first */
+static void rabbit_segment_task_touch(void *p_arg)
+{
+   /* Temporary variables */
+   rabbit_segment_task *p_task = (rabbit_segment_task *)p_arg;
+   size_t page = (size_t)sysconf(_SC_PAGESIZE), off;
+
+   for (off=0; off<p_task->data_size; off+=page)
+      p_task->p_dest[off] = 0;
+   rabbit_sched_latch_count_down(p_task->p_latch);
+}
+
+
+/* Cut a buffer into tasks of whole segments; returns the task count, or */
+/* 0 with p_tasks NULL if memory ran out */
+static size_t rabbit_segment_tasks(rabbit_segment_task **pp_tasks,
+          size_t segment_size, size_t data_size)
+{
+   /* Temporary variables */
+   size_t per_task, count, off, i;
+
+   per_task = RABBIT_SEGMENT_TASK / segment_size * segment_size;
+   if (!per_task)
+      per_task = segment_size;
+   count = (data_size + per_task - 1) / per_task;
+   *pp_tasks = (rabbit_segment_task *)calloc(count ? count : 1,
+          sizeof(rabbit_segment_task));
+   if (!*pp_tasks)
+      return 0;
+   for (i=0, off=0; i<count; i++, off+=per_task)
+   {
+      (*pp_tasks)[i].first_segment = off / segment_size;
+      (*pp_tasks)[i].data_size = data_size - off < per_task ?
+             data_size - off : per_task;
+   }
+   return count;
+}
+
+
+/* Queue each task on a worker of its node, round robin within the node; */
+/* tasks of unknown nodes or nodes without workers can go anywhere */
+static void rabbit_segment_dispatch(rabbit_sched *p_sched,
+          rabbit_segment_task *p_tasks, const int *p_nodes, size_t count,
+          rabbit_task_fn fn)
+{
+   /* Temporary variables */
+   size_t next[RABBIT_NUMA_MAX_NODES] = { 0 };
+   size_t on_node, pick, i;
+   int node, w, res;
+
+   for (i=0; i<count; i++)
+   {
+      node = p_nodes ? p_nodes[i] : -1;
+      res = -1;
+      if (node >= 0 && node < RABBIT_NUMA_MAX_NODES)
+      {
+         for (on_node=0, w=0; w<p_sched->worker_count; w++)
+            on_node += p_sched->p_workers[w].node == node;
+         if (on_node)
+         {
+            pick = next[node]++ % on_node;
+            for (w=0; w<p_sched->worker_count; w++)
+               if (p_sched->p_workers[w].node == node && !pick--)
+                  break;
+            res = rabbit_sched_submit_to(p_sched, w, fn, &p_tasks[i]);
+         }
+      }
+      if (res)
+         res = rabbit_sched_submit(p_sched, fn, &p_tasks[i]);
+      if (res)
+         fn(&p_tasks[i]);
+   }
+}
+
+
+/* Encrypt or decrypt segments on a pool */
+int rabbit_segment_cipher_parallel(rabbit_sched *p_sched,
+          const rabbit_instance *p_master_instance, const cc_byte *p_base_iv,
+          size_t segment_size, unsigned long long first_segment,
+          const cc_byte *p_src, cc_byte *p_dest, size_t data_size)
+{
+   /* Temporary variables */
+   rabbit_sched_latch latch;
+   rabbit_segment_task *p_tasks;
+   const void **pp_pages = NULL;
+   int *p_nodes = NULL;
+   size_t count, i;
+
+   /* Return error on bad sizes or when called from the pool itself */
+   if (segment_size == 0 || segment_size%16 || data_size%16 ||
+       rabbit_sched_current(p_sched) >= 0)
+      return -1;
+   if (!data_size)
+      return 0;
+
+   count = rabbit_segment_tasks(&p_tasks, segment_size, data_size);
+   if (!count)
+      return -1;
+   for (i=0; i<count; i++)
+   {
+      p_tasks[i].p_master_instance = p_master_instance;
+      p_tasks[i].p_base_iv = p_base_iv;
+      p_tasks[i].segment_size = segment_size;
+      p_tasks[i].p_src = p_src + p_tasks[i].first_segment*segment_size;
+      p_tasks[i].p_dest = p_dest + p_tasks[i].first_segment*segment_size;
+      p_tasks[i].first_segment += first_segment;
+      p_tasks[i].p_latch = &latch;
+   }
+
+   /* On a pinned pool, place each task by the node of its output, or of */
+   /* its input where the output is not populated yet */
+   if (p_sched->pinned)
+   {
+      pp_pages = (const void **)malloc(count*sizeof(void *));
+      p_nodes = (int *)malloc(count*sizeof(int));
+      if (pp_pages && p_nodes)
+      {
+         for (i=0; i<count; i++)
+            pp_pages[i] = p_tasks[i].p_dest;
+         if (!rabbit_numa_page_nodes(pp_pages, count, p_nodes))
+         {
+            for (i=0; i<count; i++)
+               pp_pages[i] = p_tasks[i].p_src;
+            for (i=0; i<count; i++)
+               if (p_nodes[i] < 0 &&
+                   rabbit_numa_page_nodes(pp_pages+i, 1, p_nodes+i))
+                  p_nodes[i] = -1;
+         }
+         else
+         {
+            free(p_nodes);
+            p_nodes = NULL;
+         }
+      }
+   }
+
+   rabbit_sched_latch_init(&latch, count);
+   rabbit_segment_dispatch(p_sched, p_tasks, p_nodes, count,
+          rabbit_segment_task_run);
+   rabbit_sched_latch_wait(&latch);
+
+   free(pp_pages);
+   free(p_nodes);
+   free(p_tasks);
+
+   /* Return success */
+   return 0;
+}
+
+
+/* Allocate a buffer placed for rabbit_segment_cipher_parallel() */
+int rabbit_segment_alloc(rabbit_sched *p_sched, size_t segment_size,
+          size_t data_size, cc_byte **pp_buf)
+{
+   /* Temporary variables */
+   rabbit_sched_latch latch;
+   rabbit_segment_task *p_tasks;
+   cc_byte *p_buf;
+   int *p_nodes;
+   int node_count = 0, node, w;
+   size_t count, i;
+
+   /* Return error on bad sizes or when called from the pool itself */
+   if (segment_size == 0 || segment_size%16 ||
+       rabbit_sched_current(p_sched) >= 0)
+      return -1;
+
+   p_buf = (cc_byte *)rabbit_numa_alloc(data_size);
+   if (!p_buf)
+      return -1;
+
+   /* Unpinned pools place pages wherever they are first written */
+   if (!p_sched->pinned || !data_size)
+   {
+      *pp_buf = p_buf;
+      return 0;
+   }
+
+   count = rabbit_segment_tasks(&p_tasks, segment_size, data_size);
+   p_nodes = (int *)malloc((count ? count : 1)*sizeof(int));
+   if (!count || !p_nodes)
+   {
+      free(p_tasks);
+      free(p_nodes);
+      rabbit_numa_free(p_buf, data_size);
+      return -1;
+   }
+
+   /* Contiguous shares of the buffer for the nodes that have workers */
+   for (w=0; w<p_sched->worker_count; w++)
+      if (p_sched->p_workers[w].node >= node_count)
+         node_count = p_sched->p_workers[w].node + 1;
+   for (i=0; i<count; i++)
+   {
+      p_tasks[i].p_dest = p_buf + p_tasks[i].first_segment*segment_size;
+      p_tasks[i].p_latch = &latch;
+      node = (int)(i*(size_t)node_count/count);
+      for (w=0; w<p_sched->worker_count; w++)
+         if (p_sched->p_workers[w].node == node)
+            break;
+      p_nodes[i] = w < p_sched->worker_count ? node : -1;
+   }
+
+   rabbit_sched_latch_init(&latch, count);
+   rabbit_segment_dispatch(p_sched, p_tasks, p_nodes, count,
+          rabbit_segment_task_touch);
+   rabbit_sched_latch_wait(&latch);
+
+   free(p_nodes);
+   free(p_tasks);
+   *pp_buf = p_buf;
+
+   /* Return success */
+   return 0;
+}
+
+
+/* Release a buffer from rabbit_segment_alloc() */
+void rabbit_segment_free(cc_byte *p_buf, size_t data_size)
+{
+   rabbit_numa_free(p_buf, data_size);
+}
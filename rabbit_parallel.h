@@ -0,0 +1,128 @@
+/******************************************************************************/
+/* File name: rabbit_parallel.h                                               */
+/*----------------------------------------------------------------------------*/
+/* Header file for parallel encryption: a work-stealing thread pool and the   */
+/* segmented-IV mode.                                                         */
+/*                                                                            */
+/* Segmented-IV mode cuts a message into fixed-size segments and encrypts     */
+/* segment k with its own instance, rabbit_iv_setup(master, base_iv + k),     */
+/* where the 8-byte IV is read as a little-endian counter. Segments are       */
+/* independent, so any number of them can be processed in parallel. The      */
+/* ciphertext differs from single-stream mode, so both sides must agree on    */
+/* the mode and the segment size, and IV ranges of different messages under   */
+/* one key must not overlap.                                                  */
+/*                                                                            */
+/* The pool keeps a Chase-Lev deque per worker: tasks submitted by a worker   */
+/* go to its own deque and idle workers steal from the others. Tasks from     */
+/* other threads enter through a shared injection queue. Each worker also     */
+/* has a private mailbox that is never stolen from, for work that should      */
+/* stay on one core.                                                          */
+/*                                                                            */
+/* rabbit_encrypt_many() runs a batch of independent messages on a private    */
+/* pool. Small messages are grouped into tasks of about 64 KiB, segmented     */
+/* messages over 1 MiB are split by segment, and messages that share a key    */
+/* are kept together so each task sets up the key only once.                  */
+/*                                                                            */
+/* On NUMA machines, rabbit_sched_create_numa() pins workers to CPUs spread   */
+/* evenly over the nodes. rabbit_segment_cipher_parallel() on such a pool     */
+/* sends each run of segments to a worker on the node that holds its pages,   */
+/* and rabbit_segment_alloc() places a buffer's pages in node-sized shares    */
+/* by having those workers write them first. On unpinned pools and single-    */
+/* node machines both work the same, without the placement.                   */
+/*                                                                            */
+/* This source code is for little-endian processors (e.g. x86).               */
+/******************************************************************************/
+
+#ifndef _RABBIT_PARALLEL_H
+#define _RABBIT_PARALLEL_H
+
+#include "rabbit.h"
+
+/* Task entry point */
+typedef void (*rabbit_task_fn)(void *p_arg);
+
+/* Opaque thread pool */
+typedef struct rabbit_sched rabbit_sched;
+
+/* One message for rabbit_encrypt_many() */
+typedef struct
+{
+   const cc_byte *p_key;        /* 16-byte key */
+   const cc_byte *p_iv;         /* 8-byte IV, or NULL for the key alone */
+   const cc_byte *p_src;
+   cc_byte *p_dest;
+   size_t data_size;            /* Multiple of 16 */
+   size_t segment_size;         /* 0 for a single stream, else segmented-IV */
+} rabbit_job;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* All function calls return zero on success */
+
+/* Derive the instance of one segment */
+int rabbit_segment_iv_setup(const rabbit_instance *p_master_instance,
+          rabbit_instance *p_instance, const cc_byte *p_base_iv,
+          unsigned long long segment);
+
+/* Encrypt or decrypt data_size bytes starting at the beginning of segment */
+/* first_segment. segment_size and data_size must be multiples of 16; the */
+/* last segment may be short. */
+int rabbit_segment_cipher(const rabbit_instance *p_master_instance,
+          const cc_byte *p_base_iv, size_t segment_size,
+          unsigned long long first_segment, const cc_byte *p_src,
+          cc_byte *p_dest, size_t data_size);
+
+/* Start a pool; thread_count 0 uses one thread per online CPU */
+int rabbit_sched_create(rabbit_sched **pp_sched, int thread_count);
+
+/* Same, with workers pinned to CPUs interleaved across the NUMA nodes */
+int rabbit_sched_create_numa(rabbit_sched **pp_sched, int thread_count);
+
+/* Run every queued task, then stop and free the pool */
+void rabbit_sched_destroy(rabbit_sched *p_sched);
+
+/* Number of worker threads */
+int rabbit_sched_size(const rabbit_sched *p_sched);
+
+/* Index of the calling worker thread, or -1 for other threads */
+int rabbit_sched_current(const rabbit_sched *p_sched);
+
+/* NUMA node of a worker, or -1 if the pool is not pinned */
+int rabbit_sched_worker_node(const rabbit_sched *p_sched, int worker);
+
+/* Queue a task for any worker */
+int rabbit_sched_submit(rabbit_sched *p_sched, rabbit_task_fn fn,
+          void *p_arg);
+
+/* Queue a task for one specific worker */
+int rabbit_sched_submit_to(rabbit_sched *p_sched, int worker,
+          rabbit_task_fn fn, void *p_arg);
+
+/* rabbit_segment_cipher() spread over a pool; on a pinned pool every run */
+/* of segments goes to a worker on the node of its pages. Must not be */
+/* called from a worker of the same pool. */
+int rabbit_segment_cipher_parallel(rabbit_sched *p_sched,
+          const rabbit_instance *p_master_instance, const cc_byte *p_base_iv,
+          size_t segment_size, unsigned long long first_segment,
+          const cc_byte *p_src, cc_byte *p_dest, size_t data_size);
+
+/* Allocate a buffer whose segments are first touched by the pool workers */
+/* that will process them; release it with rabbit_segment_free() */
+int rabbit_segment_alloc(rabbit_sched *p_sched, size_t segment_size,
+          size_t data_size, cc_byte **pp_buf);
+
+/* Release a buffer from rabbit_segment_alloc() */
+void rabbit_segment_free(cc_byte *p_buf, size_t data_size);
+
+/* Encrypt or decrypt independent messages on thread_count threads (0 for */
+/* one per online CPU). Every job is checked before any work starts. */
+int rabbit_encrypt_many(const rabbit_job *p_jobs, size_t job_count,
+          int thread_count);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,441 @@
+/******************************************************************************/
+/* File name: rabbit_pipeline.c                                               */
+/*----------------------------------------------------------------------------*/
+/* Source file for a three-stage streaming encryption pipeline.               */
+/*                                                                            */
+/* Buffer slots circulate reader -> cipher -> writer -> reader through three  */
+/* rings. Ring positions are free-running 32-bit counters; each side caches   */
+/* the other side's counter and only rereads it when the cached value says   */
+/* the ring is empty or full. In futex mode each side also bumps a sequence   */
+/* word after publishing; a waiter samples that word before its final check  */
+/* and sleeps on it, so a wake-up can never be lost.                          */
+/*                                                                            */
+/* This source code is for little-endian processors (e.g. x86).               */
+/******************************************************************************/
+
+#define _GNU_SOURCE
+
+#include "rabbit_pipeline.h"
+#include "rabbit_internal.h"
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#if defined(__linux__)
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+/* Spins between yields while busy polling */
+#define RABBIT_SPSC_SPINS 1024
+
+/* Structure to store a ring */
+struct rabbit_spsc
+{
+   /* Consumer side */
+   _Alignas(RABBIT_CACHE_LINE) atomic_uint head;
+   unsigned int tail_cache;
+   atomic_uint room_seq;
+   atomic_int consumer_waiting;
+
+   /* Producer side */
+   _Alignas(RABBIT_CACHE_LINE) atomic_uint tail;
+   unsigned int head_cache;
+   atomic_uint items_seq;
+   atomic_int producer_waiting;
+   atomic_int closed;
+
+   /* Shared, read-only */
+   _Alignas(RABBIT_CACHE_LINE) unsigned int mask;
+   int wait_mode;
+   size_t items[];
+};
+
+/* Pipeline state shared by the stage threads */
+typedef struct
+{
+   const rabbit_pipeline_config *p_config;
+   rabbit_instance *p_instance;
+   rabbit_pipeline_read_fn read_fn;
+   void *p_read_context;
+   rabbit_pipeline_write_fn write_fn;
+   void *p_write_context;
+   cc_byte *p_buffers;
+   size_t *p_lengths;
+   rabbit_spsc *p_free;      /* writer -> reader */
+   rabbit_spsc *p_full;      /* reader -> cipher */
+   rabbit_spsc *p_done;      /* cipher -> writer */
+   atomic_int failed;
+} rabbit_pipeline;
+
+
+/* Sleep while *p_word still holds value (futex mode) or spin briefly */
+static void rabbit_spsc_wait(rabbit_spsc *p_ring, atomic_uint *p_word,
+          unsigned int value, unsigned int *p_spins)
+{
+#if defined(__linux__)
+   if (p_ring->wait_mode == RABBIT_PIPELINE_FUTEX)
+   {
+      syscall(SYS_futex, (unsigned int *)p_word, FUTEX_WAIT_PRIVATE, value,
+             NULL, NULL, 0);
+      return;
+   }
+#else
+   (void)p_word;
+   (void)value;
+#endif
+
+   (void)p_ring;
+   if (++*p_spins % RABBIT_SPSC_SPINS == 0)
+      sched_yield();
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+   else
+      __builtin_ia32_pause();
+#endif
+}
+
+
+/* Bump a sequence word and wake a thread sleeping on it if it announced */
+/* itself */
+static void rabbit_spsc_wake(rabbit_spsc *p_ring, atomic_uint *p_word,
+          atomic_int *p_waiting)
+{
+#if defined(__linux__)
+   if (p_ring->wait_mode != RABBIT_PIPELINE_FUTEX)
+      return;
+   atomic_fetch_add(p_word, 1);
+   if (atomic_exchange(p_waiting, 0))
+      syscall(SYS_futex, (unsigned int *)p_word, FUTEX_WAKE_PRIVATE, 1,
+             NULL, NULL, 0);
+#else
+   (void)p_ring;
+   (void)p_word;
+   (void)p_waiting;
+#endif
+}
+
+
+/* Create a ring */
+int rabbit_spsc_create(rabbit_spsc **pp_ring, size_t capacity, int wait_mode)
+{
+   /* Temporary variables */
+   rabbit_spsc *p_ring;
+   void *p_mem;
+
+   /* Return error if the capacity is not a power of two */
+   if (capacity < 2 || (capacity & (capacity-1)) || capacity > 0x80000000UL)
+      return -1;
+
+   if (posix_memalign(&p_mem, RABBIT_CACHE_LINE,
+          sizeof(rabbit_spsc) + capacity*sizeof(size_t)))
+      return -1;
+   p_ring = (rabbit_spsc *)p_mem;
+
+   atomic_init(&p_ring->head, 0);
+   atomic_init(&p_ring->tail, 0);
+   atomic_init(&p_ring->room_seq, 0);
+   atomic_init(&p_ring->items_seq, 0);
+   atomic_init(&p_ring->consumer_waiting, 0);
+   atomic_init(&p_ring->producer_waiting, 0);
+   atomic_init(&p_ring->closed, 0);
+   p_ring->tail_cache = 0;
+   p_ring->head_cache = 0;
+   p_ring->mask = (unsigned int)(capacity-1);
+   p_ring->wait_mode = wait_mode;
+   *pp_ring = p_ring;
+
+   /* Return success */
+   return 0;
+}
+
+
+/* Free a ring */
+void rabbit_spsc_destroy(rabbit_spsc *p_ring)
+{
+   free(p_ring);
+}
+
+
+/* Producer: append items */
+void rabbit_spsc_push(rabbit_spsc *p_ring, const size_t *p_items,
+          size_t count)
+{
+   /* Temporary variables */
+   unsigned int tail = atomic_load_explicit(&p_ring->tail,
+          memory_order_relaxed);
+   unsigned int spins = 0, room, seq, i;
+
+   while (count)
+   {
+      /* Find room, rereading the consumer position only when needed */
+      room = p_ring->mask + 1 - (tail - p_ring->head_cache);
+      if (room == 0)
+      {
+         p_ring->head_cache = atomic_load_explicit(&p_ring->head,
+                memory_order_acquire);
+         room = p_ring->mask + 1 - (tail - p_ring->head_cache);
+         if (room == 0)
+         {
+            seq = atomic_load(&p_ring->room_seq);
+            atomic_store(&p_ring->producer_waiting, 1);
+            if (atomic_load(&p_ring->head) == p_ring->head_cache)
+               rabbit_spsc_wait(p_ring, &p_ring->room_seq, seq, &spins);
+            continue;
+         }
+      }
+
+      if (room > count)
+         room = (unsigned int)count;
+      for (i=0; i<room; i++)
+         p_ring->items[(tail+i) & p_ring->mask] = p_items[i];
+      tail += room;
+      p_items += room;
+      count -= room;
+
+      /* Publish and wake the consumer if it sleeps */
+      atomic_store_explicit(&p_ring->tail, tail, memory_order_release);
+      rabbit_spsc_wake(p_ring, &p_ring->items_seq, &p_ring->consumer_waiting);
+   }
+}
+
+
+/* Producer: mark the end of the stream */
+void rabbit_spsc_close(rabbit_spsc *p_ring)
+{
+   atomic_store(&p_ring->closed, 1);
+   rabbit_spsc_wake(p_ring, &p_ring->items_seq, &p_ring->consumer_waiting);
+}
+
+
+/* Consumer: take up to max_count items */
+size_t rabbit_spsc_pop(rabbit_spsc *p_ring, size_t *p_items,
+          size_t max_count)
+{
+   /* Temporary variables */
+   unsigned int head = atomic_load_explicit(&p_ring->head,
+          memory_order_relaxed);
+   unsigned int spins = 0, avail, seq, i;
+
+   for (;;)
+   {
+      /* Find items, rereading the producer position only when needed */
+      avail = p_ring->tail_cache - head;
+      if (avail == 0)
+      {
+         p_ring->tail_cache = atomic_load_explicit(&p_ring->tail,
+                memory_order_acquire);
+         avail = p_ring->tail_cache - head;
+      }
+      if (avail)
+         break;
+
+      /* Empty: finished if closed, otherwise wait */
+      if (atomic_load(&p_ring->closed))
+      {
+         p_ring->tail_cache = atomic_load_explicit(&p_ring->tail,
+                memory_order_acquire);
+         if (p_ring->tail_cache == head)
+            return 0;
+         continue;
+      }
+      seq = atomic_load(&p_ring->items_seq);
+      atomic_store(&p_ring->consumer_waiting, 1);
+      if (atomic_load(&p_ring->tail) == head && !atomic_load(&p_ring->closed))
+         rabbit_spsc_wait(p_ring, &p_ring->items_seq, seq, &spins);
+   }
+
+   if (avail > max_count)
+      avail = (unsigned int)max_count;
+   for (i=0; i<avail; i++)
+      p_items[i] = p_ring->items[(head+i) & p_ring->mask];
+
+   /* Release the slots and wake the producer if it sleeps */
+   atomic_store_explicit(&p_ring->head, head+avail, memory_order_release);
+   rabbit_spsc_wake(p_ring, &p_ring->room_seq, &p_ring->producer_waiting);
+
+   return avail;
+}
+
+
+/* Reader stage: fill free slots completely and hand them to the cipher */
+static void *rabbit_pipeline_reader(void *p_arg)
+{
+   /* Temporary variables */
+   rabbit_pipeline *p_pipe = (rabbit_pipeline *)p_arg;
+   size_t slot_size = p_pipe->p_config->slot_size;
+   size_t *p_slots, n, i, len;
+   cc_byte *p_buf;
+   long res = 1;
+
+   p_slots = (size_t *)malloc(p_pipe->p_config->batch*sizeof(size_t));
+   if (!p_slots)
+      atomic_store(&p_pipe->failed, 1);
+
+   while (p_slots && res > 0 && !atomic_load(&p_pipe->failed))
+   {
+      n = rabbit_spsc_pop(p_pipe->p_free, p_slots, p_pipe->p_config->batch);
+      for (i=0; i<n; i++)
+      {
+         p_buf = p_pipe->p_buffers + p_slots[i]*slot_size;
+         for (len=0; len<slot_size; len+=(size_t)res)
+         {
+            res = p_pipe->read_fn(p_pipe->p_read_context, p_buf+len,
+                   slot_size-len);
+            if (res <= 0)
+               break;
+         }
+         if (res < 0)
+            atomic_store(&p_pipe->failed, 1);
+         p_pipe->p_lengths[p_slots[i]] = len;
+
+         /* Stop after the end of input; an empty last slot is dropped */
+         if (res <= 0)
+         {
+            n = i + (len > 0);
+            break;
+         }
+      }
+      rabbit_spsc_push(p_pipe->p_full, p_slots, n);
+   }
+
+   rabbit_spsc_close(p_pipe->p_full);
+   free(p_slots);
+   return NULL;
+}
+
+
+/* Cipher stage: encrypt slots in place */
+static void *rabbit_pipeline_cipher(void *p_arg)
+{
+   /* Temporary variables */
+   rabbit_pipeline *p_pipe = (rabbit_pipeline *)p_arg;
+   size_t slot_size = p_pipe->p_config->slot_size;
+   size_t *p_slots, n, i, len;
+   cc_byte *p_buf;
+
+   p_slots = (size_t *)malloc(p_pipe->p_config->batch*sizeof(size_t));
+   if (!p_slots)
+      atomic_store(&p_pipe->failed, 1);
+
+   while (p_slots &&
+          (n = rabbit_spsc_pop(p_pipe->p_full, p_slots,
+                 p_pipe->p_config->batch)) > 0)
+   {
+      for (i=0; i<n; i++)
+      {
+         /* A short last slot is padded to whole blocks */
+         p_buf = p_pipe->p_buffers + p_slots[i]*slot_size;
+         len = (p_pipe->p_lengths[p_slots[i]] + 15) & ~(size_t)15;
+         rabbit_cipher_raw(p_pipe->p_instance, p_buf, p_buf, len);
+      }
+      rabbit_spsc_push(p_pipe->p_done, p_slots, n);
+   }
+
+   rabbit_spsc_close(p_pipe->p_done);
+   free(p_slots);
+   return NULL;
+}
+
+
+/* Stream input through the cipher to the output */
+int rabbit_pipeline_run(const rabbit_pipeline_config *p_config,
+          rabbit_instance *p_instance, rabbit_pipeline_read_fn read_fn,
+          void *p_read_context, rabbit_pipeline_write_fn write_fn,
+          void *p_write_context)
+{
+   /* Temporary variables */
+   rabbit_pipeline pipe;
+   pthread_t reader, cipher;
+   size_t *p_slots = NULL, n, i;
+   void *p_mem = NULL;
+   int started = 0, res;
+
+   /* Return error on an invalid configuration */
+   if (p_config->slot_size == 0 || p_config->slot_size%16 ||
+       p_config->batch == 0 || p_config->slot_count < 2 ||
+       (p_config->slot_count & (p_config->slot_count-1)))
+      return -1;
+
+   memset(&pipe, 0, sizeof(pipe));
+   pipe.p_config = p_config;
+   pipe.p_instance = p_instance;
+   pipe.read_fn = read_fn;
+   pipe.p_read_context = p_read_context;
+   pipe.write_fn = write_fn;
+   pipe.p_write_context = p_write_context;
+   atomic_init(&pipe.failed, 0);
+
+   /* Allocate buffers and rings; every slot starts out free */
+   res = posix_memalign(&p_mem, 4096, p_config->slot_count*p_config->slot_size);
+   pipe.p_buffers = res ? NULL : (cc_byte *)p_mem;
+   pipe.p_lengths = (size_t *)calloc(p_config->slot_count, sizeof(size_t));
+   p_slots = (size_t *)malloc((p_config->slot_count > p_config->batch ?
+          p_config->slot_count : p_config->batch)*sizeof(size_t));
+   res = !pipe.p_buffers || !pipe.p_lengths || !p_slots ||
+          rabbit_spsc_create(&pipe.p_free, p_config->slot_count,
+                 p_config->wait_mode) ||
+          rabbit_spsc_create(&pipe.p_full, p_config->slot_count,
+                 p_config->wait_mode) ||
+          rabbit_spsc_create(&pipe.p_done, p_config->slot_count,
+                 p_config->wait_mode);
+   if (!res)
+   {
+      for (i=0; i<p_config->slot_count; i++)
+         p_slots[i] = i;
+      rabbit_spsc_push(pipe.p_free, p_slots, p_config->slot_count);
+
+      if (!pthread_create(&reader, NULL, rabbit_pipeline_reader, &pipe))
+         started |= 1;
+      if (!pthread_create(&cipher, NULL, rabbit_pipeline_cipher, &pipe))
+         started |= 2;
+      res = started != 3;
+   }
+
+   /* Writer stage runs here; after an error it keeps recycling slots so */
+   /* the other stages can drain */
+   if (started)
+   {
+      if (!(started & 2))
+         atomic_store(&pipe.failed, 1);
+      while ((started & 2) &&
+             (n = rabbit_spsc_pop(pipe.p_done, p_slots, p_config->batch)) > 0)
+      {
+         for (i=0; i<n; i++)
+            if (!atomic_load(&pipe.failed) &&
+                write_fn(p_write_context,
+                       pipe.p_buffers + p_slots[i]*p_config->slot_size,
+                       pipe.p_lengths[p_slots[i]]))
+               atomic_store(&pipe.failed, 1);
+         rabbit_spsc_push(pipe.p_free, p_slots, n);
+      }
+      if (started & 1)
+      {
+         /* Unblock a reader still waiting for free slots */
+         if (!(started & 2))
+            rabbit_spsc_close(pipe.p_free);
+         pthread_join(reader, NULL);
+      }
+      else
+      {
+         /* No reader: let the cipher stage finish */
+         atomic_store(&pipe.failed, 1);
+         rabbit_spsc_close(pipe.p_full);
+      }
+      if (started & 2)
+         pthread_join(cipher, NULL);
+      res |= atomic_load(&pipe.failed);
+   }
+
+   if (pipe.p_buffers)
+      rabbit_wipe(pipe.p_buffers, p_config->slot_count*p_config->slot_size);
+   free(pipe.p_buffers);
+   free(pipe.p_lengths);
+   free(p_slots);
+   rabbit_spsc_destroy(pipe.p_free);
+   rabbit_spsc_destroy(pipe.p_full);
+   rabbit_spsc_destroy(pipe.p_done);
+
+   return res ? -1 : 0;
+}
@@ -0,0 +1,86 @@
+/******************************************************************************/
+/* File name: rabbit_pipeline.h                                               */
+/*----------------------------------------------------------------------------*/
+/* Header file for a three-stage streaming encryption pipeline.               */
+/*                                                                            */
+/* A reader stage fills fixed-size buffers, a cipher stage encrypts them in   */
+/* place and a writer stage drains them. Stages run on their own threads and  */
+/* pass buffer ownership through lock-free single-producer/single-consumer    */
+/* rings of slot indices, so data is never copied between stages. Each stage  */
+/* takes up to a batch of slots per wakeup and waits either by busy polling   */
+/* or on a futex.                                                             */
+/*                                                                            */
+/* The rings are usable on their own as well.                                 */
+/*                                                                            */
+/* This source code is for little-endian processors (e.g. x86).               */
+/******************************************************************************/
+
+#ifndef _RABBIT_PIPELINE_H
+#define _RABBIT_PIPELINE_H
+
+#include "rabbit.h"
+
+/* Wait modes */
+#define RABBIT_PIPELINE_BUSY_POLL 0   /* Spin; lowest latency, burns a core */
+#define RABBIT_PIPELINE_FUTEX     1   /* Sleep in the kernel when idle */
+
+/* Pipeline configuration */
+typedef struct
+{
+   size_t slot_size;    /* Bytes per buffer, a non-zero multiple of 16 */
+   size_t slot_count;   /* Number of buffers, a power of two */
+   size_t batch;        /* Most slots a stage takes per wakeup */
+   int wait_mode;       /* RABBIT_PIPELINE_BUSY_POLL or _FUTEX */
+} rabbit_pipeline_config;
+
+/* Source callback: read up to size bytes, return the count read, zero at */
+/* the end of the input or a negative value on error */
+typedef long (*rabbit_pipeline_read_fn)(void *p_context, cc_byte *p_buf,
+          size_t size);
+
+/* Sink callback: write size bytes, return zero on success */
+typedef int (*rabbit_pipeline_write_fn)(void *p_context, const cc_byte *p_buf,
+          size_t size);
+
+/* Opaque single-producer/single-consumer ring */
+typedef struct rabbit_spsc rabbit_spsc;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* All function calls return zero on success */
+
+/* Create a ring for capacity items (a power of two) */
+int rabbit_spsc_create(rabbit_spsc **pp_ring, size_t capacity, int wait_mode);
+
+/* Free a ring */
+void rabbit_spsc_destroy(rabbit_spsc *p_ring);
+
+/* Producer: append all items, waiting for room as needed */
+void rabbit_spsc_push(rabbit_spsc *p_ring, const size_t *p_items,
+          size_t count);
+
+/* Producer: mark the end of the stream */
+void rabbit_spsc_close(rabbit_spsc *p_ring);
+
+/* Consumer: wait for at least one item and take up to max_count of them. */
+/* Returns the number taken, which is zero only once the ring is closed */
+/* and empty. */
+size_t rabbit_spsc_pop(rabbit_spsc *p_ring, size_t *p_items,
+          size_t max_count);
+
+/* Stream everything from read_fn through the cipher to write_fn, */
+/* continuing the stream of *p_instance. Buffers are filled completely */
+/* except at the end of the input; the final partial buffer is processed */
+/* as whole blocks, so the instance advances to the next block boundary. */
+int rabbit_pipeline_run(const rabbit_pipeline_config *p_config,
+          rabbit_instance *p_instance, rabbit_pipeline_read_fn read_fn,
+          void *p_read_context, rabbit_pipeline_write_fn write_fn,
+          void *p_write_context);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
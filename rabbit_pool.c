@@ -0,0 +1,227 @@
+/******************************************************************************/
+/* File name: rabbit_pool.c                                                   */
+/*----------------------------------------------------------------------------*/
+/* Source file for a slab allocator of cipher instances.                      */
+/*                                                                            */
+/* Fresh slabs are handed out with a bump pointer; released instances are    */
+/* cleared and kept on an intrusive free list threaded through the slots.     */
+/*                                                                            */
+/* This source code is for little-endian processors (e.g. x86).               */
+/******************************************************************************/
+
+#define _DEFAULT_SOURCE
+
+#include "rabbit_pool.h"
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+/* Size of one slab; matches the usual huge page size */
+#define RABBIT_POOL_SLAB_SIZE ((size_t)2 << 20)
+
+/* Instances per slab */
+#define RABBIT_POOL_SLAB_COUNT (RABBIT_POOL_SLAB_SIZE / RABBIT_POOL_STRIDE)
+
+/* Free list link stored in a released slot */
+typedef struct rabbit_pool_link
+{
+   struct rabbit_pool_link *p_next;
+} rabbit_pool_link;
+
+/* Structure to store the pool */
+struct rabbit_pool
+{
+   cc_byte **pp_slabs;        /* Slab base addresses */
+   size_t slab_count;         /* Number of slabs mapped */
+   size_t slab_capacity;      /* Number of entries in pp_slabs */
+   size_t current;            /* Slab the bump pointer is in */
+   size_t bump;               /* Slots handed out from the current slab */
+   rabbit_pool_link *p_free;  /* Released slots */
+   size_t live;               /* Instances currently handed out */
+   size_t max_instances;      /* Limit on live instances, 0 if none */
+   int flags;
+};
+
+
+/* Map one slab, preferring huge pages when requested */
+static cc_byte *rabbit_pool_map_slab(int flags)
+{
+   /* Temporary variables */
+   void *p_slab = MAP_FAILED;
+#ifdef MADV_HUGEPAGE
+   void *p_map;
+   size_t head;
+#endif
+
+#ifdef MAP_HUGETLB
+   /* Explicit huge pages need a reserved hugetlbfs pool */
+   if (flags & RABBIT_POOL_HUGEPAGES)
+      p_slab = mmap(NULL, RABBIT_POOL_SLAB_SIZE, PROT_READ|PROT_WRITE,
+             MAP_PRIVATE|MAP_ANONYMOUS|MAP_HUGETLB, -1, 0);
+#endif
+
+#ifdef MADV_HUGEPAGE
+   /* Otherwise ask for transparent huge pages. Only a huge page aligned */
+   /* range can get one, so map twice the size and keep the aligned */
+   /* window. */
+   if (p_slab == MAP_FAILED && (flags & RABBIT_POOL_HUGEPAGES))
+   {
+      p_map = mmap(NULL, 2*RABBIT_POOL_SLAB_SIZE, PROT_READ|PROT_WRITE,
+             MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+      if (p_map == MAP_FAILED)
+         return NULL;
+      head = (RABBIT_POOL_SLAB_SIZE - (uintptr_t)p_map%RABBIT_POOL_SLAB_SIZE) %
+             RABBIT_POOL_SLAB_SIZE;
+      if (head)
+         munmap(p_map, head);
+      munmap((cc_byte *)p_map + head + RABBIT_POOL_SLAB_SIZE,
+             RABBIT_POOL_SLAB_SIZE - head);
+      p_slab = (cc_byte *)p_map + head;
+      madvise(p_slab, RABBIT_POOL_SLAB_SIZE, MADV_HUGEPAGE);
+   }
+#endif
+
+   if (p_slab == MAP_FAILED)
+   {
+      p_slab = mmap(NULL, RABBIT_POOL_SLAB_SIZE, PROT_READ|PROT_WRITE,
+             MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+      if (p_slab == MAP_FAILED)
+         return NULL;
+   }
+
+   return (cc_byte *)p_slab;
+}
+
+
+/* Create a pool */
+int rabbit_pool_create(rabbit_pool **pp_pool, size_t max_instances, int flags)
+{
+   /* Temporary variables */
+   rabbit_pool *p_pool;
+
+   p_pool = (rabbit_pool *)calloc(1, sizeof(rabbit_pool));
+   if (!p_pool)
+      return -1;
+
+   p_pool->max_instances = max_instances;
+   p_pool->flags = flags;
+   *pp_pool = p_pool;
+
+   /* Return success */
+   return 0;
+}
+
+
+/* Hand out a zeroed, cache line aligned instance */
+int rabbit_pool_alloc(rabbit_pool *p_pool, rabbit_instance **pp_instance)
+{
+   /* Temporary variables */
+   rabbit_pool_link *p_link;
+   cc_byte **pp_slabs;
+   cc_byte *p_slab;
+
+   /* Return error if the pool is exhausted */
+   if (p_pool->max_instances && p_pool->live >= p_pool->max_instances)
+      return -1;
+
+   /* Reuse a released slot; it is clear apart from the link */
+   if (p_pool->p_free)
+   {
+      p_link = p_pool->p_free;
+      p_pool->p_free = p_link->p_next;
+      p_link->p_next = NULL;
+      *pp_instance = (rabbit_instance *)p_link;
+      p_pool->live++;
+      return 0;
+   }
+
+   /* Move on to the next slab when the current one is used up, mapping */
+   /* a new one if all slabs are in use */
+   if (p_pool->slab_count == 0 || p_pool->bump == RABBIT_POOL_SLAB_COUNT)
+   {
+      if (p_pool->slab_count && p_pool->current+1 < p_pool->slab_count)
+         p_pool->current++;
+      else
+      {
+         if (p_pool->slab_count == p_pool->slab_capacity)
+         {
+            pp_slabs = (cc_byte **)realloc(p_pool->pp_slabs,
+                   (p_pool->slab_capacity*2 + 4)*sizeof(cc_byte *));
+            if (!pp_slabs)
+               return -1;
+            p_pool->pp_slabs = pp_slabs;
+            p_pool->slab_capacity = p_pool->slab_capacity*2 + 4;
+         }
+
+         p_slab = rabbit_pool_map_slab(p_pool->flags);
+         if (!p_slab)
+            return -1;
+         p_pool->pp_slabs[p_pool->slab_count] = p_slab;
+         p_pool->current = p_pool->slab_count++;
+      }
+      p_pool->bump = 0;
+   }
+
+   /* Fresh slab memory is already zero */
+   *pp_instance = (rabbit_instance *)(p_pool->pp_slabs[p_pool->current] +
+          p_pool->bump*RABBIT_POOL_STRIDE);
+   p_pool->bump++;
+   p_pool->live++;
+
+   /* Return success */
+   return 0;
+}
+
+
+/* Clear an instance and return it to the pool */
+void rabbit_pool_free(rabbit_pool *p_pool, rabbit_instance *p_instance)
+{
+   /* Temporary variables */
+   rabbit_pool_link *p_link = (rabbit_pool_link *)p_instance;
+
+   if (!p_instance)
+      return;
+
+   rabbit_wipe(p_instance, sizeof(rabbit_instance));
+   p_link->p_next = p_pool->p_free;
+   p_pool->p_free = p_link;
+   p_pool->live--;
+}
+
+
+/* Clear and release every instance at once */
+void rabbit_pool_reset(rabbit_pool *p_pool)
+{
+   /* Temporary variables */
+   size_t i;
+
+   /* Slabs before the current one are full; the rest were never touched */
+   for (i=0; i<p_pool->slab_count && i<=p_pool->current; i++)
+      memset(p_pool->pp_slabs[i], 0, i < p_pool->current ?
+             RABBIT_POOL_SLAB_COUNT*RABBIT_POOL_STRIDE :
+             p_pool->bump*RABBIT_POOL_STRIDE);
+
+   /* Rewind; all slabs are zero again and are refilled in order */
+   p_pool->p_free = NULL;
+   p_pool->live = 0;
+   p_pool->current = 0;
+   p_pool->bump = 0;
+}
+
+
+/* Clear all instances and unmap the slabs */
+void rabbit_pool_destroy(rabbit_pool *p_pool)
+{
+   /* Temporary variables */
+   size_t i;
+
+   if (!p_pool)
+      return;
+
+   rabbit_pool_reset(p_pool);
+   for (i=0; i<p_pool->slab_count; i++)
+      munmap(p_pool->pp_slabs[i], RABBIT_POOL_SLAB_SIZE);
+   free(p_pool->pp_slabs);
+   free(p_pool);
+}
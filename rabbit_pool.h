@@ -0,0 +1,59 @@
+/******************************************************************************/
+/* File name: rabbit_pool.h                                                   */
+/*----------------------------------------------------------------------------*/
+/* Header file for a slab allocator of cipher instances.                      */
+/*                                                                            */
+/* Instances are carved out of large slabs at a fixed stride that is a       */
+/* multiple of the cache line size, so every instance starts on a line       */
+/* boundary and no two instances share a line. Slabs can be backed by huge   */
+/* pages to cut TLB misses when millions of instances are live. Released     */
+/* instances are cleared before they are reused, and releasing the whole     */
+/* pool clears all slabs in bulk.                                             */
+/*                                                                            */
+/* A pool is not thread-safe; use one pool per thread or lock around it.      */
+/*                                                                            */
+/* This source code is for little-endian processors (e.g. x86).               */
+/******************************************************************************/
+
+#ifndef _RABBIT_POOL_H
+#define _RABBIT_POOL_H
+
+#include "rabbit.h"
+
+/* Distance between two instances handed out by a pool */
+#define RABBIT_POOL_STRIDE \
+   ((sizeof(rabbit_instance) + RABBIT_CACHE_LINE-1) & ~(size_t)(RABBIT_CACHE_LINE-1))
+
+/* Pool creation flags */
+#define RABBIT_POOL_HUGEPAGES 0x1   /* Back slabs with huge pages if possible */
+
+/* Opaque instance pool */
+typedef struct rabbit_pool rabbit_pool;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* All function calls return zero on success */
+
+/* Create a pool holding at most max_instances live instances (zero means */
+/* no limit). Memory is reserved slab by slab as the pool grows. */
+int rabbit_pool_create(rabbit_pool **pp_pool, size_t max_instances, int flags);
+
+/* Hand out a zeroed, cache line aligned instance */
+int rabbit_pool_alloc(rabbit_pool *p_pool, rabbit_instance **pp_instance);
+
+/* Clear an instance and return it to the pool */
+void rabbit_pool_free(rabbit_pool *p_pool, rabbit_instance *p_instance);
+
+/* Clear and release every instance of the pool at once, keeping the slabs */
+void rabbit_pool_reset(rabbit_pool *p_pool);
+
+/* Clear all instances and give the slabs back to the system */
+void rabbit_pool_destroy(rabbit_pool *p_pool);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
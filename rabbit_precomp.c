@@ -0,0 +1,401 @@
+/******************************************************************************/
+/* File name: rabbit_precomp.c                                                */
+/*----------------------------------------------------------------------------*/
+/* Source file for per-session keystream precomputation.                      */
+/*                                                                            */
+/* The keystream buffer is a ring. Keystream is always generated in whole     */
+/* 16-byte blocks at the tail, so the tail stays block aligned; consumers     */
+/* take bytes from the head. A busy flag serializes the two sides: refills    */
+/* only try it and skip a busy session, the cipher path spins on it for at    */
+/* most one refill.                                                           */
+/*                                                                            */
+/* This source code is for little-endian processors (e.g. x86).               */
+/******************************************************************************/
+
+#define _POSIX_C_SOURCE 200809L
+
+#include "rabbit_precomp.h"
+#include "rabbit_internal.h"
+#include "rabbit_snapshot.h"
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/* Structure to store a precompute session */
+struct rabbit_precomp
+{
+   atomic_flag busy;
+   atomic_size_t count;       /* Keystream bytes ready */
+   size_t head;               /* Offset of the next keystream byte */
+   size_t depth;              /* Buffer size */
+   rabbit_instance inst;      /* State after the last buffered block */
+   _Alignas(RABBIT_CACHE_LINE) cc_byte ks[];
+};
+
+/* Structure to store a background worker */
+struct rabbit_precomp_worker
+{
+   pthread_mutex_t lock;
+   pthread_t thread;
+   rabbit_precomp **pp_sessions;
+   size_t session_count;
+   size_t session_capacity;
+   atomic_int stop;
+};
+
+
+/* Take the busy flag, waiting for a refill in progress to finish */
+static void rabbit_precomp_lock(rabbit_precomp *p_session)
+{
+   while (atomic_flag_test_and_set_explicit(&p_session->busy,
+          memory_order_acquire))
+      sched_yield();
+}
+
+
+/* Release the busy flag */
+static void rabbit_precomp_unlock(rabbit_precomp *p_session)
+{
+   atomic_flag_clear_explicit(&p_session->busy, memory_order_release);
+}
+
+
+/* Create a session */
+int rabbit_precomp_create(rabbit_precomp **pp_session,
+          const rabbit_instance *p_instance, size_t depth)
+{
+   /* Temporary variables */
+   rabbit_precomp *p_session;
+   void *p_mem;
+
+   /* Return error on an unusable buffer size */
+   if (depth == 0 || depth%16 || depth > RABBIT_PRECOMP_MAX_DEPTH)
+      return -1;
+
+   if (posix_memalign(&p_mem, RABBIT_CACHE_LINE,
+          sizeof(rabbit_precomp) + depth))
+      return -1;
+   p_session = (rabbit_precomp *)p_mem;
+
+   atomic_flag_clear(&p_session->busy);
+   atomic_init(&p_session->count, 0);
+   p_session->head = 0;
+   p_session->depth = depth;
+   p_session->inst = *p_instance;
+   *pp_session = p_session;
+
+   /* Return success */
+   return 0;
+}
+
+
+/* Clear and free a session */
+void rabbit_precomp_destroy(rabbit_precomp *p_session)
+{
+   if (!p_session)
+      return;
+
+   rabbit_wipe(p_session, sizeof(rabbit_precomp) + p_session->depth);
+   free(p_session);
+}
+
+
+/* Top up the keystream buffer */
+size_t rabbit_precomp_refill(rabbit_precomp *p_session)
+{
+   /* Temporary variables */
+   size_t count, tail, run, generated = 0;
+
+   if (atomic_flag_test_and_set_explicit(&p_session->busy,
+          memory_order_acquire))
+      return 0;
+
+   /* Generate whole blocks into the free part of the ring, at most two */
+   /* runs; the free space ends at the head, which may be unaligned */
+   count = atomic_load_explicit(&p_session->count, memory_order_relaxed);
+   while (p_session->depth - count >= 16)
+   {
+      tail = (p_session->head + count) % p_session->depth;
+      run = (p_session->depth - count) & ~(size_t)15;
+      if (run > p_session->depth - tail)
+         run = p_session->depth - tail;
+      rabbit_prng_raw(&p_session->inst, p_session->ks + tail, run);
+      count += run;
+      generated += run;
+   }
+   atomic_store_explicit(&p_session->count, count, memory_order_relaxed);
+
+   rabbit_precomp_unlock(p_session);
+   return generated;
+}
+
+
+/* Number of keystream bytes ready */
+size_t rabbit_precomp_available(const rabbit_precomp *p_session)
+{
+   return atomic_load_explicit(&((rabbit_precomp *)p_session)->count,
+          memory_order_relaxed);
+}
+
+
+/* Encrypt or decrypt data of any size */
+int rabbit_precomp_cipher(rabbit_precomp *p_session, const cc_byte *p_src,
+          cc_byte *p_dest, size_t data_size)
+{
+   /* Temporary variables */
+   size_t count, n, i;
+   const cc_byte *p_ks;
+
+   rabbit_precomp_lock(p_session);
+   count = atomic_load_explicit(&p_session->count, memory_order_relaxed);
+
+   while (data_size)
+   {
+      if (count)
+      {
+         /* XOR with buffered keystream up to the end of the ring */
+         n = data_size < count ? data_size : count;
+         if (n > p_session->depth - p_session->head)
+            n = p_session->depth - p_session->head;
+         p_ks = p_session->ks + p_session->head;
+         for (i=0; i<n; i++)
+            p_dest[i] = p_src[i] ^ p_ks[i];
+         p_session->head = (p_session->head + n) % p_session->depth;
+         count -= n;
+      }
+      else if (data_size >= 16)
+      {
+         /* Buffer empty: run whole blocks straight through the cipher */
+         n = data_size & ~(size_t)15;
+         rabbit_cipher_raw(&p_session->inst, p_src, p_dest, n);
+      }
+      else
+      {
+         /* Short tail: buffer one block; head is block aligned here */
+         rabbit_prng_raw(&p_session->inst, p_session->ks + p_session->head, 16);
+         count = 16;
+         continue;
+      }
+
+      p_src += n;
+      p_dest += n;
+      data_size -= n;
+   }
+
+   atomic_store_explicit(&p_session->count, count, memory_order_relaxed);
+   rabbit_precomp_unlock(p_session);
+
+   /* Return success */
+   return 0;
+}
+
+
+/* Serialize a session */
+int rabbit_precomp_export(rabbit_precomp *p_session, cc_byte *p_dest,
+          size_t dest_size, size_t *p_size)
+{
+   /* Temporary variables */
+   rabbit_snapshot snapshot;
+   cc_byte *p_residue = NULL;
+   size_t count, n;
+   int res;
+
+   rabbit_precomp_lock(p_session);
+   count = atomic_load_explicit(&p_session->count, memory_order_relaxed);
+
+   /* The residue may wrap around the end of the ring */
+   if (count)
+   {
+      p_residue = (cc_byte *)malloc(count);
+      if (!p_residue)
+      {
+         rabbit_precomp_unlock(p_session);
+         return -1;
+      }
+      n = p_session->depth - p_session->head;
+      if (n > count)
+         n = count;
+      memcpy(p_residue, p_session->ks + p_session->head, n);
+      memcpy(p_residue + n, p_session->ks, count - n);
+   }
+
+   memset(&snapshot, 0, sizeof(snapshot));
+   snapshot.instance = p_session->inst;
+   snapshot.residue_size = count;
+   res = rabbit_snapshot_export(&snapshot, p_residue, p_dest, dest_size);
+   rabbit_precomp_unlock(p_session);
+
+   if (p_residue)
+   {
+      rabbit_wipe(p_residue, count);
+      free(p_residue);
+   }
+   rabbit_wipe(&snapshot, sizeof(snapshot));
+   if (!res)
+      *p_size = RABBIT_SNAPSHOT_SIZE(count);
+   return res;
+}
+
+
+/* Create a session resuming a snapshot */
+int rabbit_precomp_import(rabbit_precomp **pp_session, const cc_byte *p_src,
+          size_t src_size, size_t depth)
+{
+   /* Temporary variables */
+   rabbit_precomp *p_session;
+   rabbit_snapshot snapshot;
+   size_t residue = 0, needed;
+
+   /* A valid snapshot holds exactly its residue beyond the fixed fields */
+   if (src_size > RABBIT_SNAPSHOT_SIZE(0))
+      residue = src_size - RABBIT_SNAPSHOT_SIZE(0);
+   needed = (residue + 15) & ~(size_t)15;
+   if (depth < needed)
+      depth = needed;
+
+   memset(&snapshot, 0, sizeof(snapshot));
+   if (rabbit_precomp_create(&p_session, &snapshot.instance, depth))
+      return -1;
+
+   /* Place the residue so that it ends on a block boundary, where the */
+   /* next refill continues */
+   p_session->head = needed - residue;
+   if (rabbit_snapshot_import(&snapshot, p_session->ks + p_session->head,
+          residue, p_src, src_size))
+   {
+      rabbit_precomp_destroy(p_session);
+      return -1;
+   }
+   p_session->inst = snapshot.instance;
+   atomic_store_explicit(&p_session->count, snapshot.residue_size,
+          memory_order_relaxed);
+   rabbit_wipe(&snapshot, sizeof(snapshot));
+   *pp_session = p_session;
+
+   /* Return success */
+   return 0;
+}
+
+
+/* Background thread: refill attached sessions until stopped */
+static void *rabbit_precomp_worker_main(void *p_arg)
+{
+   /* Temporary variables */
+   rabbit_precomp_worker *p_worker = (rabbit_precomp_worker *)p_arg;
+   struct timespec idle = { 0, 50000 };
+   size_t i, generated;
+
+   while (!atomic_load_explicit(&p_worker->stop, memory_order_relaxed))
+   {
+      generated = 0;
+      pthread_mutex_lock(&p_worker->lock);
+      for (i=0; i<p_worker->session_count; i++)
+         generated += rabbit_precomp_refill(p_worker->pp_sessions[i]);
+      pthread_mutex_unlock(&p_worker->lock);
+
+      /* Everything is topped up: poll again shortly */
+      if (!generated)
+         nanosleep(&idle, NULL);
+   }
+
+   return NULL;
+}
+
+
+/* Start a background worker */
+int rabbit_precomp_worker_create(rabbit_precomp_worker **pp_worker)
+{
+   /* Temporary variables */
+   rabbit_precomp_worker *p_worker;
+
+   p_worker = (rabbit_precomp_worker *)calloc(1,
+          sizeof(rabbit_precomp_worker));
+   if (!p_worker)
+      return -1;
+
+   pthread_mutex_init(&p_worker->lock, NULL);
+   atomic_init(&p_worker->stop, 0);
+   if (pthread_create(&p_worker->thread, NULL, rabbit_precomp_worker_main,
+          p_worker))
+   {
+      pthread_mutex_destroy(&p_worker->lock);
+      free(p_worker);
+      return -1;
+   }
+
+   *pp_worker = p_worker;
+
+   /* Return success */
+   return 0;
+}
+
+
+/* Stop and free a worker */
+void rabbit_precomp_worker_destroy(rabbit_precomp_worker *p_worker)
+{
+   if (!p_worker)
+      return;
+
+   atomic_store(&p_worker->stop, 1);
+   pthread_join(p_worker->thread, NULL);
+   pthread_mutex_destroy(&p_worker->lock);
+   free(p_worker->pp_sessions);
+   free(p_worker);
+}
+
+
+/* Attach a session to a worker */
+int rabbit_precomp_worker_add(rabbit_precomp_worker *p_worker,
+          rabbit_precomp *p_session)
+{
+   /* Temporary variables */
+   rabbit_precomp **pp_sessions;
+   size_t capacity;
+   int res = 0;
+
+   pthread_mutex_lock(&p_worker->lock);
+   if (p_worker->session_count == p_worker->session_capacity)
+   {
+      capacity = p_worker->session_capacity*2 + 8;
+      pp_sessions = (rabbit_precomp **)realloc(p_worker->pp_sessions,
+             capacity*sizeof(rabbit_precomp *));
+      if (pp_sessions)
+      {
+         p_worker->pp_sessions = pp_sessions;
+         p_worker->session_capacity = capacity;
+      }
+      else
+         res = -1;
+   }
+   if (!res)
+      p_worker->pp_sessions[p_worker->session_count++] = p_session;
+   pthread_mutex_unlock(&p_worker->lock);
+
+   return res;
+}
+
+
+/* Detach a session from a worker */
+int rabbit_precomp_worker_remove(rabbit_precomp_worker *p_worker,
+          rabbit_precomp *p_session)
+{
+   /* Temporary variables */
+   size_t i;
+   int res = -1;
+
+   pthread_mutex_lock(&p_worker->lock);
+   for (i=0; i<p_worker->session_count; i++)
+      if (p_worker->pp_sessions[i] == p_session)
+      {
+         p_worker->pp_sessions[i] =
+                p_worker->pp_sessions[--p_worker->session_count];
+         res = 0;
+         break;
+      }
+   pthread_mutex_unlock(&p_worker->lock);
+
+   return res;
+}
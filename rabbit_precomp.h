@@ -0,0 +1,85 @@
+/******************************************************************************/
+/* File name: rabbit_precomp.h                                                */
+/*----------------------------------------------------------------------------*/
+/* Header file for per-session keystream precomputation.                      */
+/*                                                                            */
+/* A precompute session owns a working instance and a small buffer holding    */
+/* the next keystream bytes of its stream. The buffer is refilled off the     */
+/* critical path, either by the owning thread when it is idle or by a         */
+/* background worker, so encrypting a short packet becomes a plain XOR.       */
+/* When the buffer runs dry the keystream is generated inline, so results     */
+/* never depend on refill timing.                                             */
+/*                                                                            */
+/* Sessions process data of any length; the stream is byte-granular.          */
+/*                                                                            */
+/* This source code is for little-endian processors (e.g. x86).               */
+/******************************************************************************/
+
+#ifndef _RABBIT_PRECOMP_H
+#define _RABBIT_PRECOMP_H
+
+#include "rabbit.h"
+
+/* Largest supported lookahead in bytes */
+#define RABBIT_PRECOMP_MAX_DEPTH 65536
+
+/* Opaque session and background worker */
+typedef struct rabbit_precomp rabbit_precomp;
+typedef struct rabbit_precomp_worker rabbit_precomp_worker;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* All function calls return zero on success */
+
+/* Create a session continuing the stream of *p_instance, buffering up to */
+/* depth bytes of keystream (a non-zero multiple of 16). The buffer starts */
+/* empty. */
+int rabbit_precomp_create(rabbit_precomp **pp_session,
+          const rabbit_instance *p_instance, size_t depth);
+
+/* Clear and free a session. It must not be attached to a worker. */
+void rabbit_precomp_destroy(rabbit_precomp *p_session);
+
+/* Top up the keystream buffer. Returns the number of bytes generated, */
+/* which is zero if the buffer was full or the session was busy. */
+size_t rabbit_precomp_refill(rabbit_precomp *p_session);
+
+/* Number of keystream bytes ready in the buffer */
+size_t rabbit_precomp_available(const rabbit_precomp *p_session);
+
+/* Encrypt or decrypt data of any size on the session's stream */
+int rabbit_precomp_cipher(rabbit_precomp *p_session, const cc_byte *p_src,
+          cc_byte *p_dest, size_t data_size);
+
+/* Serialize the session with its buffered keystream (see */
+/* rabbit_snapshot.h) and store the size written in *p_size. */
+/* RABBIT_SNAPSHOT_SIZE(depth) bytes always suffice. */
+int rabbit_precomp_export(rabbit_precomp *p_session, cc_byte *p_dest,
+          size_t dest_size, size_t *p_size);
+
+/* Create a session resuming a snapshot. The buffer holds at least depth */
+/* bytes, more if needed for the buffered keystream of the snapshot. */
+int rabbit_precomp_import(rabbit_precomp **pp_session, const cc_byte *p_src,
+          size_t src_size, size_t depth);
+
+/* Start a background thread that keeps attached sessions topped up */
+int rabbit_precomp_worker_create(rabbit_precomp_worker **pp_worker);
+
+/* Stop the background thread and free the worker */
+void rabbit_precomp_worker_destroy(rabbit_precomp_worker *p_worker);
+
+/* Attach a session to a worker */
+int rabbit_precomp_worker_add(rabbit_precomp_worker *p_worker,
+          rabbit_precomp *p_session);
+
+/* Detach a session; once this returns the worker no longer touches it */
+int rabbit_precomp_worker_remove(rabbit_precomp_worker *p_worker,
+          rabbit_precomp *p_session);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,100 @@
+/******************************************************************************/
+/* File name: rabbit_probes.h                                                 */
+/*----------------------------------------------------------------------------*/
+/* Static USDT probes at the entry and return of the Rabbit entry points.     */
+/*                                                                            */
+/* Probes are recorded as SystemTap SDT notes (.note.stapsdt), so bpftrace,   */
+/* perf and SystemTap can attach to them in a running program without a      */
+/* rebuild. A probe that nobody attached to is a single nop; there is no      */
+/* semaphore and no runtime dependency. The notes are written by the          */
+/* compiler from the macros below on x86-64 and AArch64 with GCC or Clang;    */
+/* elsewhere <sys/sdt.h> is used when available, otherwise the probes         */
+/* compile to nothing. Build with -DRABBIT_NO_PROBES to leave them out.       */
+/*                                                                            */
+/* Provider "rabbit", probes and arguments:                                   */
+/*                                                                            */
+/*    key_setup_entry, iv_setup_entry, cipher_entry, prng_entry,              */
+/*    packet_entry                     (size, backend)                        */
+/*    key_setup_return, iv_setup_return, cipher_return, prng_return,          */
+/*    packet_return                    (size, backend, result)                */
+/*                                                                            */
+/* size is the key, IV or data size in bytes, backend one of the              */
+/* RABBIT_BACKEND_ values and result the return value (0 or -1; always 0      */
+/* for packet_return). See rabbit_latency.bt for an example.                  */
+/*                                                                            */
+/* This source code is for little-endian processors (e.g. x86).               */
+/******************************************************************************/
+
+#ifndef _RABBIT_PROBES_H
+#define _RABBIT_PROBES_H
+
+/* Code path that served a call */
+#define RABBIT_BACKEND_SCALAR 0     /* Reference implementation */
+#define RABBIT_BACKEND_NT     1     /* Non-temporal stores */
+#define RABBIT_BACKEND_ECRYPT 2     /* ECRYPT packet interface */
+
+#if !defined(RABBIT_NO_PROBES) && defined(__GNUC__) && defined(__ELF__) && \
+    (defined(__x86_64__) || defined(__aarch64__))
+
+/* One note per probe site, in the layout of <sys/sdt.h> version 3: the  */
+/* address of the nop, the base address for prelink adjustment, a zero   */
+/* semaphore, provider and probe names, and the argument descriptions,   */
+/* e.g. "8@%rbx -4@$1". Operands use the "nor" constraint so they stay   */
+/* wherever the compiler already has them. */
+#define RABBIT_PROBE_NOTE(name, args) \
+   "990: nop\n" \
+   ".pushsection .note.stapsdt,\"?\",\"note\"\n" \
+   ".balign 4\n" \
+   ".4byte 992f-991f, 994f-993f, 3\n" \
+   "991: .asciz \"stapsdt\"\n" \
+   "992: .balign 4\n" \
+   "993: .8byte 990b\n" \
+   ".8byte _.stapsdt.base\n" \
+   ".8byte 0\n" \
+   ".asciz \"rabbit\"\n" \
+   ".asciz \"" #name "\"\n" \
+   ".asciz \"" args "\"\n" \
+   "994: .balign 4\n" \
+   ".popsection\n" \
+   ".ifndef _.stapsdt.base\n" \
+   ".pushsection .stapsdt.base,\"aG\",\"progbits\",.stapsdt.base,comdat\n" \
+   ".weak _.stapsdt.base\n" \
+   ".hidden _.stapsdt.base\n" \
+   "_.stapsdt.base: .space 1\n" \
+   ".size _.stapsdt.base, 1\n" \
+   ".popsection\n" \
+   ".endif\n"
+
+#define RABBIT_PROBE_ENTRY(name, size, backend) \
+   __asm__ __volatile__ (RABBIT_PROBE_NOTE(name##_entry, "8@%0 -4@%1") \
+          : : "nor" ((unsigned long long)(size)), "nor" ((int)(backend)))
+
+#define RABBIT_PROBE_RETURN(name, size, backend, res) \
+   __asm__ __volatile__ (RABBIT_PROBE_NOTE(name##_return, \
+          "8@%0 -4@%1 -4@%2") \
+          : : "nor" ((unsigned long long)(size)), "nor" ((int)(backend)), \
+          "nor" ((int)(res)))
+
+#elif !defined(RABBIT_NO_PROBES) && defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+
+#include <sys/sdt.h>
+
+#define RABBIT_PROBE_ENTRY(name, size, backend) \
+   DTRACE_PROBE2(rabbit, name##_entry, (unsigned long long)(size), \
+          (int)(backend))
+
+#define RABBIT_PROBE_RETURN(name, size, backend, res) \
+   DTRACE_PROBE3(rabbit, name##_return, (unsigned long long)(size), \
+          (int)(backend), (int)(res))
+
+#endif
+#endif
+
+/* No probes on this target */
+#ifndef RABBIT_PROBE_ENTRY
+#define RABBIT_PROBE_ENTRY(name, size, backend) ((void)0)
+#define RABBIT_PROBE_RETURN(name, size, backend, res) ((void)0)
+#endif
+
+#endif
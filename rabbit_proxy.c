@@ -0,0 +1,770 @@
+/******************************************************************************/
+/* File name: rabbit_proxy.c                                                  */
+/*----------------------------------------------------------------------------*/
+/* Encrypting stream proxy for Linux.                                         */
+/*                                                                            */
+/* Usage: rabbit_proxy <listen> <target> key=<32 hex digits> [options]        */
+/* Addresses are host:port or unix:/path. Run without arguments for the       */
+/* option list.                                                               */
+/*                                                                            */
+/* Every accepted connection is relayed to the target. With mode=encrypt the  */
+/* client-to-target direction is encrypted and prefixed with a random 8-byte  */
+/* IV, and the target-to-client direction is decrypted; mode=decrypt is the   */
+/* mirror image, so two proxies form a tunnel.                                */
+/*                                                                            */
+/* Data is read into page-aligned buffers and transformed in place. By        */
+/* default it is then written to the output socket (relay=copy). With         */
+/* relay=splice it crosses the user/kernel boundary only once per direction:  */
+/* the pages are handed to a large pipe with vmsplice(SPLICE_F_GIFT) and      */
+/* spliced to the output socket. The kernel keeps referencing spliced pages   */
+/* until the receiver has read them, even after the pipe has drained and the  */
+/* bytes are acknowledged, so those pages are replaced with fresh ones before */
+/* the buffer is reused. Reusing them as soon as the pipe has drained         */
+/* corrupts loopback streams. Replacing a page costs more than the copy it    */
+/* saves, so on loopback splice is the slower relay (see rabbit_bench proxy). */
+/* A single thread serves all connections, taking a batch of ready events     */
+/* per epoll wakeup and precomputing keystream before it goes back to sleep.  */
+/*                                                                            */
+/* This source code is for little-endian processors (e.g. x86).               */
+/******************************************************************************/
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/random.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include "rabbit.h"
+#include "rabbit_precomp.h"
+
+/* -------------------------------------------------------------------------- */
+
+/* Proxy settings */
+typedef struct
+{
+   rabbit_instance master;
+   int encrypt;               /* 1: encrypt toward the target */
+   int copy;                  /* 1: plain write() instead of vmsplice() */
+   size_t buf_size;           /* Read buffer per direction, whole pages */
+   size_t pipe_size;          /* Requested pipe capacity */
+   size_t depth;              /* Keystream lookahead per direction */
+   int max_events;            /* Events taken per epoll wakeup */
+   size_t page_size;
+} proxy_config;
+
+/* One direction of a connection */
+typedef struct
+{
+   int in_fd, out_fd;
+   int pipe_fd[2];
+   size_t pipe_size;
+   size_t pipe_bytes;         /* Bytes in the pipe not yet sent */
+   cc_byte *p_buf;            /* Page-aligned read buffer */
+   size_t pending_off;        /* Transformed bytes not yet in the pipe */
+   size_t pending_len;
+   cc_byte iv[8];
+   size_t iv_len;             /* IV bytes emitted or received so far */
+   int add_iv;                /* 1: emit the IV, 0: expect it */
+   rabbit_precomp *p_ks;
+   int eof, shut;
+} proxy_flow;
+
+typedef struct proxy_conn proxy_conn;
+
+/* Epoll registration of one socket */
+typedef struct
+{
+   proxy_conn *p_conn;
+   int fd;
+   unsigned int events;
+} proxy_endpoint;
+
+/* A relayed connection */
+struct proxy_conn
+{
+   proxy_endpoint client, target;
+   proxy_flow up;             /* Client to target */
+   proxy_flow down;           /* Target to client */
+   int connecting;
+   int closed;
+   int touched;
+};
+
+/* -------------------------------------------------------------------------- */
+
+/* Read "name=value" style options, returning def if absent */
+static const char *proxy_opt(int argc, char *argv[], const char *name,
+          const char *def)
+{
+   /* Temporary variables */
+   size_t len = strlen(name);
+   int i;
+
+   for (i=0; i<argc; i++)
+      if (!strncmp(argv[i], name, len) && argv[i][len] == '=')
+         return argv[i]+len+1;
+   return def;
+}
+
+/* -------------------------------------------------------------------------- */
+
+/* Parse host:port or unix:/path. Returns the address length or 0. */
+static socklen_t proxy_parse_addr(const char *p_text,
+          struct sockaddr_storage *p_addr)
+{
+   /* Temporary variables */
+   struct sockaddr_un *p_un = (struct sockaddr_un *)p_addr;
+   struct addrinfo hints, *p_res;
+   char host[256];
+   const char *p_colon;
+   socklen_t len;
+
+   memset(p_addr, 0, sizeof(*p_addr));
+   if (!strncmp(p_text, "unix:", 5))
+   {
+      if (strlen(p_text+5) >= sizeof(p_un->sun_path))
+         return 0;
+      p_un->sun_family = AF_UNIX;
+      strcpy(p_un->sun_path, p_text+5);
+      return (socklen_t)sizeof(struct sockaddr_un);
+   }
+
+   p_colon = strrchr(p_text, ':');
+   if (!p_colon || (size_t)(p_colon - p_text) >= sizeof(host))
+      return 0;
+   memcpy(host, p_text, (size_t)(p_colon - p_text));
+   host[p_colon - p_text] = 0;
+
+   memset(&hints, 0, sizeof(hints));
+   hints.ai_family = AF_UNSPEC;
+   hints.ai_socktype = SOCK_STREAM;
+   if (getaddrinfo(host[0] ? host : NULL, p_colon+1, &hints, &p_res))
+      return 0;
+   len = p_res->ai_addrlen;
+   memcpy(p_addr, p_res->ai_addr, len);
+   freeaddrinfo(p_res);
+   return len;
+}
+
+/* -------------------------------------------------------------------------- */
+
+/* Parse a 16-byte key given as 32 hex digits */
+static int proxy_parse_key(const char *p_text, cc_byte *p_key)
+{
+   /* Temporary variables */
+   unsigned int v;
+   int i;
+
+   if (!p_text || strlen(p_text) != 32)
+      return -1;
+   for (i=0; i<16; i++)
+   {
+      if (sscanf(p_text+2*i, "%2x", &v) != 1)
+         return -1;
+      p_key[i] = (cc_byte)v;
+   }
+   return 0;
+}
+
+/* -------------------------------------------------------------------------- */
+
+/* Set up one direction; p_iv is the IV to emit, or NULL to expect one */
+static int proxy_flow_init(proxy_flow *p_flow, const proxy_config *p_config,
+          int in_fd, int out_fd, const cc_byte *p_iv)
+{
+   /* Temporary variables */
+   rabbit_instance inst;
+   void *p_mem;
+   int size;
+
+   memset(p_flow, 0, sizeof(*p_flow));
+   p_flow->in_fd = in_fd;
+   p_flow->out_fd = out_fd;
+   p_flow->pipe_fd[0] = p_flow->pipe_fd[1] = -1;
+
+   if (pipe2(p_flow->pipe_fd, O_NONBLOCK | O_CLOEXEC))
+      return -1;
+
+   /* Ask for a large pipe; settle for what the system allows */
+   fcntl(p_flow->pipe_fd[1], F_SETPIPE_SZ, (int)p_config->pipe_size);
+   size = fcntl(p_flow->pipe_fd[1], F_GETPIPE_SZ);
+   if (size <= 0)
+      return -1;
+   p_flow->pipe_size = (size_t)size;
+
+   p_mem = mmap(NULL, p_config->buf_size, PROT_READ | PROT_WRITE,
+          MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
+   if (p_mem == MAP_FAILED)
+      return -1;
+   p_flow->p_buf = (cc_byte *)p_mem;
+
+   /* The keystream starts now if we pick the IV, otherwise once it arrives */
+   if (p_iv)
+   {
+      memcpy(p_flow->iv, p_iv, 8);
+      p_flow->add_iv = 1;
+      rabbit_iv_setup(&p_config->master, &inst, p_iv, 8);
+      if (rabbit_precomp_create(&p_flow->p_ks, &inst, p_config->depth))
+         return -1;
+      rabbit_wipe(&inst, sizeof(inst));
+   }
+
+   /* Return success */
+   return 0;
+}
+
+/* -------------------------------------------------------------------------- */
+
+/* Release one direction */
+static void proxy_flow_free(proxy_flow *p_flow, const proxy_config *p_config)
+{
+   if (p_flow->pipe_fd[0] >= 0)
+      close(p_flow->pipe_fd[0]);
+   if (p_flow->pipe_fd[1] >= 0)
+      close(p_flow->pipe_fd[1]);
+   if (p_flow->p_buf)
+      munmap(p_flow->p_buf, p_config->buf_size);
+   rabbit_precomp_destroy(p_flow->p_ks);
+   rabbit_wipe(p_flow->iv, sizeof(p_flow->iv));
+}
+
+/* -------------------------------------------------------------------------- */
+
+/* Give the pending bytes to the pipe. Returns 1 on progress, 0 if the pipe */
+/* is full and -1 on error. */
+static int proxy_flow_gift(proxy_flow *p_flow, const proxy_config *p_config)
+{
+   /* Temporary variables */
+   cc_byte keep[4096];
+   struct iovec iov;
+   size_t end, first, last, kept = 0, page = p_config->page_size;
+   ssize_t n;
+
+   iov.iov_base = p_flow->p_buf + p_flow->pending_off;
+   iov.iov_len = p_flow->pending_len;
+   n = vmsplice(p_flow->pipe_fd[1], &iov, 1,
+          SPLICE_F_GIFT | SPLICE_F_NONBLOCK);
+   if (n < 0)
+      return errno == EAGAIN ? 0 : -1;
+
+   /* The pipe now references every page it took bytes from. Replace */
+   /* those pages, carrying over the untaken rest of a split page. */
+   end = p_flow->pending_off + (size_t)n;
+   first = p_flow->pending_off / page * page;
+   last = (end + page - 1) / page * page;
+   if ((size_t)n < p_flow->pending_len && end%page)
+   {
+      kept = last - end;
+      if (kept > p_flow->pending_len - (size_t)n)
+         kept = p_flow->pending_len - (size_t)n;
+      memcpy(keep, p_flow->p_buf + end, kept);
+   }
+   if (last > first && mmap(p_flow->p_buf + first, last - first,
+          PROT_READ | PROT_WRITE,
+          MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED | MAP_POPULATE,
+          -1, 0) == MAP_FAILED)
+      return -1;
+   if (kept)
+      memcpy(p_flow->p_buf + end, keep, kept);
+
+   p_flow->pipe_bytes += (size_t)n;
+   p_flow->pending_off = end;
+   p_flow->pending_len -= (size_t)n;
+   if (!p_flow->pending_len)
+      p_flow->pending_off = 0;
+   return n > 0;
+}
+
+/* -------------------------------------------------------------------------- */
+
+/* Write the pending bytes with a plain copy into the socket (relay=copy). */
+/* Returns 1 on progress, 0 if the socket is full and -1 on error. */
+static int proxy_flow_write(proxy_flow *p_flow)
+{
+   /* Temporary variables */
+   ssize_t n;
+
+   n = write(p_flow->out_fd, p_flow->p_buf + p_flow->pending_off,
+          p_flow->pending_len);
+   if (n < 0)
+      return errno == EAGAIN || errno == EINTR ? 0 : -1;
+
+   p_flow->pending_off += (size_t)n;
+   p_flow->pending_len -= (size_t)n;
+   if (!p_flow->pending_len)
+      p_flow->pending_off = 0;
+   return n > 0;
+}
+
+/* -------------------------------------------------------------------------- */
+
+/* Read once and transform in place. Returns 1 on progress, 0 if nothing */
+/* could be read and -1 on error. */
+static int proxy_flow_read(proxy_flow *p_flow, const proxy_config *p_config)
+{
+   /* Temporary variables */
+   rabbit_instance inst;
+   size_t room, off = 0, take;
+   cc_byte *p_data;
+   ssize_t n;
+
+   /* Never read more than the pipe can take right away */
+   room = p_flow->pipe_size - p_flow->pipe_bytes;
+   if (room > p_config->buf_size)
+      room = p_config->buf_size;
+
+   /* The first bytes toward the peer are the IV */
+   if (p_flow->add_iv && p_flow->iv_len < 8)
+   {
+      memcpy(p_flow->p_buf, p_flow->iv, 8);
+      off = 8;
+   }
+   if (room <= off)
+      return 0;
+
+   n = read(p_flow->in_fd, p_flow->p_buf + off, room - off);
+   if (n < 0)
+      return errno == EAGAIN || errno == EINTR ? 0 : -1;
+   if (n == 0)
+   {
+      p_flow->eof = 1;
+      return 1;
+   }
+   p_data = p_flow->p_buf + off;
+
+   if (p_flow->add_iv)
+      p_flow->iv_len = 8;
+   else if (p_flow->iv_len < 8)
+   {
+      /* Collect the IV from the start of the stream */
+      take = 8 - p_flow->iv_len;
+      if (take > (size_t)n)
+         take = (size_t)n;
+      memcpy(p_flow->iv + p_flow->iv_len, p_data, take);
+      p_flow->iv_len += take;
+      p_data += take;
+      n -= (ssize_t)take;
+      off += take;
+      if (p_flow->iv_len == 8)
+      {
+         rabbit_iv_setup(&p_config->master, &inst, p_flow->iv, 8);
+         if (rabbit_precomp_create(&p_flow->p_ks, &inst, p_config->depth))
+            return -1;
+         rabbit_wipe(&inst, sizeof(inst));
+      }
+      if (!n)
+         return 1;
+   }
+
+   rabbit_precomp_cipher(p_flow->p_ks, p_data, p_data, (size_t)n);
+
+   /* An emitted IV leads the data; a received one is dropped */
+   p_flow->pending_off = p_flow->add_iv ? 0 : off;
+   p_flow->pending_len = (size_t)n + (p_flow->add_iv ? off : 0);
+   return 1;
+}
+
+/* -------------------------------------------------------------------------- */
+
+/* Move as much data through one direction as the sockets allow. Returns */
+/* -1 on error. */
+static int proxy_flow_pump(proxy_flow *p_flow, const proxy_config *p_config)
+{
+   /* Temporary variables */
+   ssize_t n;
+   int progress = 1, res, rounds = 0;
+
+   /* A bounded number of rounds keeps busy connections from starving */
+   /* the rest of the batch */
+   while (progress && rounds++ < 16)
+   {
+      progress = 0;
+
+      /* Send what the pipe holds */
+      while (p_flow->pipe_bytes)
+      {
+         n = splice(p_flow->pipe_fd[0], NULL, p_flow->out_fd, NULL,
+                p_flow->pipe_bytes, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+         if (n < 0)
+         {
+            if (errno == EAGAIN || errno == EINTR)
+               break;
+            return -1;
+         }
+         p_flow->pipe_bytes -= (size_t)n;
+         progress = 1;
+      }
+
+      /* Hand transformed data to the pipe, or read more */
+      if (p_flow->pending_len)
+         res = p_config->copy ? proxy_flow_write(p_flow) :
+                proxy_flow_gift(p_flow, p_config);
+      else if (!p_flow->eof)
+         res = proxy_flow_read(p_flow, p_config);
+      else
+         res = 0;
+      if (res < 0)
+         return -1;
+      progress |= res;
+   }
+
+   /* Pass the end of the stream on once everything is out */
+   if (p_flow->eof && !p_flow->pending_len && !p_flow->pipe_bytes &&
+       !p_flow->shut)
+   {
+      shutdown(p_flow->out_fd, SHUT_WR);
+      p_flow->shut = 1;
+   }
+
+   /* Return success */
+   return 0;
+}
+
+/* -------------------------------------------------------------------------- */
+
+/* Whether a direction waits for input or for room in its output */
+static int proxy_flow_wants_in(const proxy_flow *p_flow)
+{
+   return !p_flow->eof && !p_flow->pending_len &&
+          p_flow->pipe_bytes < p_flow->pipe_size;
+}
+
+static int proxy_flow_wants_out(const proxy_flow *p_flow)
+{
+   return p_flow->pipe_bytes || p_flow->pending_len;
+}
+
+/* -------------------------------------------------------------------------- */
+
+/* Update the epoll interest of an endpoint */
+static int proxy_watch(int epoll_fd, proxy_endpoint *p_ep, unsigned int events)
+{
+   /* Temporary variables */
+   struct epoll_event ev;
+
+   if (events == p_ep->events)
+      return 0;
+   ev.events = events;
+   ev.data.ptr = p_ep;
+   if (epoll_ctl(epoll_fd, EPOLL_CTL_MOD, p_ep->fd, &ev))
+      return -1;
+   p_ep->events = events;
+   return 0;
+}
+
+/* -------------------------------------------------------------------------- */
+
+/* Drive a connection after an event and re-arm its sockets. Returns -1 */
+/* once the connection should be closed. */
+static int proxy_conn_run(int epoll_fd, proxy_conn *p_conn,
+          const proxy_config *p_config)
+{
+   /* Temporary variables */
+   unsigned int client_ev = 0, target_ev = 0;
+
+   if (proxy_flow_pump(&p_conn->up, p_config) ||
+       proxy_flow_pump(&p_conn->down, p_config))
+      return -1;
+
+   /* Both directions finished */
+   if (p_conn->up.shut && p_conn->down.shut)
+      return -1;
+
+   if (proxy_flow_wants_in(&p_conn->up))
+      client_ev |= EPOLLIN;
+   if (proxy_flow_wants_out(&p_conn->down))
+      client_ev |= EPOLLOUT;
+   if (proxy_flow_wants_in(&p_conn->down))
+      target_ev |= EPOLLIN;
+   if (proxy_flow_wants_out(&p_conn->up))
+      target_ev |= EPOLLOUT;
+
+   if (proxy_watch(epoll_fd, &p_conn->client, client_ev) ||
+       proxy_watch(epoll_fd, &p_conn->target, target_ev))
+      return -1;
+
+   /* Return success */
+   return 0;
+}
+
+/* -------------------------------------------------------------------------- */
+
+/* Close and free a connection */
+static void proxy_conn_free(proxy_conn *p_conn, const proxy_config *p_config)
+{
+   if (p_conn->client.fd >= 0)
+      close(p_conn->client.fd);
+   if (p_conn->target.fd >= 0)
+      close(p_conn->target.fd);
+   proxy_flow_free(&p_conn->up, p_config);
+   proxy_flow_free(&p_conn->down, p_config);
+   free(p_conn);
+}
+
+/* -------------------------------------------------------------------------- */
+
+/* Start relaying an accepted client */
+static proxy_conn *proxy_conn_open(int epoll_fd, int client_fd,
+          const struct sockaddr_storage *p_target, socklen_t target_len,
+          const proxy_config *p_config)
+{
+   /* Temporary variables */
+   proxy_conn *p_conn;
+   struct epoll_event ev;
+   cc_byte iv[8];
+   int one = 1;
+
+   p_conn = (proxy_conn *)calloc(1, sizeof(proxy_conn));
+   if (!p_conn)
+   {
+      close(client_fd);
+      return NULL;
+   }
+   p_conn->client.p_conn = p_conn->target.p_conn = p_conn;
+   p_conn->client.fd = client_fd;
+   p_conn->target.fd = socket(p_target->ss_family,
+          SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+   p_conn->up.pipe_fd[0] = p_conn->up.pipe_fd[1] = -1;
+   p_conn->down.pipe_fd[0] = p_conn->down.pipe_fd[1] = -1;
+   if (p_conn->target.fd < 0)
+      goto fail;
+   if (p_target->ss_family != AF_UNIX)
+   {
+      setsockopt(client_fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+      setsockopt(p_conn->target.fd, IPPROTO_TCP, TCP_NODELAY, &one,
+             sizeof(one));
+   }
+
+   /* The encrypting side of each direction picks its IV */
+   if (getrandom(iv, 8, 0) != 8)
+      goto fail;
+   if (proxy_flow_init(&p_conn->up, p_config, client_fd, p_conn->target.fd,
+          p_config->encrypt ? iv : NULL) ||
+       proxy_flow_init(&p_conn->down, p_config, p_conn->target.fd, client_fd,
+          p_config->encrypt ? NULL : iv))
+      goto fail;
+   rabbit_wipe(iv, sizeof(iv));
+
+   if (connect(p_conn->target.fd, (const struct sockaddr *)p_target,
+          target_len))
+   {
+      if (errno != EINPROGRESS)
+         goto fail;
+      p_conn->connecting = 1;
+   }
+
+   /* Register both sockets; run once to set the real interest */
+   ev.events = 0;
+   ev.data.ptr = &p_conn->client;
+   if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, client_fd, &ev))
+      goto fail;
+   ev.events = p_conn->target.events = EPOLLOUT;
+   ev.data.ptr = &p_conn->target;
+   if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, p_conn->target.fd, &ev))
+      goto fail;
+   if (!p_conn->connecting && proxy_conn_run(epoll_fd, p_conn, p_config))
+      goto fail;
+
+   return p_conn;
+
+fail:
+   rabbit_wipe(iv, sizeof(iv));
+   proxy_conn_free(p_conn, p_config);
+   return NULL;
+}
+
+/* -------------------------------------------------------------------------- */
+
+/* Create the listening socket */
+static int proxy_listen(const struct sockaddr_storage *p_addr, socklen_t len)
+{
+   /* Temporary variables */
+   int fd, one = 1;
+
+   fd = socket(p_addr->ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC,
+          0);
+   if (fd < 0)
+      return -1;
+   if (p_addr->ss_family == AF_UNIX)
+      unlink(((const struct sockaddr_un *)p_addr)->sun_path);
+   else
+      setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+   if (bind(fd, (const struct sockaddr *)p_addr, len) || listen(fd, 1024))
+   {
+      close(fd);
+      return -1;
+   }
+   return fd;
+}
+
+/* -------------------------------------------------------------------------- */
+
+/* Print usage */
+static int proxy_usage(const char *p_name)
+{
+   fprintf(stderr,
+      "Usage: %s <listen> <target> key=<32 hex digits> [options]\n\n"
+      "Addresses are host:port or unix:/path.\n\n"
+      "Options:\n"
+      "  mode=encrypt|decrypt  direction toward the target (encrypt)\n"
+      "  relay=copy|splice     write() copies or vmsplice() pages (copy)\n"
+      "  buf=KiB               read buffer per direction (256)\n"
+      "  pipe=KiB              pipe capacity per direction (1024)\n"
+      "  depth=KiB             keystream lookahead per direction (16)\n"
+      "  events=N              events per epoll wakeup (64)\n", p_name);
+   return 1;
+}
+
+/* -------------------------------------------------------------------------- */
+
+/* Run the proxy */
+int main(int argc, char* argv[])
+{
+   /* Temporary variables */
+   proxy_config config;
+   struct sockaddr_storage listen_addr, target_addr;
+   socklen_t listen_len, target_len;
+   struct epoll_event ev, *p_events;
+   proxy_conn **pp_touched, *p_conn;
+   proxy_endpoint *p_ep;
+   cc_byte key[16];
+   const char *p_mode, *p_relay;
+   socklen_t len;
+   int listen_fd, epoll_fd, client_fd, count, touched, err, i;
+
+   if (argc < 4)
+      return proxy_usage(argv[0]);
+
+   /* Settings */
+   memset(&config, 0, sizeof(config));
+   config.page_size = (size_t)sysconf(_SC_PAGESIZE);
+   config.buf_size = (size_t)strtoul(proxy_opt(argc, argv, "buf", "256"),
+          NULL, 0) << 10;
+   config.buf_size = (config.buf_size + config.page_size - 1) /
+          config.page_size * config.page_size;
+   config.pipe_size = (size_t)strtoul(proxy_opt(argc, argv, "pipe", "1024"),
+          NULL, 0) << 10;
+   config.depth = ((size_t)strtoul(proxy_opt(argc, argv, "depth", "16"),
+          NULL, 0) << 10) & ~(size_t)15;
+   config.max_events = atoi(proxy_opt(argc, argv, "events", "64"));
+   p_mode = proxy_opt(argc, argv, "mode", "encrypt");
+   config.encrypt = !strcmp(p_mode, "encrypt");
+   p_relay = proxy_opt(argc, argv, "relay", "copy");
+   config.copy = strcmp(p_relay, "splice") != 0;
+   if ((!config.encrypt && strcmp(p_mode, "decrypt")) ||
+       (config.copy && strcmp(p_relay, "copy")) || !config.buf_size ||
+       config.depth < 16 || config.depth > RABBIT_PRECOMP_MAX_DEPTH ||
+       config.max_events <= 0 ||
+       proxy_parse_key(proxy_opt(argc, argv, "key", NULL), key))
+      return proxy_usage(argv[0]);
+   rabbit_key_setup(&config.master, key, 16);
+   rabbit_wipe(key, sizeof(key));
+
+   listen_len = proxy_parse_addr(argv[1], &listen_addr);
+   target_len = proxy_parse_addr(argv[2], &target_addr);
+   if (!listen_len || !target_len)
+      return proxy_usage(argv[0]);
+
+   /* Failed sends are reported by splice, not by a signal */
+   signal(SIGPIPE, SIG_IGN);
+
+   listen_fd = proxy_listen(&listen_addr, listen_len);
+   epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+   p_events = (struct epoll_event *)calloc((size_t)config.max_events,
+          sizeof(struct epoll_event));
+   pp_touched = (proxy_conn **)calloc((size_t)config.max_events,
+          sizeof(proxy_conn *));
+   if (listen_fd < 0 || epoll_fd < 0 || !p_events || !pp_touched)
+   {
+      perror("rabbit_proxy");
+      return 1;
+   }
+   ev.events = EPOLLIN;
+   ev.data.ptr = NULL;
+   epoll_ctl(epoll_fd, EPOLL_CTL_ADD, listen_fd, &ev);
+
+   for (;;)
+   {
+      count = epoll_wait(epoll_fd, p_events, config.max_events, -1);
+      if (count < 0)
+      {
+         if (errno == EINTR)
+            continue;
+         perror("rabbit_proxy: epoll_wait");
+         return 1;
+      }
+
+      /* Serve the whole batch; connections that fail are only marked so */
+      /* later events of the same batch never see freed memory */
+      touched = 0;
+      for (i=0; i<count; i++)
+      {
+         p_ep = (proxy_endpoint *)p_events[i].data.ptr;
+         if (!p_ep)
+         {
+            /* Accept everything that is waiting */
+            while ((client_fd = accept4(listen_fd, NULL, NULL,
+                   SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0)
+               proxy_conn_open(epoll_fd, client_fd, &target_addr, target_len,
+                      &config);
+            continue;
+         }
+
+         p_conn = p_ep->p_conn;
+         if (p_conn->closed)
+            continue;
+
+         /* Nothing moves until the connection to the target is up */
+         if (p_conn->connecting)
+         {
+            if (p_ep != &p_conn->target)
+               continue;
+            err = 0;
+            len = sizeof(err);
+            if (getsockopt(p_conn->target.fd, SOL_SOCKET, SO_ERROR, &err,
+                   &len) || err)
+               p_conn->closed = 1;
+            p_conn->connecting = 0;
+         }
+
+         if (!p_conn->closed && proxy_conn_run(epoll_fd, p_conn, &config))
+            p_conn->closed = 1;
+         if (!p_conn->touched)
+         {
+            p_conn->touched = 1;
+            pp_touched[touched++] = p_conn;
+         }
+      }
+
+      /* Close finished connections, then top up the keystream of the */
+      /* active ones while there is nothing else to do */
+      for (i=0; i<touched; i++)
+      {
+         p_conn = pp_touched[i];
+         p_conn->touched = 0;
+         if (p_conn->closed)
+         {
+            proxy_conn_free(p_conn, &config);
+            continue;
+         }
+         if (p_conn->up.p_ks)
+            rabbit_precomp_refill(p_conn->up.p_ks);
+         if (p_conn->down.p_ks)
+            rabbit_precomp_refill(p_conn->down.p_ks);
+      }
+   }
+}
+
+/* -------------------------------------------------------------------------- */
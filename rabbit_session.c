@@ -0,0 +1,546 @@
+/******************************************************************************/
+/* File name: rabbit_session.c                                                */
+/*----------------------------------------------------------------------------*/
+/* Source file for a session table mapping stream ids to live cipher state.   */
+/*                                                                            */
+/* Each shard is a linear-probing hash table of 128-byte slots. Removal uses  */
+/* backward-shift deletion, so probe sequences never contain tombstones and   */
+/* a hit is usually found in the home slot.                                   */
+/*                                                                            */
+/* This source code is for little-endian processors (e.g. x86).               */
+/******************************************************************************/
+
+#define _POSIX_C_SOURCE 200809L
+
+#include "rabbit_session.h"
+#include "rabbit_internal.h"
+#include "rabbit_snapshot.h"
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Slot alignment: two cache lines, which the adjacent-line prefetcher */
+/* fetches together */
+#define RABBIT_SESSION_SLOT_ALIGN (2*RABBIT_CACHE_LINE)
+
+/* Default number of shards */
+#define RABBIT_SESSION_SHARDS 64
+
+/* Fewest slots per shard; the load limit then always leaves one empty, */
+/* which ends every probe sequence */
+#define RABBIT_SESSION_MIN_SLOTS 8
+
+/* How many operations ahead cipher_many() prefetches */
+#define RABBIT_SESSION_PREFETCH 8
+
+#if defined(__GNUC__)
+#define RABBIT_SESSION_PREFETCH_SLOT(p) \
+   (__builtin_prefetch((p), 1, 3), \
+    __builtin_prefetch((const cc_byte *)(p) + RABBIT_CACHE_LINE, 1, 3))
+#else
+#define RABBIT_SESSION_PREFETCH_SLOT(p) ((void)(p))
+#endif
+
+/* Session slot. Probing reads only the id and the live flag, which sit in */
+/* the first cache line. The 68-byte instance runs on into the second line; */
+/* slots are aligned to a line pair, which the adjacent-line prefetcher */
+/* loads together, so a hit usually costs a single miss. */
+typedef struct
+{
+   _Alignas(RABBIT_SESSION_SLOT_ALIGN) rabbit_session_id id;
+   cc_uint32 last_used;
+   cc_uint32 live;
+   rabbit_instance inst;
+   unsigned long long blocks;
+   cc_byte iv[8];
+} rabbit_session_slot;
+
+/* Independently locked part of the table */
+typedef struct
+{
+   _Alignas(RABBIT_CACHE_LINE) pthread_mutex_t lock;
+   rabbit_session_slot *p_slots;
+   size_t mask;
+   size_t count;
+   size_t limit;
+} rabbit_session_shard;
+
+/* Structure to store the table */
+struct rabbit_session_table
+{
+   rabbit_instance master;
+   rabbit_session_shard *p_shards;
+   size_t shard_mask;
+   _Alignas(RABBIT_CACHE_LINE) atomic_uint epoch;
+};
+
+
+/* Mix the bits of a stream id (splitmix64 finalizer) */
+static unsigned long long rabbit_session_hash(rabbit_session_id id)
+{
+   id ^= id >> 30;
+   id *= 0xBF58476D1CE4E5B9ULL;
+   id ^= id >> 27;
+   id *= 0x94D049BB133111EBULL;
+   id ^= id >> 31;
+   return id;
+}
+
+
+/* Round up to a power of two */
+static size_t rabbit_session_pow2(size_t n)
+{
+   /* Temporary variables */
+   size_t p = 1;
+
+   while (p < n)
+      p <<= 1;
+   return p;
+}
+
+
+/* Shard holding a hash */
+static rabbit_session_shard *rabbit_session_shard_of(
+          rabbit_session_table *p_table, unsigned long long hash)
+{
+   return &p_table->p_shards[(size_t)(hash >> 32) & p_table->shard_mask];
+}
+
+
+/* Find the slot of an id, or the empty slot ending its probe sequence. */
+/* The shard must be locked. */
+static rabbit_session_slot *rabbit_session_probe(rabbit_session_shard *p_shard,
+          rabbit_session_id id, unsigned long long hash)
+{
+   /* Temporary variables */
+   size_t i = (size_t)hash & p_shard->mask;
+
+   while (p_shard->p_slots[i].live && p_shard->p_slots[i].id != id)
+      i = (i+1) & p_shard->mask;
+   return &p_shard->p_slots[i];
+}
+
+
+/* Remove an occupied slot and shift later members of its cluster back. */
+/* The shard must be locked. */
+static void rabbit_session_remove(rabbit_session_shard *p_shard,
+          rabbit_session_slot *p_slot)
+{
+   /* Temporary variables */
+   size_t i = (size_t)(p_slot - p_shard->p_slots), j = i, home;
+
+   for (;;)
+   {
+      j = (j+1) & p_shard->mask;
+      if (!p_shard->p_slots[j].live)
+         break;
+
+      /* Move j into the hole unless its home lies cyclically in (i, j] */
+      home = (size_t)rabbit_session_hash(p_shard->p_slots[j].id) &
+             p_shard->mask;
+      if (((j - home) & p_shard->mask) >= ((j - i) & p_shard->mask))
+      {
+         p_shard->p_slots[i] = p_shard->p_slots[j];
+         i = j;
+      }
+   }
+
+   rabbit_wipe(&p_shard->p_slots[i], sizeof(rabbit_session_slot));
+   p_shard->count--;
+}
+
+
+/* Take the slot of a new session and mark it live, leaving its cipher */
+/* state to the caller. Returns NULL if the shard is full or the id is */
+/* present. The shard must be locked. */
+static rabbit_session_slot *rabbit_session_claim(rabbit_session_table *p_table,
+          rabbit_session_shard *p_shard, rabbit_session_id id,
+          unsigned long long hash)
+{
+   /* Temporary variables */
+   rabbit_session_slot *p_slot;
+
+   if (p_shard->count >= p_shard->limit)
+      return NULL;
+   p_slot = rabbit_session_probe(p_shard, id, hash);
+   if (p_slot->live)
+      return NULL;
+
+   p_slot->id = id;
+   p_slot->last_used = atomic_load_explicit(&p_table->epoch,
+          memory_order_relaxed);
+   p_slot->live = 1;
+   p_shard->count++;
+   return p_slot;
+}
+
+
+/* Fill a new session at the start of its IV stream. The shard must be */
+/* locked. */
+static int rabbit_session_insert(rabbit_session_table *p_table,
+          rabbit_session_shard *p_shard, rabbit_session_id id,
+          unsigned long long hash, const cc_byte *p_iv, size_t iv_size)
+{
+   /* Temporary variables */
+   rabbit_session_slot *p_slot;
+
+   /* Return error on a bad IV, a full shard or a duplicate id */
+   if (iv_size != 8 ||
+       !(p_slot = rabbit_session_claim(p_table, p_shard, id, hash)))
+      return -1;
+
+   rabbit_iv_setup_raw(&p_table->master, &p_slot->inst, p_iv, iv_size);
+   memcpy(p_slot->iv, p_iv, 8);
+   p_slot->blocks = 0;
+
+   /* Return success */
+   return 0;
+}
+
+
+/* Run one operation on a locked shard */
+static int rabbit_session_apply(rabbit_session_table *p_table,
+          rabbit_session_shard *p_shard, rabbit_session_id id,
+          unsigned long long hash, const cc_byte *p_src, cc_byte *p_dest,
+          size_t data_size)
+{
+   /* Temporary variables */
+   rabbit_session_slot *p_slot = rabbit_session_probe(p_shard, id, hash);
+
+   /* Return error if the session is unknown or the size is invalid */
+   if (!p_slot->live ||
+       rabbit_cipher_raw(&p_slot->inst, p_src, p_dest, data_size))
+      return -1;
+
+   p_slot->blocks += data_size/16;
+   p_slot->last_used = atomic_load_explicit(&p_table->epoch,
+          memory_order_relaxed);
+
+   /* Return success */
+   return 0;
+}
+
+
+/* Create a table */
+int rabbit_session_create(rabbit_session_table **pp_table,
+          const rabbit_instance *p_master_instance, size_t capacity,
+          size_t shard_count)
+{
+   /* Temporary variables */
+   rabbit_session_table *p_table;
+   rabbit_session_shard *p_shard;
+   size_t i, slots;
+   void *p_mem;
+
+   if (shard_count == 0)
+      shard_count = RABBIT_SESSION_SHARDS;
+   shard_count = rabbit_session_pow2(shard_count);
+
+   /* Size the shards for a load factor of at most 3/4 */
+   slots = rabbit_session_pow2((capacity/shard_count + 1)*4/3 + 1);
+   if (slots < RABBIT_SESSION_MIN_SLOTS)
+      slots = RABBIT_SESSION_MIN_SLOTS;
+
+   if (posix_memalign(&p_mem, RABBIT_CACHE_LINE, sizeof(rabbit_session_table)))
+      return -1;
+   p_table = (rabbit_session_table *)p_mem;
+   memset(p_table, 0, sizeof(rabbit_session_table));
+   if (posix_memalign(&p_mem, RABBIT_CACHE_LINE,
+          shard_count*sizeof(rabbit_session_shard)))
+   {
+      free(p_table);
+      return -1;
+   }
+   p_table->p_shards = (rabbit_session_shard *)p_mem;
+   memset(p_table->p_shards, 0, shard_count*sizeof(rabbit_session_shard));
+   p_table->shard_mask = shard_count-1;
+   p_table->master = *p_master_instance;
+   atomic_init(&p_table->epoch, 0);
+
+   for (i=0; i<shard_count; i++)
+   {
+      p_shard = &p_table->p_shards[i];
+      if (posix_memalign(&p_mem, RABBIT_SESSION_SLOT_ALIGN,
+             slots*sizeof(rabbit_session_slot)))
+      {
+         while (i--)
+         {
+            pthread_mutex_destroy(&p_table->p_shards[i].lock);
+            free(p_table->p_shards[i].p_slots);
+         }
+         free(p_table->p_shards);
+         free(p_table);
+         return -1;
+      }
+      p_shard->p_slots = (rabbit_session_slot *)p_mem;
+      memset(p_shard->p_slots, 0, slots*sizeof(rabbit_session_slot));
+      p_shard->mask = slots-1;
+      p_shard->limit = slots - slots/8;
+      pthread_mutex_init(&p_shard->lock, NULL);
+   }
+
+   *pp_table = p_table;
+
+   /* Return success */
+   return 0;
+}
+
+
+/* Clear all sessions and free the table */
+void rabbit_session_destroy(rabbit_session_table *p_table)
+{
+   /* Temporary variables */
+   size_t i;
+
+   if (!p_table)
+      return;
+
+   for (i=0; i<=p_table->shard_mask; i++)
+   {
+      rabbit_wipe(p_table->p_shards[i].p_slots,
+             (p_table->p_shards[i].mask+1)*sizeof(rabbit_session_slot));
+      free(p_table->p_shards[i].p_slots);
+      pthread_mutex_destroy(&p_table->p_shards[i].lock);
+   }
+   rabbit_wipe(&p_table->master, sizeof(rabbit_instance));
+   free(p_table->p_shards);
+   free(p_table);
+}
+
+
+/* Add a session */
+int rabbit_session_open(rabbit_session_table *p_table, rabbit_session_id id,
+          const cc_byte *p_iv, size_t iv_size)
+{
+   /* Temporary variables */
+   unsigned long long hash = rabbit_session_hash(id);
+   rabbit_session_shard *p_shard = rabbit_session_shard_of(p_table, hash);
+   int res;
+
+   pthread_mutex_lock(&p_shard->lock);
+   res = rabbit_session_insert(p_table, p_shard, id, hash, p_iv, iv_size);
+   pthread_mutex_unlock(&p_shard->lock);
+
+   return res;
+}
+
+
+/* Remove a session */
+int rabbit_session_close(rabbit_session_table *p_table, rabbit_session_id id)
+{
+   /* Temporary variables */
+   unsigned long long hash = rabbit_session_hash(id);
+   rabbit_session_shard *p_shard = rabbit_session_shard_of(p_table, hash);
+   rabbit_session_slot *p_slot;
+   int res = -1;
+
+   pthread_mutex_lock(&p_shard->lock);
+   p_slot = rabbit_session_probe(p_shard, id, hash);
+   if (p_slot->live)
+   {
+      rabbit_session_remove(p_shard, p_slot);
+      res = 0;
+   }
+   pthread_mutex_unlock(&p_shard->lock);
+
+   return res;
+}
+
+
+/* Encrypt or decrypt data on the stream of a session */
+int rabbit_session_cipher(rabbit_session_table *p_table, rabbit_session_id id,
+          const cc_byte *p_src, cc_byte *p_dest, size_t data_size)
+{
+   /* Temporary variables */
+   unsigned long long hash = rabbit_session_hash(id);
+   rabbit_session_shard *p_shard = rabbit_session_shard_of(p_table, hash);
+   int res;
+
+   pthread_mutex_lock(&p_shard->lock);
+   res = rabbit_session_apply(p_table, p_shard, id, hash, p_src, p_dest,
+          data_size);
+   pthread_mutex_unlock(&p_shard->lock);
+
+   return res;
+}
+
+
+/* Run a batch of operations with slot prefetching */
+void rabbit_session_cipher_many(rabbit_session_table *p_table,
+          rabbit_session_op *p_ops, size_t op_count)
+{
+   /* Temporary variables */
+   unsigned long long hash[RABBIT_SESSION_PREFETCH];
+   rabbit_session_shard *p_shard;
+   size_t i, k;
+
+   /* Hash and prefetch the first window */
+   for (i=0; i<op_count && i<RABBIT_SESSION_PREFETCH; i++)
+   {
+      hash[i] = rabbit_session_hash(p_ops[i].id);
+      p_shard = rabbit_session_shard_of(p_table, hash[i]);
+      RABBIT_SESSION_PREFETCH_SLOT(
+             &p_shard->p_slots[(size_t)hash[i] & p_shard->mask]);
+   }
+
+   for (i=0; i<op_count; i++)
+   {
+      /* Run operation i */
+      k = i % RABBIT_SESSION_PREFETCH;
+      p_shard = rabbit_session_shard_of(p_table, hash[k]);
+      pthread_mutex_lock(&p_shard->lock);
+      p_ops[i].result = rabbit_session_apply(p_table, p_shard, p_ops[i].id,
+             hash[k], p_ops[i].p_src, p_ops[i].p_dest, p_ops[i].data_size);
+      pthread_mutex_unlock(&p_shard->lock);
+
+      /* Reuse its hash entry to prefetch one window ahead */
+      if (i + RABBIT_SESSION_PREFETCH < op_count)
+      {
+         hash[k] = rabbit_session_hash(p_ops[i+RABBIT_SESSION_PREFETCH].id);
+         p_shard = rabbit_session_shard_of(p_table, hash[k]);
+         RABBIT_SESSION_PREFETCH_SLOT(
+                &p_shard->p_slots[(size_t)hash[k] & p_shard->mask]);
+      }
+   }
+}
+
+
+/* Advance the idle clock */
+void rabbit_session_tick(rabbit_session_table *p_table)
+{
+   atomic_fetch_add_explicit(&p_table->epoch, 1, memory_order_relaxed);
+}
+
+
+/* Remove idle sessions */
+size_t rabbit_session_evict_idle(rabbit_session_table *p_table,
+          unsigned int max_idle, rabbit_session_evict_fn evict_fn,
+          void *p_context)
+{
+   /* Temporary variables */
+   cc_uint32 now = atomic_load_explicit(&p_table->epoch, memory_order_relaxed);
+   rabbit_session_shard *p_shard;
+   rabbit_session_slot *p_slot;
+   size_t s, i, evicted = 0;
+
+   for (s=0; s<=p_table->shard_mask; s++)
+   {
+      p_shard = &p_table->p_shards[s];
+      pthread_mutex_lock(&p_shard->lock);
+      for (i=0; i<=p_shard->mask; )
+      {
+         p_slot = &p_shard->p_slots[i];
+         if (!p_slot->live || (cc_uint32)(now - p_slot->last_used) < max_idle)
+         {
+            i++;
+            continue;
+         }
+
+         /* Report and remove; slot i receives a shifted entry to recheck */
+         if (evict_fn)
+            evict_fn(p_context, p_slot->id, p_slot->iv, p_slot->blocks);
+         rabbit_session_remove(p_shard, p_slot);
+         evicted++;
+      }
+      pthread_mutex_unlock(&p_shard->lock);
+   }
+
+   return evicted;
+}
+
+
+/* Re-add an evicted session */
+int rabbit_session_restore(rabbit_session_table *p_table,
+          rabbit_session_id id, const cc_byte *p_iv, size_t iv_size,
+          unsigned long long blocks)
+{
+   /* Temporary variables */
+   unsigned long long hash = rabbit_session_hash(id);
+   rabbit_session_shard *p_shard = rabbit_session_shard_of(p_table, hash);
+   rabbit_session_slot *p_slot;
+   cc_byte scratch[256];
+   unsigned long long left;
+   size_t n;
+   int res;
+
+   pthread_mutex_lock(&p_shard->lock);
+   res = rabbit_session_insert(p_table, p_shard, id, hash, p_iv, iv_size);
+   if (!res)
+   {
+      /* Replay the stream up to its old position */
+      p_slot = rabbit_session_probe(p_shard, id, hash);
+      for (left=blocks; left; left-=n/16)
+      {
+         n = left < sizeof(scratch)/16 ? (size_t)left*16 : sizeof(scratch);
+         rabbit_prng_raw(&p_slot->inst, scratch, n);
+      }
+      p_slot->blocks = blocks;
+   }
+   pthread_mutex_unlock(&p_shard->lock);
+
+   rabbit_wipe(scratch, sizeof(scratch));
+   return res;
+}
+
+
+/* Serialize a session */
+int rabbit_session_export(rabbit_session_table *p_table,
+          rabbit_session_id id, cc_byte *p_dest, size_t dest_size)
+{
+   /* Temporary variables */
+   unsigned long long hash = rabbit_session_hash(id);
+   rabbit_session_shard *p_shard = rabbit_session_shard_of(p_table, hash);
+   rabbit_session_slot *p_slot;
+   rabbit_snapshot snapshot;
+   int res = -1;
+
+   memset(&snapshot, 0, sizeof(snapshot));
+   pthread_mutex_lock(&p_shard->lock);
+   p_slot = rabbit_session_probe(p_shard, id, hash);
+   if (p_slot->live)
+   {
+      snapshot.instance = p_slot->inst;
+      memcpy(snapshot.iv, p_slot->iv, 8);
+      snapshot.has_iv = 1;
+      snapshot.blocks = p_slot->blocks;
+      res = rabbit_snapshot_export(&snapshot, NULL, p_dest, dest_size);
+   }
+   pthread_mutex_unlock(&p_shard->lock);
+
+   rabbit_wipe(&snapshot, sizeof(snapshot));
+   return res;
+}
+
+
+/* Add a session from a snapshot */
+int rabbit_session_import(rabbit_session_table *p_table,
+          rabbit_session_id id, const cc_byte *p_src, size_t src_size)
+{
+   /* Temporary variables */
+   unsigned long long hash = rabbit_session_hash(id);
+   rabbit_session_shard *p_shard = rabbit_session_shard_of(p_table, hash);
+   rabbit_session_slot *p_slot;
+   rabbit_snapshot snapshot;
+   int res;
+
+   /* Return error unless the snapshot is of a block-granular IV stream */
+   if (rabbit_snapshot_import(&snapshot, NULL, 0, p_src, src_size) ||
+       !snapshot.has_iv)
+      return -1;
+
+   /* Copy the state in directly, skipping the IV setup */
+   pthread_mutex_lock(&p_shard->lock);
+   p_slot = rabbit_session_claim(p_table, p_shard, id, hash);
+   res = p_slot ? 0 : -1;
+   if (p_slot)
+   {
+      p_slot->inst = snapshot.instance;
+      memcpy(p_slot->iv, snapshot.iv, 8);
+      p_slot->blocks = snapshot.blocks;
+   }
+   pthread_mutex_unlock(&p_shard->lock);
+
+   rabbit_wipe(&snapshot, sizeof(snapshot));
+   return res;
+}
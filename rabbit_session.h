@@ -0,0 +1,105 @@
+/******************************************************************************/
+/* File name: rabbit_session.h                                                */
+/*----------------------------------------------------------------------------*/
+/* Header file for a session table mapping stream ids to live cipher state.   */
+/*                                                                            */
+/* Every session derives from one master instance and an 8-byte IV. The      */
+/* table stores the working instance inline in an open-addressing slot of     */
+/* two aligned cache lines, so a lookup touches one 128-byte sector. The      */
+/* table is split into independently locked shards, so threads working on    */
+/* different shards never contend. Idle sessions can be evicted; the caller   */
+/* keeps the IV and stream position and restores the session later from the  */
+/* master instance. A session can also be exported as a snapshot and          */
+/* imported into another table, which skips replaying the stream.             */
+/*                                                                            */
+/* This source code is for little-endian processors (e.g. x86).               */
+/******************************************************************************/
+
+#ifndef _RABBIT_SESSION_H
+#define _RABBIT_SESSION_H
+
+#include "rabbit.h"
+
+/* Stream identifier */
+typedef unsigned long long rabbit_session_id;
+
+/* One operation of a batched call */
+typedef struct
+{
+   rabbit_session_id id;
+   const cc_byte *p_src;
+   cc_byte *p_dest;
+   size_t data_size;     /* Multiple of 16, as for rabbit_cipher() */
+   int result;           /* Set to zero on success */
+} rabbit_session_op;
+
+/* Called for every evicted session with what is needed to restore it: */
+/* the IV and the number of 16-byte blocks already processed */
+typedef void (*rabbit_session_evict_fn)(void *p_context, rabbit_session_id id,
+          const cc_byte *p_iv, unsigned long long blocks);
+
+/* Opaque session table */
+typedef struct rabbit_session_table rabbit_session_table;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* All function calls return zero on success */
+
+/* Create a table for up to capacity sessions derived from a copy of */
+/* *p_master_instance, split into shard_count shards (rounded up to a power */
+/* of two; zero selects a default) */
+int rabbit_session_create(rabbit_session_table **pp_table,
+          const rabbit_instance *p_master_instance, size_t capacity,
+          size_t shard_count);
+
+/* Clear all sessions and free the table */
+void rabbit_session_destroy(rabbit_session_table *p_table);
+
+/* Add a session with the given IV. Fails if the id is already present */
+/* or the shard is full. */
+int rabbit_session_open(rabbit_session_table *p_table, rabbit_session_id id,
+          const cc_byte *p_iv, size_t iv_size);
+
+/* Remove a session and clear its state */
+int rabbit_session_close(rabbit_session_table *p_table, rabbit_session_id id);
+
+/* Encrypt or decrypt data on the stream of a session */
+int rabbit_session_cipher(rabbit_session_table *p_table, rabbit_session_id id,
+          const cc_byte *p_src, cc_byte *p_dest, size_t data_size);
+
+/* Run a batch of operations, prefetching slots ahead of use. Operations */
+/* on the same session are applied in array order. */
+void rabbit_session_cipher_many(rabbit_session_table *p_table,
+          rabbit_session_op *p_ops, size_t op_count);
+
+/* Advance the idle clock by one tick */
+void rabbit_session_tick(rabbit_session_table *p_table);
+
+/* Remove sessions unused for at least max_idle ticks, reporting each one */
+/* to evict_fn (which may be NULL). Returns the number of evicted sessions. */
+size_t rabbit_session_evict_idle(rabbit_session_table *p_table,
+          unsigned int max_idle, rabbit_session_evict_fn evict_fn,
+          void *p_context);
+
+/* Re-add an evicted session from its IV and stream position */
+int rabbit_session_restore(rabbit_session_table *p_table,
+          rabbit_session_id id, const cc_byte *p_iv, size_t iv_size,
+          unsigned long long blocks);
+
+/* Serialize a session (see rabbit_snapshot.h) into p_dest, which must */
+/* hold RABBIT_SNAPSHOT_SIZE(0) bytes */
+int rabbit_session_export(rabbit_session_table *p_table,
+          rabbit_session_id id, cc_byte *p_dest, size_t dest_size);
+
+/* Add a session exported from a table with the same master key. It */
+/* continues where the exported one stopped, without replaying the stream. */
+int rabbit_session_import(rabbit_session_table *p_table,
+          rabbit_session_id id, const cc_byte *p_src, size_t src_size);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,249 @@
+/******************************************************************************/
+/* File name: rabbit_shared.c                                                 */
+/*----------------------------------------------------------------------------*/
+/* Source file for a keystream generator shared by many consumer threads.     */
+/*                                                                            */
+/* The keystream is cut into chunks; chunk k lives in ring slot k % count.    */
+/* A slot publishes the chunk it holds through its "ready" word (k+1, with    */
+/* release semantics) and counts the bytes consumers have finished copying    */
+/* out of it. A slot may only be refilled with chunk k+count once all bytes   */
+/* of chunk k have been consumed. Refilling is serialized by a try-only flag, */
+/* so consumers never block on it: they either help or spin.                  */
+/*                                                                            */
+/* This source code is for little-endian processors (e.g. x86).               */
+/******************************************************************************/
+
+#define _POSIX_C_SOURCE 200809L
+
+#include "rabbit_shared.h"
+#include "rabbit_internal.h"
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/* Ring slot bookkeeping, one cache line per slot */
+typedef struct
+{
+   _Alignas(RABBIT_CACHE_LINE) atomic_ullong ready;
+   atomic_ullong consumed;
+} rabbit_shared_slot;
+
+/* Structure to store the shared generator */
+struct rabbit_shared
+{
+   /* Next keystream byte offset to hand out */
+   _Alignas(RABBIT_CACHE_LINE) atomic_ullong cursor;
+
+   /* Refill ownership and the state it protects */
+   _Alignas(RABBIT_CACHE_LINE) atomic_flag filling;
+   unsigned long long next_chunk;
+   rabbit_instance gen;
+
+   /* Read-mostly configuration */
+   _Alignas(RABBIT_CACHE_LINE) size_t chunk_size;
+   size_t chunk_count;
+   cc_byte *p_data;
+   rabbit_shared_slot *p_slots;
+   atomic_int stop;
+   int has_producer;
+   pthread_t producer;
+};
+
+
+/* Produce the next chunk if its slot is free. The caller must own the */
+/* filling flag. Returns 1 if a chunk was produced and 0 otherwise. */
+static int rabbit_shared_fill_one(rabbit_shared *p_shared)
+{
+   /* Temporary variables */
+   unsigned long long k = p_shared->next_chunk;
+   size_t s = (size_t)(k % p_shared->chunk_count);
+   rabbit_shared_slot *p_slot = &p_shared->p_slots[s];
+
+   /* The previous occupant must have been consumed completely */
+   if (k >= p_shared->chunk_count &&
+       atomic_load_explicit(&p_slot->consumed, memory_order_acquire) !=
+          p_shared->chunk_size)
+      return 0;
+
+   /* Generate and publish the chunk */
+   atomic_store_explicit(&p_slot->consumed, 0, memory_order_relaxed);
+   rabbit_prng_raw(&p_shared->gen, p_shared->p_data + s*p_shared->chunk_size,
+          p_shared->chunk_size);
+   atomic_store_explicit(&p_slot->ready, k+1, memory_order_release);
+   p_shared->next_chunk = k+1;
+
+   return 1;
+}
+
+
+/* Produce as many chunks as there are free slots. Returns the number of */
+/* chunks produced, or -1 if another thread is refilling. */
+static int rabbit_shared_refill(rabbit_shared *p_shared)
+{
+   /* Temporary variables */
+   int produced = 0;
+
+   if (atomic_flag_test_and_set_explicit(&p_shared->filling,
+          memory_order_acquire))
+      return -1;
+
+   while (rabbit_shared_fill_one(p_shared))
+      produced++;
+
+   atomic_flag_clear_explicit(&p_shared->filling, memory_order_release);
+   return produced;
+}
+
+
+/* Wait until chunk k is published, helping with the refill meanwhile */
+static void rabbit_shared_wait_chunk(rabbit_shared *p_shared,
+          unsigned long long k)
+{
+   /* Temporary variables */
+   rabbit_shared_slot *p_slot = &p_shared->p_slots[k % p_shared->chunk_count];
+
+   while (atomic_load_explicit(&p_slot->ready, memory_order_acquire) != k+1)
+   {
+      /* Help if nobody else is refilling, otherwise let others run */
+      if (rabbit_shared_refill(p_shared) <= 0)
+         sched_yield();
+   }
+}
+
+
+/* Producer thread: keep the ring full until asked to stop */
+static void *rabbit_shared_producer(void *p_arg)
+{
+   /* Temporary variables */
+   rabbit_shared *p_shared = (rabbit_shared *)p_arg;
+   struct timespec idle = { 0, 20000 };
+
+   while (!atomic_load_explicit(&p_shared->stop, memory_order_relaxed))
+   {
+      /* Back off briefly when the ring is full or a consumer is helping */
+      if (rabbit_shared_refill(p_shared) <= 0)
+         nanosleep(&idle, NULL);
+   }
+
+   return NULL;
+}
+
+
+/* Create a shared generator */
+int rabbit_shared_create(rabbit_shared **pp_shared,
+          const rabbit_instance *p_seed_instance, size_t chunk_size,
+          size_t chunk_count)
+{
+   /* Temporary variables */
+   rabbit_shared *p_shared;
+   void *p_mem;
+   size_t i;
+
+   /* Return error on unusable ring geometry */
+   if (chunk_size == 0 || chunk_size%16 || chunk_count < 2 ||
+       chunk_size > ((size_t)-1)/chunk_count)
+      return -1;
+
+   if (posix_memalign(&p_mem, RABBIT_CACHE_LINE, sizeof(rabbit_shared)))
+      return -1;
+   p_shared = (rabbit_shared *)p_mem;
+   memset(p_shared, 0, sizeof(rabbit_shared));
+
+   p_shared->chunk_size = chunk_size;
+   p_shared->chunk_count = chunk_count;
+   if (posix_memalign(&p_mem, RABBIT_CACHE_LINE,
+          chunk_count*sizeof(rabbit_shared_slot)))
+   {
+      free(p_shared);
+      return -1;
+   }
+   p_shared->p_slots = (rabbit_shared_slot *)p_mem;
+   if (posix_memalign(&p_mem, RABBIT_CACHE_LINE, chunk_count*chunk_size))
+   {
+      free(p_shared->p_slots);
+      free(p_shared);
+      return -1;
+   }
+   p_shared->p_data = (cc_byte *)p_mem;
+
+   /* Initialize the ring and the generator state */
+   atomic_init(&p_shared->cursor, 0);
+   atomic_flag_clear(&p_shared->filling);
+   atomic_init(&p_shared->stop, 0);
+   for (i=0; i<chunk_count; i++)
+   {
+      atomic_init(&p_shared->p_slots[i].ready, 0);
+      atomic_init(&p_shared->p_slots[i].consumed, 0);
+   }
+   p_shared->gen = *p_seed_instance;
+   p_shared->next_chunk = 0;
+
+   /* Start the producer; consumers cover for it if this fails */
+   p_shared->has_producer = !pthread_create(&p_shared->producer, NULL,
+          rabbit_shared_producer, p_shared);
+
+   *pp_shared = p_shared;
+
+   /* Return success */
+   return 0;
+}
+
+
+/* Copy the next data_size bytes of the shared keystream */
+int rabbit_shared_read(rabbit_shared *p_shared, cc_byte *p_dest,
+          size_t data_size)
+{
+   /* Temporary variables */
+   unsigned long long offset, k;
+   size_t chunk_offset, n;
+   rabbit_shared_slot *p_slot;
+
+   /* Claim the byte range */
+   offset = atomic_fetch_add_explicit(&p_shared->cursor, data_size,
+          memory_order_relaxed);
+
+   while (data_size)
+   {
+      k = offset / p_shared->chunk_size;
+      chunk_offset = (size_t)(offset % p_shared->chunk_size);
+      n = p_shared->chunk_size - chunk_offset;
+      if (n > data_size)
+         n = data_size;
+
+      /* Copy out of the chunk and release our part of it */
+      rabbit_shared_wait_chunk(p_shared, k);
+      p_slot = &p_shared->p_slots[k % p_shared->chunk_count];
+      memcpy(p_dest, p_shared->p_data +
+             (size_t)(k % p_shared->chunk_count)*p_shared->chunk_size +
+             chunk_offset, n);
+      atomic_fetch_add_explicit(&p_slot->consumed, n, memory_order_release);
+
+      offset += n;
+      p_dest += n;
+      data_size -= n;
+   }
+
+   /* Return success */
+   return 0;
+}
+
+
+/* Stop the producer, clear the keystream and free the generator */
+void rabbit_shared_destroy(rabbit_shared *p_shared)
+{
+   if (!p_shared)
+      return;
+
+   atomic_store(&p_shared->stop, 1);
+   if (p_shared->has_producer)
+      pthread_join(p_shared->producer, NULL);
+
+   rabbit_wipe(p_shared->p_data, p_shared->chunk_count*p_shared->chunk_size);
+   rabbit_wipe(&p_shared->gen, sizeof(rabbit_instance));
+   free(p_shared->p_data);
+   free(p_shared->p_slots);
+   free(p_shared);
+}
@@ -0,0 +1,54 @@
+/******************************************************************************/
+/* File name: rabbit_shared.h                                                 */
+/*----------------------------------------------------------------------------*/
+/* Header file for a keystream generator shared by many consumer threads.     */
+/*                                                                            */
+/* A producer thread refills fixed-size keystream chunks into a ring of       */
+/* buffers ahead of demand. Consumers claim byte ranges of the keystream with */
+/* a single atomic fetch-and-add and copy them out without taking a lock.     */
+/* When the consumers outpace the producer, a waiting consumer performs the   */
+/* refill itself.                                                             */
+/*                                                                            */
+/* The bytes handed out are exactly the keystream that rabbit_prng() would    */
+/* produce from the seed instance; which consumer receives which range        */
+/* depends on the order in which they claim.                                  */
+/*                                                                            */
+/* This source code is for little-endian processors (e.g. x86).               */
+/******************************************************************************/
+
+#ifndef _RABBIT_SHARED_H
+#define _RABBIT_SHARED_H
+
+#include "rabbit.h"
+
+/* Opaque shared generator */
+typedef struct rabbit_shared rabbit_shared;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* All function calls return zero on success */
+
+/* Create a shared generator seeded with a copy of *p_seed_instance. The */
+/* chunk size must be a non-zero multiple of 16 and at least two chunks */
+/* are required. The producer thread is started immediately; if it cannot */
+/* be started the generator still works, with consumers doing all refills. */
+int rabbit_shared_create(rabbit_shared **pp_shared,
+          const rabbit_instance *p_seed_instance, size_t chunk_size,
+          size_t chunk_count);
+
+/* Copy the next data_size bytes of the shared keystream to *p_dest. Any */
+/* size is accepted and any number of threads may call this concurrently. */
+int rabbit_shared_read(rabbit_shared *p_shared, cc_byte *p_dest,
+          size_t data_size);
+
+/* Stop the producer thread, clear all keystream buffers and free the */
+/* generator. No reads may be in progress. */
+void rabbit_shared_destroy(rabbit_shared *p_shared);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,141 @@
+/******************************************************************************/
+/* File name: rabbit_snapshot.c                                               */
+/*----------------------------------------------------------------------------*/
+/* Source file for serialized cipher state.                                   */
+/*                                                                            */
+/* Fields are written byte by byte in little-endian order, so a snapshot      */
+/* does not depend on the layout or alignment of rabbit_instance.             */
+/*                                                                            */
+/* This source code is for little-endian processors (e.g. x86).               */
+/******************************************************************************/
+
+#include "rabbit_snapshot.h"
+#include "rabbit_crc32c.h"
+#include <string.h>
+
+/* Offsets of the fields */
+#define RABBIT_SNAPSHOT_X       12
+#define RABBIT_SNAPSHOT_C       44
+#define RABBIT_SNAPSHOT_CARRY   76
+#define RABBIT_SNAPSHOT_IV_OFF  80
+#define RABBIT_SNAPSHOT_BLOCKS  88
+#define RABBIT_SNAPSHOT_RESIDUE 96
+
+/* Magic number */
+static const cc_byte rabbit_snapshot_magic[4] = { 'R', 'b', 'S', 'n' };
+
+
+/* Store n bytes of a value, least significant first */
+static void rabbit_snapshot_put(cc_byte *p_dest, unsigned long long value,
+          int n)
+{
+   /* Temporary variables */
+   int i;
+
+   for (i=0; i<n; i++)
+      p_dest[i] = (cc_byte)(value >> (8*i));
+}
+
+
+/* Load n bytes of a value, least significant first */
+static unsigned long long rabbit_snapshot_get(const cc_byte *p_src, int n)
+{
+   /* Temporary variables */
+   unsigned long long value = 0;
+   int i;
+
+   for (i=n-1; i>=0; i--)
+      value = (value << 8) | p_src[i];
+   return value;
+}
+
+
+/* Serialize a stream */
+int rabbit_snapshot_export(const rabbit_snapshot *p_snapshot,
+          const cc_byte *p_residue, cc_byte *p_dest, size_t dest_size)
+{
+   /* Temporary variables */
+   const rabbit_instance *p_inst = &p_snapshot->instance;
+   size_t residue_size = p_snapshot->residue_size;
+   int i;
+
+   /* Return error if the residue cannot be stored or does not fit */
+   if (residue_size > 0xFFFFFFFFUL - RABBIT_SNAPSHOT_SIZE(0) ||
+       dest_size < RABBIT_SNAPSHOT_SIZE(residue_size) ||
+       (residue_size && !p_residue))
+      return -1;
+
+   memcpy(p_dest, rabbit_snapshot_magic, 4);
+   rabbit_snapshot_put(p_dest+4, RABBIT_SNAPSHOT_VERSION, 2);
+   rabbit_snapshot_put(p_dest+6, p_snapshot->has_iv ? RABBIT_SNAPSHOT_IV : 0,
+          2);
+   rabbit_snapshot_put(p_dest+8, residue_size, 4);
+   for (i=0; i<8; i++)
+   {
+      rabbit_snapshot_put(p_dest + RABBIT_SNAPSHOT_X + 4*i, p_inst->x[i], 4);
+      rabbit_snapshot_put(p_dest + RABBIT_SNAPSHOT_C + 4*i, p_inst->c[i], 4);
+   }
+   rabbit_snapshot_put(p_dest + RABBIT_SNAPSHOT_CARRY, p_inst->carry, 4);
+   if (p_snapshot->has_iv)
+      memcpy(p_dest + RABBIT_SNAPSHOT_IV_OFF, p_snapshot->iv, 8);
+   else
+      memset(p_dest + RABBIT_SNAPSHOT_IV_OFF, 0, 8);
+   rabbit_snapshot_put(p_dest + RABBIT_SNAPSHOT_BLOCKS, p_snapshot->blocks, 8);
+   if (residue_size)
+      memcpy(p_dest + RABBIT_SNAPSHOT_RESIDUE, p_residue, residue_size);
+
+   rabbit_snapshot_put(p_dest + RABBIT_SNAPSHOT_RESIDUE + residue_size,
+          rabbit_crc32c(0, p_dest, RABBIT_SNAPSHOT_RESIDUE + residue_size), 4);
+
+   /* Return success */
+   return 0;
+}
+
+
+/* Check and read a snapshot */
+int rabbit_snapshot_import(rabbit_snapshot *p_snapshot, cc_byte *p_residue,
+          size_t residue_capacity, const cc_byte *p_src, size_t src_size)
+{
+   /* Temporary variables */
+   rabbit_instance *p_inst = &p_snapshot->instance;
+   size_t residue_size;
+   unsigned int flags;
+   int i;
+
+   /* Return error on anything but a complete, intact version 1 snapshot */
+   if (src_size < RABBIT_SNAPSHOT_SIZE(0) ||
+       memcmp(p_src, rabbit_snapshot_magic, 4) ||
+       rabbit_snapshot_get(p_src+4, 2) != RABBIT_SNAPSHOT_VERSION)
+      return -1;
+   residue_size = (size_t)rabbit_snapshot_get(p_src+8, 4);
+   flags = (unsigned int)rabbit_snapshot_get(p_src+6, 2);
+   if (src_size != RABBIT_SNAPSHOT_SIZE(residue_size) ||
+       rabbit_snapshot_get(p_src + RABBIT_SNAPSHOT_RESIDUE + residue_size, 4) !=
+       rabbit_crc32c(0, p_src, RABBIT_SNAPSHOT_RESIDUE + residue_size) ||
+       (flags & ~(unsigned int)RABBIT_SNAPSHOT_IV) ||
+       rabbit_snapshot_get(p_src + RABBIT_SNAPSHOT_CARRY, 4) > 1)
+      return -1;
+
+   /* Return error if the residue does not fit */
+   if (residue_size > residue_capacity)
+      return -1;
+
+   for (i=0; i<8; i++)
+   {
+      p_inst->x[i] = (cc_uint32)rabbit_snapshot_get(
+             p_src + RABBIT_SNAPSHOT_X + 4*i, 4);
+      p_inst->c[i] = (cc_uint32)rabbit_snapshot_get(
+             p_src + RABBIT_SNAPSHOT_C + 4*i, 4);
+   }
+   p_inst->carry = (cc_uint32)rabbit_snapshot_get(
+          p_src + RABBIT_SNAPSHOT_CARRY, 4);
+   p_snapshot->has_iv = (flags & RABBIT_SNAPSHOT_IV) != 0;
+   memcpy(p_snapshot->iv, p_src + RABBIT_SNAPSHOT_IV_OFF, 8);
+   p_snapshot->blocks = rabbit_snapshot_get(p_src + RABBIT_SNAPSHOT_BLOCKS, 8);
+   p_snapshot->residue_size = residue_size;
+   if (residue_size)
+      memcpy(p_residue, p_src + RABBIT_SNAPSHOT_RESIDUE, residue_size);
+
+   /* Return success */
+   return 0;
+}
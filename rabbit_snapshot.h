@@ -0,0 +1,78 @@
+/******************************************************************************/
+/* File name: rabbit_snapshot.h                                               */
+/*----------------------------------------------------------------------------*/
+/* Header file for serialized cipher state.                                   */
+/*                                                                            */
+/* A snapshot holds the working instance of a stream, its IV and position     */
+/* when known, and any keystream bytes generated but not used yet, so a       */
+/* stream can be moved to another process and resumed in constant time        */
+/* instead of replaying it from the IV. The layout is fixed and versioned;    */
+/* all fields are little-endian:                                              */
+/*                                                                            */
+/*    offset  size                                                            */
+/*         0     4  magic "RbSn"                                              */
+/*         4     2  version (RABBIT_SNAPSHOT_VERSION)                         */
+/*         6     2  flags (RABBIT_SNAPSHOT_IV)                                */
+/*         8     4  residue size r                                            */
+/*        12    32  state variables x[0..7]                                   */
+/*        44    32  counters c[0..7]                                          */
+/*        76     4  counter carry                                             */
+/*        80     8  IV                                                        */
+/*        88     8  16-byte blocks generated by the instance                  */
+/*        96     r  residue                                                   */
+/*      96+r     4  CRC32C of all preceding bytes                             */
+/*                                                                            */
+/* The checksum catches corruption in transit, not tampering. A snapshot is   */
+/* as secret as the key: anyone holding it can decrypt the rest of the        */
+/* stream, so send it over a protected channel only.                          */
+/*                                                                            */
+/* This source code is for little-endian processors (e.g. x86).               */
+/******************************************************************************/
+
+#ifndef _RABBIT_SNAPSHOT_H
+#define _RABBIT_SNAPSHOT_H
+
+#include "rabbit.h"
+
+/* Format version written by this implementation */
+#define RABBIT_SNAPSHOT_VERSION 1
+
+/* Flags */
+#define RABBIT_SNAPSHOT_IV 1     /* The IV field is valid */
+
+/* Serialized size for residue_size bytes of residue */
+#define RABBIT_SNAPSHOT_SIZE(residue_size) (100 + (size_t)(residue_size))
+
+/* Stream state besides the residue */
+typedef struct
+{
+   rabbit_instance instance;      /* Working instance */
+   cc_byte iv[8];                 /* IV of the stream, if has_iv */
+   int has_iv;
+   unsigned long long blocks;     /* Blocks generated by instance, 0 if */
+                                  /* unknown */
+   size_t residue_size;           /* Keystream bytes generated, not used */
+} rabbit_snapshot;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* All function calls return zero on success */
+
+/* Serialize a stream and the residue_size bytes at p_residue into */
+/* p_dest, which must hold RABBIT_SNAPSHOT_SIZE(residue_size) bytes */
+int rabbit_snapshot_export(const rabbit_snapshot *p_snapshot,
+          const cc_byte *p_residue, cc_byte *p_dest, size_t dest_size);
+
+/* Check and read a snapshot of exactly src_size bytes. The residue is */
+/* copied to p_residue, which must hold residue_capacity bytes; src_size */
+/* bytes always suffice. Fails on a bad checksum or an unknown version. */
+int rabbit_snapshot_import(rabbit_snapshot *p_snapshot, cc_byte *p_residue,
+          size_t residue_capacity, const cc_byte *p_src, size_t src_size);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,209 @@
+/******************************************************************************/
+/* File name: rabbit_stats.c                                                  */
+/*----------------------------------------------------------------------------*/
+/* Source file for optional statistics on the Rabbit entry points.            */
+/*                                                                            */
+/* Every thread owns a cache line aligned block of counters taken from a      */
+/* global list that only grows. The owner updates its counters with plain     */
+/* relaxed loads and stores; readers load them relaxed, which cannot tear on  */
+/* 64-bit targets. When a thread exits its block is marked free and the next  */
+/* new thread adopts it, keeping the counts, so totals never go backwards.    */
+/*                                                                            */
+/* This source code is for little-endian processors (e.g. x86).               */
+/******************************************************************************/
+
+#define _GNU_SOURCE
+
+#include "rabbit_stats.h"
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/* Counters of one thread */
+typedef struct rabbit_stats_block
+{
+   atomic_ullong counters[RABBIT_STATS_OPS][4 + RABBIT_STATS_BUCKETS];
+   struct rabbit_stats_block *p_next;
+   atomic_int owned;
+} rabbit_stats_block;
+
+/* Positions in a counter row */
+#define RABBIT_STATS_CALLS  0
+#define RABBIT_STATS_BYTES  1
+#define RABBIT_STATS_BLOCKS 2
+#define RABBIT_STATS_ERRORS 3
+
+/* All blocks ever created */
+static _Atomic(rabbit_stats_block *) rabbit_stats_head;
+
+/* Block of this thread */
+static _Thread_local rabbit_stats_block *rabbit_stats_self;
+
+/* Key whose destructor frees the block at thread exit */
+static pthread_once_t rabbit_stats_once = PTHREAD_ONCE_INIT;
+static pthread_key_t rabbit_stats_key;
+
+/* Operation names */
+static const char *rabbit_stats_names[RABBIT_STATS_OPS] =
+{
+   "key_setup", "iv_setup", "cipher", "prng"
+};
+
+
+/* Give a block back at thread exit */
+static void rabbit_stats_release(void *p_block)
+{
+   rabbit_stats_self = NULL;
+   atomic_store_explicit(&((rabbit_stats_block *)p_block)->owned, 0,
+          memory_order_release);
+}
+
+
+/* Create the thread exit key */
+static void rabbit_stats_init(void)
+{
+   pthread_key_create(&rabbit_stats_key, rabbit_stats_release);
+}
+
+
+/* Adopt a free block or add a new one; NULL if memory ran out */
+static rabbit_stats_block *rabbit_stats_acquire(void)
+{
+   /* Temporary variables */
+   rabbit_stats_block *p_block;
+   void *p_mem;
+   int expected;
+
+   pthread_once(&rabbit_stats_once, rabbit_stats_init);
+
+   for (p_block=atomic_load_explicit(&rabbit_stats_head, memory_order_acquire);
+        p_block; p_block=p_block->p_next)
+   {
+      expected = 0;
+      if (atomic_compare_exchange_strong_explicit(&p_block->owned, &expected,
+             1, memory_order_acquire, memory_order_relaxed))
+         goto found;
+   }
+
+   if (posix_memalign(&p_mem, RABBIT_CACHE_LINE, sizeof(rabbit_stats_block)))
+      return NULL;
+   p_block = (rabbit_stats_block *)p_mem;
+   memset(p_block, 0, sizeof(rabbit_stats_block));
+   atomic_init(&p_block->owned, 1);
+   p_block->p_next = atomic_load_explicit(&rabbit_stats_head,
+          memory_order_relaxed);
+   while (!atomic_compare_exchange_weak_explicit(&rabbit_stats_head,
+          &p_block->p_next, p_block, memory_order_release,
+          memory_order_relaxed))
+      ;
+
+found:
+   pthread_setspecific(rabbit_stats_key, p_block);
+   return p_block;
+}
+
+
+/* Owner-only increment */
+static void rabbit_stats_add(atomic_ullong *p_counter, unsigned long long n)
+{
+   atomic_store_explicit(p_counter, atomic_load_explicit(p_counter,
+          memory_order_relaxed) + n, memory_order_relaxed);
+}
+
+
+/* Monotonic time in nanoseconds */
+unsigned long long rabbit_stats_clock(void)
+{
+   /* Temporary variables */
+   struct timespec ts;
+
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return (unsigned long long)ts.tv_sec*1000000000ULL +
+          (unsigned long long)ts.tv_nsec;
+}
+
+
+/* Count one call that started at start; returns res */
+int rabbit_stats_record(int op, unsigned long long start, size_t data_size,
+          int res)
+{
+   /* Temporary variables */
+   rabbit_stats_block *p_block = rabbit_stats_self;
+   unsigned long long ns = rabbit_stats_clock() - start;
+   int bucket = 0;
+
+   if (!p_block)
+   {
+      p_block = rabbit_stats_self = rabbit_stats_acquire();
+      if (!p_block)
+         return res;
+   }
+
+   if (ns > 1)
+      bucket = 63 - __builtin_clzll(ns);
+   if (bucket >= RABBIT_STATS_BUCKETS)
+      bucket = RABBIT_STATS_BUCKETS - 1;
+
+   rabbit_stats_add(&p_block->counters[op][RABBIT_STATS_CALLS], 1);
+   if (res)
+      rabbit_stats_add(&p_block->counters[op][RABBIT_STATS_ERRORS], 1);
+   else if (op == RABBIT_STATS_CIPHER || op == RABBIT_STATS_PRNG)
+   {
+      rabbit_stats_add(&p_block->counters[op][RABBIT_STATS_BYTES], data_size);
+      rabbit_stats_add(&p_block->counters[op][RABBIT_STATS_BLOCKS],
+             data_size/16);
+   }
+   rabbit_stats_add(&p_block->counters[op][4 + bucket], 1);
+
+   return res;
+}
+
+
+/* Add up all threads */
+int rabbit_stats_snapshot(rabbit_stats *p_stats)
+{
+   /* Temporary variables */
+#ifdef RABBIT_STATS
+   rabbit_stats_block *p_block;
+   rabbit_stats_op *p_op;
+   int op, b;
+#endif
+
+   memset(p_stats, 0, sizeof(rabbit_stats));
+
+#ifndef RABBIT_STATS
+   /* Return error: the entry points are not instrumented */
+   return -1;
+#else
+
+   for (p_block=atomic_load_explicit(&rabbit_stats_head, memory_order_acquire);
+        p_block; p_block=p_block->p_next)
+      for (op=0; op<RABBIT_STATS_OPS; op++)
+      {
+         p_op = &p_stats->op[op];
+         p_op->calls += atomic_load_explicit(
+                &p_block->counters[op][RABBIT_STATS_CALLS], memory_order_relaxed);
+         p_op->bytes += atomic_load_explicit(
+                &p_block->counters[op][RABBIT_STATS_BYTES], memory_order_relaxed);
+         p_op->blocks += atomic_load_explicit(
+                &p_block->counters[op][RABBIT_STATS_BLOCKS], memory_order_relaxed);
+         p_op->errors += atomic_load_explicit(
+                &p_block->counters[op][RABBIT_STATS_ERRORS], memory_order_relaxed);
+         for (b=0; b<RABBIT_STATS_BUCKETS; b++)
+            p_op->latency[b] += atomic_load_explicit(
+                   &p_block->counters[op][4 + b], memory_order_relaxed);
+      }
+
+   /* Return success */
+   return 0;
+#endif
+}
+
+
+/* Name of an operation */
+const char *rabbit_stats_op_name(int op)
+{
+   return op >= 0 && op < RABBIT_STATS_OPS ? rabbit_stats_names[op] : "?";
+}
@@ -0,0 +1,89 @@
+/******************************************************************************/
+/* File name: rabbit_stats.h                                                  */
+/*----------------------------------------------------------------------------*/
+/* Header file for optional statistics on the Rabbit entry points.            */
+/*                                                                            */
+/* Build every file with -DRABBIT_STATS to count, per thread, the calls,      */
+/* bytes, 16-byte blocks and size errors of rabbit_key_setup(),               */
+/* rabbit_iv_setup(), rabbit_cipher() and rabbit_prng(), together with a      */
+/* histogram of their latencies in power-of-two nanosecond buckets. Each      */
+/* thread only writes its own counters; rabbit_stats_snapshot() adds up all   */
+/* threads, including ones that have exited, without taking locks.            */
+/*                                                                            */
+/* Only calls made by the application are counted; the library's own         */
+/* modules and C++ headers use the uninstrumented entry points of             */
+/* rabbit_internal.h.                                                         */
+/*                                                                            */
+/* Without RABBIT_STATS the hooks expand to nothing, so instrumented code     */
+/* is identical to the plain build, and rabbit_stats_snapshot() fails.        */
+/*                                                                            */
+/* This source code is for little-endian processors (e.g. x86).               */
+/******************************************************************************/
+
+#ifndef _RABBIT_STATS_H
+#define _RABBIT_STATS_H
+
+#include "rabbit.h"
+
+/* Instrumented operations */
+#define RABBIT_STATS_KEY_SETUP 0
+#define RABBIT_STATS_IV_SETUP  1
+#define RABBIT_STATS_CIPHER    2
+#define RABBIT_STATS_PRNG      3
+#define RABBIT_STATS_OPS       4
+
+/* Latency buckets: bucket b counts calls of [2^b, 2^(b+1)) nanoseconds, */
+/* bucket 0 also those under 1 ns, the last one everything longer */
+#define RABBIT_STATS_BUCKETS 40
+
+/* Counters of one operation */
+typedef struct
+{
+   unsigned long long calls;
+   unsigned long long bytes;
+   unsigned long long blocks;
+   unsigned long long errors;
+   unsigned long long latency[RABBIT_STATS_BUCKETS];
+} rabbit_stats_op;
+
+/* Counters of all operations */
+typedef struct
+{
+   rabbit_stats_op op[RABBIT_STATS_OPS];
+} rabbit_stats;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* All function calls return zero on success */
+
+/* Add up the counters of all threads; fails if built without RABBIT_STATS */
+int rabbit_stats_snapshot(rabbit_stats *p_stats);
+
+/* Name of an operation, e.g. "cipher" */
+const char *rabbit_stats_op_name(int op);
+
+/* Hooks for rabbit.c */
+unsigned long long rabbit_stats_clock(void);
+
+int rabbit_stats_record(int op, unsigned long long start, size_t data_size,
+          int res);
+
+#ifdef __cplusplus
+}
+#endif
+
+/* RABBIT_STATS_START goes last among a function's declarations; */
+/* return RABBIT_STATS_RETURN(op, size, res) records the call and yields res */
+#ifdef RABBIT_STATS
+#define RABBIT_STATS_START \
+   const unsigned long long rabbit_stats_start = rabbit_stats_clock();
+#define RABBIT_STATS_RETURN(op, data_size, res) \
+   rabbit_stats_record((op), rabbit_stats_start, (data_size), (res))
+#else
+#define RABBIT_STATS_START
+#define RABBIT_STATS_RETURN(op, data_size, res) (res)
+#endif
+
+#endif
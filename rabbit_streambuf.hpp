@@ -0,0 +1,314 @@
+/******************************************************************************/
+/* File name: rabbit_streambuf.hpp                                            */
+/*----------------------------------------------------------------------------*/
+/* C++ stream buffer that encrypts or decrypts with Rabbit on the fly.        */
+/*                                                                            */
+/* rabbit::cipher_streambuf sits between a std::istream or std::ostream and   */
+/* another stream buffer or a file descriptor. Written data is collected in   */
+/* a large chunk and encrypted in place just before the chunk is passed on;   */
+/* read data is decrypted in place as each chunk arrives. Bulk reads and      */
+/* writes skip the intermediate copy: writes are encrypted straight from the  */
+/* caller's buffer into the chunk and reads are decrypted in the caller's     */
+/* buffer. The keystream is byte-granular, so flushes at any position keep    */
+/* the stream intact.                                                         */
+/*                                                                            */
+/* A buffer works in one direction, chosen when it is constructed. Reading    */
+/* and writing with the same key and IV would reuse keystream.                */
+/*                                                                            */
+/* This source code is for little-endian processors (e.g. x86).               */
+/******************************************************************************/
+
+#ifndef _RABBIT_STREAMBUF_HPP
+#define _RABBIT_STREAMBUF_HPP
+
+#include <cerrno>
+#include <cstddef>
+#include <ios>
+#include <stdexcept>
+#include <streambuf>
+#include <vector>
+#include <unistd.h>
+#include "rabbit.h"
+#include "rabbit_internal.h"
+
+namespace rabbit
+{
+
+class cipher_streambuf : public std::streambuf
+{
+public:
+   /* Default chunk size in bytes */
+   static constexpr std::size_t default_chunk = 256 << 10;
+
+   /* Wrap another stream buffer, continuing the stream of instance. mode */
+   /* is std::ios_base::in to decrypt what is read or std::ios_base::out */
+   /* to encrypt what is written. */
+   cipher_streambuf(std::streambuf *p_inner, const rabbit_instance &instance,
+             std::ios_base::openmode mode = std::ios_base::out,
+             std::size_t chunk = default_chunk)
+      : p_inner_(p_inner), fd_(-1)
+   {
+      init(instance, mode, chunk);
+   }
+
+   /* Same on a file descriptor, which is not closed */
+   cipher_streambuf(int fd, const rabbit_instance &instance,
+             std::ios_base::openmode mode = std::ios_base::out,
+             std::size_t chunk = default_chunk)
+      : p_inner_(nullptr), fd_(fd)
+   {
+      init(instance, mode, chunk);
+   }
+
+   cipher_streambuf(const cipher_streambuf &) = delete;
+   cipher_streambuf &operator=(const cipher_streambuf &) = delete;
+
+   /* Flushes pending output, then clears the keystream state */
+   ~cipher_streambuf() override
+   {
+      if (writing_)
+         flush_chunk();
+      rabbit_wipe(&inst_, sizeof(inst_));
+      rabbit_wipe(ks_, sizeof(ks_));
+      rabbit_wipe(buf_.data(), buf_.size());
+   }
+
+protected:
+   /* Output: encrypt and pass on a full chunk, then store c */
+   int_type overflow(int_type c) override
+   {
+      if (!writing_ || !flush_chunk())
+         return traits_type::eof();
+      if (!traits_type::eq_int_type(c, traits_type::eof()))
+      {
+         *pptr() = traits_type::to_char_type(c);
+         pbump(1);
+      }
+      return traits_type::not_eof(c);
+   }
+
+   /* Output: bulk writes are encrypted from the caller's buffer */
+   std::streamsize xsputn(const char *p_src, std::streamsize count) override
+   {
+      std::size_t left = (std::size_t)count;
+
+      if (!writing_)
+         return 0;
+
+      /* Short writes just fill the chunk */
+      if (left <= (std::size_t)(epptr() - pptr()))
+      {
+         traits_type::copy(pptr(), p_src, left);
+         pbump((int)left);
+         return count;
+      }
+
+      if (!flush_chunk())
+         return 0;
+      while (left >= buf_.size())
+      {
+         transform(reinterpret_cast<const cc_byte *>(p_src), data(),
+                buf_.size());
+         if (!send(buf_.size()))
+            return count - (std::streamsize)left;
+         p_src += buf_.size();
+         left -= buf_.size();
+      }
+      traits_type::copy(pptr(), p_src, left);
+      pbump((int)left);
+      return count;
+   }
+
+   /* Output: pass on everything written so far */
+   int sync() override
+   {
+      if (!writing_)
+         return 0;
+      if (!flush_chunk())
+         return -1;
+      return p_inner_ ? p_inner_->pubsync() : 0;
+   }
+
+   /* Input: fetch and decrypt the next chunk */
+   int_type underflow() override
+   {
+      std::size_t n;
+
+      if (writing_)
+         return traits_type::eof();
+      if (gptr() < egptr())
+         return traits_type::to_int_type(*gptr());
+
+      n = fetch(buf_.data(), buf_.size());
+      if (!n)
+         return traits_type::eof();
+      transform(data(), data(), n);
+      setg(buf_.data(), buf_.data(), buf_.data() + n);
+      return traits_type::to_int_type(*gptr());
+   }
+
+   /* Input: bulk reads are decrypted in the caller's buffer */
+   std::streamsize xsgetn(char *p_dest, std::streamsize count) override
+   {
+      std::size_t left = (std::size_t)count, n;
+
+      if (writing_)
+         return 0;
+
+      /* Drain what is already decrypted */
+      n = (std::size_t)(egptr() - gptr());
+      if (n > left)
+         n = left;
+      traits_type::copy(p_dest, gptr(), n);
+      gbump((int)n);
+      p_dest += n;
+      left -= n;
+
+      /* Large remainders go straight into the caller's buffer */
+      while (left >= buf_.size())
+      {
+         n = fetch(p_dest, left);
+         if (!n)
+            return count - (std::streamsize)left;
+         transform(reinterpret_cast<const cc_byte *>(p_dest),
+                reinterpret_cast<cc_byte *>(p_dest), n);
+         p_dest += n;
+         left -= n;
+      }
+
+      /* The rest through the chunk */
+      while (left)
+      {
+         if (traits_type::eq_int_type(underflow(), traits_type::eof()))
+            break;
+         n = (std::size_t)(egptr() - gptr());
+         if (n > left)
+            n = left;
+         traits_type::copy(p_dest, gptr(), n);
+         gbump((int)n);
+         p_dest += n;
+         left -= n;
+      }
+      return count - (std::streamsize)left;
+   }
+
+private:
+   std::streambuf *p_inner_;
+   int fd_;
+   bool writing_ = true;
+   rabbit_instance inst_;
+   std::vector<char> buf_;
+   cc_byte ks_[16];
+   std::size_t ks_off_ = 16;     /* Unused keystream bytes start here */
+
+   void init(const rabbit_instance &instance, std::ios_base::openmode mode,
+             std::size_t chunk)
+   {
+      const std::ios_base::openmode dir = mode &
+             (std::ios_base::in | std::ios_base::out);
+
+      if (dir != std::ios_base::in && dir != std::ios_base::out)
+         throw std::invalid_argument("cipher_streambuf: mode must be in or out");
+      if (chunk < 16)
+         throw std::invalid_argument("cipher_streambuf: chunk too small");
+
+      /* Whole blocks per chunk keep the keystream aligned in bulk paths */
+      inst_ = instance;
+      writing_ = dir == std::ios_base::out;
+      buf_.resize(chunk & ~(std::size_t)15);
+      if (writing_)
+         setp(buf_.data(), buf_.data() + buf_.size());
+      else
+         setg(buf_.data(), buf_.data(), buf_.data());
+   }
+
+   cc_byte *data()
+   {
+      return reinterpret_cast<cc_byte *>(buf_.data());
+   }
+
+   /* XOR n bytes with the next keystream bytes */
+   void transform(const cc_byte *p_src, cc_byte *p_dest, std::size_t n)
+   {
+      std::size_t whole, i;
+
+      /* Finish a partly used keystream block */
+      while (n && ks_off_ < 16)
+      {
+         *p_dest++ = *p_src++ ^ ks_[ks_off_++];
+         n--;
+      }
+
+      whole = n & ~(std::size_t)15;
+      if (whole)
+         rabbit_cipher_raw(&inst_, p_src, p_dest, whole);
+
+      /* Start a block for the tail */
+      if (n > whole)
+      {
+         rabbit_prng_raw(&inst_, ks_, 16);
+         for (i=whole; i<n; i++)
+            p_dest[i] = p_src[i] ^ ks_[i-whole];
+         ks_off_ = n - whole;
+      }
+   }
+
+   /* Encrypt the put area in place and pass it on */
+   bool flush_chunk()
+   {
+      const std::size_t n = (std::size_t)(pptr() - pbase());
+
+      if (n)
+      {
+         transform(data(), data(), n);
+         if (!send(n))
+            return false;
+      }
+      setp(buf_.data(), buf_.data() + buf_.size());
+      return true;
+   }
+
+   /* Write n bytes of the chunk to the destination */
+   bool send(std::size_t n)
+   {
+      const char *p = buf_.data();
+      ssize_t res;
+
+      if (p_inner_)
+         return p_inner_->sputn(p, (std::streamsize)n) == (std::streamsize)n;
+
+      while (n)
+      {
+         res = ::write(fd_, p, n);
+         if (res < 0 && errno == EINTR)
+            continue;
+         if (res <= 0)
+            return false;
+         p += res;
+         n -= (std::size_t)res;
+      }
+      return true;
+   }
+
+   /* Read up to size bytes from the source; 0 at the end or on error */
+   std::size_t fetch(char *p_dest, std::size_t size)
+   {
+      ssize_t res;
+
+      if (p_inner_)
+      {
+         const std::streamsize got = p_inner_->sgetn(p_dest,
+                (std::streamsize)size);
+         return got > 0 ? (std::size_t)got : 0;
+      }
+
+      do
+         res = ::read(fd_, p_dest, size);
+      while (res < 0 && errno == EINTR);
+      return res > 0 ? (std::size_t)res : 0;
+   }
+};
+
+}
+
+#endif
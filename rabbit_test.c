@@ -27,7 +27,21 @@
 
 #include <limits.h>
 #include <stdio.h>
+#include <sys/uio.h>
+#include <unistd.h>
 #include "rabbit.h"
+#include "rabbit_aead.h"
+#include "rabbit_crc32c.h"
+#include "rabbit_log.h"
+#include "rabbit_parallel.h"
+#include "rabbit_pipeline.h"
+#include "rabbit_pool.h"
+#include "rabbit_precomp.h"
+#include "rabbit_session.h"
+#include "rabbit_shared.h"
+#include "rabbit_snapshot.h"
+#include "rabbit_stats.h"
+#include "rabbit_tune.h"
 
 /* -------------------------------------------------------------------------- */
 
@@ -139,6 +153,842 @@ static int test_key_setup_and_iv_setup_and_prng(cc_byte *p_key,
 
 /* -------------------------------------------------------------------------- */
 
+/* Test if rabbit_aead_encrypt() works. Return 0 on success. */
+static int test_aead_encrypt(cc_byte *p_key, cc_byte *p_iv, cc_byte *p_aad,
+          size_t aad_size, cc_byte *p_src, size_t data_size, cc_byte *p_res,
+          cc_byte *p_tag)
+{
+   /* Temporary variables */
+   rabbit_instance r_master_inst;
+   cc_byte buffer[64], tag[RABBIT_AEAD_TAG_SIZE];
+
+   /* Do the test */
+   rabbit_key_setup(&r_master_inst, p_key, 16);
+   if (rabbit_aead_encrypt(&r_master_inst, p_iv, 8, p_aad, aad_size, p_src,
+          buffer, data_size, tag))
+      return 1;
+   return !test_if_equal(buffer, p_res, data_size) ||
+          !test_if_equal(tag, p_tag, RABBIT_AEAD_TAG_SIZE);
+}
+
+/* -------------------------------------------------------------------------- */
+
+/* Test if rabbit_aead_decrypt() accepts a valid message and rejects it */
+/* once a ciphertext byte is flipped. Return 0 on success. */
+static int test_aead_decrypt(cc_byte *p_key, cc_byte *p_iv, cc_byte *p_aad,
+          size_t aad_size, cc_byte *p_src, size_t data_size, cc_byte *p_res,
+          cc_byte *p_tag)
+{
+   /* Temporary variables */
+   rabbit_instance r_master_inst;
+   cc_byte buffer[64], zeros[64];
+
+   /* Do the test */
+   rabbit_key_setup(&r_master_inst, p_key, 16);
+   if (rabbit_aead_decrypt(&r_master_inst, p_iv, 8, p_aad, aad_size, p_src,
+          buffer, data_size, p_tag))
+      return 1;
+   if (!test_if_equal(buffer, p_res, data_size))
+      return 1;
+
+   /* A forged message must fail and leave no plaintext behind */
+   clear(zeros, 64);
+   p_src[data_size-1] ^= 0x01;
+   if (!rabbit_aead_decrypt(&r_master_inst, p_iv, 8, p_aad, aad_size, p_src,
+          buffer, data_size, p_tag))
+      return 1;
+   p_src[data_size-1] ^= 0x01;
+   return !test_if_equal(buffer, zeros, data_size);
+}
+
+/* -------------------------------------------------------------------------- */
+
+/* Test if the rabbit_poly1305 functions work. Return 0 on success. */
+static int test_poly1305(cc_byte *p_key, cc_byte *p_msg, size_t msg_size,
+          cc_byte *p_res)
+{
+   /* Temporary variables */
+   rabbit_poly1305 mac;
+   cc_byte tag[16];
+
+   /* Do the test, feeding the message in two uneven parts */
+   rabbit_poly1305_init(&mac, p_key);
+   rabbit_poly1305_update(&mac, p_msg, 5);
+   rabbit_poly1305_update(&mac, p_msg+5, msg_size-5);
+   rabbit_poly1305_final(&mac, tag);
+   return !test_if_equal(tag, p_res, 16);
+}
+
+/* -------------------------------------------------------------------------- */
+
+/* Test if rabbit_crc32c() works. Return 0 on success. */
+static int test_crc32c(cc_byte *p_data, size_t data_size, cc_uint32 res)
+{
+   /* Do the test, once in one piece and once in two */
+   return rabbit_crc32c(0, p_data, data_size) != res ||
+          rabbit_crc32c(rabbit_crc32c(0, p_data, 4), p_data+4,
+                 data_size-4) != res;
+}
+
+/* -------------------------------------------------------------------------- */
+
+/* Test if rabbit_cipher_crc32c() gives the same ciphertext and checksum as */
+/* rabbit_cipher() followed by rabbit_crc32c(). Return 0 on success. */
+static int test_cipher_crc32c(cc_byte *p_key, cc_byte *p_iv, cc_byte *p_res)
+{
+   /* Temporary variables */
+   rabbit_instance r_master_inst, r_inst;
+   cc_byte buffer[48];
+   cc_uint32 crc = 0;
+
+   /* Do the test */
+   rabbit_key_setup(&r_master_inst, p_key, 16);
+   rabbit_iv_setup(&r_master_inst, &r_inst, p_iv, 8);
+   clear(buffer, 48);
+   rabbit_cipher_crc32c(&r_inst, buffer, buffer, 48, &crc);
+   return !test_if_equal(buffer, p_res, 48) ||
+          crc != rabbit_crc32c(0, p_res, 48);
+}
+
+/* -------------------------------------------------------------------------- */
+
+/* Test if rabbit_cipher_iov() works on chains whose fragments split */
+/* blocks at different places. Return 0 on success. */
+static int test_cipher_iov(cc_byte *p_key, cc_byte *p_iv, cc_byte *p_res)
+{
+   /* Temporary variables */
+   rabbit_instance r_master_inst, r_inst;
+   cc_byte src[48], buffer[48];
+   struct iovec src_iov[4], dest_iov[3];
+
+   /* Source split 5 + 0 + 20 + 23, destination split 16 + 1 + 31 */
+   src_iov[0].iov_base = src;       src_iov[0].iov_len = 5;
+   src_iov[1].iov_base = src+5;     src_iov[1].iov_len = 0;
+   src_iov[2].iov_base = src+5;     src_iov[2].iov_len = 20;
+   src_iov[3].iov_base = src+25;    src_iov[3].iov_len = 23;
+   dest_iov[0].iov_base = buffer;    dest_iov[0].iov_len = 16;
+   dest_iov[1].iov_base = buffer+16; dest_iov[1].iov_len = 1;
+   dest_iov[2].iov_base = buffer+17; dest_iov[2].iov_len = 31;
+
+   /* Do the test */
+   rabbit_key_setup(&r_master_inst, p_key, 16);
+   rabbit_iv_setup(&r_master_inst, &r_inst, p_iv, 8);
+   clear(src, 48);
+   if (rabbit_cipher_iov(&r_inst, src_iov, 4, dest_iov, 3))
+      return 1;
+   return !test_if_equal(buffer, p_res, 48);
+}
+
+/* -------------------------------------------------------------------------- */
+
+/* Test if rabbit_encrypt_many() reproduces the single-message vectors for */
+/* a batch with shared keys, a job without IV and a segmented job (one */
+/* segment, so its IV is the base IV). Return 0 on success. */
+static int test_encrypt_many(cc_byte *p_key1, cc_byte *p_key2,
+          cc_byte *p_iv1, cc_byte *p_iv3, cc_byte *p_res2, cc_byte *p_res4,
+          cc_byte *p_res6)
+{
+   /* Temporary variables */
+   rabbit_job jobs[3];
+   cc_byte src[48], buffer[3][48];
+   int i;
+
+   clear(src, 48);
+   for (i=0; i<3; i++)
+   {
+      jobs[i].p_src = src;
+      jobs[i].p_dest = buffer[i];
+      jobs[i].data_size = 48;
+      jobs[i].segment_size = 0;
+   }
+   jobs[0].p_key = p_key1;  jobs[0].p_iv = p_iv3;  jobs[0].segment_size = 48;
+   jobs[1].p_key = p_key2;  jobs[1].p_iv = NULL;
+   jobs[2].p_key = p_key1;  jobs[2].p_iv = p_iv1;
+
+   /* Do the test */
+   if (rabbit_encrypt_many(jobs, 3, 2))
+      return 1;
+   return !test_if_equal(buffer[0], p_res6, 48) ||
+          !test_if_equal(buffer[1], p_res2, 48) ||
+          !test_if_equal(buffer[2], p_res4, 48);
+}
+
+/* -------------------------------------------------------------------------- */
+
+/* Test if the non-temporal path of rabbit_cipher() gives the same output */
+/* as the default one. Return 0 on success. */
+static int test_cipher_nt(cc_byte *p_key, cc_byte *p_iv, cc_byte *p_res)
+{
+   /* Temporary variables */
+   rabbit_instance r_master_inst, r_inst;
+   cc_byte src[48];
+   union { cc_byte b[48]; cc_uint32 align; } buffer;
+   size_t threshold = rabbit_get_nt_threshold();
+   int res;
+
+   /* Do the test with a threshold every call reaches */
+   rabbit_key_setup(&r_master_inst, p_key, 16);
+   rabbit_iv_setup(&r_master_inst, &r_inst, p_iv, 8);
+   clear(src, 48);
+   rabbit_set_nt_threshold(16);
+   res = rabbit_cipher(&r_inst, src, buffer.b, 48);
+   rabbit_set_nt_threshold(threshold);
+   return res || !test_if_equal(buffer.b, p_res, 48);
+}
+
+/* -------------------------------------------------------------------------- */
+
+/* Test if key_setup(), iv_setup(), cipher() and prng() work on keys, IVs */
+/* and data at odd addresses. Return 0 on success. */
+static int test_unaligned(cc_byte *p_key, cc_byte *p_iv, cc_byte *p_res)
+{
+   /* Temporary variables */
+   rabbit_instance r_master_inst, r_inst;
+   cc_byte key[17], iv[9], src[49], buffer[51];
+   int i;
+
+   /* Copy the key and IV one byte past an aligned start */
+   for (i=0; i<16; i++)
+      key[i+1] = p_key[i];
+   for (i=0; i<8; i++)
+      iv[i+1] = p_iv[i];
+
+   /* Do the test, with source and destination misaligned differently */
+   rabbit_key_setup(&r_master_inst, key+1, 16);
+   rabbit_iv_setup(&r_master_inst, &r_inst, iv+1, 8);
+   clear(src, 49);
+   if (rabbit_cipher(&r_inst, src+1, buffer+3, 48) ||
+       !test_if_equal(buffer+3, p_res, 48))
+      return 1;
+   rabbit_iv_setup(&r_master_inst, &r_inst, iv+1, 8);
+   if (rabbit_prng(&r_inst, buffer+2, 48))
+      return 1;
+   return !test_if_equal(buffer+2, p_res, 48);
+}
+
+/* -------------------------------------------------------------------------- */
+
+/* Test if rabbit_stats_snapshot() counts calls, bytes, blocks, errors and */
+/* latencies when built with RABBIT_STATS, and fails otherwise. Calls made */
+/* inside the library must not be counted. Return 0 on success. */
+static int test_stats(cc_byte *p_key, cc_byte *p_iv)
+{
+   /* Temporary variables */
+   rabbit_stats before, after;
+#ifdef RABBIT_STATS
+   rabbit_instance r_master_inst, r_inst;
+   cc_byte buffer[48];
+   unsigned long long timed;
+   cc_uint32 crc = 0;
+   int op, b;
+
+   /* Do the test */
+   if (rabbit_stats_snapshot(&before))
+      return 1;
+   rabbit_key_setup(&r_master_inst, p_key, 16);
+   rabbit_iv_setup(&r_master_inst, &r_inst, p_iv, 8);
+   clear(buffer, 48);
+   rabbit_cipher(&r_inst, buffer, buffer, 48);
+   rabbit_cipher(&r_inst, buffer, buffer, 17);
+   rabbit_prng(&r_inst, buffer, 32);
+   rabbit_cipher_crc32c(&r_inst, buffer, buffer, 48, &crc);
+   if (rabbit_stats_snapshot(&after))
+      return 1;
+
+   if (after.op[RABBIT_STATS_KEY_SETUP].calls -
+          before.op[RABBIT_STATS_KEY_SETUP].calls != 1 ||
+       after.op[RABBIT_STATS_IV_SETUP].calls -
+          before.op[RABBIT_STATS_IV_SETUP].calls != 1 ||
+       after.op[RABBIT_STATS_CIPHER].calls -
+          before.op[RABBIT_STATS_CIPHER].calls != 2 ||
+       after.op[RABBIT_STATS_CIPHER].bytes -
+          before.op[RABBIT_STATS_CIPHER].bytes != 48 ||
+       after.op[RABBIT_STATS_CIPHER].blocks -
+          before.op[RABBIT_STATS_CIPHER].blocks != 3 ||
+       after.op[RABBIT_STATS_CIPHER].errors -
+          before.op[RABBIT_STATS_CIPHER].errors != 1 ||
+       after.op[RABBIT_STATS_PRNG].bytes -
+          before.op[RABBIT_STATS_PRNG].bytes != 32)
+      return 1;
+
+   /* Every call lands in exactly one latency bucket */
+   for (op=0; op<RABBIT_STATS_OPS; op++)
+   {
+      timed = 0;
+      for (b=0; b<RABBIT_STATS_BUCKETS; b++)
+         timed += after.op[op].latency[b] - before.op[op].latency[b];
+      if (timed != after.op[op].calls - before.op[op].calls)
+         return 1;
+   }
+   return 0;
+#else
+   (void)p_key;
+   (void)p_iv;
+   (void)before;
+   return !rabbit_stats_snapshot(&after);
+#endif
+}
+
+/* -------------------------------------------------------------------------- */
+
+/* Tune on first use, which must keep the non-temporal threshold the */
+/* caller set, then tune twice through a cache file and check that the */
+/* second run loads the first result. Return 0 on success. */
+static int test_autotune(void)
+{
+   /* Temporary variables */
+   rabbit_tune first, second;
+   rabbit_tune_class small, large;
+   char path[64];
+   int i, res = 0;
+
+   /* Do the test */
+   rabbit_set_nt_threshold((size_t)-1);
+   if (rabbit_tune_lookup(100, &small) ||
+       rabbit_get_nt_threshold() != (size_t)-1)
+      res = 1;
+
+   snprintf(path, sizeof(path), "/tmp/rabbit_tune_test.%ld", (long)getpid());
+   remove(path);
+   if (rabbit_autotune(&first, path) || first.from_cache ||
+       rabbit_get_nt_threshold() != first.nt_threshold ||
+       rabbit_autotune(&second, path) || !second.from_cache ||
+       first.nt_threshold != second.nt_threshold ||
+       !test_if_equal((cc_byte *)first.cpu_model, (cc_byte *)second.cpu_model,
+              sizeof(first.cpu_model)))
+      res = 1;
+   for (i=0; i<RABBIT_TUNE_CLASSES && !res; i++)
+      if ((i && first.classes[i].max_size <= first.classes[i-1].max_size) ||
+          first.classes[i].lanes < 1 ||
+          (first.classes[i].backend == RABBIT_TUNE_PRECOMP) !=
+          (first.classes[i].buffer_size != 0) ||
+          first.classes[i].max_size != second.classes[i].max_size ||
+          first.classes[i].backend != second.classes[i].backend ||
+          first.classes[i].lanes != second.classes[i].lanes ||
+          first.classes[i].buffer_size != second.classes[i].buffer_size)
+         res = 1;
+   if (rabbit_tune_lookup(100, &small) ||
+       rabbit_tune_lookup((size_t)1 << 40, &large) ||
+       small.max_size != 1024 ||
+       large.max_size != first.classes[RABBIT_TUNE_CLASSES-1].max_size)
+      res = 1;
+   remove(path);
+   rabbit_set_nt_threshold(0);
+   return res;
+}
+
+/* -------------------------------------------------------------------------- */
+
+/* Test if a stream resumed from a snapshot continues where it stopped: */
+/* a plain instance, a precompute session with a partial block buffered and */
+/* a session table entry. A damaged snapshot must be rejected. Return 0 */
+/* on success. */
+static int test_snapshot(cc_byte *p_key, cc_byte *p_iv, cc_byte *p_res)
+{
+   /* Temporary variables */
+   rabbit_instance r_master_inst, r_inst;
+   rabbit_snapshot snapshot;
+   rabbit_precomp *p_first, *p_second;
+   rabbit_session_table *p_table1, *p_table2;
+   cc_byte src[48], buffer[48], image[RABBIT_SNAPSHOT_SIZE(64)];
+   size_t size;
+   int i, res = 0;
+
+   clear(src, 48);
+   rabbit_key_setup(&r_master_inst, p_key, 16);
+
+   /* Do the test with an instance */
+   clear((cc_byte *)&snapshot, sizeof(snapshot));
+   rabbit_iv_setup(&r_master_inst, &snapshot.instance, p_iv, 8);
+   rabbit_cipher(&snapshot.instance, src, buffer, 16);
+   for (i=0; i<8; i++)
+      snapshot.iv[i] = p_iv[i];
+   snapshot.has_iv = 1;
+   snapshot.blocks = 1;
+   if (rabbit_snapshot_export(&snapshot, NULL, image, RABBIT_SNAPSHOT_SIZE(0)))
+      return 1;
+   image[20] ^= 1;
+   if (!rabbit_snapshot_import(&snapshot, NULL, 0, image,
+          RABBIT_SNAPSHOT_SIZE(0)))
+      return 1;
+   image[20] ^= 1;
+   clear((cc_byte *)&snapshot, sizeof(snapshot));
+   if (rabbit_snapshot_import(&snapshot, NULL, 0, image,
+          RABBIT_SNAPSHOT_SIZE(0)) || !snapshot.has_iv ||
+       snapshot.blocks != 1 || !test_if_equal(snapshot.iv, p_iv, 8))
+      return 1;
+   rabbit_cipher(&snapshot.instance, src+16, buffer+16, 32);
+   res |= !test_if_equal(buffer, p_res, 48);
+
+   /* Do the test with a precompute session holding 11 unused bytes */
+   rabbit_iv_setup(&r_master_inst, &r_inst, p_iv, 8);
+   if (rabbit_precomp_create(&p_first, &r_inst, 64))
+      return 1;
+   rabbit_precomp_cipher(p_first, src, buffer, 5);
+   if (rabbit_precomp_export(p_first, image, sizeof(image), &size) ||
+       size != RABBIT_SNAPSHOT_SIZE(11) ||
+       rabbit_precomp_import(&p_second, image, size, 16))
+      res = 1;
+   else
+   {
+      rabbit_precomp_refill(p_second);
+      rabbit_precomp_cipher(p_second, src+5, buffer+5, 43);
+      res |= !test_if_equal(buffer, p_res, 48);
+      rabbit_precomp_destroy(p_second);
+   }
+   rabbit_precomp_destroy(p_first);
+
+   /* Do the test with a session moved between tables */
+   if (rabbit_session_create(&p_table1, &r_master_inst, 4, 1))
+      return 1;
+   if (rabbit_session_create(&p_table2, &r_master_inst, 4, 1))
+   {
+      rabbit_session_destroy(p_table1);
+      return 1;
+   }
+   if (rabbit_session_open(p_table1, 1, p_iv, 8) ||
+       rabbit_session_cipher(p_table1, 1, src, buffer, 32) ||
+       rabbit_session_export(p_table1, 1, image, RABBIT_SNAPSHOT_SIZE(0)) ||
+       rabbit_session_import(p_table2, 7, image, RABBIT_SNAPSHOT_SIZE(0)) ||
+       rabbit_session_cipher(p_table2, 7, src+32, buffer+32, 16))
+      res = 1;
+   res |= !test_if_equal(buffer, p_res, 48);
+   rabbit_session_destroy(p_table1);
+   rabbit_session_destroy(p_table2);
+
+   return res;
+}
+
+/* -------------------------------------------------------------------------- */
+
+/* Write a log, add a torn tail, reopen it and append again, then read the */
+/* records back out of order. Record 0 must be the keystream of the base */
+/* IV. Return 0 on success. */
+static int test_log(cc_byte *p_key, cc_byte *p_iv, cc_byte *p_res)
+{
+   /* Temporary variables */
+   rabbit_instance r_master_inst;
+   rabbit_log *p_log;
+   rabbit_log_reader *p_reader;
+   cc_byte src[48], buffer[48];
+   unsigned long long seq, count;
+   size_t size;
+   char path[64];
+   FILE *p_file;
+   int i, res = 0;
+
+   for (i=0; i<48; i++)
+      src[i] = (cc_byte)(i + 1);
+   rabbit_key_setup(&r_master_inst, p_key, 16);
+   snprintf(path, sizeof(path), "/tmp/rabbit_log_test.%ld", (long)getpid());
+   remove(path);
+
+   /* Write records of 48, 5 and 0 bytes */
+   clear(buffer, 48);
+   if (rabbit_log_open(&p_log, path, &r_master_inst, p_iv, NULL))
+      return 1;
+   if (rabbit_log_append(p_log, buffer, 48, &seq) || seq != 0 ||
+       rabbit_log_append(p_log, src, 5, &seq) || seq != 1 ||
+       rabbit_log_append(p_log, NULL, 0, &seq) || seq != 2)
+      res = 1;
+   rabbit_log_close(p_log);
+
+   /* Check the ciphertext of record 0, then tear the tail */
+   p_file = fopen(path, "r+b");
+   if (!p_file)
+      return 1;
+   if (fseek(p_file, 48, SEEK_SET) || fread(buffer, 1, 48, p_file) != 48 ||
+       !test_if_equal(buffer, p_res, 48) ||
+       fseek(p_file, 0, SEEK_END) || fwrite(src, 1, 7, p_file) != 7)
+      res = 1;
+   fclose(p_file);
+
+   /* Reopen and append */
+   if (rabbit_log_open(&p_log, path, &r_master_inst, NULL, NULL))
+   {
+      remove(path);
+      return 1;
+   }
+   if (rabbit_log_append(p_log, src, 20, &seq) || seq != 3)
+      res = 1;
+   rabbit_log_close(p_log);
+
+   /* Read back */
+   if (rabbit_log_reader_open(&p_reader, path, &r_master_inst, 2))
+   {
+      remove(path);
+      return 1;
+   }
+   if (rabbit_log_count(p_reader, &count) || count != 4 ||
+       rabbit_log_read(p_reader, 3, buffer, 48, &size) || size != 20 ||
+       !test_if_equal(buffer, src, 20) ||
+       rabbit_log_read(p_reader, 1, buffer, 48, &size) || size != 5 ||
+       !test_if_equal(buffer, src, 5) ||
+       rabbit_log_read(p_reader, 2, buffer, 48, &size) || size != 0 ||
+       !rabbit_log_read(p_reader, 0, buffer, 16, &size) || size != 48 ||
+       rabbit_log_read(p_reader, 0, buffer, 48, &size) || size != 48 ||
+       !rabbit_log_read(p_reader, 4, buffer, 48, &size))
+      res = 1;
+   clear(src, 48);
+   res |= !test_if_equal(buffer, src, 48);
+   rabbit_log_reader_close(p_reader);
+   remove(path);
+
+   return res;
+}
+
+/* -------------------------------------------------------------------------- */
+
+/* Fill a table of small shards to its limit, then look up an id that is */
+/* not in it, which must fail rather than probe forever. A session must */
+/* still encrypt like its own stream. Return 0 on success. */
+static int test_session_full(cc_byte *p_key, cc_byte *p_iv, cc_byte *p_res)
+{
+   /* Temporary variables */
+   rabbit_instance r_master_inst;
+   rabbit_session_table *p_table;
+   cc_byte src[48], buffer[48];
+   rabbit_session_id id, first = 0;
+   int opened = 0, res = 0;
+
+   clear(src, 48);
+   rabbit_key_setup(&r_master_inst, p_key, 16);
+   if (rabbit_session_create(&p_table, &r_master_inst, 4, 4))
+      return 1;
+
+   /* Do the test */
+   for (id=0; id<100; id++)
+      if (!rabbit_session_open(p_table, id, p_iv, 8) && !opened++)
+         first = id;
+   if (!opened || opened == 100 ||
+       !rabbit_session_cipher(p_table, 12345, src, buffer, 16) ||
+       !rabbit_session_close(p_table, 12345) ||
+       rabbit_session_cipher(p_table, first, src, buffer, 48))
+      res = 1;
+   res |= !test_if_equal(buffer, p_res, 48);
+
+   rabbit_session_destroy(p_table);
+   return res;
+}
+
+/* -------------------------------------------------------------------------- */
+
+/* Test rabbit_pool: instances are zeroed and cache line aligned, the */
+/* limit holds, released instances come back cleared and a reset clears */
+/* and releases everything. Return 0 on success. */
+static int test_pool(cc_byte *p_key, cc_byte *p_res)
+{
+   /* Temporary variables */
+   rabbit_pool *p_pool;
+   rabbit_instance *p_inst[3], *p_extra;
+   cc_byte zero[sizeof(rabbit_instance)], buffer[48];
+   int i, res = 0;
+
+   clear(zero, sizeof(zero));
+   if (rabbit_pool_create(&p_pool, 3, RABBIT_POOL_HUGEPAGES))
+      return 1;
+
+   /* Do the test */
+   for (i=0; i<3; i++)
+      if (rabbit_pool_alloc(p_pool, &p_inst[i]) ||
+          (size_t)p_inst[i] % RABBIT_CACHE_LINE ||
+          !test_if_equal((cc_byte *)p_inst[i], zero, sizeof(zero)))
+      {
+         rabbit_pool_destroy(p_pool);
+         return 1;
+      }
+   if (!rabbit_pool_alloc(p_pool, &p_extra))
+      res = 1;
+
+   /* A pool instance encrypts like any other */
+   rabbit_key_setup(p_inst[1], p_key, 16);
+   clear(buffer, 48);
+   rabbit_cipher(p_inst[1], buffer, buffer, 48);
+   res |= !test_if_equal(buffer, p_res, 48);
+
+   /* A released instance is cleared and makes room under the limit */
+   rabbit_pool_free(p_pool, p_inst[1]);
+   if (rabbit_pool_alloc(p_pool, &p_extra) || p_extra != p_inst[1] ||
+       !test_if_equal((cc_byte *)p_extra, zero, sizeof(zero)))
+      res = 1;
+
+   /* A reset clears every instance and lifts the limit again */
+   for (i=0; i<3; i++)
+      rabbit_key_setup(p_inst[i], p_key, 16);
+   rabbit_pool_reset(p_pool);
+   for (i=0; i<3; i++)
+      if (rabbit_pool_alloc(p_pool, &p_extra) ||
+          !test_if_equal((cc_byte *)p_extra, zero, sizeof(zero)))
+         res = 1;
+   if (!rabbit_pool_alloc(p_pool, &p_extra))
+      res = 1;
+
+   rabbit_pool_destroy(p_pool);
+   return res;
+}
+
+/* -------------------------------------------------------------------------- */
+
+/* Test if rabbit_shared_read() hands out the keystream of the seed */
+/* instance when read in uneven pieces across chunk refills. Return 0 on */
+/* success. */
+static int test_shared_read(cc_byte *p_key, cc_byte *p_res)
+{
+   /* Temporary variables */
+   rabbit_instance r_inst;
+   rabbit_shared *p_shared;
+   cc_byte buffer[48];
+   size_t sizes[5] = { 5, 11, 1, 23, 8 }, offset = 0;
+   int i, res = 0;
+
+   rabbit_key_setup(&r_inst, p_key, 16);
+   if (rabbit_shared_create(&p_shared, &r_inst, 16, 2))
+      return 1;
+
+   /* Do the test */
+   clear(buffer, 48);
+   for (i=0; i<5; i++)
+   {
+      if (rabbit_shared_read(p_shared, buffer+offset, sizes[i]))
+         res = 1;
+      offset += sizes[i];
+   }
+   res |= !test_if_equal(buffer, p_res, 48);
+
+   rabbit_shared_destroy(p_shared);
+   return res;
+}
+
+/* -------------------------------------------------------------------------- */
+
+/* Test if rabbit_precomp_cipher() continues the stream across refills of */
+/* a one-block buffer when called with odd lengths. Return 0 on success. */
+static int test_precomp_cipher(cc_byte *p_key, cc_byte *p_res)
+{
+   /* Temporary variables */
+   rabbit_instance r_inst;
+   rabbit_precomp *p_session;
+   cc_byte src[48], buffer[48];
+   size_t sizes[4] = { 7, 9, 13, 19 }, offset = 0;
+   int i, res = 0;
+
+   rabbit_key_setup(&r_inst, p_key, 16);
+   if (rabbit_precomp_create(&p_session, &r_inst, 16))
+      return 1;
+
+   /* Do the test, refilling before every other piece */
+   clear(src, 48);
+   clear(buffer, 48);
+   for (i=0; i<4; i++)
+   {
+      if (i%2)
+         rabbit_precomp_refill(p_session);
+      if (rabbit_precomp_cipher(p_session, src+offset, buffer+offset,
+             sizes[i]))
+         res = 1;
+      offset += sizes[i];
+   }
+   res |= !test_if_equal(buffer, p_res, 48);
+
+   rabbit_precomp_destroy(p_session);
+   return res;
+}
+
+/* -------------------------------------------------------------------------- */
+
+/* Memory source or sink for rabbit_pipeline_run() */
+typedef struct
+{
+   cc_byte *p_data;
+   size_t size;
+   size_t offset;
+   size_t piece;   /* Most bytes a read returns */
+} test_stream;
+
+/* Pipeline source: read at most one piece */
+static long test_stream_read(void *p_context, cc_byte *p_buf, size_t size)
+{
+   /* Temporary variables */
+   test_stream *p_stream = (test_stream *)p_context;
+   size_t i;
+
+   if (size > p_stream->piece)
+      size = p_stream->piece;
+   if (size > p_stream->size - p_stream->offset)
+      size = p_stream->size - p_stream->offset;
+   for (i=0; i<size; i++)
+      p_buf[i] = p_stream->p_data[p_stream->offset++];
+   return (long)size;
+}
+
+/* Pipeline sink: append, failing on overflow */
+static int test_stream_write(void *p_context, const cc_byte *p_buf,
+          size_t size)
+{
+   /* Temporary variables */
+   test_stream *p_stream = (test_stream *)p_context;
+   size_t i;
+
+   if (size > p_stream->size - p_stream->offset)
+      return -1;
+   for (i=0; i<size; i++)
+      p_stream->p_data[p_stream->offset++] = p_buf[i];
+   return 0;
+}
+
+/* Test if rabbit_pipeline_run() encrypts to the known answer through a */
+/* ring of two one-block slots fed in 5-byte reads, and decrypts back. */
+/* Return 0 on success. */
+static int test_pipeline_run(cc_byte *p_key, cc_byte *p_res)
+{
+   /* Temporary variables */
+   rabbit_pipeline_config config = { 16, 2, 1, RABBIT_PIPELINE_FUTEX };
+   rabbit_instance r_inst;
+   cc_byte src[48], buffer[48], back[48];
+   test_stream in, out;
+   int res = 0;
+
+   clear(src, 48);
+   clear(buffer, 48);
+   clear(back, 48);
+
+   /* Encrypt */
+   in.p_data = src;
+   in.size = 48;
+   in.offset = 0;
+   in.piece = 5;
+   out = in;
+   out.p_data = buffer;
+   rabbit_key_setup(&r_inst, p_key, 16);
+   if (rabbit_pipeline_run(&config, &r_inst, test_stream_read, &in,
+          test_stream_write, &out) || out.offset != 48)
+      res = 1;
+   res |= !test_if_equal(buffer, p_res, 48);
+
+   /* Decrypt */
+   in.p_data = buffer;
+   in.offset = 0;
+   out.p_data = back;
+   out.offset = 0;
+   rabbit_key_setup(&r_inst, p_key, 16);
+   if (rabbit_pipeline_run(&config, &r_inst, test_stream_read, &in,
+          test_stream_write, &out) || out.offset != 48)
+      res = 1;
+   res |= !test_if_equal(back, src, 48);
+
+   return res;
+}
+
+/* -------------------------------------------------------------------------- */
+
+/* What rabbit_session_evict_idle() reported */
+typedef struct
+{
+   rabbit_session_id id;
+   cc_byte iv[8];
+   unsigned long long blocks;
+   int count;
+} test_evicted;
+
+/* Eviction callback: record the session */
+static void test_session_evicted(void *p_context, rabbit_session_id id,
+          const cc_byte *p_iv, unsigned long long blocks)
+{
+   /* Temporary variables */
+   test_evicted *p_evicted = (test_evicted *)p_context;
+   int i;
+
+   p_evicted->id = id;
+   for (i=0; i<8; i++)
+      p_evicted->iv[i] = p_iv[i];
+   p_evicted->blocks = blocks;
+   p_evicted->count++;
+}
+
+/* Test if a session evicted after three idle ticks, then restored from */
+/* the IV and block count reported for it, continues its stream while a */
+/* busy session stays. Return 0 on success. */
+static int test_session_evict(cc_byte *p_key, cc_byte *p_iv, cc_byte *p_res)
+{
+   /* Temporary variables */
+   rabbit_instance r_master_inst;
+   rabbit_session_table *p_table;
+   test_evicted evicted;
+   cc_byte src[48], buffer[48], busy[16];
+   int i, res = 0;
+
+   clear(src, 48);
+   clear(buffer, 48);
+   evicted.count = 0;
+   rabbit_key_setup(&r_master_inst, p_key, 16);
+   if (rabbit_session_create(&p_table, &r_master_inst, 64, 0))
+      return 1;
+
+   /* Do the test */
+   if (rabbit_session_open(p_table, 7, p_iv, 8) ||
+       rabbit_session_open(p_table, 8, p_iv, 8) ||
+       rabbit_session_cipher(p_table, 7, src, buffer, 16))
+      res = 1;
+   for (i=0; i<3; i++)
+   {
+      rabbit_session_tick(p_table);
+      rabbit_session_cipher(p_table, 8, src, busy, 16);
+   }
+   if (rabbit_session_evict_idle(p_table, 3, test_session_evicted,
+          &evicted) != 1 || evicted.count != 1 || evicted.id != 7 ||
+       evicted.blocks != 1 || !test_if_equal(evicted.iv, p_iv, 8) ||
+       !rabbit_session_cipher(p_table, 7, src, buffer+16, 16))
+      res = 1;
+   if (rabbit_session_restore(p_table, 7, evicted.iv, 8, evicted.blocks) ||
+       rabbit_session_cipher(p_table, 7, src+16, buffer+16, 32))
+      res = 1;
+   res |= !test_if_equal(buffer, p_res, 48);
+
+   rabbit_session_destroy(p_table);
+   return res;
+}
+
+/* -------------------------------------------------------------------------- */
+
+/* Test if rabbit_segment_cipher_parallel() on a pinned pool, over a */
+/* buffer from rabbit_segment_alloc(), matches rabbit_segment_cipher(), */
+/* short last segment included. Segment 0 of zeros gives the vector of the */
+/* base IV. Return 0 on success. */
+static int test_segment_numa(cc_byte *p_key, cc_byte *p_iv, cc_byte *p_res)
+{
+   /* Temporary variables */
+   rabbit_instance r_master_inst;
+   rabbit_sched *p_sched;
+   cc_byte *p_buf, ref[17*256 + 48];
+   size_t i, size = sizeof(ref);
+   int res = 0;
+
+   rabbit_key_setup(&r_master_inst, p_key, 16);
+   if (rabbit_sched_create_numa(&p_sched, 2))
+      return 1;
+   if (rabbit_segment_alloc(p_sched, 256, size, &p_buf))
+   {
+      rabbit_sched_destroy(p_sched);
+      return 1;
+   }
+
+   /* Do the test */
+   for (i=0; i<size; i++)
+      ref[i] = p_buf[i] = (cc_byte)(i < 256 ? 0 : i*7);
+   if (rabbit_segment_cipher(&r_master_inst, p_iv, 256, 0, ref, ref, size) ||
+       rabbit_segment_cipher_parallel(p_sched, &r_master_inst, p_iv, 256, 0,
+          p_buf, p_buf, size))
+      res = 1;
+   res |= !test_if_equal(p_buf, ref, size);
+   res |= !test_if_equal(p_buf, p_res, 48);
+
+   rabbit_segment_free(p_buf, size);
+   rabbit_sched_destroy(p_sched);
+   return res;
+}
+
+/* -------------------------------------------------------------------------- */
+
 /* Do the tests */
 int main(int argc, char* argv[])
 {
@@ -204,6 +1054,46 @@ int main(int argc, char* argv[])
                          0xCB, 0x51, 0x15, 0xF0, 0x34, 0xF0, 0x3D, 0x31, 
                          0x17, 0x1C, 0xA7, 0x5F, 0x89, 0xFC, 0xCB, 0x9F };
 
+   cc_byte aad1[12]  = { 0x50, 0x51, 0x52, 0x53, 0x54, 0x55, 0x56, 0x57,
+                         0x58, 0x59, 0x5A, 0x5B };
+
+   cc_byte msg1[37]  = "Rabbit with Poly1305 authentication.!";
+
+   cc_byte msg2[48]  = { 0x00 };
+
+   cc_byte ct1[37]   = { 0x38, 0x5C, 0x0A, 0x40, 0x06, 0x35, 0xE5, 0x81,
+                         0xE8, 0x15, 0xF7, 0xD8, 0x14, 0x3C, 0x13, 0x15,
+                         0x02, 0xF9, 0x35, 0x1A, 0xA0, 0x9F, 0x34, 0x43,
+                         0xB1, 0xCA, 0x35, 0x2B, 0x36, 0x97, 0xFB, 0x06,
+                         0x1C, 0x3B, 0x64, 0x28, 0x52 };
+
+   cc_byte tag1[16]  = { 0x77, 0x57, 0x24, 0x2D, 0x11, 0x80, 0x7C, 0x6B,
+                         0x8F, 0x57, 0x12, 0x5C, 0x7A, 0xA3, 0xDD, 0x33 };
+
+   cc_byte ct2[48]   = { 0x45, 0xC2, 0x17, 0x1C, 0xD8, 0x9C, 0x64, 0x77,
+                         0xC5, 0x01, 0xB8, 0x95, 0xA4, 0x30, 0x85, 0x5B,
+                         0x38, 0xF5, 0x19, 0x94, 0xB6, 0xA4, 0xBD, 0x6C,
+                         0x08, 0x62, 0x98, 0xF7, 0x46, 0x4C, 0xC2, 0x0A,
+                         0x58, 0xE7, 0x50, 0xA5, 0x26, 0x24, 0x6F, 0x77,
+                         0x14, 0xD5, 0x26, 0x64, 0x74, 0x60, 0x5B, 0xFA };
+
+   cc_byte tag2[16]  = { 0xF9, 0x12, 0xF0, 0xF8, 0x01, 0xB2, 0x15, 0xAB,
+                         0x96, 0xC8, 0x9A, 0xC5, 0x5B, 0xEF, 0xD6, 0x10 };
+
+   /* Poly1305 test vector from RFC 8439, section 2.5.2 */
+   cc_byte pkey1[32] = { 0x85, 0xD6, 0xBE, 0x78, 0x57, 0x55, 0x6D, 0x33,
+                         0x7F, 0x44, 0x52, 0xFE, 0x42, 0xD5, 0x06, 0xA8,
+                         0x01, 0x03, 0x80, 0x8A, 0xFB, 0x0D, 0xB2, 0xFD,
+                         0x4A, 0xBF, 0xF6, 0xAF, 0x41, 0x49, 0xF5, 0x1B };
+
+   cc_byte pmsg1[34] = "Cryptographic Forum Research Group";
+
+   cc_byte ptag1[16] = { 0xA8, 0x06, 0x1D, 0xC1, 0x30, 0x51, 0x36, 0xC6,
+                         0xC2, 0x2B, 0x8B, 0xAF, 0x0C, 0x01, 0x27, 0xA9 };
+
+   /* CRC32C check value */
+   cc_byte check1[9] = "123456789";
+
    /* Test 1: Testing key_setup() and cipher() */
    res = test_key_setup_and_cipher(key1, out1);
    if (res)
@@ -276,6 +1166,134 @@ int main(int argc, char* argv[])
       printf("Error found in test 12 (testing key_setup(), iv_setup() and prng())!\n");
    error_found |= res;
 
+   /* Test 13: Testing aead_encrypt() with associated data */
+   res = test_aead_encrypt(key2, iv2, aad1, 12, msg1, 37, ct1, tag1);
+   if (res)
+      printf("Error found in test 13 (testing aead_encrypt())!\n");
+   error_found |= res;
+
+   /* Test 14: Testing aead_encrypt() without associated data */
+   res = test_aead_encrypt(key3, iv3, aad1, 0, msg2, 48, ct2, tag2);
+   if (res)
+      printf("Error found in test 14 (testing aead_encrypt())!\n");
+   error_found |= res;
+
+   /* Test 15: Testing aead_decrypt() */
+   res = test_aead_decrypt(key2, iv2, aad1, 12, ct1, 37, msg1, tag1);
+   if (res)
+      printf("Error found in test 15 (testing aead_decrypt())!\n");
+   error_found |= res;
+
+   /* Test 16: Testing poly1305_init(), poly1305_update() and poly1305_final() */
+   res = test_poly1305(pkey1, pmsg1, 34, ptag1);
+   if (res)
+      printf("Error found in test 16 (testing poly1305())!\n");
+   error_found |= res;
+
+   /* Test 17: Testing crc32c() */
+   res = test_crc32c(check1, 9, 0xE3069283);
+   if (res)
+      printf("Error found in test 17 (testing crc32c())!\n");
+   error_found |= res;
+
+   /* Test 18: Testing cipher_crc32c() */
+   res = test_cipher_crc32c(key1, iv2, out5);
+   if (res)
+      printf("Error found in test 18 (testing cipher_crc32c())!\n");
+   error_found |= res;
+
+   /* Test 19: Testing key_setup(), iv_setup() and cipher_iov() */
+   res = test_cipher_iov(key1, iv3, out6);
+   if (res)
+      printf("Error found in test 19 (testing key_setup(), iv_setup() and cipher_iov())!\n");
+   error_found |= res;
+
+   /* Test 20: Testing encrypt_many() */
+   res = test_encrypt_many(key1, key2, iv1, iv3, out2, out4, out6);
+   if (res)
+      printf("Error found in test 20 (testing encrypt_many())!\n");
+   error_found |= res;
+
+   /* Test 21: Testing key_setup(), iv_setup() and cipher() with */
+   /* non-temporal stores */
+   res = test_cipher_nt(key1, iv3, out6);
+   if (res)
+      printf("Error found in test 21 (testing key_setup(), iv_setup() and cipher() with non-temporal stores)!\n");
+   error_found |= res;
+
+   /* Test 22: Testing key_setup(), iv_setup(), cipher() and prng() on */
+   /* unaligned buffers */
+   res = test_unaligned(key1, iv3, out6);
+   if (res)
+      printf("Error found in test 22 (testing key_setup(), iv_setup(), cipher() and prng() on unaligned buffers)!\n");
+   error_found |= res;
+
+   /* Test 23: Testing stats_snapshot() */
+   res = test_stats(key1, iv3);
+   if (res)
+      printf("Error found in test 23 (testing stats_snapshot())!\n");
+   error_found |= res;
+
+   /* Test 24: Testing autotune() */
+   res = test_autotune();
+   if (res)
+      printf("Error found in test 24 (testing autotune())!\n");
+   error_found |= res;
+
+   /* Test 25: Testing snapshot_export() and snapshot_import() */
+   res = test_snapshot(key1, iv3, out6);
+   if (res)
+      printf("Error found in test 25 (testing snapshot_export() and snapshot_import())!\n");
+   error_found |= res;
+
+   /* Test 26: Testing log_append() and log_read() */
+   res = test_log(key1, iv3, out6);
+   if (res)
+      printf("Error found in test 26 (testing log_append() and log_read())!\n");
+   error_found |= res;
+
+   /* Test 27: Testing session_cipher() on a full table */
+   res = test_session_full(key1, iv3, out6);
+   if (res)
+      printf("Error found in test 27 (testing session_cipher() on a full table)!\n");
+   error_found |= res;
+
+   /* Test 28: Testing pool_alloc() and pool_free() */
+   res = test_pool(key1, out1);
+   if (res)
+      printf("Error found in test 28 (testing pool_alloc() and pool_free())!\n");
+   error_found |= res;
+
+   /* Test 29: Testing shared_read() in uneven pieces */
+   res = test_shared_read(key1, out1);
+   if (res)
+      printf("Error found in test 29 (testing shared_read() in uneven pieces)!\n");
+   error_found |= res;
+
+   /* Test 30: Testing precomp_cipher() across refills */
+   res = test_precomp_cipher(key1, out1);
+   if (res)
+      printf("Error found in test 30 (testing precomp_cipher() across refills)!\n");
+   error_found |= res;
+
+   /* Test 31: Testing pipeline_run() */
+   res = test_pipeline_run(key1, out1);
+   if (res)
+      printf("Error found in test 31 (testing pipeline_run())!\n");
+   error_found |= res;
+
+   /* Test 32: Testing session_evict_idle() and session_restore() */
+   res = test_session_evict(key1, iv3, out6);
+   if (res)
+      printf("Error found in test 32 (testing session_evict_idle() and session_restore())!\n");
+   error_found |= res;
+
+   /* Test 33: Testing segment_cipher_parallel() on a pinned pool */
+   res = test_segment_numa(key1, iv3, out6);
+   if (res)
+      printf("Error found in test 33 (testing segment_cipher_parallel() on a pinned pool)!\n");
+   error_found |= res;
+
    /* Print result */
    if (!error_found)
       printf("\nAll tests passed successfully!\n");
@@ -0,0 +1,440 @@
+/******************************************************************************/
+/* File name: rabbit_test.cpp                                                 */
+/*----------------------------------------------------------------------------*/
+/* Source file for test program for the C++ interfaces of the Rabbit stream   */
+/* cipher (rabbit_async.hpp, rabbit_streambuf.hpp,                            */
+/* rabbit_keystream_view.hpp).                                                */
+/*                                                                            */
+/* Every result is checked against the C functions, which rabbit_test.c       */
+/* checks against the test vectors. Build with a C++20 compiler and link      */
+/* with the library sources compiled as C, e.g.                               */
+/*                                                                            */
+/*    g++ -std=c++20 -O2 -pthread rabbit_test.cpp <library objects>           */
+/*                                                                            */
+/* This source code is for little-endian processors (e.g. x86).               */
+/******************************************************************************/
+
+#include <algorithm>
+#include <atomic>
+#include <coroutine>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <exception>
+#include <istream>
+#include <ostream>
+#include <ranges>
+#include <span>
+#include <sstream>
+#include <string>
+#include <vector>
+#include "rabbit.h"
+#include "rabbit_async.hpp"
+#include "rabbit_keystream_view.hpp"
+#include "rabbit_parallel.h"
+#include "rabbit_stats.h"
+#include "rabbit_streambuf.hpp"
+
+/* -------------------------------------------------------------------------- */
+
+/* Coroutine that starts at once and frees itself when it returns */
+struct detached
+{
+   struct promise_type
+   {
+      detached get_return_object() { return {}; }
+      std::suspend_never initial_suspend() noexcept { return {}; }
+      std::suspend_never final_suspend() noexcept { return {}; }
+      void return_void() {}
+      void unhandled_exception() { std::terminate(); }
+   };
+};
+
+/* -------------------------------------------------------------------------- */
+
+/* Fill a data block with a pattern that differs per position */
+static void fill(cc_byte *p_dest, size_t data_size)
+{
+   /* Temporary variables */
+   size_t i;
+
+   for (i=0; i<data_size; i++)
+      p_dest[i] = (cc_byte)(i*7 + (i>>8) + 3);
+}
+
+/* -------------------------------------------------------------------------- */
+
+/* Await async_encrypt() once per entry of sizes on consecutive pieces of */
+/* src, then set *p_done */
+static detached encrypt_pieces(rabbit::cipher_stream &stream,
+          const std::vector<cc_byte> &src, std::vector<cc_byte> &dest,
+          const std::vector<size_t> &sizes, std::atomic<bool> *p_done)
+{
+   /* Temporary variables */
+   size_t offset = 0;
+
+   for (size_t size : sizes)
+   {
+      co_await rabbit::async_encrypt(stream,
+             std::span<const cc_byte>(src.data() + offset, size),
+             std::span<cc_byte>(dest.data() + offset, size),
+             rabbit::inline_executor());
+      offset += size;
+   }
+
+   p_done->store(true);
+   p_done->notify_one();
+}
+
+/* -------------------------------------------------------------------------- */
+
+/* Test async_encrypt() with sizes on both sides of inline_threshold */
+static int test_async_encrypt(cc_byte *p_key, cc_byte *p_iv)
+{
+   /* Temporary variables */
+   const size_t threshold =
+          rabbit::encrypt_awaitable<rabbit::inline_executor>::inline_threshold;
+   const size_t segment_size = 4096;
+   const std::vector<size_t> sizes = { 48, threshold - 16, 3*threshold + 16,
+          1024, (1 << 20) + 4096 + 16, 16, threshold };
+   rabbit_instance master, inst;
+   std::vector<cc_byte> src, dest, ref;
+   unsigned long long first_segment = 0;
+   size_t total = 0, offset = 0;
+
+   for (size_t size : sizes)
+      total += size;
+   src.resize(total);
+   dest.resize(total);
+   ref.resize(total);
+   fill(src.data(), total);
+
+   if (rabbit_key_setup(&master, p_key, 16))
+      return 1;
+   if (rabbit_iv_setup(&master, &inst, p_iv, 8))
+      return 1;
+
+   /* Single stream: the pieces continue one keystream */
+   {
+      rabbit_instance ref_inst = inst;
+      rabbit::cipher_stream stream(inst);
+      std::atomic<bool> done(false);
+
+      if (rabbit_cipher(&ref_inst, src.data(), ref.data(), total))
+         return 1;
+      encrypt_pieces(stream, src, dest, sizes, &done);
+      done.wait(false);
+      if (dest != ref)
+         return 1;
+   }
+
+   /* Segmented: every call starts with a fresh segment */
+   {
+      rabbit::cipher_stream stream(master, p_iv, segment_size);
+      std::atomic<bool> done(false);
+
+      for (size_t size : sizes)
+      {
+         if (rabbit_segment_cipher(&master, p_iv, segment_size, first_segment,
+                src.data() + offset, ref.data() + offset, size))
+            return 1;
+         first_segment += (size + segment_size - 1) / segment_size;
+         offset += size;
+      }
+      std::fill(dest.begin(), dest.end(), 0);
+      encrypt_pieces(stream, src, dest, sizes, &done);
+      done.wait(false);
+      if (dest != ref || stream.next_segment() != first_segment)
+         return 1;
+   }
+
+   return 0;
+}
+
+/* -------------------------------------------------------------------------- */
+
+/* Test cipher_streambuf: flushes in the middle of keystream blocks, bulk */
+/* writes and reads past the chunk size, and single characters mixed with */
+/* reads, for a write and read round trip */
+static int test_streambuf(cc_byte *p_key, cc_byte *p_iv)
+{
+   /* Temporary variables */
+   const size_t chunk = 64;
+   const size_t data_size = 1000;
+   rabbit_instance master, inst;
+   std::vector<cc_byte> plain(data_size + 8), ref(data_size + 8);
+   std::vector<cc_byte> back(data_size);
+   std::string cipher;
+   size_t pos = 0;
+   int c;
+
+   fill(plain.data(), data_size);
+   if (rabbit_key_setup(&master, p_key, 16))
+      return 1;
+   if (rabbit_iv_setup(&master, &inst, p_iv, 8))
+      return 1;
+
+   /* rabbit_cipher() needs whole blocks; the padding is not compared */
+   {
+      rabbit_instance ref_inst = inst;
+
+      if (rabbit_cipher(&ref_inst, plain.data(), ref.data(), data_size + 8))
+         return 1;
+   }
+
+   /* Encrypt, flushing at positions that are not multiples of 16 */
+   {
+      std::stringbuf sink;
+      rabbit::cipher_streambuf buf(&sink, inst, std::ios_base::out, chunk);
+      std::ostream os(&buf);
+      const char *p_src = reinterpret_cast<const char *>(plain.data());
+
+      for (; pos<5; pos++)
+         os.put(p_src[pos]);
+      os.flush();
+      if (sink.str().size() != 5)
+         return 1;
+      os.write(p_src + pos, 30);
+      pos += 30;
+      os.flush();
+      os.write(p_src + pos, 300);
+      pos += 300;
+      for (; pos<338; pos++)
+         os.put(p_src[pos]);
+      os.write(p_src + pos, 7);
+      pos += 7;
+      os.flush();
+      os.write(p_src + pos, 3*chunk + 1);
+      pos += 3*chunk + 1;
+      os.write(p_src + pos, data_size - pos);
+      os.flush();
+      if (!os)
+         return 1;
+      cipher = sink.str();
+   }
+   if (cipher.size() != data_size ||
+       std::memcmp(cipher.data(), ref.data(), data_size))
+      return 1;
+
+   /* Decrypt with single characters between short and bulk reads */
+   {
+      std::stringbuf source(cipher);
+      rabbit::cipher_streambuf buf(&source, inst, std::ios_base::in, chunk);
+      std::istream is(&buf);
+      char *p_dest = reinterpret_cast<char *>(back.data());
+
+      for (pos=0; pos<3; pos++)
+         if ((c = is.get()) == EOF)
+            return 1;
+         else
+            p_dest[pos] = (char)c;
+      is.read(p_dest + pos, 10);
+      pos += 10;
+      is.read(p_dest + pos, 200);
+      pos += 200;
+      if ((c = is.get()) == EOF)
+         return 1;
+      p_dest[pos++] = (char)c;
+      is.read(p_dest + pos, 5);
+      pos += 5;
+      is.read(p_dest + pos, 2*chunk);
+      pos += 2*chunk;
+      is.read(p_dest + pos, data_size - pos);
+      if (!is || is.get() != EOF)
+         return 1;
+   }
+   if (std::memcmp(back.data(), plain.data(), data_size))
+      return 1;
+
+   return 0;
+}
+
+/* -------------------------------------------------------------------------- */
+
+/* Test keystream_view<T>: iterator reads, transform_xor() and */
+/* views::transform_xor mixed on one stream, each crossing refills */
+template <class T>
+static int test_keystream_view(cc_byte *p_key, cc_byte *p_iv)
+{
+   /* Temporary variables */
+   const size_t words = rabbit::keystream_view<T>::chunk_words;
+   const size_t count = 5 + (words + 3) + (2*words - 1) + words + 7 + 1;
+   rabbit_instance master, inst;
+   std::vector<T> src(count), dest(count), ref(count);
+   std::vector<cc_byte> ks((count*sizeof(T) + 15) & ~(size_t)15);
+   size_t pos = 0, i;
+
+   fill(reinterpret_cast<cc_byte *>(src.data()), count*sizeof(T));
+   if (rabbit_key_setup(&master, p_key, 16))
+      return 1;
+   if (rabbit_iv_setup(&master, &inst, p_iv, 8))
+      return 1;
+
+   /* Expected: the rabbit_prng() output of the same instance, which */
+   /* needs whole blocks */
+   {
+      rabbit_instance ref_inst = inst;
+
+      if (rabbit_prng(&ref_inst, ks.data(), ks.size()))
+         return 1;
+      std::memcpy(ref.data(), ks.data(), count*sizeof(T));
+   }
+
+   rabbit::keystream_view<T> view(inst);
+
+   /* Keystream words through the iterator */
+   {
+      auto it = view.begin();
+
+      for (i=0; i<5; i++, ++it)
+         dest[pos++] = *it;
+   }
+
+   /* Eager kernel */
+   view.transform_xor(std::span<const T>(src.data() + pos, words + 3),
+          std::span<T>(dest.data() + pos, words + 3));
+   pos += words + 3;
+
+   /* Lazy adaptor */
+   for (T word : std::span<const T>(src.data() + pos, 2*words - 1) |
+          rabbit::views::transform_xor(view))
+      dest[pos++] = word;
+
+   /* Iterator again, through a standard pipeline */
+   for (T word : view | std::views::take(words))
+      dest[pos++] = word;
+
+   /* In-place kernel, then the adaptor for one word */
+   std::copy(src.begin() + pos, src.begin() + pos + 7, dest.begin() + pos);
+   view.transform_xor(std::span<T>(dest.data() + pos, 7));
+   pos += 7;
+   for (T word : std::span<const T>(src.data() + pos, 1) |
+          rabbit::views::transform_xor(view))
+      dest[pos++] = word;
+
+   /* Words read from the iterator are keystream, the rest src ^ keystream */
+   for (i=0; i<count; i++)
+   {
+      const bool plain = i < 5 || (i >= 5 + (words + 3) + (2*words - 1) &&
+             i < 5 + (words + 3) + (2*words - 1) + words);
+
+      if (dest[i] != (plain ? ref[i] : (T)(src[i] ^ ref[i])))
+         return 1;
+   }
+
+   return 0;
+}
+
+/* -------------------------------------------------------------------------- */
+
+/* Test that the C++ adapters are not counted by the statistics, as the */
+/* library's calls are not (see test 23 of rabbit_test.c) */
+static int test_stats(cc_byte *p_key, cc_byte *p_iv)
+{
+   /* Temporary variables */
+   rabbit_stats before, after;
+#ifdef RABBIT_STATS
+   const size_t data_size = 2 << 20;
+   rabbit_instance master, inst;
+   std::vector<cc_byte> data(data_size);
+   int op;
+
+   if (rabbit_key_setup(&master, p_key, 16))
+      return 1;
+   if (rabbit_iv_setup(&master, &inst, p_iv, 8))
+      return 1;
+
+   /* Do the test */
+   if (rabbit_stats_snapshot(&before))
+      return 1;
+   {
+      rabbit::keystream_view<std::uint64_t> view(inst);
+      std::vector<std::uint64_t> words(100);
+
+      view.transform_xor(std::span<std::uint64_t>(words));
+   }
+   {
+      std::stringbuf sink;
+      rabbit::cipher_streambuf buf(&sink, inst, std::ios_base::out, 64);
+      std::ostream os(&buf);
+
+      os.write(reinterpret_cast<const char *>(data.data()), 1000);
+      os.flush();
+   }
+   {
+      rabbit::cipher_stream stream(inst);
+      const std::vector<size_t> sizes = { 48, data_size - 48 };
+      std::atomic<bool> done(false);
+
+      encrypt_pieces(stream, data, data, sizes, &done);
+      done.wait(false);
+   }
+   if (rabbit_stats_snapshot(&after))
+      return 1;
+
+   for (op=0; op<RABBIT_STATS_OPS; op++)
+      if (after.op[op].calls != before.op[op].calls)
+         return 1;
+   return 0;
+#else
+   (void)p_key;
+   (void)p_iv;
+   (void)before;
+   return !rabbit_stats_snapshot(&after);
+#endif
+}
+
+/* -------------------------------------------------------------------------- */
+
+int main(int argc, char* argv[])
+{
+   /* Temporary variables */
+   int error_found = 0;
+   int res;
+
+   /* Prepare arrays with test data */
+   cc_byte key[16]  = { 0xAC, 0xC3, 0x51, 0xDC, 0xF1, 0x62, 0xFC, 0x3B,
+                        0xFE, 0x36, 0x3D, 0x2E, 0x29, 0x13, 0x28, 0x91 };
+
+   cc_byte iv[8]    = { 0x27, 0x17, 0xF4, 0xD2, 0x1A, 0x56, 0xEB, 0xA6 };
+
+   /* Test 1: Testing async_encrypt() */
+   res = test_async_encrypt(key, iv);
+   if (res)
+      printf("Error found in test 1 (testing async_encrypt())!\n");
+   error_found |= res;
+
+   /* Test 2: Testing cipher_streambuf */
+   res = test_streambuf(key, iv);
+   if (res)
+      printf("Error found in test 2 (testing cipher_streambuf)!\n");
+   error_found |= res;
+
+   /* Test 3: Testing keystream_view<std::uint8_t> */
+   res = test_keystream_view<std::uint8_t>(key, iv);
+   if (res)
+      printf("Error found in test 3 (testing keystream_view<std::uint8_t>)!\n");
+   error_found |= res;
+
+   /* Test 4: Testing keystream_view<std::uint64_t> */
+   res = test_keystream_view<std::uint64_t>(key, iv);
+   if (res)
+      printf("Error found in test 4 (testing keystream_view<std::uint64_t>)!\n");
+   error_found |= res;
+
+   /* Test 5: Testing stats with the C++ adapters */
+   res = test_stats(key, iv);
+   if (res)
+      printf("Error found in test 5 (testing stats with the C++ adapters)!\n");
+   error_found |= res;
+
+   /* Print result */
+   if (!error_found)
+      printf("\nAll tests passed successfully!\n");
+   else
+      printf("\nError(s) have been found!\n");
+
+   return 0;
+}
+
+/* -------------------------------------------------------------------------- */
@@ -0,0 +1,516 @@
+/******************************************************************************/
+/* File name: rabbit_tune.c                                                   */
+/*----------------------------------------------------------------------------*/
+/* Source file for the startup autotuner.                                     */
+/*                                                                            */
+/* Three measurements, each on a few MiB at most:                             */
+/*                                                                            */
+/*  - the critical-path cost of a message served from a filled precompute     */
+/*    buffer against rabbit_cipher(), for the classes a buffer can hold;      */
+/*  - ordinary against non-temporal stores on a buffer larger than L2;        */
+/*  - inline against pooled segmented-IV encryption, if there is more than    */
+/*    one usable CPU.                                                         */
+/*                                                                            */
+/* The time of each pass is estimated from the throughput seen so far; a      */
+/* pass that would overrun the time budget is skipped, and a stage left       */
+/* without a result keeps the defaults, which are what the library does       */
+/* without tuning. Measuring never changes the non-temporal threshold other   */
+/* threads see; only the final result is applied.                             */
+/*                                                                            */
+/* This source code is for little-endian processors (e.g. x86).               */
+/******************************************************************************/
+
+#define _GNU_SOURCE
+
+#include "rabbit_tune.h"
+#include "rabbit_internal.h"
+#include "rabbit_parallel.h"
+#include "rabbit_precomp.h"
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+/* Cache file format version */
+#define RABBIT_TUNE_VERSION 1
+
+/* Time budget of a measurement in seconds */
+#define RABBIT_TUNE_BUDGET 0.050
+
+/* Seconds per byte assumed before the first pass, i.e. 100 MB/s */
+#define RABBIT_TUNE_SLOW 1e-8
+
+/* Bytes per precompute measurement, buffer size of the other stages and */
+/* passes per store mode */
+#define RABBIT_TUNE_WORK   (256*1024)
+#define RABBIT_TUNE_LARGE  (2*1024*1024)
+#define RABBIT_TUNE_SEGMENT (64*1024)
+#define RABBIT_TUNE_PASSES 2
+
+/* Bytes per pooled task, see rabbit_parallel.c */
+#define RABBIT_TUNE_TASK   (1024*1024)
+
+/* Required gain before leaving the default path */
+#define RABBIT_TUNE_PRECOMP_GAIN 0.8
+#define RABBIT_TUNE_NT_GAIN      0.9
+#define RABBIT_TUNE_LANES_GAIN   0.9
+
+/* Upper bounds of the size classes */
+static const size_t rabbit_tune_limits[RABBIT_TUNE_CLASSES] =
+{
+   64, 1024, 16*1024, 256*1024, 4*1024*1024, SIZE_MAX
+};
+
+/* Process-wide result */
+static pthread_mutex_t rabbit_tune_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t rabbit_tune_once = PTHREAD_ONCE_INIT;
+static rabbit_tune rabbit_tune_current;
+static int rabbit_tune_valid;
+
+
+/* Monotonic time in seconds */
+static double rabbit_tune_now(void)
+{
+   /* Temporary variables */
+   struct timespec ts;
+
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return (double)ts.tv_sec + (double)ts.tv_nsec*1e-9;
+}
+
+
+/* Whether work expected to take t seconds still fits the budget of a */
+/* measurement that began at start */
+static int rabbit_tune_fits(double start, double t)
+{
+   return rabbit_tune_now() - start + t <= RABBIT_TUNE_BUDGET;
+}
+
+
+/* CPU model from /proc/cpuinfo and the number of usable CPUs */
+static void rabbit_tune_identify(rabbit_tune *p_tune)
+{
+   /* Temporary variables */
+   static const char *keys[] = { "model name", "cpu model", "Processor",
+          "CPU part" };
+   char line[256], *p_value;
+   FILE *p_file;
+   cpu_set_t set;
+   size_t k, len, best = sizeof(keys)/sizeof(keys[0]);
+
+   strcpy(p_tune->cpu_model, "unknown");
+   p_file = fopen("/proc/cpuinfo", "r");
+   while (p_file && fgets(line, sizeof(line), p_file))
+      for (k=0; k<best; k++)
+         if (!strncmp(line, keys[k], strlen(keys[k])) &&
+             (p_value = strchr(line, ':')))
+         {
+            /* Keep the most descriptive key found */
+            for (p_value++; *p_value == ' ' || *p_value == '\t'; p_value++)
+               ;
+            len = strcspn(p_value, "\n");
+            if (len >= sizeof(p_tune->cpu_model))
+               len = sizeof(p_tune->cpu_model) - 1;
+            memcpy(p_tune->cpu_model, p_value, len);
+            p_tune->cpu_model[len] = 0;
+            best = k;
+            break;
+         }
+   if (p_file)
+      fclose(p_file);
+
+   p_tune->cpu_count = (int)sysconf(_SC_NPROCESSORS_ONLN);
+   if (!sched_getaffinity(0, sizeof(set), &set))
+      p_tune->cpu_count = CPU_COUNT(&set);
+   if (p_tune->cpu_count <= 0)
+      p_tune->cpu_count = 1;
+}
+
+
+/* Load a cached result for the host described by *p_tune */
+static int rabbit_tune_load(rabbit_tune *p_tune, const char *p_path)
+{
+   /* Temporary variables */
+   rabbit_tune loaded;
+   char line[256];
+   unsigned long long max_size, buffer_size, threshold;
+   int version, backend, lanes, i;
+   size_t len;
+   FILE *p_file = fopen(p_path, "r");
+
+   /* Return error if there is no cache yet */
+   if (!p_file)
+      return -1;
+
+   loaded = *p_tune;
+   if (!fgets(line, sizeof(line), p_file) ||
+       sscanf(line, "rabbit_tune %d", &version) != 1 ||
+       version != RABBIT_TUNE_VERSION ||
+       !fgets(line, sizeof(line), p_file) || strncmp(line, "cpu=", 4))
+      goto fail;
+
+   /* Another CPU model or count: measure again */
+   len = strcspn(line+4, "\n");
+   if (len != strlen(p_tune->cpu_model) ||
+       memcmp(line+4, p_tune->cpu_model, len) ||
+       !fgets(line, sizeof(line), p_file) ||
+       sscanf(line, "cpus=%d", &i) != 1 || i != p_tune->cpu_count ||
+       !fgets(line, sizeof(line), p_file) ||
+       sscanf(line, "nt_threshold=%llu", &threshold) != 1)
+      goto fail;
+   loaded.nt_threshold = (size_t)threshold;
+
+   for (i=0; i<RABBIT_TUNE_CLASSES; i++)
+   {
+      if (!fgets(line, sizeof(line), p_file) ||
+          sscanf(line, "class=%llu %d %d %llu", &max_size, &backend, &lanes,
+                 &buffer_size) != 4 ||
+          (size_t)max_size != rabbit_tune_limits[i] ||
+          backend < RABBIT_TUNE_SCALAR || backend > RABBIT_TUNE_NT ||
+          lanes < 1 || buffer_size > RABBIT_PRECOMP_MAX_DEPTH ||
+          buffer_size%16)
+         goto fail;
+      loaded.classes[i].max_size = rabbit_tune_limits[i];
+      loaded.classes[i].backend = backend;
+      loaded.classes[i].lanes = lanes;
+      loaded.classes[i].buffer_size = (size_t)buffer_size;
+   }
+   fclose(p_file);
+   loaded.from_cache = 1;
+   *p_tune = loaded;
+
+   /* Return success */
+   return 0;
+
+fail:
+   /* Return error: stale or damaged cache */
+   fclose(p_file);
+   return -1;
+}
+
+
+/* Write a result next to the cache file, then move it into place */
+static int rabbit_tune_save(const rabbit_tune *p_tune, const char *p_path)
+{
+   /* Temporary variables */
+   char tmp_path[4096];
+   FILE *p_file;
+   int i, res;
+
+   if (snprintf(tmp_path, sizeof(tmp_path), "%s.%ld", p_path,
+          (long)getpid()) >= (int)sizeof(tmp_path))
+      return -1;
+   p_file = fopen(tmp_path, "w");
+   if (!p_file)
+      return -1;
+
+   fprintf(p_file, "rabbit_tune %d\ncpu=%s\ncpus=%d\nnt_threshold=%llu\n",
+          RABBIT_TUNE_VERSION, p_tune->cpu_model, p_tune->cpu_count,
+          (unsigned long long)p_tune->nt_threshold);
+   for (i=0; i<RABBIT_TUNE_CLASSES; i++)
+      fprintf(p_file, "class=%llu %d %d %llu\n",
+             (unsigned long long)p_tune->classes[i].max_size,
+             p_tune->classes[i].backend, p_tune->classes[i].lanes,
+             (unsigned long long)p_tune->classes[i].buffer_size);
+
+   res = ferror(p_file);
+   res |= fclose(p_file);
+   if (res || rename(tmp_path, p_path))
+   {
+      remove(tmp_path);
+      return -1;
+   }
+
+   /* Return success */
+   return 0;
+}
+
+
+/* Time per message of size bytes through rabbit_cipher() and through a */
+/* filled precompute buffer, refills excluded */
+static int rabbit_tune_precomp(const rabbit_instance *p_master, cc_byte *p_buf,
+          size_t size, double *p_scalar, double *p_precomp)
+{
+   /* Temporary variables */
+   rabbit_instance inst = *p_master;
+   rabbit_precomp *p_session;
+   size_t count = RABBIT_TUNE_WORK/size, per_fill, i, j;
+   double t;
+
+   if (rabbit_precomp_create(&p_session, p_master, RABBIT_PRECOMP_MAX_DEPTH))
+      return -1;
+   per_fill = RABBIT_PRECOMP_MAX_DEPTH/size;
+
+   t = rabbit_tune_now();
+   for (i=0; i<count; i++)
+      rabbit_cipher_raw(&inst, p_buf, p_buf, size);
+   *p_scalar = (rabbit_tune_now() - t)/(double)count;
+
+   *p_precomp = 0;
+   for (i=0; i<count; i+=per_fill)
+   {
+      rabbit_precomp_refill(p_session);
+      t = rabbit_tune_now();
+      for (j=0; j<per_fill && i+j<count; j++)
+         rabbit_precomp_cipher(p_session, p_buf, p_buf, size);
+      *p_precomp += rabbit_tune_now() - t;
+   }
+   *p_precomp /= (double)count;
+
+   rabbit_precomp_destroy(p_session);
+   rabbit_wipe(&inst, sizeof(inst));
+
+   /* Return success */
+   return 0;
+}
+
+
+/* Time of one out-of-place pass over size bytes, ordinary or */
+/* non-temporal stores */
+static double rabbit_tune_stores(const rabbit_instance *p_master,
+          const cc_byte *p_src, cc_byte *p_dest, size_t size, int nt)
+{
+   /* Temporary variables */
+   rabbit_instance inst = *p_master;
+   double t;
+
+   t = rabbit_tune_now();
+   rabbit_cipher_stores(&inst, p_src, p_dest, size, nt);
+   t = rabbit_tune_now() - t;
+   rabbit_wipe(&inst, sizeof(inst));
+   return t;
+}
+
+
+/* Best number of threads for segmented-IV encryption of large buffers, */
+/* 1 if the two passes do not fit the budget */
+static int rabbit_tune_lanes(const rabbit_instance *p_master,
+          const cc_byte *p_src, cc_byte *p_dest, size_t size, int cpu_count,
+          double start, double byte_time)
+{
+   /* Temporary variables */
+   static const cc_byte iv[8] = { 0 };
+   rabbit_sched *p_sched;
+   double t_inline, t_pool;
+   int lanes = 1;
+
+   if (cpu_count < 2 || !rabbit_tune_fits(start, 2*(double)size*byte_time) ||
+       rabbit_sched_create(&p_sched, cpu_count))
+      return 1;
+
+   t_inline = rabbit_tune_now();
+   rabbit_segment_cipher(p_master, iv, RABBIT_TUNE_SEGMENT, 0, p_src, p_dest,
+          size);
+   t_inline = rabbit_tune_now() - t_inline;
+
+   /* The pooled pass should take no longer than the inline one */
+   if (!rabbit_tune_fits(start, t_inline))
+   {
+      rabbit_sched_destroy(p_sched);
+      return 1;
+   }
+   t_pool = rabbit_tune_now();
+   if (!rabbit_segment_cipher_parallel(p_sched, p_master, iv,
+          RABBIT_TUNE_SEGMENT, 0, p_src, p_dest, size))
+   {
+      t_pool = rabbit_tune_now() - t_pool;
+      if (t_pool < t_inline*RABBIT_TUNE_LANES_GAIN)
+         lanes = rabbit_sched_size(p_sched);
+   }
+
+   rabbit_sched_destroy(p_sched);
+   return lanes;
+}
+
+
+/* Measure this host */
+static int rabbit_tune_measure(rabbit_tune *p_tune)
+{
+   /* Temporary variables */
+   static const cc_byte key[16] = { 0 };
+   rabbit_instance master;
+   cc_byte *p_src, *p_dest;
+   double start = rabbit_tune_now(), t_scalar, t_precomp, t_plain, t_nt, t;
+   double byte_time = RABBIT_TUNE_SLOW;
+   size_t nt_threshold, lower;
+   int i, mode, passes, lanes = 1;
+
+   p_src = (cc_byte *)malloc(RABBIT_TUNE_LARGE);
+   p_dest = (cc_byte *)aligned_alloc(RABBIT_CACHE_LINE, RABBIT_TUNE_LARGE);
+   if (!p_src || !p_dest)
+   {
+      free(p_src);
+      free(p_dest);
+      return -1;
+   }
+   memset(p_src, 0, RABBIT_TUNE_LARGE);
+   memset(p_dest, 0, RABBIT_TUNE_LARGE);
+   rabbit_key_setup_raw(&master, key, 16);
+
+   /* Defaults: what the library does untuned. The threshold in effect is */
+   /* left alone; it may have been set by the caller. */
+   nt_threshold = rabbit_nt_default();
+   for (i=0; i<RABBIT_TUNE_CLASSES; i++)
+   {
+      p_tune->classes[i].max_size = rabbit_tune_limits[i];
+      p_tune->classes[i].backend = RABBIT_TUNE_SCALAR;
+      p_tune->classes[i].lanes = 1;
+      p_tune->classes[i].buffer_size = 0;
+   }
+
+   /* A buffer pays off when serving from it is clearly cheaper than */
+   /* generating inline; it holds four messages of the class */
+   for (i=0; i<RABBIT_TUNE_CLASSES &&
+        4*rabbit_tune_limits[i] <= RABBIT_PRECOMP_MAX_DEPTH; i++)
+   {
+      if (!rabbit_tune_fits(start, 2*RABBIT_TUNE_WORK*byte_time) ||
+          rabbit_tune_precomp(&master, p_src, rabbit_tune_limits[i],
+             &t_scalar, &t_precomp))
+         break;
+      byte_time = t_scalar/(double)rabbit_tune_limits[i];
+      if (t_precomp < t_scalar*RABBIT_TUNE_PRECOMP_GAIN)
+      {
+         p_tune->classes[i].backend = RABBIT_TUNE_PRECOMP;
+         p_tune->classes[i].buffer_size = 4*rabbit_tune_limits[i];
+      }
+   }
+
+   /* Non-temporal stores from RABBIT_TUNE_LARGE on if they already win */
+   /* there; otherwise keep the threshold derived from the cache size. */
+   /* Alternate the modes and keep the fastest pass of each; the slowest */
+   /* pass seen sizes the next one. */
+   t_plain = t_nt = 0;
+   for (passes=0; passes<2*RABBIT_TUNE_PASSES; passes++)
+   {
+      mode = passes & 1;
+      if (!rabbit_tune_fits(start, RABBIT_TUNE_LARGE*byte_time))
+         break;
+      t = rabbit_tune_stores(&master, p_src, p_dest, RABBIT_TUNE_LARGE, mode);
+      if (t > RABBIT_TUNE_LARGE*byte_time)
+         byte_time = t/RABBIT_TUNE_LARGE;
+      if (mode && (passes < 2 || t < t_nt))
+         t_nt = t;
+      else if (!mode && (passes < 2 || t < t_plain))
+         t_plain = t;
+   }
+   if (passes >= 2 && t_nt < t_plain*RABBIT_TUNE_NT_GAIN &&
+       nt_threshold > RABBIT_TUNE_LARGE)
+      nt_threshold = RABBIT_TUNE_LARGE;
+
+   lanes = rabbit_tune_lanes(&master, p_src, p_dest, RABBIT_TUNE_LARGE,
+          p_tune->cpu_count, start, byte_time);
+
+   /* Classes whose smallest message reaches the threshold stream their */
+   /* output; those spanning several pooled tasks use the threads */
+   for (i=0; i<RABBIT_TUNE_CLASSES; i++)
+   {
+      lower = i ? rabbit_tune_limits[i-1] + 1 : 0;
+      if (lower >= nt_threshold)
+         p_tune->classes[i].backend = RABBIT_TUNE_NT;
+      if (rabbit_tune_limits[i] > RABBIT_TUNE_TASK)
+         p_tune->classes[i].lanes =
+                rabbit_tune_limits[i]/RABBIT_TUNE_TASK < (size_t)lanes ?
+                (int)(rabbit_tune_limits[i]/RABBIT_TUNE_TASK) : lanes;
+   }
+   p_tune->nt_threshold = nt_threshold;
+   p_tune->from_cache = 0;
+
+   rabbit_wipe(&master, sizeof(master));
+   free(p_src);
+   free(p_dest);
+
+   /* Return success */
+   return 0;
+}
+
+
+/* Tune, or load a cached result, and make it current. The non-temporal */
+/* threshold is applied only if apply_nt is set. */
+static int rabbit_tune_run(rabbit_tune *p_tune, const char *p_cache_path,
+          int apply_nt)
+{
+   /* Temporary variables */
+   rabbit_tune tune;
+
+   memset(&tune, 0, sizeof(tune));
+   rabbit_tune_identify(&tune);
+
+   if (!p_cache_path || rabbit_tune_load(&tune, p_cache_path))
+   {
+      if (rabbit_tune_measure(&tune))
+         return -1;
+
+      /* A cache that cannot be written only costs the next start time */
+      if (p_cache_path)
+         rabbit_tune_save(&tune, p_cache_path);
+   }
+
+   pthread_mutex_lock(&rabbit_tune_mutex);
+   if (apply_nt)
+      rabbit_set_nt_threshold(tune.nt_threshold);
+   rabbit_tune_current = tune;
+   rabbit_tune_valid = 1;
+   pthread_mutex_unlock(&rabbit_tune_mutex);
+
+   if (p_tune)
+      *p_tune = tune;
+
+   /* Return success */
+   return 0;
+}
+
+
+/* Tune, or load a cached result, and apply it */
+int rabbit_autotune(rabbit_tune *p_tune, const char *p_cache_path)
+{
+   return rabbit_tune_run(p_tune, p_cache_path, 1);
+}
+
+
+/* Tune on first use unless rabbit_autotune() ran already. The threshold */
+/* in effect is kept: the application may have set it, or turned */
+/* non-temporal stores off. */
+static void rabbit_tune_first_use(void)
+{
+   /* Temporary variables */
+   int valid;
+
+   pthread_mutex_lock(&rabbit_tune_mutex);
+   valid = rabbit_tune_valid;
+   pthread_mutex_unlock(&rabbit_tune_mutex);
+
+   if (!valid)
+      rabbit_tune_run(NULL, getenv("RABBIT_TUNE_CACHE"), 0);
+}
+
+
+/* Settings for one message size */
+int rabbit_tune_lookup(size_t data_size, rabbit_tune_class *p_class)
+{
+   /* Temporary variables */
+   int i;
+
+   /* Concurrent first callers wait for a single tuning run */
+   pthread_once(&rabbit_tune_once, rabbit_tune_first_use);
+
+   pthread_mutex_lock(&rabbit_tune_mutex);
+
+   /* Return error if tuning failed */
+   if (!rabbit_tune_valid)
+   {
+      pthread_mutex_unlock(&rabbit_tune_mutex);
+      return -1;
+   }
+   for (i=0; i<RABBIT_TUNE_CLASSES-1 && data_size >
+        rabbit_tune_current.classes[i].max_size; i++)
+      ;
+   *p_class = rabbit_tune_current.classes[i];
+   pthread_mutex_unlock(&rabbit_tune_mutex);
+
+   /* Return success */
+   return 0;
+}
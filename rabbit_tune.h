@@ -0,0 +1,77 @@
+/******************************************************************************/
+/* File name: rabbit_tune.h                                                   */
+/*----------------------------------------------------------------------------*/
+/* Header file for the startup autotuner.                                     */
+/*                                                                            */
+/* rabbit_autotune() runs a short microbenchmark (about 30 ms; passes are     */
+/* sized from the throughput measured so far to keep within 50 ms) and        */
+/* picks, for each message size class, the code path to use:                  */
+/* plain rabbit_cipher(), a rabbit_precomp session with its keystream buffer  */
+/* size, or non-temporal stores, plus the number of threads worth using for   */
+/* segmented-IV encryption. It sets the non-temporal threshold of             */
+/* rabbit_cipher() itself; the other choices are advice for callers, read     */
+/* with rabbit_tune_lookup(). When rabbit_tune_lookup() tunes on first use,   */
+/* the threshold in effect is left as the application set it.                 */
+/*                                                                            */
+/* The result can be kept in a cache file. It is reused as long as the CPU    */
+/* model and the number of usable CPUs are the same, so later process starts  */
+/* skip the measurement.                                                      */
+/*                                                                            */
+/* This source code is for little-endian processors (e.g. x86).               */
+/******************************************************************************/
+
+#ifndef _RABBIT_TUNE_H
+#define _RABBIT_TUNE_H
+
+#include "rabbit.h"
+
+/* Message size classes: up to 64 bytes, 1 KiB, 16 KiB, 256 KiB, 4 MiB */
+/* and anything larger */
+#define RABBIT_TUNE_CLASSES 6
+
+/* Code paths */
+#define RABBIT_TUNE_SCALAR  0     /* rabbit_cipher() */
+#define RABBIT_TUNE_PRECOMP 1     /* rabbit_precomp session */
+#define RABBIT_TUNE_NT      2     /* rabbit_cipher() with non-temporal stores */
+
+/* Choice for one size class */
+typedef struct
+{
+   size_t max_size;               /* Largest message of the class */
+   int backend;                   /* One of the RABBIT_TUNE_ paths */
+   int lanes;                     /* Threads for segmented-IV encryption */
+   size_t buffer_size;            /* Precompute depth, 0 if not buffered */
+} rabbit_tune_class;
+
+/* Result of a tuning run */
+typedef struct
+{
+   char cpu_model[64];            /* Key of the cache file */
+   int cpu_count;
+   size_t nt_threshold;           /* As set with rabbit_set_nt_threshold() */
+   rabbit_tune_class classes[RABBIT_TUNE_CLASSES];
+   int from_cache;                /* Loaded instead of measured */
+} rabbit_tune;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* All function calls return zero on success */
+
+/* Measure and apply the best settings for this host, or load them from */
+/* p_cache_path if it holds a result for the same CPU; a new result is */
+/* written back there. p_cache_path may be NULL, p_tune too if only the */
+/* settings are wanted. */
+int rabbit_autotune(rabbit_tune *p_tune, const char *p_cache_path);
+
+/* Settings for messages of data_size bytes. The first call without a */
+/* previous rabbit_autotune() tunes, caching in $RABBIT_TUNE_CACHE if set, */
+/* but does not change the non-temporal threshold. */
+int rabbit_tune_lookup(size_t data_size, rabbit_tune_class *p_class);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,1316 @@
+/******************************************************************************/
+/* File name: rabbit_verify.c                                                 */
+/*----------------------------------------------------------------------------*/
+/* Differential verification of every Rabbit code path against the            */
+/* reference loop of rabbit.c.                                                */
+/*                                                                            */
+/* Usage: rabbit_verify [options]                                             */
+/*                                                                            */
+/*    vectors=FILE  known-answer vectors (default test-vectors.txt)           */
+/*    seed=N        seed of the random inputs (default 1)                     */
+/*    iters=N       random messages per backend (default 1000)                */
+/*    max=N         largest random message in bytes (default 4096)            */
+/*    mb=N, gb=N    length of the streaming comparison (default 64 MiB)       */
+/*    threads=N     threads for the parallel backends (default 4)             */
+/*    expect=HASH   stream hash a previous build printed for the same seed    */
+/*                                                                            */
+/* The reference is rabbit_prng() over a whole aligned buffer, itself         */
+/* checked first against the vectors of the text file. Every backend then     */
+/* runs the vectors and random keys, IVs and lengths at unaligned offsets,    */
+/* split at random points into calls. Long streams are compared window by     */
+/* window through a rolling hash, so no reference copy of the stream is       */
+/* kept. The exit status is non-zero if anything differs.                     */
+/*                                                                            */
+/* This source code is for little-endian processors (e.g. x86).               */
+/******************************************************************************/
+
+#define _GNU_SOURCE
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#include "rabbit.h"
+#include "rabbit_crc32c.h"
+#include "rabbit_parallel.h"
+#include "rabbit_pipeline.h"
+#include "rabbit_precomp.h"
+#include "rabbit_session.h"
+#include "rabbit_shared.h"
+#include "rabbit_snapshot.h"
+
+/* Most vectors read from the text file */
+#define VERIFY_MAX_VECTORS 64
+
+/* Longest known-answer output */
+#define VERIFY_MAX_OUT 256
+
+/* Window of the streaming comparison */
+#define VERIFY_WINDOW (1 << 20)
+
+/* Backend properties */
+#define VERIFY_ANY_SIZE  1     /* Accepts sizes that are not multiples of 16 */
+#define VERIFY_NEEDS_IV  2     /* Works on IV-derived streams only */
+#define VERIFY_SEGMENTED 4     /* Segmented-IV stream */
+
+/* -------------------------------------------------------------------------- */
+
+/* Monotonic time in seconds */
+static double verify_now(void)
+{
+   /* Temporary variables */
+   struct timespec ts;
+
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return (double)ts.tv_sec + (double)ts.tv_nsec*1e-9;
+}
+
+/* -------------------------------------------------------------------------- */
+
+/* Read "name=value" style numeric options, returning def if absent */
+static size_t verify_opt(int argc, char *argv[], const char *name, size_t def)
+{
+   /* Temporary variables */
+   size_t len = strlen(name);
+   int i;
+
+   for (i=0; i<argc; i++)
+      if (!strncmp(argv[i], name, len) && argv[i][len] == '=')
+         return (size_t)strtoull(argv[i]+len+1, NULL, 0);
+   return def;
+}
+
+/* Same for string options */
+static const char *verify_opt_str(int argc, char *argv[], const char *name,
+          const char *def)
+{
+   /* Temporary variables */
+   size_t len = strlen(name);
+   int i;
+
+   for (i=0; i<argc; i++)
+      if (!strncmp(argv[i], name, len) && argv[i][len] == '=')
+         return argv[i]+len+1;
+   return def;
+}
+
+/* -------------------------------------------------------------------------- */
+
+/* Small deterministic generator for the random inputs (xorshift64*) */
+static uint64_t verify_rand(uint64_t *p_state)
+{
+   *p_state ^= *p_state >> 12;
+   *p_state ^= *p_state << 25;
+   *p_state ^= *p_state >> 27;
+   return *p_state * 0x2545F4914F6CDD1DULL;
+}
+
+/* Uniform value below n (n > 0) */
+static size_t verify_below(uint64_t *p_state, size_t n)
+{
+   return (size_t)(verify_rand(p_state) % n);
+}
+
+/* Fill a buffer with random bytes */
+static void verify_fill(uint64_t *p_state, cc_byte *p_buf, size_t size)
+{
+   /* Temporary variables */
+   uint64_t r = 0;
+   size_t i;
+
+   for (i=0; i<size; i++)
+   {
+      if (!(i%8))
+         r = verify_rand(p_state);
+      p_buf[i] = (cc_byte)r;
+      r >>= 8;
+   }
+}
+
+/* Size of the next call when remaining bytes are left, favouring short */
+/* calls; a multiple of 16 unless any_size is set */
+static size_t verify_split(uint64_t *p_state, size_t remaining, int any_size)
+{
+   /* Temporary variables */
+   size_t n;
+
+   switch (verify_below(p_state, 4))
+   {
+   case 0:
+      n = 1 + verify_below(p_state, 64);
+      break;
+   case 1:
+      n = 1 + verify_below(p_state, 4096);
+      break;
+   case 2:
+      n = 1 + verify_below(p_state, remaining ? remaining : 1);
+      break;
+   default:
+      n = remaining;
+      break;
+   }
+   if (!any_size)
+      n = (n + 15) & ~(size_t)15;
+   return n < remaining ? n : remaining;
+}
+
+/* -------------------------------------------------------------------------- */
+
+/* Rolling hash over 64-bit words (size a multiple of 8). Every step is a */
+/* bijection of the running value and injective in the word, so a single */
+/* differing word always changes the result. */
+static uint64_t verify_hash(uint64_t h, const cc_byte *p_data, size_t size)
+{
+   /* Temporary variables */
+   uint64_t w;
+   size_t i;
+
+   for (i=0; i<size; i+=8)
+   {
+      memcpy(&w, p_data+i, 8);
+      h = (h ^ w) * 0x9E3779B97F4A7C15ULL;
+      h ^= h >> 32;
+   }
+   return h;
+}
+
+/* -------------------------------------------------------------------------- */
+
+/* One test message */
+typedef struct
+{
+   cc_byte key[16];
+   cc_byte iv[8];
+   int has_iv;
+   size_t segment_size;               /* Segmented backends only */
+   unsigned long long first_segment;
+   const cc_byte *p_src;
+   size_t size;
+} verify_case;
+
+/* Shared state of a run */
+typedef struct
+{
+   uint64_t rng;
+   rabbit_sched *p_sched;
+   int threads;
+} verify_env;
+
+/* Instance of the stream of a message */
+static int verify_setup(const verify_case *p_case, rabbit_instance *p_inst)
+{
+   /* Temporary variables */
+   rabbit_instance master;
+
+   if (rabbit_key_setup(&master, p_case->key, 16))
+      return -1;
+   if (!p_case->has_iv)
+   {
+      *p_inst = master;
+      return 0;
+   }
+   return rabbit_iv_setup(&master, p_inst, p_case->iv, 8);
+}
+
+/* Reference keystream: one rabbit_prng() call on an aligned buffer */
+static int verify_keystream(rabbit_instance *p_inst, cc_byte *p_dest,
+          size_t size)
+{
+   /* Temporary variables */
+   size_t padded = (size + RABBIT_CACHE_LINE) &
+          ~(size_t)(RABBIT_CACHE_LINE - 1);
+   cc_byte *p_buf;
+   int res;
+
+   p_buf = (cc_byte *)aligned_alloc(RABBIT_CACHE_LINE, padded);
+   if (!p_buf)
+      return -1;
+   res = rabbit_prng(p_inst, p_buf, (size + 15) & ~(size_t)15);
+   memcpy(p_dest, p_buf, size);
+   free(p_buf);
+   return res;
+}
+
+/* Reference output of a message; segment n of a segmented message uses */
+/* the base IV plus n as a little-endian 64-bit counter, derived here */
+/* independently of rabbit_segment_iv_setup() */
+static int verify_reference(const verify_case *p_case, cc_byte *p_expect)
+{
+   /* Temporary variables */
+   verify_case seg_case = *p_case;
+   rabbit_instance inst;
+   unsigned long long segment = p_case->first_segment;
+   size_t off, n, i;
+   int b, carry;
+
+   if (!p_case->segment_size)
+   {
+      if (verify_setup(p_case, &inst) ||
+          verify_keystream(&inst, p_expect, p_case->size))
+         return -1;
+      for (i=0; i<p_case->size; i++)
+         p_expect[i] ^= p_case->p_src[i];
+      return 0;
+   }
+
+   for (off=0; off<p_case->size; off+=n, segment++)
+   {
+      n = p_case->size - off;
+      if (n > p_case->segment_size)
+         n = p_case->segment_size;
+
+      /* Byte-wise addition with carry */
+      carry = 0;
+      for (b=0; b<8; b++)
+      {
+         carry += p_case->iv[b] + (int)((segment >> (8*b)) & 0xFF);
+         seg_case.iv[b] = (cc_byte)carry;
+         carry >>= 8;
+      }
+      seg_case.has_iv = 1;
+      if (verify_setup(&seg_case, &inst) ||
+          verify_keystream(&inst, p_expect+off, n))
+         return -1;
+      for (i=0; i<n; i++)
+         p_expect[off+i] ^= p_case->p_src[off+i];
+   }
+   return 0;
+}
+
+/* -------------------------------------------------------------------------- */
+
+/* rabbit_cipher(), out of place, without non-temporal stores */
+static int verify_cipher(verify_env *p_env, const verify_case *p_case,
+          cc_byte *p_out)
+{
+   /* Temporary variables */
+   rabbit_instance inst;
+   size_t off, n;
+
+   if (verify_setup(p_case, &inst))
+      return -1;
+   for (off=0; off<p_case->size; off+=n)
+   {
+      n = verify_split(&p_env->rng, p_case->size - off, 0);
+      if (rabbit_cipher(&inst, p_case->p_src+off, p_out+off, n))
+         return -1;
+   }
+   return 0;
+}
+
+/* rabbit_cipher() in place */
+static int verify_cipher_inplace(verify_env *p_env, const verify_case *p_case,
+          cc_byte *p_out)
+{
+   /* Temporary variables */
+   rabbit_instance inst;
+   size_t off, n;
+
+   if (verify_setup(p_case, &inst))
+      return -1;
+   memcpy(p_out, p_case->p_src, p_case->size);
+   for (off=0; off<p_case->size; off+=n)
+   {
+      n = verify_split(&p_env->rng, p_case->size - off, 0);
+      if (rabbit_cipher(&inst, p_out+off, p_out+off, n))
+         return -1;
+   }
+   return 0;
+}
+
+/* rabbit_cipher() with non-temporal stores for every call they can serve */
+static int verify_cipher_nt(verify_env *p_env, const verify_case *p_case,
+          cc_byte *p_out)
+{
+   /* Temporary variables */
+   int res;
+
+   rabbit_set_nt_threshold(16);
+   res = verify_cipher(p_env, p_case, p_out);
+   rabbit_set_nt_threshold((size_t)-1);
+   return res;
+}
+
+/* rabbit_prng() into unaligned pieces, then XOR with the input */
+static int verify_prng(verify_env *p_env, const verify_case *p_case,
+          cc_byte *p_out)
+{
+   /* Temporary variables */
+   rabbit_instance inst;
+   size_t off, n, i;
+
+   if (verify_setup(p_case, &inst))
+      return -1;
+   for (off=0; off<p_case->size; off+=n)
+   {
+      n = verify_split(&p_env->rng, p_case->size - off, 0);
+      if (rabbit_prng(&inst, p_out+off, n))
+         return -1;
+   }
+   for (i=0; i<p_case->size; i++)
+      p_out[i] ^= p_case->p_src[i];
+   return 0;
+}
+
+/* rabbit_cipher_iov() over random fragments of any size, some empty */
+static int verify_iov(verify_env *p_env, const verify_case *p_case,
+          cc_byte *p_out)
+{
+   /* Temporary variables */
+   rabbit_instance inst;
+   struct iovec iov[2][16];
+   size_t cuts[16], off, n;
+   int count[2], chain, i, j;
+
+   if (verify_setup(p_case, &inst))
+      return -1;
+
+   /* Cut the input and the output at independent random points */
+   for (chain=0; chain<2; chain++)
+   {
+      count[chain] = 1 + (int)verify_below(&p_env->rng, 16);
+      for (i=0; i<count[chain]-1; i++)
+      {
+         n = verify_below(&p_env->rng, p_case->size + 1);
+         for (j=i; j>0 && cuts[j-1] > n; j--)
+            cuts[j] = cuts[j-1];
+         cuts[j] = n;
+      }
+      cuts[count[chain]-1] = p_case->size;
+
+      for (i=0, off=0; i<count[chain]; off=cuts[i], i++)
+      {
+         iov[chain][i].iov_base = chain ? (void *)(p_out + off) :
+                (void *)(p_case->p_src + off);
+         iov[chain][i].iov_len = cuts[i] - off;
+      }
+   }
+
+   return rabbit_cipher_iov(&inst, iov[0], count[0], iov[1], count[1]);
+}
+
+/* rabbit_cipher_crc32c(): the checksum must match the output */
+static int verify_cipher_crc32c(verify_env *p_env, const verify_case *p_case,
+          cc_byte *p_out)
+{
+   /* Temporary variables */
+   rabbit_instance inst;
+   cc_uint32 crc = 0;
+   size_t off, n;
+
+   if (verify_setup(p_case, &inst))
+      return -1;
+   for (off=0; off<p_case->size; off+=n)
+   {
+      n = verify_split(&p_env->rng, p_case->size - off, 0);
+      if (rabbit_cipher_crc32c(&inst, p_case->p_src+off, p_out+off, n, &crc))
+         return -1;
+   }
+   return crc == rabbit_crc32c(0, p_out, p_case->size) ? 0 : -1;
+}
+
+/* rabbit_crc32c_cipher(): the checksum must match the input */
+static int verify_crc32c_cipher(verify_env *p_env, const verify_case *p_case,
+          cc_byte *p_out)
+{
+   /* Temporary variables */
+   rabbit_instance inst;
+   cc_uint32 crc = 0;
+   size_t off, n;
+
+   if (verify_setup(p_case, &inst))
+      return -1;
+   for (off=0; off<p_case->size; off+=n)
+   {
+      n = verify_split(&p_env->rng, p_case->size - off, 0);
+      if (rabbit_crc32c_cipher(&inst, p_case->p_src+off, p_out+off, n, &crc))
+         return -1;
+   }
+   return crc == rabbit_crc32c(0, p_case->p_src, p_case->size) ? 0 : -1;
+}
+
+/* rabbit_precomp_cipher() with byte-granular calls and random refills */
+static int verify_precomp(verify_env *p_env, const verify_case *p_case,
+          cc_byte *p_out)
+{
+   /* Temporary variables */
+   rabbit_instance inst;
+   rabbit_precomp *p_session;
+   size_t off, n;
+   int res = 0;
+
+   if (verify_setup(p_case, &inst) ||
+       rabbit_precomp_create(&p_session, &inst,
+              16*(1 + verify_below(&p_env->rng, 256))))
+      return -1;
+   for (off=0; off<p_case->size && !res; off+=n)
+   {
+      if (!verify_below(&p_env->rng, 4))
+         rabbit_precomp_refill(p_session);
+      n = verify_split(&p_env->rng, p_case->size - off, 1);
+      res = rabbit_precomp_cipher(p_session, p_case->p_src+off, p_out+off, n);
+   }
+   rabbit_precomp_destroy(p_session);
+   return res;
+}
+
+/* rabbit_precomp_cipher() moved to a new session through a snapshot */
+/* before every call, so any partial block travels in the residue */
+static int verify_snapshot(verify_env *p_env, const verify_case *p_case,
+          cc_byte *p_out)
+{
+   /* Temporary variables */
+   rabbit_instance inst;
+   rabbit_precomp *p_session, *p_next;
+   cc_byte image[RABBIT_SNAPSHOT_SIZE(4096)];
+   size_t off, n, size;
+   int res = 0;
+
+   if (verify_setup(p_case, &inst) ||
+       rabbit_precomp_create(&p_session, &inst,
+              16*(1 + verify_below(&p_env->rng, 256))))
+      return -1;
+   for (off=0; off<p_case->size && !res; off+=n)
+   {
+      if (!verify_below(&p_env->rng, 4))
+         rabbit_precomp_refill(p_session);
+      if (rabbit_precomp_export(p_session, image, sizeof(image), &size) ||
+          rabbit_precomp_import(&p_next, image, size,
+                 16*(1 + verify_below(&p_env->rng, 256))))
+      {
+         res = -1;
+         break;
+      }
+      rabbit_precomp_destroy(p_session);
+      p_session = p_next;
+      n = verify_split(&p_env->rng, p_case->size - off, 1);
+      res = rabbit_precomp_cipher(p_session, p_case->p_src+off, p_out+off, n);
+   }
+   rabbit_precomp_destroy(p_session);
+   return res;
+}
+
+/* rabbit_shared_read() with a random chunk layout, then XOR */
+static int verify_shared(verify_env *p_env, const verify_case *p_case,
+          cc_byte *p_out)
+{
+   /* Temporary variables */
+   rabbit_instance inst;
+   rabbit_shared *p_shared;
+   size_t off, n, i;
+   int res = 0;
+
+   if (verify_setup(p_case, &inst) ||
+       rabbit_shared_create(&p_shared, &inst,
+              16*(1 + verify_below(&p_env->rng, 64)),
+              2 + verify_below(&p_env->rng, 7)))
+      return -1;
+   for (off=0; off<p_case->size && !res; off+=n)
+   {
+      n = verify_split(&p_env->rng, p_case->size - off, 1);
+      res = rabbit_shared_read(p_shared, p_out+off, n);
+   }
+   rabbit_shared_destroy(p_shared);
+   for (i=0; i<p_case->size; i++)
+      p_out[i] ^= p_case->p_src[i];
+   return res;
+}
+
+/* rabbit_session_cipher() on a session among others */
+static int verify_session(verify_env *p_env, const verify_case *p_case,
+          cc_byte *p_out)
+{
+   /* Temporary variables */
+   rabbit_instance master;
+   rabbit_session_table *p_table;
+   rabbit_session_id id = verify_rand(&p_env->rng);
+   cc_byte other_iv[8] = { 0 };
+   size_t off, n;
+   int res;
+
+   if (rabbit_key_setup(&master, p_case->key, 16) ||
+       rabbit_session_create(&p_table, &master, 8, 0))
+      return -1;
+   res = rabbit_session_open(p_table, id, p_case->iv, 8) ||
+         rabbit_session_open(p_table, id + 1, other_iv, 8);
+   for (off=0; off<p_case->size && !res; off+=n)
+   {
+      n = verify_split(&p_env->rng, p_case->size - off, 0);
+      res = rabbit_session_cipher(p_table, id, p_case->p_src+off, p_out+off,
+             n);
+   }
+   rabbit_session_destroy(p_table);
+   return res ? -1 : 0;
+}
+
+/* Memory source and sink of the pipeline */
+typedef struct
+{
+   uint64_t rng;
+   const cc_byte *p_src;
+   cc_byte *p_dest;
+   size_t size;
+   size_t pos;
+} verify_stream_buf;
+
+static long verify_pipeline_read(void *p_context, cc_byte *p_buf, size_t size)
+{
+   /* Temporary variables */
+   verify_stream_buf *p_sb = (verify_stream_buf *)p_context;
+   size_t n = p_sb->size - p_sb->pos;
+
+   /* Short reads of random length */
+   if (n > size)
+      n = size;
+   if (n)
+      n = 1 + verify_below(&p_sb->rng, n);
+   memcpy(p_buf, p_sb->p_src + p_sb->pos, n);
+   p_sb->pos += n;
+   return (long)n;
+}
+
+static int verify_pipeline_write(void *p_context, const cc_byte *p_buf,
+          size_t size)
+{
+   /* Temporary variables */
+   verify_stream_buf *p_sb = (verify_stream_buf *)p_context;
+
+   if (size > p_sb->size - p_sb->pos)
+      return -1;
+   memcpy(p_sb->p_dest + p_sb->pos, p_buf, size);
+   p_sb->pos += size;
+   return 0;
+}
+
+/* rabbit_pipeline_run() with a random ring layout and short reads */
+static int verify_pipeline(verify_env *p_env, const verify_case *p_case,
+          cc_byte *p_out)
+{
+   /* Temporary variables */
+   rabbit_instance inst;
+   rabbit_pipeline_config config;
+   verify_stream_buf in, out;
+
+   if (verify_setup(p_case, &inst))
+      return -1;
+   config.slot_size = 16*(1 + verify_below(&p_env->rng, 64));
+   config.slot_count = (size_t)2 << verify_below(&p_env->rng, 4);
+   config.batch = 1 + verify_below(&p_env->rng, 4);
+
+   /* Spinning stages starve each other on a single CPU */
+   config.wait_mode = sysconf(_SC_NPROCESSORS_ONLN) > 1 &&
+          verify_below(&p_env->rng, 2) ? RABBIT_PIPELINE_BUSY_POLL :
+          RABBIT_PIPELINE_FUTEX;
+
+   in.rng = verify_rand(&p_env->rng) | 1;
+   in.p_src = p_case->p_src;
+   in.size = p_case->size;
+   in.pos = 0;
+   out.p_dest = p_out;
+   out.size = p_case->size;
+   out.pos = 0;
+   if (rabbit_pipeline_run(&config, &inst, verify_pipeline_read, &in,
+          verify_pipeline_write, &out))
+      return -1;
+   return out.pos == p_case->size ? 0 : -1;
+}
+
+/* rabbit_segment_cipher() */
+static int verify_segment(verify_env *p_env, const verify_case *p_case,
+          cc_byte *p_out)
+{
+   /* Temporary variables */
+   rabbit_instance master;
+
+   (void)p_env;
+   if (rabbit_key_setup(&master, p_case->key, 16))
+      return -1;
+   return rabbit_segment_cipher(&master, p_case->iv, p_case->segment_size,
+          p_case->first_segment, p_case->p_src, p_out, p_case->size);
+}
+
+/* rabbit_segment_cipher_parallel() on the pool of the run */
+static int verify_segment_parallel(verify_env *p_env,
+          const verify_case *p_case, cc_byte *p_out)
+{
+   /* Temporary variables */
+   rabbit_instance master;
+
+   if (rabbit_key_setup(&master, p_case->key, 16))
+      return -1;
+   return rabbit_segment_cipher_parallel(p_env->p_sched, &master, p_case->iv,
+          p_case->segment_size, p_case->first_segment, p_case->p_src, p_out,
+          p_case->size);
+}
+
+/* rabbit_encrypt_many() with the message as one job among random others, */
+/* which are checked here */
+static int verify_many(verify_env *p_env, const verify_case *p_case,
+          cc_byte *p_out)
+{
+   /* Temporary variables */
+   rabbit_job jobs[8];
+   verify_case others[8];
+   cc_byte *p_buf[8] = { NULL }, *p_expect = NULL;
+   size_t count = 1 + verify_below(&p_env->rng, 8), max = 0, j;
+   int res = -1;
+
+   for (j=0; j<count; j++)
+   {
+      if (j)
+      {
+         verify_fill(&p_env->rng, others[j].key, 16);
+         verify_fill(&p_env->rng, others[j].iv, 8);
+         others[j].has_iv = (int)verify_below(&p_env->rng, 2);
+         others[j].size = 16*verify_below(&p_env->rng, 128);
+         others[j].segment_size = others[j].has_iv &&
+                verify_below(&p_env->rng, 2) ?
+                16*(1 + verify_below(&p_env->rng, 16)) : 0;
+         others[j].first_segment = 0;
+         others[j].p_src = p_case->p_src;
+         if (others[j].size > p_case->size)
+            others[j].size = p_case->size & ~(size_t)15;
+      }
+      else
+         others[j] = *p_case;
+
+      p_buf[j] = (cc_byte *)malloc(others[j].size + 1);
+      if (!p_buf[j])
+         goto out;
+      if (others[j].size > max)
+         max = others[j].size;
+
+      jobs[j].p_key = others[j].key;
+      jobs[j].p_iv = others[j].has_iv ? others[j].iv : NULL;
+      jobs[j].p_src = others[j].p_src;
+      jobs[j].p_dest = j ? p_buf[j] : p_out;
+      jobs[j].data_size = others[j].size;
+      jobs[j].segment_size = others[j].segment_size;
+   }
+
+   p_expect = (cc_byte *)malloc(max + 1);
+   if (!p_expect || rabbit_encrypt_many(jobs, count,
+          1 + (int)verify_below(&p_env->rng, (size_t)p_env->threads)))
+      goto out;
+
+   for (j=1; j<count; j++)
+      if (verify_reference(&others[j], p_expect) ||
+          memcmp(p_expect, p_buf[j], others[j].size))
+         goto out;
+   res = 0;
+
+out:
+   for (j=0; j<count; j++)
+      free(p_buf[j]);
+   free(p_expect);
+   return res;
+}
+
+/* -------------------------------------------------------------------------- */
+
+/* A backend under test */
+typedef struct
+{
+   const char *name;
+   int flags;
+   int (*run)(verify_env *p_env, const verify_case *p_case, cc_byte *p_out);
+} verify_backend;
+
+static const verify_backend verify_backends[] =
+{
+   { "cipher", 0, verify_cipher },
+   { "cipher-inplace", 0, verify_cipher_inplace },
+   { "cipher-nt", 0, verify_cipher_nt },
+   { "prng", 0, verify_prng },
+   { "cipher-iov", 0, verify_iov },
+   { "cipher-crc32c", 0, verify_cipher_crc32c },
+   { "crc32c-cipher", 0, verify_crc32c_cipher },
+   { "precomp", VERIFY_ANY_SIZE, verify_precomp },
+   { "precomp-snapshot", VERIFY_ANY_SIZE, verify_snapshot },
+   { "shared", VERIFY_ANY_SIZE, verify_shared },
+   { "session", VERIFY_NEEDS_IV, verify_session },
+   { "pipeline", 0, verify_pipeline },
+   { "segment", VERIFY_NEEDS_IV | VERIFY_SEGMENTED, verify_segment },
+   { "segment-parallel", VERIFY_NEEDS_IV | VERIFY_SEGMENTED,
+          verify_segment_parallel },
+   { "encrypt-many", 0, verify_many },
+};
+
+#define VERIFY_BACKEND_COUNT \
+   (sizeof(verify_backends)/sizeof(verify_backends[0]))
+
+/* Guard bytes around every output */
+#define VERIFY_GUARD 64
+
+/* Run one message through a backend at the given output offset and */
+/* compare with the expected output. Returns 0 if they agree; reports */
+/* the first difference otherwise. */
+static int verify_run(verify_env *p_env, const verify_backend *p_backend,
+          const verify_case *p_case, const cc_byte *p_expect, size_t offset,
+          const char *p_label)
+{
+   /* Temporary variables */
+   cc_byte *p_buf, *p_out;
+   size_t total = p_case->size + offset + 2*VERIFY_GUARD, i;
+   int res;
+
+   p_buf = (cc_byte *)aligned_alloc(RABBIT_CACHE_LINE,
+          (total + RABBIT_CACHE_LINE - 1) & ~(size_t)(RABBIT_CACHE_LINE - 1));
+   if (!p_buf)
+      return -1;
+   memset(p_buf, 0xA5, total);
+   p_out = p_buf + VERIFY_GUARD + offset;
+
+   res = p_backend->run(p_env, p_case, p_out);
+   if (res)
+      printf("  %s: %s call failed or was inconsistent (size %lu)\n",
+             p_backend->name, p_label, (unsigned long)p_case->size);
+   else
+   {
+      for (i=0; i<p_case->size && p_out[i] == p_expect[i]; i++)
+         ;
+      if (i < p_case->size)
+      {
+         printf("  %s: %s differs at byte %lu of %lu (offset %lu)\n",
+                p_backend->name, p_label, (unsigned long)i,
+                (unsigned long)p_case->size, (unsigned long)offset);
+         res = -1;
+      }
+      for (i=0; i<total && !res; i++)
+         if ((i < VERIFY_GUARD + offset ||
+              i >= VERIFY_GUARD + offset + p_case->size) && p_buf[i] != 0xA5)
+         {
+            printf("  %s: %s wrote outside the output (size %lu)\n",
+                   p_backend->name, p_label, (unsigned long)p_case->size);
+            res = -1;
+         }
+   }
+
+   free(p_buf);
+   return res;
+}
+
+/* -------------------------------------------------------------------------- */
+
+/* A known-answer vector */
+typedef struct
+{
+   int test;
+   cc_byte key[16];
+   cc_byte iv[8];
+   int has_iv;
+   cc_byte out[VERIFY_MAX_OUT];
+   size_t out_size;
+} verify_vector;
+
+/* Parse the bytes of "name = [hex ...]", which may span lines, into */
+/* p_dest. Returns the number of bytes, or -1 on a syntax error. */
+static long verify_parse_hex(const char **pp_text, cc_byte *p_dest,
+          size_t max_size)
+{
+   /* Temporary variables */
+   const char *p = *pp_text;
+   size_t count = 0;
+   int digits = 0, v = 0, d;
+
+   for (; *p && *p != ']'; p++)
+   {
+      if (*p >= '0' && *p <= '9')
+         d = *p - '0';
+      else if (*p >= 'a' && *p <= 'f')
+         d = *p - 'a' + 10;
+      else if (*p >= 'A' && *p <= 'F')
+         d = *p - 'A' + 10;
+      else if (*p == ' ' || *p == '\t' || *p == '\r' || *p == '\n')
+      {
+         if (digits == 1)
+            return -1;
+         continue;
+      }
+      else
+         return -1;
+
+      v = v*16 + d;
+      if (++digits == 2)
+      {
+         if (count == max_size)
+            return -1;
+         p_dest[count++] = (cc_byte)v;
+         digits = v = 0;
+      }
+   }
+   if (*p != ']' || digits)
+      return -1;
+   *pp_text = p + 1;
+   return (long)count;
+}
+
+/* Read the vectors of a test-vectors.txt style file: sections starting */
+/* with "Test N:" holding keyN, optionally ivN, and outN, the keystream */
+static int verify_load_vectors(const char *p_path, verify_vector *p_vectors,
+          size_t *p_count)
+{
+   /* Temporary variables */
+   FILE *p_file;
+   char *p_text;
+   const char *p, *p_name;
+   verify_vector *p_vec = NULL;
+   long size, n;
+   size_t count = 0, i;
+
+   p_file = fopen(p_path, "rb");
+   if (!p_file)
+      return -1;
+   if (fseek(p_file, 0, SEEK_END) || (size = ftell(p_file)) < 0 ||
+       fseek(p_file, 0, SEEK_SET) || !(p_text = (char *)malloc(size + 1)))
+   {
+      fclose(p_file);
+      return -1;
+   }
+   size = (long)fread(p_text, 1, (size_t)size, p_file);
+   fclose(p_file);
+   p_text[size] = 0;
+
+   for (p=p_text; *p; )
+   {
+      /* Start of a line */
+      if (!strncmp(p, "Test ", 5))
+      {
+         if (count == VERIFY_MAX_VECTORS)
+            goto fail;
+         p_vec = &p_vectors[count++];
+         memset(p_vec, 0, sizeof(verify_vector));
+         p_vec->test = atoi(p + 5);
+      }
+      else if (p_vec && (!strncmp(p, "key", 3) || !strncmp(p, "iv", 2) ||
+               !strncmp(p, "out", 3)))
+      {
+         p_name = p;
+         while (*p && *p != '[' && *p != '\n')
+            p++;
+         if (*p != '[')
+            goto fail;
+         p++;
+         if (p_name[0] == 'k')
+            n = verify_parse_hex(&p, p_vec->key, 16) == 16 ? 0 : -1;
+         else if (p_name[0] == 'i')
+         {
+            n = verify_parse_hex(&p, p_vec->iv, 8) == 8 ? 0 : -1;
+            p_vec->has_iv = 1;
+         }
+         else
+         {
+            n = verify_parse_hex(&p, p_vec->out, VERIFY_MAX_OUT);
+            p_vec->out_size = n > 0 ? (size_t)n : 0;
+         }
+         if (n < 0)
+            goto fail;
+      }
+
+      /* Next line */
+      while (*p && *p != '\n')
+         p++;
+      if (*p)
+         p++;
+   }
+
+   /* Every vector needs a whole number of keystream blocks */
+   for (i=0; i<count; i++)
+      if (!p_vectors[i].out_size || p_vectors[i].out_size%16)
+         goto fail;
+
+   free(p_text);
+   *p_count = count;
+   return 0;
+
+fail:
+   free(p_text);
+   return -1;
+}
+
+/* Known answers through the reference and every backend */
+static int verify_vectors(verify_env *p_env, const verify_vector *p_vectors,
+          size_t count)
+{
+   /* Temporary variables */
+   verify_case c;
+   cc_byte zero[VERIFY_MAX_OUT] = { 0 }, out[VERIFY_MAX_OUT];
+   const verify_backend *p_backend;
+   char label[32];
+   size_t v, b, passed;
+   int failures = 0, res;
+
+   printf("%-18s %8s %8s\n", "known answers", "vectors", "result");
+
+   /* The reference first: everything else is compared with it */
+   for (v=0, passed=0; v<count; v++)
+   {
+      memcpy(c.key, p_vectors[v].key, 16);
+      memcpy(c.iv, p_vectors[v].iv, 8);
+      c.has_iv = p_vectors[v].has_iv;
+      c.segment_size = 0;
+      c.first_segment = 0;
+      c.p_src = zero;
+      c.size = p_vectors[v].out_size;
+      if (!verify_reference(&c, out) &&
+          !memcmp(out, p_vectors[v].out, c.size))
+         passed++;
+      else
+         printf("  reference: test %d differs\n", p_vectors[v].test);
+   }
+   printf("%-18s %8lu %8s\n", "reference", (unsigned long)count,
+          passed == count ? "ok" : "FAIL");
+   if (passed != count)
+      return -1;
+
+   for (b=0; b<VERIFY_BACKEND_COUNT; b++)
+   {
+      p_backend = &verify_backends[b];
+      for (v=0, passed=0, res=0; v<count; v++)
+      {
+         if ((p_backend->flags & VERIFY_NEEDS_IV) && !p_vectors[v].has_iv)
+            continue;
+         memcpy(c.key, p_vectors[v].key, 16);
+         memcpy(c.iv, p_vectors[v].iv, 8);
+         c.has_iv = p_vectors[v].has_iv;
+         c.p_src = zero;
+         c.size = p_vectors[v].out_size;
+
+         /* A single segment starting at segment 0 uses the base IV */
+         c.segment_size = p_backend->flags & VERIFY_SEGMENTED ? c.size : 0;
+         c.first_segment = 0;
+
+         snprintf(label, sizeof(label), "test %d", p_vectors[v].test);
+         if (verify_run(p_env, p_backend, &c, p_vectors[v].out,
+                verify_below(&p_env->rng, 16), label))
+            res = -1;
+         else
+            passed++;
+      }
+      printf("%-18s %8lu %8s\n", p_backend->name, (unsigned long)passed,
+             res ? "FAIL" : "ok");
+      failures += res != 0;
+   }
+   return failures ? -1 : 0;
+}
+
+/* -------------------------------------------------------------------------- */
+
+/* Random messages through every backend */
+static int verify_random(verify_env *p_env, size_t iters, size_t max_size)
+{
+   /* Temporary variables */
+   const verify_backend *p_backend;
+   verify_case c;
+   cc_byte *p_src_buf, *p_expect;
+   unsigned long long bytes;
+   size_t b, it, size;
+   char label[48];
+   int failures = 0, errors;
+   double t;
+
+   p_src_buf = (cc_byte *)malloc(max_size + 16);
+   p_expect = (cc_byte *)malloc(max_size + 1);
+   if (!p_src_buf || !p_expect)
+   {
+      free(p_src_buf);
+      free(p_expect);
+      return -1;
+   }
+
+   printf("\n%-18s %8s %12s %8s %8s\n", "random messages", "cases", "bytes",
+          "s", "result");
+   for (b=0; b<VERIFY_BACKEND_COUNT; b++)
+   {
+      p_backend = &verify_backends[b];
+      errors = 0;
+      bytes = 0;
+      t = verify_now();
+      for (it=0; it<iters; it++)
+      {
+         /* Sizes of 0, of a few blocks and up to max */
+         size = verify_below(&p_env->rng, 4) ?
+                verify_below(&p_env->rng, max_size + 1) :
+                verify_below(&p_env->rng, 65);
+         if (!(p_backend->flags & VERIFY_ANY_SIZE))
+            size &= ~(size_t)15;
+
+         verify_fill(&p_env->rng, c.key, 16);
+         verify_fill(&p_env->rng, c.iv, 8);
+         c.has_iv = (p_backend->flags & VERIFY_NEEDS_IV) ||
+                verify_below(&p_env->rng, 2);
+         c.segment_size = 0;
+         c.first_segment = 0;
+         if (p_backend->flags & VERIFY_SEGMENTED)
+         {
+            c.segment_size = 16*(1 + verify_below(&p_env->rng, 64));
+            c.first_segment = verify_below(&p_env->rng, 2) ?
+                   verify_rand(&p_env->rng) : verify_below(&p_env->rng, 16);
+         }
+
+         /* Input at a random offset */
+         c.p_src = p_src_buf + verify_below(&p_env->rng, 16);
+         c.size = size;
+         verify_fill(&p_env->rng, (cc_byte *)c.p_src, size);
+
+         snprintf(label, sizeof(label), "case %lu", (unsigned long)it);
+         if (verify_reference(&c, p_expect) ||
+             verify_run(p_env, p_backend, &c, p_expect,
+                    verify_below(&p_env->rng, 16), label))
+         {
+            /* Report the first few failures only */
+            if (++errors >= 4)
+               break;
+         }
+         bytes += size;
+      }
+      printf("%-18s %8lu %12llu %8.2f %8s\n", p_backend->name,
+             (unsigned long)it, bytes, verify_now() - t,
+             errors ? "FAIL" : "ok");
+      failures += errors != 0;
+   }
+
+   free(p_src_buf);
+   free(p_expect);
+   return failures ? -1 : 0;
+}
+
+/* -------------------------------------------------------------------------- */
+
+/* Streaming backends of the long comparison */
+#define VERIFY_STREAM_CIPHER  0
+#define VERIFY_STREAM_NT      1
+#define VERIFY_STREAM_PRNG    2
+#define VERIFY_STREAM_PRECOMP 3
+#define VERIFY_STREAM_SHARED  4
+#define VERIFY_STREAM_SESSION 5
+#define VERIFY_STREAMS        6
+
+static const char *verify_stream_names[VERIFY_STREAMS] =
+{
+   "cipher", "cipher-nt", "prng", "precomp", "shared", "session"
+};
+
+/* One stream under comparison */
+typedef struct
+{
+   rabbit_instance inst;
+   rabbit_precomp *p_precomp;
+   rabbit_shared *p_shared;
+   rabbit_session_table *p_table;
+   uint64_t hash;
+   unsigned long long first_bad;   /* First differing window, or ~0 */
+   double seconds;
+} verify_stream;
+
+/* Next window of keystream of a stream, in random pieces */
+static int verify_stream_next(verify_env *p_env, int kind,
+          verify_stream *p_stream, const cc_byte *p_zero, cc_byte *p_win,
+          size_t size)
+{
+   /* Temporary variables */
+   size_t off, n;
+   int res = 0;
+
+   if (kind == VERIFY_STREAM_NT)
+      rabbit_set_nt_threshold(16);
+   for (off=0; off<size && !res; off+=n)
+   {
+      n = verify_split(&p_env->rng, size - off,
+             kind == VERIFY_STREAM_PRECOMP || kind == VERIFY_STREAM_SHARED);
+      switch (kind)
+      {
+      case VERIFY_STREAM_CIPHER:
+      case VERIFY_STREAM_NT:
+         res = rabbit_cipher(&p_stream->inst, p_zero, p_win+off, n);
+         break;
+      case VERIFY_STREAM_PRNG:
+         res = rabbit_prng(&p_stream->inst, p_win+off, n);
+         break;
+      case VERIFY_STREAM_PRECOMP:
+         if (!verify_below(&p_env->rng, 4))
+            rabbit_precomp_refill(p_stream->p_precomp);
+         res = rabbit_precomp_cipher(p_stream->p_precomp, p_zero, p_win+off,
+                n);
+         break;
+      case VERIFY_STREAM_SHARED:
+         res = rabbit_shared_read(p_stream->p_shared, p_win+off, n);
+         break;
+      default:
+         res = rabbit_session_cipher(p_stream->p_table, 1, p_zero, p_win+off,
+                n);
+         break;
+      }
+   }
+   if (kind == VERIFY_STREAM_NT)
+      rabbit_set_nt_threshold((size_t)-1);
+   return res;
+}
+
+/* One long stream through the streaming backends, window by window */
+static int verify_streams(verify_env *p_env, uint64_t seed,
+          unsigned long long total, int have_expect, uint64_t expect)
+{
+   /* Temporary variables */
+   verify_stream streams[VERIFY_STREAMS];
+   rabbit_instance master, inst;
+   cc_byte key[16], iv[8], *p_zero, *p_ref, *p_win;
+   uint64_t ref_hash = 0;
+   unsigned long long w, windows = total / VERIFY_WINDOW;
+   double t, ref_seconds = 0;
+   int s, res = -1, failures = 0;
+
+   /* The key and IV depend on the seed alone, so the hash can be compared */
+   /* between builds and runs with other options */
+   memset(streams, 0, sizeof(streams));
+   verify_fill(&seed, key, 16);
+   verify_fill(&seed, iv, 8);
+   rabbit_key_setup(&master, key, 16);
+   rabbit_iv_setup(&master, &inst, iv, 8);
+
+   p_zero = (cc_byte *)calloc(1, VERIFY_WINDOW);
+   p_ref = (cc_byte *)aligned_alloc(RABBIT_CACHE_LINE, VERIFY_WINDOW);
+   p_win = (cc_byte *)aligned_alloc(RABBIT_CACHE_LINE,
+          VERIFY_WINDOW + RABBIT_CACHE_LINE);
+   if (!p_zero || !p_ref || !p_win)
+      goto out;
+   for (s=0; s<VERIFY_STREAMS; s++)
+   {
+      streams[s].inst = inst;
+      streams[s].first_bad = ~0ULL;
+   }
+   if (rabbit_precomp_create(&streams[VERIFY_STREAM_PRECOMP].p_precomp,
+          &inst, 64 << 10) ||
+       rabbit_shared_create(&streams[VERIFY_STREAM_SHARED].p_shared, &inst,
+          64 << 10, 4) ||
+       rabbit_session_create(&streams[VERIFY_STREAM_SESSION].p_table, &master,
+          4, 0) ||
+       rabbit_session_open(streams[VERIFY_STREAM_SESSION].p_table, 1, iv, 8))
+      goto out;
+
+   for (w=0; w<windows; w++)
+   {
+      t = verify_now();
+      if (rabbit_prng(&inst, p_ref, VERIFY_WINDOW))
+         goto out;
+      ref_hash = verify_hash(ref_hash, p_ref, VERIFY_WINDOW);
+      ref_seconds += verify_now() - t;
+
+      for (s=0; s<VERIFY_STREAMS; s++)
+      {
+         /* The prng output lands at an odd address */
+         cc_byte *p_dest = s == VERIFY_STREAM_PRNG ? p_win + 3 : p_win;
+
+         t = verify_now();
+         if (verify_stream_next(p_env, s, &streams[s], p_zero, p_dest,
+                VERIFY_WINDOW))
+            goto out;
+         streams[s].hash = verify_hash(streams[s].hash, p_dest, VERIFY_WINDOW);
+         streams[s].seconds += verify_now() - t;
+         if (streams[s].hash != ref_hash && streams[s].first_bad == ~0ULL)
+            streams[s].first_bad = w;
+      }
+   }
+
+   printf("\n%-18s %8s %16s %8s %8s\n", "stream", "MiB", "hash", "GB/s",
+          "result");
+   printf("%-18s %8llu %016llx %8.2f %8s\n", "reference", windows,
+          (unsigned long long)ref_hash,
+          ref_seconds > 0 ? (double)windows*VERIFY_WINDOW/ref_seconds*1e-9 : 0,
+          have_expect && ref_hash != expect ? "FAIL" : "ok");
+   failures += have_expect && ref_hash != expect;
+   for (s=0; s<VERIFY_STREAMS; s++)
+   {
+      printf("%-18s %8llu %016llx %8.2f %8s\n", verify_stream_names[s],
+             windows, (unsigned long long)streams[s].hash,
+             streams[s].seconds > 0 ?
+             (double)windows*VERIFY_WINDOW/streams[s].seconds*1e-9 : 0,
+             streams[s].first_bad == ~0ULL ? "ok" : "FAIL");
+      if (streams[s].first_bad != ~0ULL)
+      {
+         printf("  %s: first differs in MiB %llu\n", verify_stream_names[s],
+                streams[s].first_bad);
+         failures++;
+      }
+   }
+   if (have_expect && ref_hash != expect)
+      printf("  reference: expected %016llx\n", (unsigned long long)expect);
+   res = failures ? -1 : 0;
+
+out:
+   if (res && !failures)
+      printf("stream setup or call failed\n");
+   rabbit_session_destroy(streams[VERIFY_STREAM_SESSION].p_table);
+   rabbit_shared_destroy(streams[VERIFY_STREAM_SHARED].p_shared);
+   rabbit_precomp_destroy(streams[VERIFY_STREAM_PRECOMP].p_precomp);
+   free(p_zero);
+   free(p_ref);
+   free(p_win);
+   return res;
+}
+
+/* -------------------------------------------------------------------------- */
+
+/* Run all comparisons */
+int main(int argc, char* argv[])
+{
+   /* Temporary variables */
+   const char *p_path = verify_opt_str(argc-1, argv+1, "vectors",
+          "test-vectors.txt");
+   size_t iters = verify_opt(argc-1, argv+1, "iters", 1000);
+   size_t max_size = verify_opt(argc-1, argv+1, "max", 4096);
+   unsigned long long total;
+   uint64_t seed;
+   verify_vector *p_vectors;
+   verify_env env;
+   size_t count;
+   int failures = 0;
+
+   total = (unsigned long long)verify_opt(argc-1, argv+1, "mb", 64) << 20;
+   if (verify_opt(argc-1, argv+1, "gb", 0))
+      total = (unsigned long long)verify_opt(argc-1, argv+1, "gb", 0) << 30;
+   seed = verify_opt(argc-1, argv+1, "seed", 1);
+   env.rng = seed | 1;
+   env.threads = (int)verify_opt(argc-1, argv+1, "threads", 4);
+   if (env.threads < 1)
+      env.threads = 1;
+
+   p_vectors = (verify_vector *)malloc(VERIFY_MAX_VECTORS*sizeof(verify_vector));
+   if (!p_vectors || verify_load_vectors(p_path, p_vectors, &count) || !count)
+   {
+      printf("Cannot read known-answer vectors from %s\n", p_path);
+      free(p_vectors);
+      return 1;
+   }
+   if (rabbit_sched_create(&env.p_sched, env.threads))
+   {
+      free(p_vectors);
+      return 1;
+   }
+
+   /* Plain stores unless a backend asks for non-temporal ones */
+   rabbit_set_nt_threshold((size_t)-1);
+
+   printf("%lu vectors from %s, seed %llu\n\n", (unsigned long)count, p_path,
+          (unsigned long long)seed);
+   if (verify_vectors(&env, p_vectors, count))
+      failures++;
+   else
+   {
+      failures += verify_random(&env, iters, max_size) != 0;
+      failures += verify_streams(&env, (seed ^ 0x5DEECE66DULL) | 1, total,
+             verify_opt_str(argc-1, argv+1, "expect", NULL) != NULL,
+             verify_opt(argc-1, argv+1, "expect", 0)) != 0;
+   }
+
+   rabbit_set_nt_threshold(0);
+   rabbit_sched_destroy(env.p_sched);
+   free(p_vectors);
+   printf("\n%s\n", failures ? "FAILED" : "All backends agree");
+   return failures ? 1 : 0;
+}
+
+/* -------------------------------------------------------------------------- */